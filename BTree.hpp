@@ -12,6 +12,112 @@
 
 namespace sjtu {
 //
+// Created by Alex Chi on 2019-06-15.
+//
+
+#ifndef BPLUSTREE_SPARSEARRAY_HPP
+#define BPLUSTREE_SPARSEARRAY_HPP
+
+#include <cassert>
+#include <cstring>
+
+/*
+ * Array of Cap elements stored as a directory of chunks of Chunk_Size elements.
+ * Chunks are allocated on first write and the directory grows to the highest chunk
+ * written, so memory scales with indices in use instead of Cap.
+ * Elements never written read as T().
+ * load may run in other threads alongside store, as directories and chunks stay allocated
+ * until clear.
+ */
+template<typename T, unsigned Cap, unsigned Chunk_Size = 512>
+class SparseArray {
+    T **dir;
+    unsigned dir_size;
+    // directories replaced by grow, a concurrent load may still read them
+    T **old_dirs[32];
+    unsigned old_dirs_size;
+
+    void grow(unsigned c) {
+        unsigned size = dir_size ? dir_size : 8;
+        while (size <= c) size *= 2;
+        if (size > Chunks) size = Chunks;
+        T **_dir = new T *[size];
+        if (dir_size) memcpy(_dir, dir, sizeof(T *) * dir_size);
+        memset(_dir + dir_size, 0, sizeof(T *) * (size - dir_size));
+        if (dir) {
+            assert(old_dirs_size < 32);
+            old_dirs[old_dirs_size++] = dir;
+        }
+        // published before its size, so a load seeing the new size sees the new directory
+        __atomic_store_n(&dir, _dir, __ATOMIC_RELEASE);
+        __atomic_store_n(&dir_size, size, __ATOMIC_RELEASE);
+    }
+
+public:
+    static constexpr unsigned Chunk = Chunk_Size;
+    static constexpr unsigned Chunks = (Cap + Chunk_Size - 1) / Chunk_Size;
+
+    // number of chunks allocated
+    unsigned allocated;
+
+    SparseArray() : dir(nullptr), dir_size(0), old_dirs_size(0), allocated(0) {}
+
+    SparseArray(const SparseArray &) = delete;
+
+    ~SparseArray() { clear(); }
+
+    T get(unsigned i) const {
+        assert(i < Cap);
+        unsigned c = i / Chunk;
+        return c < dir_size && dir[c] ? dir[c][i % Chunk] : T();
+    }
+
+    // element i, may run in another thread than store
+    T load(unsigned i) const {
+        assert(i < Cap);
+        unsigned c = i / Chunk;
+        if (c >= __atomic_load_n(&dir_size, __ATOMIC_ACQUIRE)) return T();
+        T *elements = __atomic_load_n(&__atomic_load_n(&dir, __ATOMIC_ACQUIRE)[c], __ATOMIC_ACQUIRE);
+        return elements ? __atomic_load_n(&elements[i % Chunk], __ATOMIC_ACQUIRE) : T();
+    }
+
+    void store(unsigned i, T value) { __atomic_store_n(&ref(i), value, __ATOMIC_RELEASE); }
+
+    // reference to element i, allocating its chunk
+    T &ref(unsigned i) {
+        assert(i < Cap);
+        return chunk(i / Chunk)[i % Chunk];
+    }
+
+    bool has_chunk(unsigned c) const { return c < dir_size && dir[c]; }
+
+    // elements of chunk c, allocating it
+    T *chunk(unsigned c) {
+        assert(c < Chunks);
+        if (c >= dir_size) grow(c);
+        if (!dir[c]) {
+            __atomic_store_n(&dir[c], new T[Chunk](), __ATOMIC_RELEASE);
+            ++allocated;
+        }
+        return dir[c];
+    }
+
+    // chunks are allocated below this one only
+    unsigned chunk_end() const { return dir_size; }
+
+    void clear() {
+        for (unsigned c = 0; c < dir_size; c++) delete[] dir[c];
+        delete[] dir;
+        for (unsigned i = 0; i < old_dirs_size; i++) delete[] old_dirs[i];
+        dir = nullptr;
+        dir_size = 0;
+        old_dirs_size = 0;
+        allocated = 0;
+    }
+};
+
+#endif //BPLUSTREE_SPARSEARRAY_HPP
+//
 // Created by Alex Chi on 2019-05-30.
 //
 
@@ -19,89 +125,335 @@ namespace sjtu {
 #define BPLUSTREE_LRU_HPP
 
 #include <cstring>
+#ifndef ONLINE_JUDGE
+#include "SparseArray.hpp"
+#endif
+
+/*
+ * Replacement policies of the page cache. Each of them tracks pages in memory by id and
+ * offers put, get on a hit, remove, drop for a freed page whose id may be reused, expire
+ * to pick a victim, and expire_while, for_each and contains. Lists are linked through
+ * arrays indexed by page id, so that no node is allocated per page.
+ */
 
+// doubly linked lists of page ids, a page is in at most one of them
 template<unsigned Cap, typename Idx = unsigned>
-class LRU {
-    struct Node {
-        Idx idx;
-        Node *prev, *next;
+class PageLists {
+    struct Link {
+        // id + 1 of neighbours, 0 if none
+        Idx prev, next;
+        // list the page is in, 0 if none
+        unsigned char list;
+        // referenced since the clock hand passed it
+        bool ref;
+    };
 
-        Node(Idx idx) : idx(idx), prev(nullptr), next(nullptr) {}
-    } *head, *tail;
+    SparseArray<Link, Cap> links;
 
-    void push(Node* ptr) {
-        if (size == 0) { head = tail = ptr; }
-        else {
-            ptr->next = head;
-            head->prev = ptr;
-            head = ptr;
+public:
+    struct List {
+        Idx head, tail;
+        unsigned size;
+        unsigned char id;
+
+        explicit List(unsigned char id) : head(0), tail(0), size(0), id(id) {}
+    };
+
+    Link &operator[](Idx idx) { return links.ref(idx); }
+
+    unsigned char list(Idx idx) const { return links.get(idx).list; }
+
+    bool ref(Idx idx) const { return links.get(idx).ref; }
+
+    // first page of l after idx, wrapping around
+    Idx next(const List &l, Idx idx) const {
+        Idx next = links.get(idx).next;
+        return next ? next - 1 : l.head - 1;
+    }
+
+    // insert idx before at, or at the tail if at is none
+    void insert(List &l, Idx idx, Idx at) {
+        assert(idx < Cap);
+        Link &link = links.ref(idx);
+        assert(!link.list);
+        link.list = l.id;
+        link.ref = false;
+        link.next = at;
+        link.prev = at ? links.ref(at - 1).prev : l.tail;
+        if (link.prev) links.ref(link.prev - 1).next = idx + 1; else l.head = idx + 1;
+        if (link.next) links.ref(link.next - 1).prev = idx + 1; else l.tail = idx + 1;
+        ++l.size;
+    }
+
+    void push_front(List &l, Idx idx) { insert(l, idx, l.head); }
+
+    void remove(List &l, Idx idx) {
+        Link &link = links.ref(idx);
+        assert(link.list == l.id);
+        if (link.prev) links.ref(link.prev - 1).next = link.next; else l.head = link.next;
+        if (link.next) links.ref(link.next - 1).prev = link.prev; else l.tail = link.prev;
+        link.prev = link.next = 0;
+        link.list = 0;
+        --l.size;
+    }
+
+    // visit from head to tail, f may remove what it visits
+    template<typename F>
+    void for_each(const List &l, F f) const {
+        for (Idx i = l.head; i;) {
+            Idx next = links.get(i - 1).next;
+            f(i - 1);
+            i = next;
         }
+    }
+
+    // visit from tail to head while f returns true, false if stopped
+    template<typename F>
+    bool for_each_reverse(const List &l, F f) const {
+        for (Idx i = l.tail; i; i = links.get(i - 1).prev)
+            if (!f(i - 1)) return false;
+        return true;
+    }
+
+    // visit once around from at, id + 1 or 0 for the head, while f returns true
+    template<typename F>
+    bool for_each_from(const List &l, Idx at, F f) const {
+        Idx start = at ? at : l.head;
+        if (!start) return true;
+        Idx i = start;
+        do {
+            if (!f(i - 1)) return false;
+            i = next(l, i - 1) + 1;
+        } while (i != start);
+        return true;
+    }
+};
+
+// least recently used, every hit moves the page to the front
+template<unsigned Cap, typename Idx = unsigned>
+class LRU {
+    using Lists = PageLists<Cap, Idx>;
+    Lists lists;
+    typename Lists::List l;
+
+public:
+    unsigned size;
+
+    LRU() : l(1), size(0) {}
+
+    LRU(const LRU &) = delete;
+
+    void put(Idx idx) {
+        lists.push_front(l, idx);
         ++size;
     }
 
-    void remove(Node* ptr) {
-        if (ptr->prev) ptr->prev->next = ptr->next; else {
-            head = ptr->next;
-        }
-        if (ptr->next) ptr->next->prev = ptr->prev; else {
-            tail = ptr->prev;
-        }
-        ptr->next = ptr->prev = nullptr;
+    void get(Idx idx) {
+        assert(lists.list(idx) == l.id);
+        lists.remove(l, idx);
+        lists.push_front(l, idx);
+    }
+
+    Idx expire() { return l.tail - 1; }
+
+    void remove(Idx idx) {
+        lists.remove(l, idx);
         --size;
     }
 
+    void drop(Idx idx) { remove(idx); }
+
+    bool contains(Idx idx) const { return lists.list(idx) != 0; }
+
+    // visit from the most to the least recently used
+    template<typename F>
+    void for_each(F f) const { lists.for_each(l, f); }
+
+    // visit from the next victim on while f returns true, leaving pages as they are
+    template<typename F>
+    void for_each_cold(F f) const { lists.for_each_reverse(l, f); }
+
+    // visit from the least to the most recently used while f returns true, f may remove what it visits
+    template<typename F>
+    void expire_while(F f) {
+        for (unsigned n = size; n > 0 && size > 0; n--) {
+            Idx idx = expire();
+            if (!f(idx)) return;
+            // a page that stays counts as used
+            if (contains(idx)) get(idx);
+        }
+    }
+};
+
+/*
+ * CLOCK: a hit only sets the reference bit of a page, and the hand sweeping pages for a
+ * victim clears it, so that a page survives a sweep if it was used since the last one.
+ * New pages are placed right before the hand, unreferenced.
+ */
+template<unsigned Cap, typename Idx = unsigned>
+class Clock {
+    using Lists = PageLists<Cap, Idx>;
+    Lists lists;
+    typename Lists::List ring;
+    // id + 1 of the page the hand points to, 0 for the head, new pages go right before it
+    Idx hand;
+
 public:
     unsigned size;
 
-    Node** nodes;
+    Clock() : ring(1), hand(0), size(0) {}
+
+    Clock(const Clock &) = delete;
 
-    LRU() : head(nullptr), tail(nullptr), size(0) {
-        nodes = new Node*[Cap];
-        memset(nodes, 0, sizeof(Node*) * Cap);
+    void put(Idx idx) {
+        lists.insert(ring, idx, hand);
+        ++size;
+    }
+
+    void get(Idx idx) { lists[idx].ref = true; }
+
+    Idx expire() {
+        for (;;) {
+            Idx idx = hand ? hand - 1 : ring.head - 1;
+            if (!lists.ref(idx)) {
+                hand = idx + 1;
+                return idx;
+            }
+            lists[idx].ref = false;
+            hand = lists.next(ring, idx) + 1;
+        }
     }
 
-    ~LRU() {
-        delete[] nodes;
+    void remove(Idx idx) {
+        if (hand == idx + 1) hand = size > 1 ? lists.next(ring, idx) + 1 : 0;
+        lists.remove(ring, idx);
+        --size;
     }
 
+    void drop(Idx idx) { remove(idx); }
+
+    bool contains(Idx idx) const { return lists.list(idx) != 0; }
+
+    template<typename F>
+    void for_each(F f) const { lists.for_each(ring, f); }
+
+    // visit in the order of the hand while f returns true, leaving reference bits as they are
+    template<typename F>
+    void for_each_cold(F f) const { lists.for_each_from(ring, hand, f); }
+
+    // visit victims in the order of the hand while f returns true, f may remove what it visits
+    template<typename F>
+    void expire_while(F f) {
+        for (unsigned n = size * 2; n > 0 && size > 0; n--) {
+            Idx idx = expire();
+            if (!f(idx)) return;
+            if (contains(idx)) hand = lists.next(ring, idx) + 1;
+        }
+    }
+};
+
+/*
+ * 2Q: pages enter a FIFO queue, and hits there are ignored, as they are likely correlated.
+ * Pages expired from it are remembered in a ghost queue of ids, and a page loaded again
+ * while remembered goes to the main queue, managed as a CLOCK. A scan then only cycles
+ * through the FIFO queue, and the pages used again and again stay.
+ */
+template<unsigned Cap, typename Idx = unsigned>
+class TwoQueue {
+    using Lists = PageLists<Cap, Idx>;
+    Lists lists;
+    typename Lists::List in, main, ghost;
+    Idx hand;
+
+    enum { In = 1, Main = 2, Ghost = 3 };
+
+    // share of pages in the FIFO queue, and of ghosts, as in the paper
+    bool in_full() const { return in.size * 4 > size || !main.size; }
+
+    unsigned max_ghosts() const { return size / 2 + 1; }
+
+public:
+    unsigned size;
+
+    TwoQueue() : in(In), main(Main), ghost(Ghost), hand(0), size(0) {}
+
+    TwoQueue(const TwoQueue &) = delete;
+
     void put(Idx idx) {
-        assert(idx < Cap);
-        assert(nodes[idx] == nullptr);
-        Node *ptr = new Node(idx);
-        push(ptr);
-        nodes[idx] = ptr;
+        if (lists.list(idx) == Ghost) {
+            lists.remove(ghost, idx);
+            lists.insert(main, idx, hand);
+        } else
+            lists.push_front(in, idx);
+        ++size;
     }
 
     void get(Idx idx) {
-        assert(idx < Cap);
-        assert(nodes[idx]);
-        remove(nodes[idx]);
-        push(nodes[idx]);
+        if (lists.list(idx) == Main) lists[idx].ref = true;
     }
 
     Idx expire() {
-        return tail->idx;
+        if (in_full()) return in.tail - 1;
+        for (;;) {
+            Idx idx = hand ? hand - 1 : main.head - 1;
+            if (!lists.ref(idx)) {
+                hand = idx + 1;
+                return idx;
+            }
+            lists[idx].ref = false;
+            hand = lists.next(main, idx) + 1;
+        }
     }
 
     void remove(Idx idx) {
-        assert(idx < Cap);
-        assert(nodes[idx]);
-        remove(nodes[idx]);
-        delete nodes[idx];
-        nodes[idx] = nullptr;
-    }
-
-    void debug() {
-        unsigned last_idx;
-        for (auto ptr = head; ptr != nullptr; ptr = ptr->next) {
-            if (ptr->idx == last_idx) {
-                std::clog << "Cycle detected!" << std::endl;
-                return;
-            }
-            std::clog << ptr->idx << " ";
-            last_idx = ptr->idx;
+        bool seen_once = lists.list(idx) == In;
+        drop(idx);
+        if (seen_once) lists.push_front(ghost, idx);
+        while (ghost.size > max_ghosts()) lists.remove(ghost, ghost.tail - 1);
+    }
+
+    // not remembered, a page taking the id next is new and goes through the FIFO queue
+    void drop(Idx idx) {
+        if (lists.list(idx) == In) lists.remove(in, idx);
+        else {
+            if (hand == idx + 1) hand = main.size > 1 ? lists.next(main, idx) + 1 : 0;
+            lists.remove(main, idx);
+        }
+        --size;
+        while (ghost.size > max_ghosts()) lists.remove(ghost, ghost.tail - 1);
+    }
+
+    bool contains(Idx idx) const {
+        unsigned char list = lists.list(idx);
+        return list == In || list == Main;
+    }
+
+    template<typename F>
+    void for_each(F f) const {
+        lists.for_each(in, f);
+        lists.for_each(main, f);
+    }
+
+    // visit the FIFO queue from its tail, then the main queue from the hand, while f returns true
+    template<typename F>
+    void for_each_cold(F f) const {
+        if (lists.for_each_reverse(in, f)) lists.for_each_from(main, hand, f);
+    }
+
+    // visit victims in order while f returns true, f may remove what it visits
+    template<typename F>
+    void expire_while(F f) {
+        for (unsigned n = size * 2; n > 0 && size > 0; n--) {
+            Idx idx = expire();
+            if (!f(idx)) return;
+            if (!contains(idx)) continue;
+            // a page that stays counts as used
+            if (lists.list(idx) == In) {
+                lists.remove(in, idx);
+                lists.push_front(in, idx);
+            } else
+                hand = lists.next(main, idx) + 1;
         }
-        std::clog << std::endl;
     }
 };
 
@@ -113,10 +465,17 @@ public:
 #ifndef BPLUSTREE_PERSISTENCE_HPP
 #define BPLUSTREE_PERSISTENCE_HPP
 
+#include <algorithm>
 #include <fstream>
 #include <iostream>
+#include <cerrno>
 #include <cstring>
+#include <cstddef>
+#include <system_error>
 #ifndef ONLINE_JUDGE
+#include <fcntl.h>
+#include <unistd.h>
+#include "SparseArray.hpp"
 #include "LRU.hpp"
 #endif
 
@@ -131,12 +490,283 @@ public:
     static constexpr bool is_serializable() { return true; }
 };
 
-template<typename Block, typename Index, typename Leaf, unsigned MAX_PAGES = 1048576, unsigned MAX_IN_MEMORY = 65536>
+/*
+ * Page store backed by std::fstream, every page access seeks on the data file.
+ * A store opens the data file and hands out streams positioned at a given offset.
+ * A stream failing a write stays failed, and sync throws std::system_error for it.
+ */
+struct FileStore {
+    std::fstream f;
+
+    // returns true if an existing data file is opened
+    bool open(const char *path) {
+        f.open(path, std::ios::in | std::ios::out | std::ios::ate | std::ios::binary);
+        bool exists = bool(f);
+        if (!exists) f.open(path, std::ios::in | std::ios::out | std::ios::trunc | std::ios::binary);
+#ifndef ONLINE_JUDGE
+        // for hints and syncs fstream has no way to pass on, fsync on any descriptor of the file flushes it
+        fd = ::open(path, O_RDONLY);
+#endif
+        return exists;
+    }
+
+    void close() {
+        f.close();
+#ifndef ONLINE_JUDGE
+        if (fd >= 0) ::close(fd);
+        fd = -1;
+#endif
+    }
+
+    // start reading a range in the background, a hint only
+    void prefetch(size_t offset, size_t size) {
+#ifndef ONLINE_JUDGE
+        if (fd >= 0) posix_fadvise(fd, offset, size, POSIX_FADV_WILLNEED);
+#endif
+    }
+
+    // reads start right away on prefetch
+    void submit() {}
+
+    std::istream &reader(size_t offset, size_t) {
+        f.seekg(offset, f.beg);
+        return f;
+    }
+
+    std::ostream &writer(size_t offset, size_t) {
+        f.seekp(offset, f.beg);
+        return f;
+    }
+
+    // make everything written so far durable, throws if some of it is not
+    void sync() {
+        if (!f.flush()) {
+            f.clear();
+            throw std::system_error(EIO, std::generic_category(), "failed to write data file");
+        }
+#ifndef ONLINE_JUDGE
+        int result;
+        while ((result = fsync(fd)) != 0 && errno == EINTR);
+        if (result != 0) throw std::system_error(errno, std::generic_category(), "failed to sync data file");
+#endif
+    }
+
+    int fd;
+
+    FileStore() : fd(-1) {}
+};
+
+// growable array for bookkeeping that should not scale with MAX_PAGES
+template<typename T>
+class Stack {
+    T *x;
+    unsigned capacity;
+public:
+    unsigned size;
+
+    Stack() : x(nullptr), capacity(0), size(0) {}
+
+    Stack(const Stack &) = delete;
+
+    ~Stack() { delete[] x; }
+
+    void push(const T &d) {
+        if (size == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            T *_x = new T[capacity];
+            for (unsigned i = 0; i < size; i++) _x[i] = x[i];
+            delete[] x;
+            x = _x;
+        }
+        x[size++] = d;
+    }
+
+    T &operator[](unsigned i) {
+        assert(i < size);
+        return x[i];
+    }
+
+    // remove without keeping order
+    T remove(unsigned i) {
+        assert(i < size);
+        T d = x[i];
+        x[i] = x[--size];
+        return d;
+    }
+
+    void clear() { size = 0; }
+};
+
+/*
+ * Chunks of Size bytes carved out of slabs of Per_Slab chunks. A freed chunk goes on a free
+ * list and is handed out again, and slabs go back to the allocator only with the slab
+ * itself, so that objects coming and going all the time don't fragment the heap.
+ */
+template<unsigned Size, unsigned Align, unsigned Per_Slab = 16>
+class Slab {
+    union Chunk {
+        Chunk *next;
+        alignas(Align) char data[Size];
+    };
+
+    Chunk *free_list;
+    Stack<Chunk *> slabs;
+public:
+    Slab() : free_list(nullptr) {}
+
+    Slab(const Slab &) = delete;
+
+    ~Slab() {
+        for (unsigned i = 0; i < slabs.size; i++) delete[] slabs[i];
+    }
+
+    void *allocate() {
+        if (!free_list) {
+            Chunk *slab = new Chunk[Per_Slab];
+            for (unsigned i = 0; i < Per_Slab; i++) slab[i].next = i + 1 < Per_Slab ? &slab[i + 1] : nullptr;
+            free_list = slab;
+            slabs.push(slab);
+        }
+        Chunk *chunk = free_list;
+        free_list = chunk->next;
+        return chunk;
+    }
+
+    void deallocate(void *x) {
+        Chunk *chunk = static_cast<Chunk *>(x);
+        chunk->next = free_list;
+        free_list = chunk;
+    }
+
+    // chunks taken from the allocator
+    unsigned capacity() const { return slabs.size * Per_Slab; }
+};
+
+/*
+ * Synchronization policy for trees used by one thread at a time: latches and locks do nothing.
+ * See MultiThread for concurrent use.
+ */
+struct SingleThread {
+    struct Latch {
+        void lock() {}
+
+        bool try_lock() { return true; }
+
+        void unlock() {}
+
+        void lock_shared() {}
+
+        void unlock_shared() {}
+    };
+
+    using Mutex = Latch;
+
+    static constexpr bool enabled() { return false; }
+
+    // back off before restarting an operation that lost a race
+    static void pause() {}
+
+    struct Version {
+        unsigned long long load() const { return 0; }
+
+        bool validate(unsigned long long) const { return true; }
+
+        void bump() {}
+    };
+
+    // no reader outlives an operation, but the operation itself may still hold what it retires
+    template<typename T>
+    struct Reclaimer {
+        Stack<T *> retired;
+
+        struct Guard {
+            explicit Guard(Reclaimer &) {}
+        };
+
+        void retire(T *object) { retired.push(object); }
+
+        // free(object) for objects retired so far
+        template<typename F>
+        void collect(F free) {
+            for (unsigned i = 0; i < retired.size; i++) free(retired[i]);
+            retired.clear();
+        }
+
+        template<typename F>
+        void clear(F free) { collect(free); }
+    };
+};
+
+/*
+ * A page pinned for as long as the reference lives, so that it is not evicted under its
+ * holder. Moving a reference hands the pin over. A page merged away, whose idx is reset,
+ * has no pin left to release.
+ */
+template<typename Pool, typename Block>
+class PageRef {
+    Pool *pool;
+    Block *block;
+
+public:
+    PageRef() : pool(nullptr), block(nullptr) {}
+
+    PageRef(Pool *pool, Block *block) : pool(pool), block(block) {}
+
+    PageRef(const PageRef &) = delete;
+
+    PageRef(PageRef &&that) : pool(that.pool), block(that.block) { that.block = nullptr; }
+
+    PageRef &operator=(PageRef &&that) {
+        if (this != &that) {
+            release();
+            pool = that.pool;
+            block = that.block;
+            that.block = nullptr;
+        }
+        return *this;
+    }
+
+    ~PageRef() { release(); }
+
+    void release() {
+        if (block && block->idx) pool->unpin(block->idx);
+        block = nullptr;
+    }
+
+    Block *get() const { return block; }
+
+    Block *operator->() const { return block; }
+
+    explicit operator bool() const { return block != nullptr; }
+};
+
+template<typename Block, typename Index, typename Leaf,
+        unsigned MAX_PAGES = 1048576, unsigned MAX_IN_MEMORY = 65536,
+        typename Store = FileStore, typename Sync = SingleThread,
+        template<unsigned, typename> class Replacer = TwoQueue>
 struct Persistence {
     const char *path;
-    std::fstream f;
+    Store store;
 
-    static const unsigned VERSION = 6;
+    static const unsigned VERSION = 10;
+
+    struct Page {
+        size_t offset;
+        size_t size;
+        unsigned char is_leaf;
+    };
+
+    /*
+     * The page table is a two-level radix tree. Entries of pages are kept in table chunks
+     * of TABLE_CHUNK pages, offsets of table chunks in directory pages of TABLE_CHUNK
+     * chunks, and offsets of directory pages in the header. Chunks and directory pages
+     * are allocated on first write and saved as pages of the data file.
+     */
+    static constexpr unsigned TABLE_CHUNK = 512;
+    using Table = SparseArray<Page, MAX_PAGES, TABLE_CHUNK>;
+    using Directory = SparseArray<size_t, Table::Chunks, TABLE_CHUNK>;
+    static constexpr size_t Chunk_Size() { return sizeof(Page) * TABLE_CHUNK; }
+    static constexpr size_t Directory_Page_Size() { return sizeof(size_t) * TABLE_CHUNK; }
 
     struct PersistenceIndex {
         unsigned root_idx;
@@ -144,9 +774,9 @@ struct Persistence {
         unsigned version;
         unsigned size;
         size_t tail_pos;
-        size_t page_offset[MAX_PAGES];
-        size_t page_size[MAX_PAGES];
-        unsigned char is_leaf[MAX_PAGES];
+        // last log record covered by this index
+        unsigned long long lsn;
+        size_t directory_offset[Directory::Chunks];
 
         static unsigned constexpr MAGIC_KEY() {
             return sizeof(Index) * 233
@@ -157,15 +787,109 @@ struct Persistence {
         PersistenceIndex() : root_idx(0), magic_key(MAGIC_KEY()),
                              version(VERSION),
                              tail_pos(sizeof(PersistenceIndex)),
-                             size(0) {
-            memset(page_offset, 0, sizeof(page_offset));
-            memset(is_leaf, 0, sizeof(is_leaf));
+                             size(0), lsn(0) {
+            memset(directory_offset, 0, sizeof(directory_offset));
         }
     } *persistence_index;
 
-    Block **pages;
-    bool *dirty;
+    Table table;
+    Directory directory;
+
+    SparseArray<Block *, MAX_PAGES> pages;
+    SparseArray<bool, MAX_PAGES> dirty;
+    // pages in memory marked dirty
+    unsigned dirty_pages;
     unsigned lst_empty_slot;
+    // slots from here on are empty, see park_extents
+    unsigned slot_end;
+
+    /*
+     * With concurrent operations, pages, the page table and the LRU are guarded by pool_lock,
+     * and a page is kept in memory while it is pinned by an operation holding it.
+     * Calls on the store are serialized by io_lock, which is never held together with
+     * pool_lock, so that threads finding their pages in memory do not wait for the disk.
+     * A page being read in or written out meanwhile is marked moving, and pinning it waits.
+     */
+    struct Guard {
+        typename Sync::Mutex &mutex;
+
+        explicit Guard(typename Sync::Mutex &mutex) : mutex(mutex) { mutex.lock(); }
+
+        ~Guard() { mutex.unlock(); }
+    };
+
+    typename Sync::Mutex pool_lock, io_lock;
+    SparseArray<unsigned, MAX_PAGES> pins;
+    SparseArray<bool, MAX_PAGES> moving;
+    // pages evicted dirty, written by write_out once pool_lock is released
+    Stack<Block *> outgoing;
+
+    // frames blocks live in, recycled as pages are loaded and evicted
+    Slab<std::max(sizeof(Leaf), sizeof(Index)), std::max(alignof(Leaf), alignof(Index))> frames;
+
+    // pages evicted or merged away are freed once no optimistic reader may hold them
+    using Reclaimer = typename Sync::template Reclaimer<Block>;
+    Reclaimer reclaimer;
+    // bumped before keys move to a page on the left or a page is freed, see BTree::query_optimistic
+    typename Sync::Version shift_version;
+
+    // errno of the first write that failed, checkpoints throw from then on
+    int write_error;
+    bool closed, saved;
+
+    // table chunks and directory pages modified since the last save
+    Stack<unsigned> dirty_chunks;
+    SparseArray<bool, Table::Chunks> chunk_dirty;
+    bool directory_dirty[Directory::Chunks];
+
+    void set_page(unsigned page_id, size_t offset, size_t size, unsigned char is_leaf) {
+        table.ref(page_id) = Page{offset, size, is_leaf};
+        if (offset && page_id >= slot_end) slot_end = page_id + 1;
+        unsigned chunk = page_id / TABLE_CHUNK;
+        if (!chunk_dirty.get(chunk)) {
+            chunk_dirty.ref(chunk) = true;
+            dirty_chunks.push(chunk);
+        }
+    }
+
+    void set_chunk_offset(unsigned chunk, size_t offset) {
+        directory.ref(chunk) = offset;
+        directory_dirty[chunk / TABLE_CHUNK] = true;
+    }
+
+    /*
+     * Shadow paging: pages referenced by the index on disk are never overwritten.
+     * The first write of such a page after a save goes to a new extent, and extents
+     * freed since the last save are only reused after the next one. Hence the data
+     * file always holds a consistent tree as of the last save, which a log replays onto.
+     * Table chunks and directory pages are shadowed the same way.
+     */
+    bool shadow;
+    // page image on disk is referenced by the index on disk
+    SparseArray<bool, MAX_PAGES> stable;
+    SparseArray<bool, Table::Chunks> chunk_stable;
+    bool directory_stable[Directory::Chunks];
+
+    struct Extent {
+        size_t offset, size;
+    };
+    // extents referenced on disk but no longer in memory, and extents free to use
+    Stack<Extent> retired, released;
+    // pages written to new extents since the last save
+    Stack<unsigned> unstable;
+    // slots holding free extents in the index on disk
+    Stack<unsigned> parked;
+
+    // take a free extent of at least size, looking only at the most recent ones
+    bool take_extent(size_t size, size_t &offset) {
+        for (unsigned i = released.size; i > 0 && i + 8 > released.size; i--) {
+            if (released[i - 1].size >= size) {
+                offset = released.remove(i - 1).offset;
+                return true;
+            }
+        }
+        return false;
+    }
 
     struct Stat {
         long long create;
@@ -174,6 +898,11 @@ struct Persistence {
         long long access_cache_miss;
         long long dirty_write;
         long long swap_out;
+        long long checkpoint;
+        long long checkpoint_write;
+        long long table_write;
+        long long prefetch;
+        long long write_back;
 
         void stat() {
             printf("    access hit/total %lld/%lld %.5f%%\n",
@@ -184,165 +913,618 @@ struct Persistence {
             printf("    swap_in/out/dirty %lld %lld %lld %.5f%%\n",
                    access_cache_miss, swap_out, dirty_write,
                    double(dirty_write) / (swap_out) * 100);
+            printf("    checkpoint pages/chunks %lld %lld %lld\n", checkpoint, checkpoint_write, table_write);
+            printf("    prefetch %lld\n", prefetch);
+            printf("    written back ahead of eviction %lld\n", write_back);
         }
 
         Stat() : create(0), destroy(0),
-                 access_cache_hit(1), access_cache_miss(0), dirty_write(0), swap_out(0) {}
+                 access_cache_hit(1), access_cache_miss(0), dirty_write(0), swap_out(0),
+                 checkpoint(0), checkpoint_write(0), table_write(0), prefetch(0), write_back(0) {}
     } stat;
 
-    using BLRU = LRU<MAX_PAGES>;
+    // pages in memory, in the order they are expired by the replacement policy
+    using BLRU = Replacer<MAX_PAGES, unsigned>;
     BLRU lru;
 
-    Persistence(const char *path = nullptr) : path(path), lst_empty_slot(16) {
+    Persistence(const char *path = nullptr, bool shadow = false) :
+            path(path), dirty_pages(0), lst_empty_slot(16), slot_end(16), write_error(0), closed(false), saved(true),
+            shadow(shadow) {
         assert(Index::is_serializable());
         assert(Leaf::is_serializable());
         persistence_index = new PersistenceIndex;
-        pages = new Block *[MAX_PAGES];
-        dirty = new bool[MAX_PAGES];
-        memset(pages, 0, sizeof(Block *) * MAX_PAGES);
-        memset(dirty, 0, sizeof(bool) * MAX_PAGES);
-        if (path) {
-            f.open(path, std::ios::in | std::ios::out | std::ios::ate | std::ios::binary);
-            if (f)
-                restore();
-            else
-                f.open(path, std::ios::in | std::ios::out | std::ios::trunc | std::ios::binary);
+        memset(directory_dirty, 0, sizeof(directory_dirty));
+        memset(directory_stable, 0, sizeof(directory_stable));
+        try {
+            if (path && store.open(path)) restore();
+        } catch (...) {
+            delete persistence_index;
+            throw;
         }
     }
 
     ~Persistence() {
-        save();
-        f.close();
-        delete[] dirty;
-        delete[] pages;
+        close();
+        reclaimer.clear([this](Block *page) { free_page(page); });
         delete persistence_index;
     }
 
+    /*
+     * Save and close the data file, returns false if that failed, in which case a log up to
+     * the lsn of the header is still needed. Pages are left in memory then.
+     */
+    bool close() {
+        if (closed) return saved;
+        closed = true;
+        try {
+            save();
+            store.close();
+        } catch (const std::system_error &e) {
+            std::clog << "[Warning] failed to save " << path << ": " << e.what() << std::endl;
+            saved = false;
+        }
+        return saved;
+    }
+
+    static constexpr size_t Header_Size() { return sizeof(PersistenceIndex); }
+
+    // read the header and the parts of the page table in use
     void restore() {
         if (!path) return;
-        f.seekg(0, f.beg);
-        if (!f.read(reinterpret_cast<char *>(persistence_index), sizeof(PersistenceIndex))) {
-            std::clog << "[Warning] failed to restore from " << path << " " << f.gcount() << std::endl;
-            f.clear();
+        std::istream &in = store.reader(0, Header_Size());
+        if (!in.read(reinterpret_cast<char *>(persistence_index), Header_Size())) {
+            std::clog << "[Warning] failed to restore from " << path << " " << in.gcount() << std::endl;
+            in.clear();
+        }
+        if (persistence_index->version == 0 && persistence_index->magic_key == 0) {
+            // index was never saved, e.g. crashed before the first save
+            new(persistence_index) PersistenceIndex;
         }
         assert(persistence_index->version == VERSION);
         assert(persistence_index->magic_key == PersistenceIndex::MAGIC_KEY());
+        for (unsigned d = 0; d < Directory::Chunks; d++) {
+            if (!persistence_index->directory_offset[d]) continue;
+            store.reader(persistence_index->directory_offset[d], Directory_Page_Size())
+                    .read(reinterpret_cast<char *>(directory.chunk(d)), Directory_Page_Size());
+            directory_stable[d] = shadow;
+        }
+        unsigned chunks = directory.chunk_end() * TABLE_CHUNK;
+        if (chunks > Table::Chunks) chunks = Table::Chunks;
+        for (unsigned chunk = 0; chunk < chunks; chunk++) {
+            size_t offset = directory.get(chunk);
+            if (!offset) continue;
+            Page *entries = table.chunk(chunk);
+            store.reader(offset, Chunk_Size()).read(reinterpret_cast<char *>(entries), Chunk_Size());
+            if (!shadow) continue;
+            chunk_stable.ref(chunk) = true;
+            for (unsigned i = 0; i < TABLE_CHUNK; i++) {
+                unsigned page_id = chunk * TABLE_CHUNK + i;
+                if (entries[i].offset != 0) slot_end = std::max(slot_end, page_id + 1);
+                if (entries[i].is_leaf == 2 && entries[i].offset != 0) parked.push(page_id);
+                else if (entries[i].offset != 0) stable.ref(page_id) = true;
+            }
+        }
+        if (shadow) unpark_extents();
+    }
+
+    // move a page referenced by the index on disk to a new extent before overwriting it
+    void relocate(unsigned page_id) {
+        Page page = table.get(page_id);
+        size_t offset;
+        retired.push(Extent{page.offset, page.size});
+        allocate_extent(offset, page.size);
+        set_page(page_id, offset, page.size, page.is_leaf);
+        stable.ref(page_id) = false;
+        unstable.push(page_id);
+    }
+
+    // mark a dirty page clean, returning where it is to be written by put_page
+    Page clean_page(unsigned page_id) {
+        if (shadow && stable.get(page_id)) relocate(page_id);
+        dirty.ref(page_id) = false;
+        --dirty_pages;
+        return table.get(page_id);
+    }
+
+    void put_page(const Block *page, const Page &entry) {
+        // a store queueing writes may fail to hand earlier ones over
+        try {
+            std::ostream &out = store.writer(entry.offset, entry.size);
+            page->serialize(out);
+            check_write(out);
+        } catch (const std::system_error &e) {
+            fail(e.code().value());
+        }
+    }
+
+    void write_page(unsigned page_id) {
+        Page entry = clean_page(page_id);
+        put_page(pages.get(page_id), entry);
     }
 
     void offload_page(unsigned page_id) {
         if (!path) return;
-        Block *page = pages[page_id];
 
-        if (dirty[page_id]) {
-            auto offset = persistence_index->page_offset[page_id];
-            f.seekp(offset, f.beg);
-            page->serialize(f);
+        if (dirty.get(page_id)) {
+            write_page(page_id);
             ++stat.dirty_write;
         }
 
-        delete pages[page_id];
-        pages[page_id] = nullptr;
+        Block *page = pages.get(page_id);
+        pages.store(page_id, nullptr);
+        reclaimer.retire(page);
 
         lru.remove(page_id);
     }
 
-    bool is_loaded(unsigned page_id) { return pages[page_id] != nullptr; }
+    bool is_loaded(unsigned page_id) { return pages.get(page_id) != nullptr; }
 
-    Block *load_page(unsigned page_id) {
-        if (pages[page_id]) {
-            ++stat.access_cache_hit;
-            lru.get(page_id);
-            return pages[page_id];
+    // read a page marked moving into a frame, and put it in memory pinned
+    void load_page(unsigned page_id, Block *page, const Page &entry) {
+        try {
+            Guard guard(io_lock);
+            page->deserialize(store.reader(entry.offset, entry.size));
+        } catch (...) {
+            Guard guard(pool_lock);
+            moving.ref(page_id) = false;
+            free_page(page);
+            throw;
         }
-        if (!path) return nullptr;
-        ++stat.access_cache_miss;
-        Block *page;
-        if (!persistence_index->page_offset[page_id]) return nullptr;
-        if (persistence_index->is_leaf[page_id] == 1)
-            page = new Leaf;
-        else if (persistence_index->is_leaf[page_id] == 0)
-            page = new Index;
-        else
-            assert(false);
-        f.seekg(persistence_index->page_offset[page_id], f.beg);
-        page->deserialize(f);
-        pages[page_id] = page;
+        Guard guard(pool_lock);
+        moving.ref(page_id) = false;
+        pages.store(page_id, page);
         page->storage = this;
         page->idx = page_id;
         lru.put(page_id);
-        return page;
+        ++pins.ref(page_id);
+    }
+
+    // write pages evicted dirty, by whoever evicted them or waits for one of them
+    void write_out() {
+        for (;;) {
+            Block *page;
+            Page entry;
+            {
+                Guard guard(pool_lock);
+                if (!outgoing.size) return;
+                page = outgoing.remove(outgoing.size - 1);
+                entry = clean_page(page->idx);
+                ++stat.dirty_write;
+            }
+            {
+                Guard guard(io_lock);
+                put_page(page, entry);
+            }
+            Guard guard(pool_lock);
+            moving.ref(page->idx) = false;
+            reclaimer.retire(page);
+        }
+    }
+
+    /*
+     * Write dirty pages in memory and modified parts of the page table, keeping pages loaded.
+     * Cost is proportional to what changed since the last checkpoint, not to MAX_PAGES.
+     * Everything is on disk once it returns, and a log up to the lsn of the header may be
+     * dropped. Throws std::system_error instead if a write failed, since the last one too.
+     */
+    void checkpoint() {
+        if (!path) return;
+        write_out();
+        lru.for_each([this](unsigned page_id) {
+            if (dirty.get(page_id)) {
+                write_page(page_id);
+                ++stat.checkpoint_write;
+            }
+        });
+        // pages must be on disk before the index referencing them
+        if (shadow) sync();
+        write_table();
+        // and so must the table chunks and directory pages the header points at
+        sync();
+        check_write(store.writer(0, Header_Size())
+                            .write(reinterpret_cast<char *>(persistence_index), Header_Size()));
+        sync();
+        if (shadow) {
+            for (unsigned i = 0; i < unstable.size; i++) {
+                unsigned page_id = unstable[i];
+                Page page = table.get(page_id);
+                stable.ref(page_id) = page.offset != 0 && page.is_leaf != 2;
+            }
+            unstable.clear();
+            unpark_extents();
+        }
+        ++stat.checkpoint;
+    }
+
+    // wait for what is written to be durable, throws if some of it is not, then and from then on
+    void sync() {
+        if (!write_error) {
+            try {
+                store.sync();
+            } catch (const std::system_error &e) {
+                fail(e.code().value());
+                throw;
+            }
+        }
+        if (write_error) throw std::system_error(write_error, std::generic_category(), "failed to write page");
+    }
+
+    // a failed write leaves the stream failed, and the data file short of a page until reopened
+    void check_write(std::ostream &out) {
+        if (out) return;
+        out.clear();
+        fail(EIO);
     }
 
+    void fail(int error) {
+        if (!write_error) write_error = error;
+    }
+
+    // returns true if a table chunk or directory page at offset has to move before being written
+    bool place(size_t &offset, bool &stable, size_t size) {
+        if (offset && !(shadow && stable)) return false;
+        if (offset) retired.push(Extent{offset, size});
+        allocate_extent(offset, size);
+        stable = false;
+        return true;
+    }
+
+    void write_table() {
+        // In shadow mode, moving a chunk retires its extent, and parking that modifies
+        // the table again. Find extents for everything to be written before writing.
+        for (bool moved = true; moved;) {
+            moved = false;
+            if (shadow) park_extents();
+            for (unsigned i = 0; i < dirty_chunks.size; i++) {
+                unsigned chunk = dirty_chunks[i];
+                size_t offset = directory.get(chunk);
+                if (place(offset, chunk_stable.ref(chunk), Chunk_Size())) {
+                    set_chunk_offset(chunk, offset);
+                    moved = true;
+                }
+            }
+            for (unsigned d = 0; d < Directory::Chunks; d++) {
+                if (directory_dirty[d] &&
+                    place(persistence_index->directory_offset[d], directory_stable[d], Directory_Page_Size()))
+                    moved = true;
+            }
+        }
+        for (unsigned i = 0; i < dirty_chunks.size; i++) {
+            unsigned chunk = dirty_chunks[i];
+            check_write(store.writer(directory.get(chunk), Chunk_Size())
+                                .write(reinterpret_cast<char *>(table.chunk(chunk)), Chunk_Size()));
+            chunk_dirty.ref(chunk) = false;
+            chunk_stable.ref(chunk) = shadow;
+            ++stat.table_write;
+        }
+        dirty_chunks.clear();
+        for (unsigned d = 0; d < Directory::Chunks; d++) {
+            if (!directory_dirty[d]) continue;
+            check_write(store.writer(persistence_index->directory_offset[d], Directory_Page_Size())
+                                .write(reinterpret_cast<char *>(directory.chunk(d)), Directory_Page_Size()));
+            directory_dirty[d] = false;
+            directory_stable[d] = shadow;
+            ++stat.table_write;
+        }
+    }
+
+    // checkpoint and release every page in memory
     void save() {
         if (!path) return;
-        f.seekp(0, f.beg);
-        f.write(reinterpret_cast<char *>(persistence_index), sizeof(PersistenceIndex));
-        for (unsigned i = 0; i < MAX_PAGES; i++) {
-            if (pages[i]) offload_page(i);
+        checkpoint();
+        while (lru.size) offload_page(lru.expire());
+    }
+
+    /*
+     * Once the index is saved, retired extents are no longer referenced. Record them
+     * together with free ones as deleted pages in empty slots so that they survive a restart.
+     */
+    void park_extents() {
+        // slots past the last one in use are taken, so that parking costs as much as the extents
+        for (Stack<Extent> *extents : {&retired, &released}) {
+            // extents left over once slots run out are parked by a later checkpoint
+            while (extents->size && slot_end < MAX_PAGES) {
+                Extent extent = extents->remove(extents->size - 1);
+                parked.push(slot_end);
+                set_page(slot_end, extent.offset, extent.size, 2);
+            }
         }
     }
 
-    const Block *read(unsigned page_id) {
-        return load_page(page_id);
+    // move extents parked in the index on disk back to the free list in memory
+    void unpark_extents() {
+        for (unsigned i = 0; i < parked.size; i++) {
+            unsigned slot = parked[i];
+            Page page = table.get(slot);
+            released.push(Extent{page.offset, page.size});
+            set_page(slot, 0, 0, 0);
+            lst_empty_slot = std::min(lst_empty_slot, slot);
+        }
+        parked.clear();
+        while (slot_end > 16 && table.get(slot_end - 1).offset == 0) --slot_end;
     }
 
-    Block *get(unsigned page_id) {
-        dirty[page_id] = true;
-        return load_page(page_id);
+    using Ref = PageRef<Persistence, Block>;
+    using ConstRef = PageRef<Persistence, const Block>;
+
+    // page pinned for reading
+    ConstRef read(unsigned page_id) { return ConstRef(this, pin(page_id)); }
+
+    // page pinned for writing, a page is only written back once touched
+    Ref get(unsigned page_id) { return Ref(this, pin(page_id)); }
+
+    // mark a pinned page modified
+    void touch(unsigned page_id) {
+        Guard guard(pool_lock);
+        assert(pins.get(page_id) > 0);
+        if (dirty.get(page_id)) return;
+        dirty.ref(page_id) = true;
+        ++dirty_pages;
+    }
+
+    // hint the store to read a page that is about to be loaded
+    void prefetch(unsigned page_id) {
+        Page page;
+        {
+            Guard guard(pool_lock);
+            if (!path || pages.get(page_id) || moving.get(page_id)) return;
+            page = table.get(page_id);
+            if (!page.offset) return;
+            ++stat.prefetch;
+        }
+        Guard guard(io_lock);
+        store.prefetch(page.offset, page.size);
+    }
+
+    // start reads prefetched so far at once, for stores queueing them
+    void submit() {
+        if (!path) return;
+        Guard guard(io_lock);
+        store.submit();
+    }
+
+    // page if in memory, without locking or touching the LRU, for readers validating versions
+    const Block *peek(unsigned page_id) const { return pages.load(page_id); }
+
+    // a block in a frame of the pool, which frees it once it is retired
+    Leaf *new_leaf() {
+        Guard guard(pool_lock);
+        return new(frames.allocate()) Leaf;
+    }
+
+    Index *new_index() {
+        Guard guard(pool_lock);
+        return new(frames.allocate()) Index;
+    }
+
+    // put the frame of a retired block back, with pool_lock held
+    void free_page(Block *page) {
+        if (page->is_leaf()) {
+            Leaf *leaf = static_cast<Leaf *>(page);
+            leaf->~Leaf();
+            frames.deallocate(leaf);
+        } else {
+            Index *index = static_cast<Index *>(page);
+            index->~Index();
+            frames.deallocate(index);
+        }
+    }
+
+    // free a block merged away once readers are done with it
+    void retire(Block *block) {
+        Guard guard(pool_lock);
+        reclaimer.retire(block);
+    }
+
+    // load a page and keep it in memory until unpin
+    Block *pin(unsigned page_id) {
+        Block *page;
+        Page entry;
+        for (;;) {
+            {
+                Guard guard(pool_lock);
+                page = pages.get(page_id);
+                if (page) {
+                    ++stat.access_cache_hit;
+                    lru.get(page_id);
+                    ++pins.ref(page_id);
+                    return page;
+                }
+                if (!path) return nullptr;
+                if (!moving.get(page_id)) {
+                    entry = table.get(page_id);
+                    if (!entry.offset) return nullptr;
+                    ++stat.access_cache_miss;
+                    moving.ref(page_id) = true;
+                    // pages are evicted as soon as the pool is full, not only between operations
+                    evict(MAX_IN_MEMORY - 1);
+                    if (entry.is_leaf == 1)
+                        page = new(frames.allocate()) Leaf;
+                    else if (entry.is_leaf == 0)
+                        page = new(frames.allocate()) Index;
+                    else
+                        assert(false);
+                    break;
+                }
+            }
+            // read in by another thread, or still to be written out
+            write_out();
+            Sync::pause();
+        }
+        load_page(page_id, page, entry);
+        write_out();
+        return page;
+    }
+
+    void unpin(unsigned page_id) {
+        Guard guard(pool_lock);
+        assert(pins.get(page_id) > 0);
+        --pins.ref(page_id);
+    }
+
+    void add_size(int delta) {
+        Guard guard(pool_lock);
+        persistence_index->size += delta;
     }
 
     size_t align_to_4k(size_t offset) {
         return (offset + 0xfff) & (~0xfff);
     }
 
-    unsigned append_page(size_t &offset, size_t size) {
+    void allocate_extent(size_t &offset, size_t size) {
+        if (shadow && take_extent(size, offset)) return;
         offset = align_to_4k(persistence_index->tail_pos);
         persistence_index->tail_pos = offset + size;
+    }
+
+    unsigned append_page(size_t &offset, size_t size) {
+        allocate_extent(offset, size);
         return lst_empty_slot++;
     }
 
     unsigned request_page(size_t &offset, size_t size) {
         for(;;lst_empty_slot++) {
-            if (persistence_index->page_offset[lst_empty_slot] == 0) return append_page(offset, size);
-            if (persistence_index->is_leaf[lst_empty_slot] == 2 && persistence_index->page_size[lst_empty_slot] >= size) {
-                offset = persistence_index->page_offset[lst_empty_slot];
+            Page page = table.get(lst_empty_slot);
+            if (page.offset == 0) return append_page(offset, size);
+            if (page.is_leaf == 2 && page.size >= size) {
+                offset = page.offset;
                 return lst_empty_slot++;
             }
         }
     }
 
     void create_page(Block *block) {
+        evict(MAX_IN_MEMORY - 1);
         size_t offset;
         unsigned page_id = request_page(offset, block->storage_size());
         block->idx = page_id;
-        pages[page_id] = block;
-        persistence_index->is_leaf[page_id] = block->is_leaf() ? 1 : 0;
-        persistence_index->page_offset[page_id] = offset;
-        persistence_index->page_size[page_id] = block->storage_size();
+        pages.store(page_id, block);
+        set_page(page_id, offset, block->storage_size(), block->is_leaf() ? 1 : 0);
         lru.put(page_id);
-        dirty[page_id] = true;
+        dirty.ref(page_id) = true;
+        ++dirty_pages;
+        // the creator holds a new page until it is linked into the tree
+        pins.ref(page_id) = 1;
+        if (shadow) {
+            stable.ref(page_id) = false;
+            unstable.push(page_id);
+        }
     }
 
+    /*
+     * Offload pages until at most size are in memory, pages pinned or latched stay.
+     * Dirty pages are left to write_out, and marked moving until they are written.
+     */
+    void evict(unsigned size) {
+        if (!path || lru.size <= size) return;
+        lru.expire_while([this, size](unsigned idx) {
+            if (lru.size <= size) return false;
+            Block *page = pages.get(idx);
+            if (!pins.get(idx) && page->latch.try_lock()) {
+                // obsolete, readers still holding the page start over
+                page->version.bump();
+                page->latch.unlock();
+                if (dirty.get(idx)) {
+                    moving.ref(idx) = true;
+                    outgoing.push(page);
+                    pages.store(idx, nullptr);
+                    lru.remove(idx);
+                } else
+                    offload_page(idx);
+                ++stat.swap_out;
+            }
+            return true;
+        });
+    }
+
+    /*
+     * Write back dirty pages coldest first, keeping them in memory, until at most low are
+     * dirty or batch are written, so that eviction finds clean pages. Pages pinned or
+     * latched are left to eviction. Returns number of pages written.
+     */
+    unsigned write_back(unsigned low, unsigned batch) {
+        if (!path) return 0;
+        struct Write {
+            Block *page;
+            Page entry;
+        };
+        Stack<Write> writes;
+        {
+            Guard guard(pool_lock);
+            lru.for_each_cold([this, low, batch, &writes](unsigned idx) {
+                if (dirty_pages <= low || writes.size == batch) return false;
+                Block *page = pages.get(idx);
+                // kept latched until written, and pinned so that it stays in memory
+                if (dirty.get(idx) && !pins.get(idx) && page->latch.try_lock()) {
+                    ++pins.ref(idx);
+                    writes.push(Write{page, clean_page(idx)});
+                    ++stat.write_back;
+                }
+                return true;
+            });
+        }
+        {
+            Guard guard(io_lock);
+            for (unsigned i = 0; i < writes.size; i++) put_page(writes[i].page, writes[i].entry);
+            // left to the next checkpoint to raise, as this runs in the background
+            try {
+                store.submit();
+            } catch (const std::system_error &e) {
+                fail(e.code().value());
+            }
+        }
+        Guard guard(pool_lock);
+        for (unsigned i = 0; i < writes.size; i++) {
+            --pins.ref(writes[i].page->idx);
+            writes[i].page->latch.unlock();
+        }
+        return writes.size;
+    }
+
+    unsigned dirty_count() {
+        Guard guard(pool_lock);
+        return dirty_pages;
+    }
+
+    // called between operations, when nothing is pinned by the caller any more
     void swap_out_pages() {
-        while (lru.size > MAX_IN_MEMORY) {
-            unsigned idx = lru.expire();
-            offload_page(idx);
-            ++stat.swap_out;
+        {
+            Guard guard(pool_lock);
+            evict(MAX_IN_MEMORY);
+            reclaimer.collect([this](Block *page) { free_page(page); });
         }
+        write_out();
     }
 
     void record(Block *block) {
-        create_page(block);
-        block->storage = this;
-        ++stat.create;
+        {
+            Guard guard(pool_lock);
+            create_page(block);
+            block->storage = this;
+            ++stat.create;
+        }
+        write_out();
     }
 
     void deregister(Block *block) {
-        lru.remove(block->idx);
-        pages[block->idx] = nullptr;
-        dirty[block->idx] = false;
-        lst_empty_slot = std::min(lst_empty_slot, block->idx);
-        persistence_index->is_leaf[block->idx] = 2;
+        Guard guard(pool_lock);
+        shift_version.bump();
+        unsigned page_id = block->idx;
+        // the id is reused by a new page, which is not to be taken for this one
+        lru.drop(page_id);
+        pages.store(page_id, nullptr);
+        if (dirty.get(page_id)) --dirty_pages;
+        dirty.ref(page_id) = false;
+        pins.ref(page_id) = 0;
+        lst_empty_slot = std::min(lst_empty_slot, page_id);
+        Page page = table.get(page_id);
+        if (shadow && stable.get(page_id)) {
+            // extent is still referenced on disk, leave the slot without one
+            retired.push(Extent{page.offset, page.size});
+            set_page(page_id, 0, 0, 2);
+            stable.ref(page_id) = false;
+        } else
+            set_page(page_id, page.offset, page.size, 2);
         block->idx = 0;
         ++stat.destroy;
     }
@@ -359,8 +1541,12 @@ struct Persistence {
 #include <cassert>
 #include <cstring>
 #include <iostream>
+
 #ifndef ONLINE_JUDGE
+
 #include "Persistence.hpp"
+#include "Search.hpp"
+
 #endif
 
 #ifdef ONLINE_JUDGE
@@ -385,21 +1571,26 @@ struct Allocator {
 };
 
 template<typename T, unsigned Cap>
-class Vector : Serializable {
+class Vector {
     Allocator<T> a;
+    // elements and size of a vector allocated on its own, null for a view
+    T *own;
+    unsigned own_size;
 public:
     T *x;
-    unsigned size;
+    unsigned &size;
 
     static constexpr unsigned capacity() { return Cap; }
 
-    Vector() : size(0) {
-        x = a.allocate(capacity());
-    }
+    Vector() : own(a.allocate(capacity())), own_size(0), x(own), size(own_size) {}
 
-    virtual ~Vector() {
+    // view over elements and size kept elsewhere, such as in a page frame, which owns them
+    Vector(unsigned &size, T *x) : own(nullptr), x(x), size(size) {}
+
+    ~Vector() {
+        if (!own) return;
         for (int i = 0; i < size; i++) a.destruct(&x[i]);
-        a.deallocate(x);
+        a.deallocate(own);
     }
 
     Vector(const Vector &) = delete;
@@ -490,9 +1681,60 @@ public:
     }
 };
 
+/*
+ * Sorted keys. A set may also keep a sample of the first key in every cache line of keys,
+ * so that a search reads the sample and one line of keys instead of a line per step of a
+ * binary search over all of them. The sample is refreshed by every change made through
+ * the set, and only through it. Its Samples keys are owned by whoever enables it, so that
+ * sets searched without one, such as keys of leaves, do not carry them.
+ */
 template<typename T, unsigned Cap>
 class Set : public Vector<T, Cap> {
+    using Base = Vector<T, Cap>;
 public:
+    static constexpr unsigned Stride = sizeof(T) >= 64 ? 1 : 64 / sizeof(T);
+
+    static constexpr unsigned Samples = Cap / Stride + 1;
+
+    // sample[j] is x[j * Stride], null if keys are not sampled
+    T *sample;
+
+    Set() : Base(), sample(nullptr) {}
+
+    Set(unsigned &size, T *x) : Base(size, x), sample(nullptr) {}
+
+    // sample keys into s, of Samples keys
+    void enable_sample(T *s) {
+        sample = s;
+        refresh();
+    }
+
+    // refresh samples of keys from pos on
+    void refresh(unsigned pos = 0) {
+        if (!sample) return;
+        for (unsigned j = (pos + Stride - 1) / Stride; j * Stride < this->size; j++) sample[j] = this->x[j * Stride];
+    }
+
+    // keys of x[0, n) less than d, or no greater than d if upper
+    static unsigned count(const T *x, unsigned n, const T &d, bool upper) {
+#ifndef ONLINE_JUDGE
+        if constexpr (KeySearch<T>::Vectorized) return KeySearch<T>::count_window(x, n, d, upper);
+#endif
+        unsigned c = 0;
+        for (unsigned i = 0; i < n; i++) c += upper ? !(d < x[i]) : x[i] < d;
+        return c;
+    }
+
+    unsigned sampled_bound(const T &d, bool upper) const {
+        unsigned size = this->size;
+        unsigned c = count(sample, (size + Stride - 1) / Stride, d, upper);
+        if (c == 0) return 0;
+        // x[base] is before the bound, x[base + Stride] is not
+        unsigned base = (c - 1) * Stride;
+        unsigned rest = size > base ? size - base : 0;
+        return base + count(this->x + base, rest < Stride ? rest : Stride, d, upper);
+    }
+
     unsigned bin_lower_bound(const T &d) const {
         // https://academy.realm.io/posts/how-we-beat-cpp-stl-binary-search/
         unsigned low = 0, size = this->size;
@@ -535,15 +1777,64 @@ public:
         return this->size;
     }
 
-    unsigned upper_bound(const T &d) const { return bin_upper_bound(d); }
-
-    unsigned lower_bound(const T &d) const { return bin_lower_bound(d); }
+    unsigned upper_bound(const T &d) const {
+        if (sample) return sampled_bound(d, true);
+#ifndef ONLINE_JUDGE
+        if constexpr (KeySearch<T>::Vectorized) return KeySearch<T>::upper_bound(this->x, this->size, d);
+#endif
+        if (Cap >= 16) return bin_upper_bound(d); else return linear_upper_bound(d);
+    }
+    unsigned lower_bound(const T &d) const {
+        if (sample) return sampled_bound(d, false);
+#ifndef ONLINE_JUDGE
+        if constexpr (KeySearch<T>::Vectorized) return KeySearch<T>::lower_bound(this->x, this->size, d);
+#endif
+        if (Cap >= 16) return bin_lower_bound(d); else return linear_lower_bound(d);
+    }
 
     unsigned insert(const T &d) {
         unsigned pos = upper_bound(d);
-        Vector<T, Cap>::insert(pos, d);
+        insert(pos, d);
         return pos;
     }
+
+    void insert(unsigned pos, const T &d) {
+        Base::insert(pos, d);
+        refresh(pos);
+    }
+
+    void assign(unsigned pos, const T &d) {
+        (*this)[pos] = d;
+        if (sample && pos % Stride == 0) sample[pos / Stride] = d;
+    }
+
+    void append(const T &d) {
+        Base::append(d);
+        refresh(this->size - 1);
+    }
+
+    T remove(unsigned pos) {
+        T d = Base::remove(pos);
+        refresh(pos);
+        return d;
+    }
+
+    void remove_range(unsigned pos, unsigned length = 1) {
+        Base::remove_range(pos, length);
+        refresh(pos);
+    }
+
+    void move_from(Set &that, unsigned offset, unsigned length) {
+        Base::move_from(that, offset, length);
+        refresh();
+        that.refresh(offset);
+    }
+
+    void move_insert_from(Set &that, unsigned offset, unsigned length, unsigned at) {
+        Base::move_insert_from(that, offset, length, at);
+        refresh(at);
+        that.refresh(offset);
+    }
 };
 
 #endif //BPLUSTREE_CONTAINER_HPP
@@ -567,9 +1858,12 @@ public:
 
     Iterator &operator++() {
         ++pos;
-        if (pos == leaf()->keys.size && leaf()->next) {
-            pos = 0;
-            leaf_idx = leaf()->next;
+        {
+            auto l = leaf();
+            if (pos == (int) l->keys.size && l->next) {
+                pos = 0;
+                leaf_idx = l->next;
+            }
         }
         expire();
         return *this;
@@ -579,15 +1873,20 @@ public:
         tree->storage->swap_out_pages();
     }
 
-    const Leaf *leaf() const { return reinterpret_cast<const Leaf *>(tree->storage->read(leaf_idx)); }
+    // the leaf, pinned while the reference lives
+    typename BTree::ConstRef leaf() const { return tree->storage->read(leaf_idx); }
 
-    Leaf *leaf_mut() { return Block::into_leaf(tree->storage->get(leaf_idx)); }
+    typename BTree::Ref leaf_mut() { return tree->storage->get(leaf_idx); }
 
     Iterator &operator--() {
         --pos;
-        if (pos < 0 && leaf()->prev) {
-            leaf_idx = leaf()->prev;
-            pos = leaf()->keys.size - 1;
+        if (pos < 0) {
+            auto l = leaf();
+            if (Block::into_leaf(l.get())->prev) {
+                leaf_idx = Block::into_leaf(l.get())->prev;
+                l = leaf();
+                pos = l->keys.size - 1;
+            }
         }
         expire();
         return *this;
@@ -605,7 +1904,7 @@ public:
         return _;
     }
 
-    V operator*() {
+    V operator*() const {
         return getValue();
     }
 
@@ -617,14 +1916,95 @@ public:
         return !(a == b);
     }
 
-    V getValue() {
+    V getValue() const {
+        expire();
+        return Block::into_leaf(leaf().get())->data[pos];
+    }
+
+    void modify(const V &v) {
         expire();
-        return leaf_mut()->data[pos];
+        auto l = leaf_mut();
+        l->touch();
+        Block::into_leaf(l.get())->data[pos] = v;
+        tree->log_operation(BTree::LogModify, l->keys[pos], &v);
+    }
+};
+
+/*
+ * Cursor over keys in [lo, hi) yielding runs of keys and values, a leaf at a time.
+ * The leaf of the current run stays pinned, and latched shared against concurrent writers,
+ * until the cursor moves on, while the leaf after it is prefetched.
+ * keys and values point into the leaf and are valid until the next call to next.
+ */
+template<typename BTree, typename Block, typename Leaf, typename K, typename V>
+class RangeCursor {
+    BTree *tree;
+    K hi;
+    typename BTree::Latches latches;
+    Leaf *leaf;
+    unsigned pos;
+    bool started, last;
+
+public:
+    const K *keys;
+    const V *values;
+    unsigned count;
+
+    RangeCursor(BTree *tree, const K &lo, const K &hi) :
+            tree(tree), hi(hi), latches(tree, false), leaf(nullptr), pos(0), started(false), last(false),
+            keys(nullptr), values(nullptr), count(0) {
+        latches.lock_root();
+        if (!tree->root_idx()) {
+            latches.release();
+            return;
+        }
+        Block *blk = latches.acquire(tree->root_idx());
+        latches.unlock_root();
+        while (!blk->is_leaf()) {
+            auto *index = Block::into_index(blk);
+            blk = latches.acquire(index->children[index->keys.upper_bound(lo)]);
+            latches.release_above();
+        }
+        leaf = Block::into_leaf(blk);
+        pos = leaf->keys.lower_bound(lo);
+    }
+
+    RangeCursor(const RangeCursor &) = delete;
+
+    // move to the next run, false once the range is exhausted
+    bool next() {
+        while (leaf) {
+            if (started) {
+                if (last || !leaf->next) {
+                    close();
+                    return false;
+                }
+                leaf = Block::into_leaf(latches.acquire(leaf->next));
+                latches.release_above();
+                pos = 0;
+                tree->storage->swap_out_pages();
+            }
+            started = true;
+            unsigned end = leaf->keys.lower_bound(hi);
+            last = end < leaf->keys.size;
+            if (!last && leaf->next) {
+                tree->storage->prefetch(leaf->next);
+                tree->storage->submit();
+            }
+            if (pos < end) {
+                keys = leaf->keys.x + pos;
+                values = leaf->data.x + pos;
+                count = end - pos;
+                return true;
+            }
+        }
+        return false;
     }
 
-    void modify(const V &v) {
-        expire();
-        leaf_mut()->data[pos] = v;
+    void close() {
+        latches.release();
+        leaf = nullptr;
+        count = 0;
     }
 };
 
@@ -639,6 +2019,7 @@ public:
 #include <cassert>
 #include <iostream>
 #include <fstream>
+#include <type_traits>
 
 #include "utility.hpp"
 
@@ -650,9 +2031,10 @@ public:
 
 #endif
 
+// an Index frame fits in 4K: two sizes, links, high key and padding besides Ord keys and Ord + 1 children
 template<typename K>
 constexpr unsigned Default_Ord() {
-    return std::max((int) ((4 * 1024 - sizeof(unsigned) * 3) / (sizeof(K) + sizeof(unsigned))), 4);
+    return std::max((int) ((4 * 1024 - sizeof(unsigned) * 6 - sizeof(K) * 2) / (sizeof(K) + sizeof(unsigned))), 4);
 }
 
 template<typename K, unsigned Ord>
@@ -674,10 +2056,37 @@ constexpr unsigned Default_Max_Pages() {
 }
 #endif
 
+/*
+ * Log policy that keeps no log: changes become durable only when the tree is saved on close.
+ * See WAL for a write-ahead log.
+ */
+struct NoLog {
+    unsigned long long lsn;
+
+    NoLog() : lsn(0) {}
+
+    static constexpr bool enabled() { return false; }
+
+    void open(const char *) {}
+
+    unsigned long long append(char, const char *, unsigned) { return 0; }
+
+    void sync() {}
+
+    template<typename F>
+    void replay(unsigned long long, F) {}
+
+    void checkpoint(unsigned long long) {}
+};
+
 template<typename K, typename V,
         unsigned Ord = Default_Ord<K>(),
         unsigned Max_Page_In_Memory = Default_Max_Page_In_Memory<K, Ord>(),
-        unsigned Max_Page = Default_Max_Pages()>
+        unsigned Max_Page = Default_Max_Pages(),
+        typename Store = FileStore,
+        typename Log = NoLog,
+        typename Sync = SingleThread,
+        template<unsigned, typename> class Replacer = TwoQueue>
 class BTree {
 public:
     static constexpr unsigned MaxPageInMemory() { return Max_Page_In_Memory; }
@@ -692,13 +2101,20 @@ public:
 
     /*
      * data Block k v = Index { idx :: Int,
+     *                          next :: Block,
+     *                          high_key :: k,
      *                          keys :: [k],
      *                          children :: [Block] } |
      *                  Leaf { idx :: Int,
      *                         prev :: Block,
      *                         next :: Block,
+     *                         high_key :: k,
      *                         keys :: [k],
      *                         data :: [v] }
+     *
+     * B-link: every block links to its right neighbour on the same level, and keys of a
+     * block with a right neighbour are less than its high key, the separator between them.
+     * A reader that reaches a block split after its parent was read finds k to the right.
      */
 
     class Leaf;
@@ -708,28 +2124,70 @@ public:
     class Block;
 
     using LeafPos = pair<BlockIdx, unsigned>;
-    using BPersistence = Persistence<Block, Index, Leaf, Max_Page, Max_Page_In_Memory>;
+    using BPersistence = Persistence<Block, Index, Leaf, Max_Page, Max_Page_In_Memory, Store, Sync, Replacer>;
+    // pages pinned while they are used, see PageRef
+    using Ref = typename BPersistence::Ref;
+    using ConstRef = typename BPersistence::ConstRef;
+
+    /*
+     * A block is stored as one fixed-size frame, which is also where its fields live in memory,
+     * so a page is read and written in one piece. Only trivially copyable keys and values fit.
+     */
+    struct FrameHead {
+        BlockIdx prev = 0, next = 0;
+        unsigned keys_size = 0, values_size = 0;
+        K high_key{};
+        K keys[Order()];
+    };
+
+    template<typename T, unsigned N>
+    struct Frame : FrameHead {
+        T values[N];
+    };
+
+    static_assert(std::is_trivially_copyable<K>::value && std::is_trivially_copyable<V>::value,
+                  "keys and values are stored in page frames as they are");
 
-    struct Block : public Serializable {
+    /*
+     * Blocks have no vtable: a tag tells a Leaf from an Index, and calls on a Block are
+     * dispatched on it to the derived block, whose methods are then inlined.
+     */
+    struct Block {
         BlockIdx idx;
         Set<K, Order()> keys;
+        BlockIdx &next;
+        // upper bound of keys, if there is a next block
+        K &high_key;
         BPersistence *storage;
+        // held by concurrent operations, see Latches
+        mutable typename Sync::Latch latch;
+        // bumped when a writer latches and releases the block, see query_optimistic
+        typename Sync::Version version;
+        const bool leaf;
 
-        Block() : storage(nullptr) {}
+        // fields are bound to the frame of the derived block, which is not constructed yet
+        Block(FrameHead &f, bool leaf) : keys(f.keys_size, f.keys), next(f.next), high_key(f.high_key),
+                                         storage(nullptr), leaf(leaf) {}
 
-        virtual ~Block() {}
+        Block(const Block &) = delete;
 
-        virtual bool is_leaf() const = 0;
+        static constexpr bool is_serializable() { return true; }
 
-        virtual Block *split(K &split_key) = 0;
+        bool is_leaf() const { return leaf; }
 
-        virtual bool insert(const K &k, const V &v) = 0;
+        // call f with the block as the Leaf or Index it is
+        template<typename F>
+        auto visit(F f) { return is_leaf() ? f(into_leaf(this)) : f(into_index(this)); }
 
-        virtual bool remove(const K &k) = 0;
+        template<typename F>
+        auto visit(F f) const { return is_leaf() ? f(into_leaf(this)) : f(into_index(this)); }
 
-        virtual const V *query(const K &k) const = 0;
+        Block *split(K &split_key) { return visit([&](auto *b) -> Block * { return b->split(split_key); }); }
 
-        virtual LeafPos find(const K &k) const = 0;
+        // mark the block modified, blocks are written back only if touched while pinned
+        void touch() {
+            if (storage) storage->touch(idx);
+        }
 
         bool should_split() const { return keys.size == Order(); }
 
@@ -737,191 +2195,208 @@ public:
 
         bool may_borrow() const { return keys.size * 2 > Order(); }
 
-        virtual K borrow_from_left(Block *left, const K &split_key) = 0;
+        K borrow_from_left(Block *left, const K &split_key) {
+            return visit([&](auto *b) { return b->borrow_from_left(left, split_key); });
+        }
+
+        K borrow_from_right(Block *right, const K &split_key) {
+            return visit([&](auto *b) { return b->borrow_from_right(right, split_key); });
+        }
+
+        void merge_with_left(Block *left, const K &split_key) {
+            visit([&](auto *b) { b->merge_with_left(left, split_key); });
+        }
+
+        void merge_with_right(Block *right, const K &split_key) {
+            visit([&](auto *b) { b->merge_with_right(right, split_key); });
+        }
 
-        virtual K borrow_from_right(Block *right, const K &split_key) = 0;
+        unsigned storage_size() const { return is_leaf() ? Leaf::Storage_Size() : Index::Storage_Size(); }
 
-        virtual void merge_with_left(Block *left, const K &split_key) = 0;
+        void serialize(std::ostream &out) const { visit([&](auto *b) { b->serialize(out); }); }
 
-        virtual void merge_with_right(Block *right, const K &split_key) = 0;
+        void deserialize(std::istream &in) { visit([&](auto *b) { b->deserialize(in); }); }
 
         inline static Leaf *into_leaf(Block *b) {
             assert(b->is_leaf());
-            Leaf *l = reinterpret_cast<Leaf *>(b);
-            assert(l);
-            return l;
+            return static_cast<Leaf *>(b);
         }
 
         inline static Index *into_index(Block *b) {
             assert(!b->is_leaf());
-            Index *i = reinterpret_cast<Index *>(b);
-            assert(i);
-            return i;
+            return static_cast<Index *>(b);
         }
+
+        inline static const Leaf *into_leaf(const Block *b) { return into_leaf(const_cast<Block *>(b)); }
+
+        inline static const Index *into_index(const Block *b) { return into_index(const_cast<Block *>(b)); }
     };
 
     struct Index : public Block {
-        Index() : Block() {}
-
+        Frame<BlockIdx, Order() + 1> frame;
         Vector<BlockIdx, Order() + 1> children;
 
-        constexpr bool is_leaf() const override { return false; }
+        // keys spanning a few cache lines are searched through a sample of them, see Set
+        static constexpr bool Sampled() { return Order() * sizeof(K) > 4 * 64; }
+        K sample[Sampled() ? Set<K, Order()>::Samples : 1];
+
+        Index() : Block(frame, false), children(frame.values_size, frame.values) {
+            if (Sampled()) this->keys.enable_sample(sample);
+        }
 
-        Index *split(K &k) override {
-            Index *that = new Index;
+        Index *split(K &k) {
+            Index *that = this->storage->new_index();
             this->storage->record(that);
-            that->keys.move_from(this->keys, HalfOrder(), HalfOrder());
-            that->children.move_from(this->children, HalfOrder(), HalfOrder() + 1);
+            this->touch();
+            // the upper half moves, so that odd orders split as well
+            that->keys.move_from(this->keys, this->keys.size - HalfOrder(), HalfOrder());
+            that->children.move_from(this->children, this->children.size - HalfOrder() - 1, HalfOrder() + 1);
             k = this->keys.pop();
+            that->next = this->next;
+            that->high_key = this->high_key;
+            this->next = that->idx;
+            this->high_key = k;
             return that;
         }
 
         void insert_block(const K &k, BlockIdx v) {
+            this->touch();
             unsigned pos = this->keys.insert(k);
             this->children.insert(pos + 1, v);
         }
 
-        const V *query(const K &k) const override {
-            // {left: key < index_key} {right: key >= index_key}
-            unsigned pos = this->keys.upper_bound(k);
-            const Block *block = this->storage->read(children[pos]);
-            return block->query(k);
-        }
-
-        LeafPos find(const K &k) const override {
-            unsigned pos = this->keys.upper_bound(k);
-            const Block *block = this->storage->read(children[pos]);
-            return block->find(k);
+        // split a full child and insert its right half
+        void split_child(Block *block) {
+            K k;
+            Block *that = block->split(k);
+            insert_block(k, that->idx);
+            this->storage->unpin(that->idx);
         }
 
-        bool insert(const K &k, const V &v) override {
-            // {left: key < index_key} {right: key >= index_key}
-            unsigned pos = this->keys.upper_bound(k);
-            Block *block = this->storage->get(children[pos]);
-            bool result = block->insert(k, v);
-            if (!result) return false;
-            if (block->should_split()) {
-                K k;
-                Block *that = block->split(k);
-                insert_block(k, that->idx);
-            }
-            return true;
-        };
-
-        bool remove(const K &k) override {
-            unsigned pos = this->keys.upper_bound(k);
-            Block *block = this->storage->get(children[pos]);
-            bool result = block->remove(k);
-            if (!result) return false;
-            if (block->should_merge()) {
-                if (pos != 0) {
-                    K split_key = this->keys[pos - 1];
-                    Block *left = this->storage->get(children[pos - 1]);
-                    if (left->may_borrow()) {
-                        this->keys[pos - 1] = block->borrow_from_left(left, split_key);
-                        return true;
-                    }
-                }
-                if (pos != this->children.size - 1) {
-                    K split_key = this->keys[pos];
-                    Block *right = this->storage->get(children[pos + 1]);
-                    if (right->may_borrow()) {
-                        this->keys[pos] = block->borrow_from_right(right, split_key);
-                        return true;
-                    }
-                }
-                if (pos != 0) {
-                    K split_key = this->keys[pos - 1];
-                    Block *left = this->storage->get(children.remove(pos - 1));
-                    block->merge_with_left(left, split_key);
-                    delete left;
-                    this->keys.remove(pos - 1);
+        // borrow a key for the underfull child at pos or merge it with a sibling, false if merged
+        bool rebalance(unsigned pos, Block *block) {
+            // a key or a child of this block changes either way
+            this->touch();
+            // siblings are fetched once, for borrowing and then for merging
+            Ref left, right;
+            if (pos != 0) {
+                K split_key = this->keys[pos - 1];
+                left = this->storage->get(children[pos - 1]);
+                if (left->may_borrow()) {
+                    this->keys.assign(pos - 1, block->borrow_from_left(left.get(), split_key));
                     return true;
                 }
-                if (pos != this->children.size - 1) {
-                    K split_key = this->keys[pos];
-                    Block *right = this->storage->get(children.remove(pos + 1));
-                    block->merge_with_right(right, split_key);
-                    delete right;
-                    this->keys.remove(pos);
+            }
+            if (pos != this->children.size - 1) {
+                K split_key = this->keys[pos];
+                right = this->storage->get(children[pos + 1]);
+                if (right->may_borrow()) {
+                    this->storage->shift_version.bump();
+                    this->keys.assign(pos, block->borrow_from_right(right.get(), split_key));
                     return true;
                 }
-                assert(false);
             }
-            return true;
+            // the left block is kept, so that the right link to it stays valid
+            if (left) {
+                K split_key = this->keys[pos - 1];
+                children.remove(pos);
+                left->merge_with_right(block, split_key);
+                dispose(block);
+                this->keys.remove(pos - 1);
+                // two Index blocks and their split key may fill a whole block
+                if (left->should_split()) split_child(left.get());
+                return false;
+            }
+            if (right) {
+                K split_key = this->keys[pos];
+                children.remove(pos + 1);
+                block->merge_with_right(right.get(), split_key);
+                dispose(right.get());
+                this->keys.remove(pos);
+                if (block->should_split()) split_child(block);
+                return false;
+            }
+            assert(false);
+            return false;
         }
 
-        static constexpr unsigned Storage_Size() {
-            return Set<K, Order()>::Storage_Size() + Vector<BlockIdx, Order() + 1>::Storage_Size();
-        }
+        static constexpr unsigned Storage_Size() { return sizeof(Frame<BlockIdx, Order() + 1>); }
 
-        K borrow_from_left(Block *_left, const K &split_key) override {
+        K borrow_from_left(Block *_left, const K &split_key) {
             Index *left = this->into_index(_left);
+            this->touch();
+            left->touch();
             // TODO: we should verify that split_key is always the minimum
             this->keys.insert(split_key);
             // TODO: wish I were writing in Rust... therefore there'll be no copy overhead
             K new_split_key = left->keys.pop();
             this->children.move_insert_from(left->children, left->children.size - 1, 1, 0);
+            left->high_key = new_split_key;
             return new_split_key;
         };
 
-        K borrow_from_right(Block *_right, const K &split_key) override {
+        K borrow_from_right(Block *_right, const K &split_key) {
             Index *right = this->into_index(_right);
+            this->touch();
+            right->touch();
             this->keys.insert(split_key);
             K new_split_key = right->keys.remove(0);
             this->children.move_insert_from(right->children, 0, 1, this->children.size);
+            this->high_key = new_split_key;
             return new_split_key;
         };
 
-        void merge_with_left(Block *_left, const K &split_key) override {
+        void merge_with_left(Block *_left, const K &split_key) {
             Index *left = this->into_index(_left);
+            this->touch();
             this->keys.insert(split_key);
             this->keys.move_insert_from(left->keys, 0, left->keys.size, 0);
             this->children.move_insert_from(left->children, 0, left->children.size, 0);
             this->storage->deregister(left);
         };
 
-        void merge_with_right(Block *_right, const K &split_key) override {
+        void merge_with_right(Block *_right, const K &split_key) {
             Index *right = this->into_index(_right);
+            this->touch();
             this->keys.insert(split_key);
             this->keys.move_insert_from(right->keys, 0, right->keys.size, this->keys.size);
             this->children.move_insert_from(right->children, 0, right->children.size, this->children.size);
+            this->next = right->next;
+            this->high_key = right->high_key;
             this->storage->deregister(right);
         };
 
-        unsigned storage_size() const override { return Storage_Size(); }
+        unsigned storage_size() const { return Storage_Size(); }
 
         /*
          * Storage Mapping
-         * | 8 size | Order() K keys |
-         * | 8 size | Order()+1 BlockIdx children |
+         * | 4 BlockIdx prev (unused) | 4 BlockIdx next | 4 keys size | 4 children size | K high_key |
+         * | Order() K keys | Order()+1 BlockIdx children |
          */
-        void serialize(std::ostream &out) const override {
-            this->keys.serialize(out);
-            this->children.serialize(out);
+        void serialize(std::ostream &out) const {
+            out.write(reinterpret_cast<const char *>(&frame), sizeof(frame));
         };
 
-        void deserialize(std::istream &in) override {
-            this->keys.deserialize(in);
-            this->children.deserialize(in);
+        void deserialize(std::istream &in) {
+            in.read(reinterpret_cast<char *>(&frame), sizeof(frame));
+            this->keys.refresh();
         };
     };
 
     struct Leaf : public Block {
-        BlockIdx prev, next;
+        Frame<V, Order()> frame;
+        BlockIdx &prev;
         Vector<V, Order()> data;
 
-        Leaf() : Block(), prev(0), next(0) {}
-
-        constexpr bool is_leaf() const override { return true; }
+        Leaf() : Block(frame, true), prev(frame.prev), data(frame.values_size, frame.values) {}
 
-        const V *query(const K &k) const override {
-            LeafPos pos = this->find(k);
-            if (pos.first == 0) return nullptr;
-            return &this->data[pos.second];
+        const V *query(const K &k) const {
+            unsigned pos = this->keys.lower_bound(k);
+            if (pos >= this->keys.size || this->keys[pos] != k) return nullptr;
+            return &this->data[pos];
         }
 
-        LeafPos find(const K &k) const override {
+        LeafPos find(const K &k) const {
             unsigned pos = this->keys.lower_bound(k);
             if (pos >= this->keys.size || this->keys[pos] != k)
                 return LeafPos(0, 0);
@@ -929,18 +2404,20 @@ public:
                 return LeafPos(this->idx, pos);
         }
 
-        bool insert(const K &k, const V &v) override {
+        bool insert(const K &k, const V &v) {
             unsigned pos = this->keys.lower_bound(k);
             if (pos < this->keys.size && this->keys[pos] == k) return false;
+            this->touch();
             this->keys.insert(k);
             this->data.insert(pos, v);
             return true;
         }
 
-        bool remove(const K &k) override {
+        bool remove(const K &k) {
             unsigned pos = this->keys.lower_bound(k);
             if (pos >= this->keys.size || this->keys[pos] != k)
                 return false;
+            this->touch();
             this->keys.remove(pos);
             this->data.remove(pos);
             return true;
@@ -950,117 +2427,124 @@ public:
          * split (Leaf a) = [k, prev, next]
          * this = prev, return = next
          */
-        Leaf *split(K &k) override {
+        Leaf *split(K &k) {
             assert(this->should_split());
-            Leaf *that = new Leaf;
+            Leaf *that = this->storage->new_leaf();
             this->storage->record(that);
+            this->touch();
             if (this->next) {
-                Leaf* rr = this->into_leaf(this->storage->get(this->next));
-                rr->prev = that->idx;
+                Ref rr = this->storage->get(this->next);
+                rr->touch();
+                this->into_leaf(rr.get())->prev = that->idx;
                 that->next = rr->idx;
             }
             this->next = that->idx;
             that->prev = this->idx;
-            that->keys.move_from(this->keys, HalfOrder(), HalfOrder());
-            that->data.move_from(this->data, HalfOrder(), HalfOrder());
+            that->keys.move_from(this->keys, this->keys.size - HalfOrder(), HalfOrder());
+            that->data.move_from(this->data, this->data.size - HalfOrder(), HalfOrder());
             k = that->keys[0];
+            that->high_key = this->high_key;
+            this->high_key = k;
             return that;
         }
 
-        K borrow_from_left(Block *_left, const K &) override {
+        K borrow_from_left(Block *_left, const K &) {
             Leaf *left = this->into_leaf(_left);
             assert(this->prev == left->idx);
             assert(left->next == this->idx);
+            this->touch();
+            left->touch();
             this->keys.move_insert_from(left->keys, left->keys.size - 1, 1, 0);
             this->data.move_insert_from(left->data, left->data.size - 1, 1, 0);
+            left->high_key = this->keys[0];
             return this->keys[0];
         };
 
-        K borrow_from_right(Block *_right, const K &) override {
+        K borrow_from_right(Block *_right, const K &) {
             Leaf *right = this->into_leaf(_right);
             assert(this->next == right->idx);
             assert(right->prev == this->idx);
+            this->touch();
+            right->touch();
             this->keys.move_insert_from(right->keys, 0, 1, this->keys.size);
             this->data.move_insert_from(right->data, 0, 1, this->data.size);
+            this->high_key = right->keys[0];
             return right->keys[0];
         };
 
-        void merge_with_left(Block *_left, const K &) override {
+        void merge_with_left(Block *_left, const K &) {
             Leaf *left = this->into_leaf(_left);
             assert(this->prev == left->idx);
             assert(left->next == this->idx);
+            this->touch();
             this->keys.move_insert_from(left->keys, 0, left->keys.size, 0);
             this->data.move_insert_from(left->data, 0, left->data.size, 0);
             this->prev = left->prev;
             if (this->prev) {
-                Leaf* ll = this->into_leaf(this->storage->get(this->prev));
+                Ref ll = this->storage->get(this->prev);
+                ll->touch();
                 ll->next = this->idx;
             }
             this->storage->deregister(left);
         };
 
-        void merge_with_right(Block *_right, const K &) override {
+        void merge_with_right(Block *_right, const K &) {
             Leaf *right = this->into_leaf(_right);
             assert(this->next == right->idx);
             assert(right->prev == this->idx);
+            this->touch();
             this->keys.move_insert_from(right->keys, 0, right->keys.size, this->keys.size);
             this->data.move_insert_from(right->data, 0, right->data.size, this->data.size);
             this->next = right->next;
+            this->high_key = right->high_key;
             if (this->next) {
-                Leaf* rr = this->into_leaf(this->storage->get(this->next));
-                rr->prev = this->idx;
+                Ref rr = this->storage->get(this->next);
+                rr->touch();
+                this->into_leaf(rr.get())->prev = this->idx;
             }
             this->storage->deregister(right);
         };
 
-        static constexpr unsigned Storage_Size() {
-            return Set<K, Order()>::Storage_Size() + Vector<V, Order()>::Storage_Size() + sizeof(BlockIdx) * 2;
-        }
+        static constexpr unsigned Storage_Size() { return sizeof(Frame<V, Order()>); }
 
-        unsigned storage_size() const override { return Storage_Size(); }
+        unsigned storage_size() const { return Storage_Size(); }
 
         /*
          * Storage Mapping
-         * | 8 BlockIdx prev | 8 BlockIdx next |
-         * | 8 size | Order() K keys |
-         * | 8 size | Order() V data |
+         * | 4 BlockIdx prev | 4 BlockIdx next | 4 keys size | 4 data size | K high_key |
+         * | Order() K keys | Order() V data |
          */
 
-        void serialize(std::ostream &out) const override {
-            out.write(reinterpret_cast<const char *>(&prev), sizeof(prev));
-            out.write(reinterpret_cast<const char *>(&next), sizeof(next));
-            this->keys.serialize(out);
-            this->data.serialize(out);
+        void serialize(std::ostream &out) const {
+            out.write(reinterpret_cast<const char *>(&frame), sizeof(frame));
         };
 
-        void deserialize(std::istream &in) override {
-            in.read(reinterpret_cast<char *>(&prev), sizeof(prev));
-            in.read(reinterpret_cast<char *>(&next), sizeof(next));
-            this->keys.deserialize(in);
-            this->data.deserialize(in);
+        void deserialize(std::istream &in) {
+            in.read(reinterpret_cast<char *>(&frame), sizeof(frame));
         };
     };
 
     using iterator = Iterator<BTree, Block, Leaf, K, V>;
     using const_iterator = Iterator<const BTree, const Block, const Leaf, const K, const V>;
+    using range_cursor = RangeCursor<BTree, Block, Leaf, K, V>;
 
     BTree(const BTree &) = delete;
 
     BTree &operator=(const BTree &) = delete;
 
-    Leaf *get_leaf_begin() const {
-        Block *blk = root();
-        while (!blk->is_leaf()) blk = storage->get(Block::into_index(blk)->children[0]);
-        return Block::into_leaf(blk);
+    ConstRef get_leaf_begin() const {
+        ConstRef blk = root();
+        while (!blk->is_leaf()) blk = storage->read(Block::into_index(blk.get())->children[0]);
+        return blk;
     }
 
-    Leaf *get_leaf_end() const {
-        Block *blk = root();
+    ConstRef get_leaf_end() const {
+        ConstRef blk = root();
         while (!blk->is_leaf()) {
-            Index *idx = Block::into_index(blk);
-            blk = storage->get(idx->children[idx->children.size - 1]);
+            const Index *idx = Block::into_index(blk.get());
+            blk = storage->read(idx->children[idx->children.size - 1]);
         }
-        return Block::into_leaf(blk);
+        return blk;
     }
 
     iterator begin() {
@@ -1090,12 +2574,61 @@ public:
         return storage->persistence_index->root_idx;
     }
 
-    Block *root() const {
-        return storage->get(root_idx());
+    ConstRef root() const {
+        return storage->read(root_idx());
+    }
+
+    Log log;
+    // operations are logged unless the log itself is being replayed
+    bool logging;
+
+    enum LogOperation : char {
+        LogInsert = 'i', LogRemove = 'r', LogModify = 'm'
+    };
+
+    BTree(const char *path) : path(path), logging(false) {
+        storage = new BPersistence(path, Log::enabled());
+        if (path && Log::enabled()) recover();
+        logging = true;
+    }
+
+    /*
+     * Storage Mapping of a log record
+     * | K key | V value | (value omitted for LogRemove)
+     */
+    void log_operation(LogOperation op, const K &k, const V *v = nullptr) {
+        if (!Log::enabled() || !logging || !path) return;
+        char record[sizeof(K) + sizeof(V)];
+        memcpy(record, &k, sizeof(K));
+        if (v) memcpy(record + sizeof(K), v, sizeof(V));
+        log.append(op, record, v ? sizeof(K) + sizeof(V) : sizeof(K));
+    }
+
+    // redo operations logged after the last checkpoint of the data file
+    void recover() {
+        log.open(path);
+        log.replay(storage->persistence_index->lsn, [this](char op, const char *record, unsigned) {
+            K k;
+            V v;
+            memcpy(&k, record, sizeof(K));
+            if (op != LogRemove) memcpy(&v, record + sizeof(K), sizeof(V));
+            if (op == LogInsert) insert(k, v);
+            else if (op == LogRemove) remove(k);
+            else if (op == LogModify) {
+                iterator iter = find(k);
+                if (iter != end()) iter.modify(v);
+            } else
+                assert(false);
+        });
     }
 
-    BTree(const char *path) : path(path) {
-        storage = new BPersistence(path);
+    // write dirty pages and the index, after which the log up to now is no longer needed
+    void checkpoint() {
+        if (!path) return;
+        storage->persistence_index->lsn = log.lsn;
+        // throws before the log is dropped if the data file is not synced
+        storage->checkpoint();
+        log.checkpoint(log.lsn);
     }
 
 #ifdef ONLINE_JUDGE
@@ -1107,81 +2640,862 @@ public:
 #endif
 
     ~BTree() {
+        storage->persistence_index->lsn = log.lsn;
+        // otherwise the log is kept to replay what the data file is missing
+        if (storage->close()) log.checkpoint(log.lsn);
         delete storage;
     }
 
-    V at(const K &k) {
+    V at(const K &k) const {
         return *query(k);
     }
 
-    const V* query(const K& k) {
+    // leaf k belongs to, by descending from the root a level at a time
+    ConstRef leaf_of(const K &k) const {
+        ConstRef blk = root();
+        while (!blk->is_leaf()) {
+            const Index *index = Block::into_index(blk.get());
+            blk = storage->read(index->children[index->keys.upper_bound(k)]);
+        }
+        return blk;
+    }
+
+    const V* query(const K& k) const {
         if (!root_idx()) return nullptr;
-        auto v = storage->read(root_idx())->query(k);
+        auto v = Block::into_leaf(leaf_of(k).get())->query(k);
         storage->swap_out_pages();
         return v;
     }
 
     iterator find(const K &k) {
         if (!root_idx()) return end();
-        auto v = storage->read(root_idx())->find(k);
+        auto v = Block::into_leaf(leaf_of(k).get())->find(k);
         storage->swap_out_pages();
         if (v.first == 0) return end();
         return iterator(this, v.first, v.second);
     }
 
     Leaf *create_leaf() {
-        Leaf *block = new Leaf;
+        Leaf *block = storage->new_leaf();
         storage->record(block);
         return block;
     }
 
     Index *create_index() {
-        Index *block = new Index;
+        Index *block = storage->new_index();
         storage->record(block);
         return block;
     }
 
+    /*
+     * number of nodes a level of n entries is packed into, so that every node holds
+     * about fill_factor * hi entries, never more than hi, and no less than lo if possible
+     */
+    static unsigned bulk_load_nodes(unsigned n, double fill_factor, unsigned lo, unsigned hi) {
+        unsigned target = std::max(lo, std::min(hi, (unsigned) (fill_factor * hi)));
+        unsigned nodes = std::max(1u, (n + target - 1) / target);
+        unsigned min_nodes = (n + hi - 1) / hi;
+        while (nodes > min_nodes && n / nodes < lo) --nodes;
+        return nodes;
+    }
+
+    // entries of the i-th node when n entries are evenly spread over `nodes` nodes
+    static unsigned bulk_load_share(unsigned n, unsigned nodes, unsigned i) {
+        return n / nodes + (i < n % nodes ? 1 : 0);
+    }
+
+    /* bulk_load :: [(k, v)] -> BTree
+     * Build the tree bottom-up from strictly ascending (k, v) pairs. Leaves are packed
+     * to fill_factor and linked as they are created, then each Index level is built
+     * over the level below. Pages are never revisited once the next one is created,
+     * so each of them is written to disk exactly once.
+     * Pairs from the first one out of order on, and all of them if the tree is not
+     * empty, are inserted one by one instead.
+     * Returns number of pairs loaded, skipping keys already in the tree.
+     */
+    template<typename It>
+    unsigned bulk_load(It first, It last, double fill_factor = 1.0) {
+        unsigned n = 0;
+        if (root_idx()) {
+            for (; first != last; ++first)
+                if (insert(first->first, first->second) == OperationResult::Success) ++n;
+            return n;
+        }
+        for (It it = first, prev = first; it != last; prev = it++, ++n)
+            if (n && !(prev->first < it->first)) break;
+        if (n == 0) return 0;
+
+        unsigned count = bulk_load_nodes(n, fill_factor, (Order() + 1) / 2, Order() - 1);
+        K *low_keys = new K[count];
+        BlockIdx *blocks = new BlockIdx[count];
+        for (unsigned i = 0; i < count; i++) {
+            Leaf *leaf = create_leaf();
+            for (unsigned j = bulk_load_share(n, count, i); j > 0; j--, ++first) {
+                leaf->keys.append(first->first);
+                leaf->data.append(first->second);
+            }
+            low_keys[i] = leaf->keys[0];
+            blocks[i] = leaf->idx;
+            if (i != 0) {
+                Ref prev = storage->get(blocks[i - 1]);
+                prev->touch();
+                prev->next = leaf->idx;
+                prev->high_key = low_keys[i];
+                leaf->prev = prev->idx;
+            }
+            storage->unpin(leaf->idx);
+            storage->swap_out_pages();
+        }
+
+        while (count > 1) {
+            unsigned parents = bulk_load_nodes(count, fill_factor, (Order() + 1) / 2 + 1, Order());
+            for (unsigned i = 0, c = 0; i < parents; i++) {
+                Index *idx = create_index();
+                K low_key = low_keys[c];
+                idx->children.append(blocks[c++]);
+                for (unsigned j = bulk_load_share(count, parents, i); j > 1; j--, c++) {
+                    idx->keys.append(low_keys[c]);
+                    idx->children.append(blocks[c]);
+                }
+                if (i != 0) {
+                    Ref prev = storage->get(blocks[i - 1]);
+                    prev->touch();
+                    prev->next = idx->idx;
+                    prev->high_key = low_key;
+                }
+                // i <= c, so entries of this level are compacted in place
+                low_keys[i] = low_key;
+                blocks[i] = idx->idx;
+                storage->unpin(idx->idx);
+                storage->swap_out_pages();
+            }
+            count = parents;
+        }
+
+        root_idx() = blocks[0];
+        storage->persistence_index->size = n;
+        delete[] low_keys;
+        delete[] blocks;
+        // pairs are not logged one by one, make them durable at once
+        if (Log::enabled()) checkpoint();
+        for (; first != last; ++first)
+            if (insert(first->first, first->second) == OperationResult::Success) ++n;
+        return n;
+    }
+
     OperationResult insert(const K &k, const V &v) {
-        if (!root_idx()) root_idx() = create_leaf()->idx;
-        auto root = storage->get(root_idx());
-        bool result = storage->get(root_idx())->insert(k, v);
-        if (!result) return OperationResult::Duplicated;
-        if (root->should_split()) {
-            K k;
-            Block *next = root->split(k);
-            Block *prev = root;
-            Index *idx = create_index();
-            idx->children.append(prev->idx);
-            idx->children.append(next->idx);
-            idx->keys.append(k);
-            root_idx() = idx->idx;
+        if (Sync::enabled()) return insert_latched(k, v);
+        if (!root_idx()) {
+            root_idx() = create_leaf()->idx;
+            storage->unpin(root_idx());
         }
+        Path path;
+        descend(path, k);
+        bool result = insert_along(path, k, v, true);
+        unpin(path);
+        if (!result) return OperationResult::Duplicated;
         ++storage->persistence_index->size;
         storage->swap_out_pages();
+        log_operation(LogInsert, k, &v);
         return OperationResult::Success;
     }
 
+    /*
+     * Blocks an operation goes through, from the highest one it may change down to a leaf,
+     * and the child taken at each Index. Splits and merges walk the path back up instead of
+     * recursing, so that no block on it is looked up twice.
+     */
+    struct Path {
+        static constexpr unsigned Capacity = 64;
+
+        Block *blocks[Capacity];
+        // child of blocks[i] that blocks[i + 1] is
+        unsigned pos[Capacity];
+        unsigned size;
+
+        Path() : size(0) {}
+
+        Block *last() const { return blocks[size - 1]; }
+
+        void push(Block *block) {
+            assert(size < Capacity);
+            blocks[size++] = block;
+        }
+
+        void push(unsigned child, Block *block) {
+            pos[size - 1] = child;
+            push(block);
+        }
+
+        // the block pushed last is the highest one the operation may change
+        void cut() {
+            blocks[0] = last();
+            size = 1;
+        }
+    };
+
+    // pin blocks from the root down to the leaf k belongs to
+    void descend(Path &path, const K &k) {
+        path.push(storage->pin(root_idx()));
+        while (!path.last()->is_leaf()) {
+            Index *index = Block::into_index(path.last());
+            unsigned pos = index->keys.upper_bound(k);
+            path.push(pos, storage->pin(index->children[pos]));
+        }
+    }
+
+    // blocks merged away have no pin left
+    void unpin(const Path &path) {
+        for (unsigned i = 0; i < path.size; i++)
+            if (path.blocks[i]->idx) storage->unpin(path.blocks[i]->idx);
+    }
+
+    // insert into the leaf the path ends at, then split full blocks from there up
+    bool insert_along(Path &path, const K &k, const V &v, bool root) {
+        if (!Block::into_leaf(path.last())->insert(k, v)) return false;
+        for (unsigned i = path.size - 1; i > 0; i--)
+            if (path.blocks[i]->should_split()) Block::into_index(path.blocks[i - 1])->split_child(path.blocks[i]);
+        if (root && path.blocks[0]->should_split()) split_root(path.blocks[0]);
+        return true;
+    }
+
+    // a full root is split under a new Index root
+    void split_root(Block *root) {
+        K k;
+        Block *next = root->split(k);
+        Index *idx = create_index();
+        idx->children.append(root->idx);
+        idx->children.append(next->idx);
+        idx->keys.append(k);
+        root_idx() = idx->idx;
+        storage->unpin(next->idx);
+        storage->unpin(idx->idx);
+    }
+
     bool remove(const K &k) {
+        if (Sync::enabled()) return remove_latched(k);
         if (!root_idx()) return false;
-        auto root = storage->get(root_idx());
-        bool result = storage->get(root_idx())->remove(k);
+        Path path;
+        descend(path, k);
+        bool result = remove_along(path, k, true);
+        unpin(path);
         if (!result) return false;
-        if (root->keys.size == 0) {
-            if (!root->is_leaf()) {
-                Index *prev_root = Block::into_index(root);
-                root_idx() = prev_root->children[0];
-                storage->deregister(prev_root);
-                delete prev_root;
+        --storage->persistence_index->size;
+        storage->swap_out_pages();
+        log_operation(LogRemove, k);
+        return true;
+    }
+
+    // remove from the leaf the path ends at, then rebalance underfull blocks from there up
+    bool remove_along(Path &path, const K &k, bool root) {
+        if (!Block::into_leaf(path.last())->remove(k)) return false;
+        for (unsigned i = path.size - 1; i > 0; i--)
+            if (path.blocks[i]->should_merge()) Block::into_index(path.blocks[i - 1])->rebalance(path.pos[i - 1], path.blocks[i]);
+        Block *top = path.blocks[0];
+        if (root && top->keys.size == 0 && !top->is_leaf()) shrink_root(top);
+        return true;
+    }
+
+    // an Index root without keys is replaced by its only child
+    void shrink_root(Block *root) {
+        Index *prev_root = Block::into_index(root);
+        root_idx() = prev_root->children[0];
+        storage->deregister(prev_root);
+        dispose(prev_root);
+    }
+
+    /*
+     * Concurrent operations latch blocks from the root down (crabbing). A writer keeps the
+     * latches of ancestors only while the child it moves to may split or merge, and then
+     * the operation starts from the highest block it holds. Blocks a split or merge touches
+     * beside the path are latched on the way down: those to the right are waited for, those
+     * to the left are only tried and the operation restarts if one is taken, so that
+     * latches are always waited for top-down and left to right.
+     */
+    typename Sync::Latch root_latch;
+    // bumped with root_latch held exclusively, as root_idx may change
+    typename Sync::Version root_version;
+
+    struct Latches {
+        static constexpr unsigned Capacity = 64;
+
+        BTree *tree;
+        bool exclusive;
+        // root_latch is held
+        bool root;
+        Block *blocks[Capacity];
+        unsigned size;
+
+        Latches(BTree *tree, bool exclusive) : tree(tree), exclusive(exclusive), root(false), size(0) {}
+
+        Latches(const Latches &) = delete;
+
+        ~Latches() { release(); }
+
+        void lock_root() {
+            if (exclusive) {
+                tree->root_latch.lock();
+                tree->root_version.bump();
+            } else
+                tree->root_latch.lock_shared();
+            root = true;
+        }
+
+        void unlock_root() {
+            if (!root) return;
+            if (exclusive) {
+                tree->root_version.bump();
+                tree->root_latch.unlock();
+            } else
+                tree->root_latch.unlock_shared();
+            root = false;
+        }
+
+        Block *acquire(BlockIdx idx) {
+            assert(size < Capacity);
+            Block *block = tree->storage->pin(idx);
+            if (exclusive) {
+                block->latch.lock();
+                block->version.bump();
+            } else
+                block->latch.lock_shared();
+            return blocks[size++] = block;
+        }
+
+        // nullptr if the latch is taken
+        Block *try_acquire(BlockIdx idx) {
+            assert(exclusive && size < Capacity);
+            Block *block = tree->storage->pin(idx);
+            if (!block->latch.try_lock()) {
+                tree->storage->unpin(idx);
+                return nullptr;
             }
+            block->version.bump();
+            return blocks[size++] = block;
         }
-        --storage->persistence_index->size;
+
+        void release(unsigned from, unsigned to) {
+            for (unsigned i = from; i < to; i++) {
+                Block *block = blocks[i];
+                // unpinned before unlocked, as a block is evicted only if its latch is free
+                BlockIdx idx = block->idx;
+                if (idx) tree->storage->unpin(idx);
+                // a block merged away keeps an odd version, readers holding it start over
+                if (exclusive && idx) block->version.bump();
+                if (exclusive) block->latch.unlock(); else block->latch.unlock_shared();
+                if (!idx) tree->storage->retire(block);
+            }
+        }
+
+        void release() {
+            unlock_root();
+            release(0, size);
+            size = 0;
+        }
+
+        // release the block acquired last
+        void release_last() {
+            release(size - 1, size);
+            --size;
+        }
+
+        // release all but the block acquired last
+        void release_above() {
+            unlock_root();
+            release(0, size - 1);
+            blocks[0] = blocks[size - 1];
+            size = 1;
+        }
+    };
+
+    static bool insert_safe(const Block *block) { return block->keys.size + 1 < Order(); }
+
+    static bool remove_safe(const Block *block) { return block->keys.size * 2 >= Order() + 2; }
+
+    // blocks merged away are deleted after the operation, or with concurrent operations once their latch is released
+    static void dispose(Block *block) {
+        if (!Sync::enabled()) block->storage->retire(block);
+    }
+
+    OperationResult insert_latched(const K &k, const V &v) {
+        Latches latches(this, true);
+        latches.lock_root();
+        if (!root_idx()) {
+            root_idx() = create_leaf()->idx;
+            storage->unpin(root_idx());
+        }
+        Path path;
+        Block *blk = latches.acquire(root_idx());
+        path.push(blk);
+        if (insert_safe(blk)) latches.unlock_root();
+        while (!blk->is_leaf()) {
+            Index *idx = Block::into_index(blk);
+            unsigned pos = idx->keys.upper_bound(k);
+            blk = latches.acquire(idx->children[pos]);
+            path.push(pos, blk);
+            if (insert_safe(blk)) {
+                latches.release_above();
+                path.cut();
+            }
+        }
+        // a split leaf relinks its right neighbour
+        Leaf *leaf = Block::into_leaf(blk);
+        if (!insert_safe(leaf) && leaf->next) latches.acquire(leaf->next);
+        bool result = insert_along(path, k, v, latches.root);
+        if (!result) return OperationResult::Duplicated;
+        storage->add_size(1);
+        log_operation(LogInsert, k, &v);
+        latches.release();
         storage->swap_out_pages();
+        return OperationResult::Success;
+    }
+
+    // latch what merging child at pos of parent with a sibling may touch, false if one to the left is taken
+    bool acquire_siblings(Latches &latches, Index *parent, unsigned pos, Block *child) {
+        Block *left = nullptr, *right = nullptr;
+        if (pos + 1 < parent->children.size) right = latches.acquire(parent->children[pos + 1]);
+        if (pos > 0 && !(left = latches.try_acquire(parent->children[pos - 1]))) return false;
+        if (!child->is_leaf()) return true;
+        // the left leaf is kept, and the leaf after the one merged away is relinked
+        Block *merged = left ? child : right;
+        if (merged && merged->next && !(right && merged->next == right->idx)) latches.acquire(merged->next);
+        return true;
+    }
+
+    bool remove_latched(const K &k) {
+        for (;;) {
+            Latches latches(this, true);
+            latches.lock_root();
+            if (!root_idx()) return false;
+            Path path;
+            Block *blk = latches.acquire(root_idx());
+            path.push(blk);
+            // root is replaced when an Index with one key loses it
+            if (blk->is_leaf() || blk->keys.size > 1) latches.unlock_root();
+            bool restart = false;
+            while (!blk->is_leaf()) {
+                Index *idx = Block::into_index(blk);
+                unsigned pos = idx->keys.upper_bound(k);
+                Block *child = latches.acquire(idx->children[pos]);
+                path.push(pos, child);
+                if (remove_safe(child)) {
+                    latches.release_above();
+                    path.cut();
+                } else if (!acquire_siblings(latches, idx, pos, child)) {
+                    restart = true;
+                    break;
+                }
+                blk = child;
+            }
+            if (restart) {
+                latches.release();
+                Sync::pause();
+                continue;
+            }
+            bool result = remove_along(path, k, latches.root);
+            if (result) {
+                storage->add_size(-1);
+                log_operation(LogRemove, k);
+            }
+            latches.release();
+            storage->swap_out_pages();
+            return result;
+        }
+    }
+
+    static constexpr unsigned Optimistic_Attempts() { return 8; }
+
+    // copy value of k into v, safe with concurrent operations unlike query(k)
+    bool query(const K &k, V &v) {
+        if (Sync::enabled()) {
+            bool found;
+            for (unsigned i = 0; i < Optimistic_Attempts(); i++) {
+                if (query_optimistic(k, v, found)) return found;
+                Sync::pause();
+            }
+        }
+        return query_latched(k, v);
+    }
+
+    /*
+     * Optimistic lock coupling: take no latch and write nothing shared on the way down.
+     * The version of each block is read before using it and validated after. A block split
+     * after its parent was read is left through its right link. Keys moving to the left
+     * and freed pages, whose slots may be reused, are caught by the shift version of the
+     * pool instead. Returns false if a writer got in the way, or a page is not in memory,
+     * which is left to the latched lookup.
+     */
+    bool query_optimistic(const K &k, V &v, bool &found) {
+        typename BPersistence::Reclaimer::Guard epoch(storage->reclaimer);
+        unsigned long long shift = storage->shift_version.load();
+        unsigned long long root = root_version.load();
+        if (root & 1) return false;
+        BlockIdx idx = root_idx();
+        if (!root_version.validate(root)) return false;
+        if (!idx) {
+            found = false;
+            return true;
+        }
+        const Block *blk;
+        unsigned long long version;
+        if (!peek_unlatched(idx, blk, version)) return false;
+        // keys and children may be inconsistent until validated, but stay within capacity
+        for (;;) {
+            if (blk->next && !(k < blk->high_key))
+                idx = blk->next;
+            else if (!blk->is_leaf())
+                idx = Block::into_index(blk)->children.x[Block::into_index(blk)->keys.upper_bound(k)];
+            else
+                break;
+            if (!blk->version.validate(version)) return false;
+            if (!peek_unlatched(idx, blk, version)) return false;
+            if (!storage->shift_version.validate(shift)) return false;
+        }
+        const Leaf *leaf = Block::into_leaf(blk);
+        unsigned pos = leaf->keys.lower_bound(k);
+        found = pos < leaf->keys.size && leaf->keys.x[pos] == k;
+        if (found) {
+            V value = leaf->data.x[pos];
+            if (!blk->version.validate(version) || !storage->shift_version.validate(shift)) return false;
+            v = value;
+        } else if (!blk->version.validate(version) || !storage->shift_version.validate(shift))
+            return false;
         return true;
     }
 
+    // block idx if it is in memory and no writer holds it
+    bool peek_unlatched(BlockIdx idx, const Block *&blk, unsigned long long &version) {
+        blk = storage->peek(idx);
+        if (!blk) return false;
+        version = blk->version.load();
+        return !(version & 1);
+    }
+
+    bool query_latched(const K &k, V &v) {
+        Latches latches(this, false);
+        latches.lock_root();
+        if (!root_idx()) return false;
+        Block *blk = latches.acquire(root_idx());
+        latches.unlock_root();
+        while (!blk->is_leaf()) {
+            Index *idx = Block::into_index(blk);
+            blk = latches.acquire(idx->children[idx->keys.upper_bound(k)]);
+            latches.release_above();
+        }
+        const V *result = Block::into_leaf(blk)->query(k);
+        if (result) v = *result;
+        latches.release();
+        storage->swap_out_pages();
+        return result != nullptr;
+    }
+
+    /*
+     * Look up n keys at once, copying the value of keys[i] into values[i] where found[i].
+     * Keys are visited in sorted order from a single descent, so blocks shared by several
+     * keys are latched and searched once, and children are prefetched before their keys
+     * are looked up. Pages a batch touches stay in memory until it returns.
+     * Returns number of keys found.
+     */
+    unsigned multi_get(const K *keys, unsigned n, V *values, bool *found) {
+        if (n == 0) return 0;
+        unsigned *order = new unsigned[n];
+        sort_order(keys, order, n);
+        for (unsigned i = 0; i < n; i++) found[i] = false;
+        unsigned result = 0;
+        {
+            Latches latches(this, false);
+            latches.lock_root();
+            if (root_idx()) {
+                Block *root = latches.acquire(root_idx());
+                latches.unlock_root();
+                result = multi_get(latches, root, keys, order, 0, n, values, found);
+            }
+        }
+        delete[] order;
+        storage->swap_out_pages();
+        return result;
+    }
+
+    // look up keys[order[from .. to)], sorted, below blk which is latched last
+    unsigned multi_get(Latches &latches, Block *blk, const K *keys, const unsigned *order,
+                       unsigned from, unsigned to, V *values, bool *found) {
+        if (blk->is_leaf()) {
+            const Leaf *leaf = Block::into_leaf(blk);
+            unsigned n = 0;
+            for (unsigned i = from; i < to; i++) {
+                unsigned j = order[i];
+                unsigned pos = leaf->keys.lower_bound(keys[j]);
+                if (pos < leaf->keys.size && leaf->keys[pos] == keys[j]) {
+                    values[j] = leaf->data[pos];
+                    found[j] = true;
+                    ++n;
+                }
+            }
+            return n;
+        }
+        const Index *index = Block::into_index(blk);
+        // each child is fetched ahead of the lookups before it
+        for (unsigned i = from, pos; i < to; i = run_end(index, keys, order, i, to, pos)) {
+            pos = index->keys.upper_bound(keys[order[i]]);
+            BlockIdx child = index->children[pos];
+            if (const Block *page = storage->peek(child)) __builtin_prefetch(page->keys.x);
+            else
+                storage->prefetch(child);
+        }
+        // reads of children not in memory go out as one batch
+        storage->submit();
+        unsigned n = 0;
+        for (unsigned i = from, pos, end; i < to; i = end) {
+            pos = index->keys.upper_bound(keys[order[i]]);
+            end = run_end(index, keys, order, i, to, pos);
+            Block *child = latches.acquire(index->children[pos]);
+            n += multi_get(latches, child, keys, order, i, end, values, found);
+            latches.release_last();
+        }
+        return n;
+    }
+
+    // end of the run of keys from i on that go to child pos
+    static unsigned run_end(const Index *index, const K *keys, const unsigned *order,
+                            unsigned i, unsigned to, unsigned pos) {
+        if (pos == index->keys.size) return to;
+        while (i < to && keys[order[i]] < index->keys[pos]) i++;
+        return i;
+    }
+
+    // indices of keys in ascending order of keys, by merge sort
+    static void sort_order(const K *keys, unsigned *order, unsigned n) {
+        bool sorted = true;
+        for (unsigned i = 0; i < n; i++) {
+            order[i] = i;
+            if (i && keys[i] < keys[i - 1]) sorted = false;
+        }
+        if (sorted) return;
+        unsigned *from = order, *to = new unsigned[n];
+        for (unsigned width = 1; width < n; width *= 2) {
+            for (unsigned lo = 0; lo < n; lo += 2 * width) {
+                unsigned mid = std::min(lo + width, n), hi = std::min(lo + 2 * width, n);
+                unsigned i = lo, j = mid, k = lo;
+                while (i < mid && j < hi) to[k++] = keys[from[j]] < keys[from[i]] ? from[j++] : from[i++];
+                while (i < mid) to[k++] = from[i++];
+                while (j < hi) to[k++] = from[j++];
+            }
+            std::swap(from, to);
+        }
+        if (from != order) {
+            memcpy(order, from, n * sizeof(unsigned));
+            to = from;
+        }
+        delete[] to;
+    }
+
+    // keys of a batch, and their values if it inserts, applied in ascending order of keys
+    struct Batch {
+        K *keys;
+        V *values;
+        unsigned *order;
+        unsigned n;
+
+        Batch(unsigned n, bool with_values) :
+                keys(new K[n]), values(with_values ? new V[n] : nullptr), order(new unsigned[n]), n(n) {}
+
+        Batch(const Batch &) = delete;
+
+        ~Batch() {
+            delete[] keys;
+            delete[] values;
+            delete[] order;
+        }
+
+        void sort() { sort_order(keys, order, n); }
+
+        const K &key(unsigned i) const { return keys[order[i]]; }
+
+        const V &value(unsigned i) const { return values[order[i]]; }
+
+        // a key repeated in the batch is applied once
+        bool repeated(unsigned i) const { return i > 0 && !(key(i - 1) < key(i)); }
+    };
+
+    /*
+     * Insert pairs in [first, last) with a few descents instead of one per pair. Pairs are
+     * sorted and split into runs going to the same leaf, and each run is merged into its
+     * leaf in one pass. A block that fills up is split once the run going to it is applied,
+     * and a descent stops at a full Index, which is split before the next one.
+     * With concurrent operations pairs are inserted one by one.
+     * Returns number of pairs inserted, skipping keys in the tree or earlier in the batch.
+     */
+    template<typename It>
+    unsigned insert_batch(It first, It last) {
+        unsigned n = 0, inserted = 0;
+        if (Sync::enabled()) {
+            for (; first != last; ++first)
+                if (insert(first->first, first->second) == OperationResult::Success) ++n;
+            return n;
+        }
+        for (It it = first; it != last; ++it) ++n;
+        if (n == 0) return 0;
+        Batch batch(n, true);
+        for (unsigned i = 0; i < n; i++, ++first) {
+            batch.keys[i] = first->first;
+            batch.values[i] = first->second;
+        }
+        batch.sort();
+        if (!root_idx()) {
+            root_idx() = create_leaf()->idx;
+            storage->unpin(root_idx());
+        }
+        for (unsigned i = 0; i < n;) {
+            Ref root = storage->get(root_idx());
+            i = insert_run(root.get(), batch, i, n, inserted);
+            if (root->should_split()) split_root(root.get());
+            root.release();
+            storage->swap_out_pages();
+        }
+        storage->persistence_index->size += inserted;
+        return inserted;
+    }
+
+    // insert keys of batch from i on below blk, returns where it stopped
+    unsigned insert_run(Block *blk, const Batch &batch, unsigned i, unsigned to, unsigned &inserted) {
+        if (blk->is_leaf()) return insert_into_leaf(Block::into_leaf(blk), batch, i, to, inserted);
+        Index *index = Block::into_index(blk);
+        do {
+            unsigned pos = index->keys.upper_bound(batch.key(i));
+            unsigned end = run_end(index, batch.keys, batch.order, i, to, pos);
+            Ref child = storage->get(index->children[pos]);
+            i = insert_run(child.get(), batch, i, end, inserted);
+            if (child->should_split()) index->split_child(child.get());
+        } while (i < to && !index->should_split());
+        return i;
+    }
+
+    // merge keys of batch from i on into leaf from the back, as many as it has room for
+    unsigned insert_into_leaf(Leaf *leaf, const Batch &batch, unsigned i, unsigned to, unsigned &inserted) {
+        unsigned size = leaf->keys.size, room = Order() - size, fresh = 0, end = i;
+        for (unsigned pos = leaf->keys.lower_bound(batch.key(i)); end < to && fresh < room; end++) {
+            if (batch.repeated(end)) continue;
+            while (pos < size && leaf->keys[pos] < batch.key(end)) pos++;
+            if (pos < size && leaf->keys[pos] == batch.key(end)) continue;
+            ++fresh;
+        }
+        if (fresh) leaf->touch();
+        K *keys = leaf->keys.x;
+        V *data = leaf->data.x;
+        for (unsigned j = end, at = size + fresh, from = size; j-- > i;) {
+            const K &k = batch.key(j);
+            if (batch.repeated(j)) continue;
+            for (; from > 0 && k < keys[from - 1]; from--, at--) {
+                keys[at - 1] = keys[from - 1];
+                data[at - 1] = data[from - 1];
+            }
+            if (from > 0 && keys[from - 1] == k) continue;
+            --at;
+            keys[at] = k;
+            data[at] = batch.value(j);
+            log_operation(LogInsert, k, &data[at]);
+        }
+        leaf->keys.size = leaf->data.size = size + fresh;
+        inserted += fresh;
+        return end;
+    }
+
+    /*
+     * Remove keys in [first, last) with a few descents. Keys are sorted, the keys going to
+     * a leaf are removed from it in one pass, and an underfull block is rebalanced once the
+     * run going to it is applied. A descent stops at an underfull Index, which is rebalanced
+     * before the next one.
+     * With concurrent operations keys are removed one by one.
+     * Returns number of keys removed.
+     */
+    template<typename It>
+    unsigned remove_batch(It first, It last) {
+        unsigned n = 0, removed = 0;
+        if (Sync::enabled()) {
+            for (; first != last; ++first)
+                if (remove(*first)) ++n;
+            return n;
+        }
+        if (!root_idx()) return 0;
+        for (It it = first; it != last; ++it) ++n;
+        if (n == 0) return 0;
+        Batch batch(n, false);
+        for (unsigned i = 0; i < n; i++, ++first) batch.keys[i] = *first;
+        batch.sort();
+        for (unsigned i = 0; i < n;) {
+            Ref root = storage->get(root_idx());
+            i = remove_run(root.get(), batch, i, n, removed, true);
+            while (root->keys.size == 0 && !root->is_leaf()) {
+                shrink_root(root.get());
+                root = storage->get(root_idx());
+            }
+            root.release();
+            storage->swap_out_pages();
+        }
+        storage->persistence_index->size -= removed;
+        return removed;
+    }
+
+    // remove keys of batch from i on below blk, returns where it stopped
+    unsigned remove_run(Block *blk, const Batch &batch, unsigned i, unsigned to, unsigned &removed, bool root) {
+        if (blk->is_leaf()) return remove_from_leaf(Block::into_leaf(blk), batch, i, to, removed);
+        Index *index = Block::into_index(blk);
+        do {
+            unsigned pos = index->keys.upper_bound(batch.key(i));
+            unsigned end = run_end(index, batch.keys, batch.order, i, to, pos);
+            Ref child = storage->get(index->children[pos]);
+            i = remove_run(child.get(), batch, i, end, removed, false);
+            while (child->should_merge() && index->rebalance(pos, child.get()));
+        } while (i < to && index->keys.size > 0 && (root || !index->should_merge()));
+        return i;
+    }
+
+    // drop keys of batch from i to to from leaf, compacting it in one pass
+    unsigned remove_from_leaf(Leaf *leaf, const Batch &batch, unsigned i, unsigned to, unsigned &removed) {
+        K *keys = leaf->keys.x;
+        V *data = leaf->data.x;
+        unsigned size = leaf->keys.size, at = leaf->keys.lower_bound(batch.key(i));
+        for (unsigned from = at, j = i; from < size; from++) {
+            while (j < to && batch.key(j) < keys[from]) j++;
+            if (j < to && batch.key(j) == keys[from]) {
+                log_operation(LogRemove, keys[from]);
+                continue;
+            }
+            keys[at] = keys[from];
+            data[at] = data[from];
+            at++;
+        }
+        if (at == size) return to;
+        leaf->touch();
+        removed += size - at;
+        leaf->keys.size = leaf->data.size = at;
+        return to;
+    }
+
+    // keys in [lo, hi) a leaf at a time
+    range_cursor range(const K &lo, const K &hi) { return range_cursor(this, lo, hi); }
+
+    /*
+     * Call f(keys, values, count) on runs of keys in [lo, hi) and their values, in order.
+     * Returns number of keys scanned.
+     */
+    template<typename F>
+    unsigned scan(const K &lo, const K &hi, F f) {
+        unsigned n = 0;
+        {
+            range_cursor cursor(this, lo, hi);
+            while (cursor.next()) {
+                f(cursor.keys, cursor.values, cursor.count);
+                n += cursor.count;
+            }
+        }
+        storage->swap_out_pages();
+        return n;
+    }
+
     unsigned size() const { return storage->persistence_index->size; }
 
-    unsigned count(const K &k) { return query(k) ? 1 : 0; }
+    unsigned count(const K &k) const { return query(k) ? 1 : 0; }
 
     void debug(Block *block) {
         std::cerr << "Block ID: " << block->idx << " ";
@@ -1204,7 +3518,7 @@ public:
             }
             std::cerr << std::endl;
             for (int i = 0; i < index->children.size; i++) {
-                debug(storage->get(index->children[i]));
+                debug(storage->get(index->children[i]).get());
             }
         }
     }
@@ -16,6 +16,7 @@ cat <<EOF > BTree.hpp
 namespace sjtu {
 EOF
 
+cat src/SparseArray.hpp >> BTree.hpp
 cat src/LRU.hpp >> BTree.hpp
 cat src/Persistence.hpp >> BTree.hpp
 cat src/Container.hpp >> BTree.hpp
@@ -8,6 +8,7 @@
 #include <cassert>
 #include <iostream>
 #include <fstream>
+#include <type_traits>
 
 #include "utility.hpp"
 
@@ -19,9 +20,10 @@
 
 #endif
 
+// an Index frame fits in 4K: two sizes, links, high key and padding besides Ord keys and Ord + 1 children
 template<typename K>
 constexpr unsigned Default_Ord() {
-    return std::max((int) ((4 * 1024 - sizeof(unsigned) * 3) / (sizeof(K) + sizeof(unsigned))), 4);
+    return std::max((int) ((4 * 1024 - sizeof(unsigned) * 6 - sizeof(K) * 2) / (sizeof(K) + sizeof(unsigned))), 4);
 }
 
 template<typename K, unsigned Ord>
@@ -43,10 +45,37 @@ constexpr unsigned Default_Max_Pages() {
 }
 #endif
 
+/*
+ * Log policy that keeps no log: changes become durable only when the tree is saved on close.
+ * See WAL for a write-ahead log.
+ */
+struct NoLog {
+    unsigned long long lsn;
+
+    NoLog() : lsn(0) {}
+
+    static constexpr bool enabled() { return false; }
+
+    void open(const char *) {}
+
+    unsigned long long append(char, const char *, unsigned) { return 0; }
+
+    void sync() {}
+
+    template<typename F>
+    void replay(unsigned long long, F) {}
+
+    void checkpoint(unsigned long long) {}
+};
+
 template<typename K, typename V,
         unsigned Ord = Default_Ord<K>(),
         unsigned Max_Page_In_Memory = Default_Max_Page_In_Memory<K, Ord>(),
-        unsigned Max_Page = Default_Max_Pages()>
+        unsigned Max_Page = Default_Max_Pages(),
+        typename Store = FileStore,
+        typename Log = NoLog,
+        typename Sync = SingleThread,
+        template<unsigned, typename> class Replacer = TwoQueue>
 class BTree {
 public:
     static constexpr unsigned MaxPageInMemory() { return Max_Page_In_Memory; }
@@ -61,13 +90,20 @@ public:
 
     /*
      * data Block k v = Index { idx :: Int,
+     *                          next :: Block,
+     *                          high_key :: k,
      *                          keys :: [k],
      *                          children :: [Block] } |
      *                  Leaf { idx :: Int,
      *                         prev :: Block,
      *                         next :: Block,
+     *                         high_key :: k,
      *                         keys :: [k],
      *                         data :: [v] }
+     *
+     * B-link: every block links to its right neighbour on the same level, and keys of a
+     * block with a right neighbour are less than its high key, the separator between them.
+     * A reader that reaches a block split after its parent was read finds k to the right.
      */
 
     class Leaf;
@@ -77,28 +113,70 @@ public:
     class Block;
 
     using LeafPos = pair<BlockIdx, unsigned>;
-    using BPersistence = Persistence<Block, Index, Leaf, Max_Page, Max_Page_In_Memory>;
+    using BPersistence = Persistence<Block, Index, Leaf, Max_Page, Max_Page_In_Memory, Store, Sync, Replacer>;
+    // pages pinned while they are used, see PageRef
+    using Ref = typename BPersistence::Ref;
+    using ConstRef = typename BPersistence::ConstRef;
 
-    struct Block : public Serializable {
+    /*
+     * A block is stored as one fixed-size frame, which is also where its fields live in memory,
+     * so a page is read and written in one piece. Only trivially copyable keys and values fit.
+     */
+    struct FrameHead {
+        BlockIdx prev = 0, next = 0;
+        unsigned keys_size = 0, values_size = 0;
+        K high_key{};
+        K keys[Order()];
+    };
+
+    template<typename T, unsigned N>
+    struct Frame : FrameHead {
+        T values[N];
+    };
+
+    static_assert(std::is_trivially_copyable<K>::value && std::is_trivially_copyable<V>::value,
+                  "keys and values are stored in page frames as they are");
+
+    /*
+     * Blocks have no vtable: a tag tells a Leaf from an Index, and calls on a Block are
+     * dispatched on it to the derived block, whose methods are then inlined.
+     */
+    struct Block {
         BlockIdx idx;
         Set<K, Order()> keys;
+        BlockIdx &next;
+        // upper bound of keys, if there is a next block
+        K &high_key;
         BPersistence *storage;
+        // held by concurrent operations, see Latches
+        mutable typename Sync::Latch latch;
+        // bumped when a writer latches and releases the block, see query_optimistic
+        typename Sync::Version version;
+        const bool leaf;
 
-        Block() : storage(nullptr) {}
+        // fields are bound to the frame of the derived block, which is not constructed yet
+        Block(FrameHead &f, bool leaf) : keys(f.keys_size, f.keys), next(f.next), high_key(f.high_key),
+                                         storage(nullptr), leaf(leaf) {}
 
-        virtual ~Block() {}
+        Block(const Block &) = delete;
 
-        virtual bool is_leaf() const = 0;
+        static constexpr bool is_serializable() { return true; }
 
-        virtual Block *split(K &split_key) = 0;
+        bool is_leaf() const { return leaf; }
 
-        virtual bool insert(const K &k, const V &v) = 0;
+        // call f with the block as the Leaf or Index it is
+        template<typename F>
+        auto visit(F f) { return is_leaf() ? f(into_leaf(this)) : f(into_index(this)); }
 
-        virtual bool remove(const K &k) = 0;
+        template<typename F>
+        auto visit(F f) const { return is_leaf() ? f(into_leaf(this)) : f(into_index(this)); }
 
-        virtual const V *query(const K &k) const = 0;
+        Block *split(K &split_key) { return visit([&](auto *b) -> Block * { return b->split(split_key); }); }
 
-        virtual LeafPos find(const K &k) const = 0;
+        // mark the block modified, blocks are written back only if touched while pinned
+        void touch() {
+            if (storage) storage->touch(idx);
+        }
 
         bool should_split() const { return keys.size == Order(); }
 
@@ -106,191 +184,208 @@ public:
 
         bool may_borrow() const { return keys.size * 2 > Order(); }
 
-        virtual K borrow_from_left(Block *left, const K &split_key) = 0;
+        K borrow_from_left(Block *left, const K &split_key) {
+            return visit([&](auto *b) { return b->borrow_from_left(left, split_key); });
+        }
+
+        K borrow_from_right(Block *right, const K &split_key) {
+            return visit([&](auto *b) { return b->borrow_from_right(right, split_key); });
+        }
+
+        void merge_with_left(Block *left, const K &split_key) {
+            visit([&](auto *b) { b->merge_with_left(left, split_key); });
+        }
+
+        void merge_with_right(Block *right, const K &split_key) {
+            visit([&](auto *b) { b->merge_with_right(right, split_key); });
+        }
 
-        virtual K borrow_from_right(Block *right, const K &split_key) = 0;
+        unsigned storage_size() const { return is_leaf() ? Leaf::Storage_Size() : Index::Storage_Size(); }
 
-        virtual void merge_with_left(Block *left, const K &split_key) = 0;
+        void serialize(std::ostream &out) const { visit([&](auto *b) { b->serialize(out); }); }
 
-        virtual void merge_with_right(Block *right, const K &split_key) = 0;
+        void deserialize(std::istream &in) { visit([&](auto *b) { b->deserialize(in); }); }
 
         inline static Leaf *into_leaf(Block *b) {
             assert(b->is_leaf());
-            Leaf *l = reinterpret_cast<Leaf *>(b);
-            assert(l);
-            return l;
+            return static_cast<Leaf *>(b);
         }
 
         inline static Index *into_index(Block *b) {
             assert(!b->is_leaf());
-            Index *i = reinterpret_cast<Index *>(b);
-            assert(i);
-            return i;
+            return static_cast<Index *>(b);
         }
+
+        inline static const Leaf *into_leaf(const Block *b) { return into_leaf(const_cast<Block *>(b)); }
+
+        inline static const Index *into_index(const Block *b) { return into_index(const_cast<Block *>(b)); }
     };
 
     struct Index : public Block {
-        Index() : Block() {}
-
+        Frame<BlockIdx, Order() + 1> frame;
         Vector<BlockIdx, Order() + 1> children;
 
-        constexpr bool is_leaf() const override { return false; }
+        // keys spanning a few cache lines are searched through a sample of them, see Set
+        static constexpr bool Sampled() { return Order() * sizeof(K) > 4 * 64; }
+        K sample[Sampled() ? Set<K, Order()>::Samples : 1];
 
-        Index *split(K &k) override {
-            Index *that = new Index;
+        Index() : Block(frame, false), children(frame.values_size, frame.values) {
+            if (Sampled()) this->keys.enable_sample(sample);
+        }
+
+        Index *split(K &k) {
+            Index *that = this->storage->new_index();
             this->storage->record(that);
-            that->keys.move_from(this->keys, HalfOrder(), HalfOrder());
-            that->children.move_from(this->children, HalfOrder(), HalfOrder() + 1);
+            this->touch();
+            // the upper half moves, so that odd orders split as well
+            that->keys.move_from(this->keys, this->keys.size - HalfOrder(), HalfOrder());
+            that->children.move_from(this->children, this->children.size - HalfOrder() - 1, HalfOrder() + 1);
             k = this->keys.pop();
+            that->next = this->next;
+            that->high_key = this->high_key;
+            this->next = that->idx;
+            this->high_key = k;
             return that;
         }
 
         void insert_block(const K &k, BlockIdx v) {
+            this->touch();
             unsigned pos = this->keys.insert(k);
             this->children.insert(pos + 1, v);
         }
 
-        const V *query(const K &k) const override {
-            // {left: key < index_key} {right: key >= index_key}
-            unsigned pos = this->keys.upper_bound(k);
-            const Block *block = this->storage->read(children[pos]);
-            return block->query(k);
-        }
-
-        LeafPos find(const K &k) const override {
-            unsigned pos = this->keys.upper_bound(k);
-            const Block *block = this->storage->read(children[pos]);
-            return block->find(k);
+        // split a full child and insert its right half
+        void split_child(Block *block) {
+            K k;
+            Block *that = block->split(k);
+            insert_block(k, that->idx);
+            this->storage->unpin(that->idx);
         }
 
-        bool insert(const K &k, const V &v) override {
-            // {left: key < index_key} {right: key >= index_key}
-            unsigned pos = this->keys.upper_bound(k);
-            Block *block = this->storage->get(children[pos]);
-            bool result = block->insert(k, v);
-            if (!result) return false;
-            if (block->should_split()) {
-                K k;
-                Block *that = block->split(k);
-                insert_block(k, that->idx);
-            }
-            return true;
-        };
-
-        bool remove(const K &k) override {
-            unsigned pos = this->keys.upper_bound(k);
-            Block *block = this->storage->get(children[pos]);
-            bool result = block->remove(k);
-            if (!result) return false;
-            if (block->should_merge()) {
-                if (pos != 0) {
-                    K split_key = this->keys[pos - 1];
-                    Block *left = this->storage->get(children[pos - 1]);
-                    if (left->may_borrow()) {
-                        this->keys[pos - 1] = block->borrow_from_left(left, split_key);
-                        return true;
-                    }
-                }
-                if (pos != this->children.size - 1) {
-                    K split_key = this->keys[pos];
-                    Block *right = this->storage->get(children[pos + 1]);
-                    if (right->may_borrow()) {
-                        this->keys[pos] = block->borrow_from_right(right, split_key);
-                        return true;
-                    }
-                }
-                if (pos != 0) {
-                    K split_key = this->keys[pos - 1];
-                    Block *left = this->storage->get(children.remove(pos - 1));
-                    block->merge_with_left(left, split_key);
-                    delete left;
-                    this->keys.remove(pos - 1);
+        // borrow a key for the underfull child at pos or merge it with a sibling, false if merged
+        bool rebalance(unsigned pos, Block *block) {
+            // a key or a child of this block changes either way
+            this->touch();
+            // siblings are fetched once, for borrowing and then for merging
+            Ref left, right;
+            if (pos != 0) {
+                K split_key = this->keys[pos - 1];
+                left = this->storage->get(children[pos - 1]);
+                if (left->may_borrow()) {
+                    this->keys.assign(pos - 1, block->borrow_from_left(left.get(), split_key));
                     return true;
                 }
-                if (pos != this->children.size - 1) {
-                    K split_key = this->keys[pos];
-                    Block *right = this->storage->get(children.remove(pos + 1));
-                    block->merge_with_right(right, split_key);
-                    delete right;
-                    this->keys.remove(pos);
+            }
+            if (pos != this->children.size - 1) {
+                K split_key = this->keys[pos];
+                right = this->storage->get(children[pos + 1]);
+                if (right->may_borrow()) {
+                    this->storage->shift_version.bump();
+                    this->keys.assign(pos, block->borrow_from_right(right.get(), split_key));
                     return true;
                 }
-                assert(false);
             }
-            return true;
+            // the left block is kept, so that the right link to it stays valid
+            if (left) {
+                K split_key = this->keys[pos - 1];
+                children.remove(pos);
+                left->merge_with_right(block, split_key);
+                dispose(block);
+                this->keys.remove(pos - 1);
+                // two Index blocks and their split key may fill a whole block
+                if (left->should_split()) split_child(left.get());
+                return false;
+            }
+            if (right) {
+                K split_key = this->keys[pos];
+                children.remove(pos + 1);
+                block->merge_with_right(right.get(), split_key);
+                dispose(right.get());
+                this->keys.remove(pos);
+                if (block->should_split()) split_child(block);
+                return false;
+            }
+            assert(false);
+            return false;
         }
 
-        static constexpr unsigned Storage_Size() {
-            return Set<K, Order()>::Storage_Size() + Vector<BlockIdx, Order() + 1>::Storage_Size();
-        }
+        static constexpr unsigned Storage_Size() { return sizeof(Frame<BlockIdx, Order() + 1>); }
 
-        K borrow_from_left(Block *_left, const K &split_key) override {
+        K borrow_from_left(Block *_left, const K &split_key) {
             Index *left = this->into_index(_left);
+            this->touch();
+            left->touch();
             // TODO: we should verify that split_key is always the minimum
             this->keys.insert(split_key);
             // TODO: wish I were writing in Rust... therefore there'll be no copy overhead
             K new_split_key = left->keys.pop();
             this->children.move_insert_from(left->children, left->children.size - 1, 1, 0);
+            left->high_key = new_split_key;
             return new_split_key;
         };
 
-        K borrow_from_right(Block *_right, const K &split_key) override {
+        K borrow_from_right(Block *_right, const K &split_key) {
             Index *right = this->into_index(_right);
+            this->touch();
+            right->touch();
             this->keys.insert(split_key);
             K new_split_key = right->keys.remove(0);
             this->children.move_insert_from(right->children, 0, 1, this->children.size);
+            this->high_key = new_split_key;
             return new_split_key;
         };
 
-        void merge_with_left(Block *_left, const K &split_key) override {
+        void merge_with_left(Block *_left, const K &split_key) {
             Index *left = this->into_index(_left);
+            this->touch();
             this->keys.insert(split_key);
             this->keys.move_insert_from(left->keys, 0, left->keys.size, 0);
             this->children.move_insert_from(left->children, 0, left->children.size, 0);
             this->storage->deregister(left);
         };
 
-        void merge_with_right(Block *_right, const K &split_key) override {
+        void merge_with_right(Block *_right, const K &split_key) {
             Index *right = this->into_index(_right);
+            this->touch();
             this->keys.insert(split_key);
             this->keys.move_insert_from(right->keys, 0, right->keys.size, this->keys.size);
             this->children.move_insert_from(right->children, 0, right->children.size, this->children.size);
+            this->next = right->next;
+            this->high_key = right->high_key;
             this->storage->deregister(right);
         };
 
-        unsigned storage_size() const override { return Storage_Size(); }
+        unsigned storage_size() const { return Storage_Size(); }
 
         /*
          * Storage Mapping
-         * | 8 size | Order() K keys |
-         * | 8 size | Order()+1 BlockIdx children |
+         * | 4 BlockIdx prev (unused) | 4 BlockIdx next | 4 keys size | 4 children size | K high_key |
+         * | Order() K keys | Order()+1 BlockIdx children |
          */
-        void serialize(std::ostream &out) const override {
-            this->keys.serialize(out);
-            this->children.serialize(out);
+        void serialize(std::ostream &out) const {
+            out.write(reinterpret_cast<const char *>(&frame), sizeof(frame));
         };
 
-        void deserialize(std::istream &in) override {
-            this->keys.deserialize(in);
-            this->children.deserialize(in);
+        void deserialize(std::istream &in) {
+            in.read(reinterpret_cast<char *>(&frame), sizeof(frame));
+            this->keys.refresh();
         };
     };
 
     struct Leaf : public Block {
-        BlockIdx prev, next;
+        Frame<V, Order()> frame;
+        BlockIdx &prev;
         Vector<V, Order()> data;
 
-        Leaf() : Block(), prev(0), next(0) {}
+        Leaf() : Block(frame, true), prev(frame.prev), data(frame.values_size, frame.values) {}
 
-        constexpr bool is_leaf() const override { return true; }
-
-        const V *query(const K &k) const override {
-            LeafPos pos = this->find(k);
-            if (pos.first == 0) return nullptr;
-            return &this->data[pos.second];
+        const V *query(const K &k) const {
+            unsigned pos = this->keys.lower_bound(k);
+            if (pos >= this->keys.size || this->keys[pos] != k) return nullptr;
+            return &this->data[pos];
         }
 
-        LeafPos find(const K &k) const override {
+        LeafPos find(const K &k) const {
             unsigned pos = this->keys.lower_bound(k);
             if (pos >= this->keys.size || this->keys[pos] != k)
                 return LeafPos(0, 0);
@@ -298,18 +393,20 @@ public:
                 return LeafPos(this->idx, pos);
         }
 
-        bool insert(const K &k, const V &v) override {
+        bool insert(const K &k, const V &v) {
             unsigned pos = this->keys.lower_bound(k);
             if (pos < this->keys.size && this->keys[pos] == k) return false;
+            this->touch();
             this->keys.insert(k);
             this->data.insert(pos, v);
             return true;
         }
 
-        bool remove(const K &k) override {
+        bool remove(const K &k) {
             unsigned pos = this->keys.lower_bound(k);
             if (pos >= this->keys.size || this->keys[pos] != k)
                 return false;
+            this->touch();
             this->keys.remove(pos);
             this->data.remove(pos);
             return true;
@@ -319,117 +416,124 @@ public:
          * split (Leaf a) = [k, prev, next]
          * this = prev, return = next
          */
-        Leaf *split(K &k) override {
+        Leaf *split(K &k) {
             assert(this->should_split());
-            Leaf *that = new Leaf;
+            Leaf *that = this->storage->new_leaf();
             this->storage->record(that);
+            this->touch();
             if (this->next) {
-                Leaf* rr = this->into_leaf(this->storage->get(this->next));
-                rr->prev = that->idx;
+                Ref rr = this->storage->get(this->next);
+                rr->touch();
+                this->into_leaf(rr.get())->prev = that->idx;
                 that->next = rr->idx;
             }
             this->next = that->idx;
             that->prev = this->idx;
-            that->keys.move_from(this->keys, HalfOrder(), HalfOrder());
-            that->data.move_from(this->data, HalfOrder(), HalfOrder());
+            that->keys.move_from(this->keys, this->keys.size - HalfOrder(), HalfOrder());
+            that->data.move_from(this->data, this->data.size - HalfOrder(), HalfOrder());
             k = that->keys[0];
+            that->high_key = this->high_key;
+            this->high_key = k;
             return that;
         }
 
-        K borrow_from_left(Block *_left, const K &) override {
+        K borrow_from_left(Block *_left, const K &) {
             Leaf *left = this->into_leaf(_left);
             assert(this->prev == left->idx);
             assert(left->next == this->idx);
+            this->touch();
+            left->touch();
             this->keys.move_insert_from(left->keys, left->keys.size - 1, 1, 0);
             this->data.move_insert_from(left->data, left->data.size - 1, 1, 0);
+            left->high_key = this->keys[0];
             return this->keys[0];
         };
 
-        K borrow_from_right(Block *_right, const K &) override {
+        K borrow_from_right(Block *_right, const K &) {
             Leaf *right = this->into_leaf(_right);
             assert(this->next == right->idx);
             assert(right->prev == this->idx);
+            this->touch();
+            right->touch();
             this->keys.move_insert_from(right->keys, 0, 1, this->keys.size);
             this->data.move_insert_from(right->data, 0, 1, this->data.size);
+            this->high_key = right->keys[0];
             return right->keys[0];
         };
 
-        void merge_with_left(Block *_left, const K &) override {
+        void merge_with_left(Block *_left, const K &) {
             Leaf *left = this->into_leaf(_left);
             assert(this->prev == left->idx);
             assert(left->next == this->idx);
+            this->touch();
             this->keys.move_insert_from(left->keys, 0, left->keys.size, 0);
             this->data.move_insert_from(left->data, 0, left->data.size, 0);
             this->prev = left->prev;
             if (this->prev) {
-                Leaf* ll = this->into_leaf(this->storage->get(this->prev));
+                Ref ll = this->storage->get(this->prev);
+                ll->touch();
                 ll->next = this->idx;
             }
             this->storage->deregister(left);
         };
 
-        void merge_with_right(Block *_right, const K &) override {
+        void merge_with_right(Block *_right, const K &) {
             Leaf *right = this->into_leaf(_right);
             assert(this->next == right->idx);
             assert(right->prev == this->idx);
+            this->touch();
             this->keys.move_insert_from(right->keys, 0, right->keys.size, this->keys.size);
             this->data.move_insert_from(right->data, 0, right->data.size, this->data.size);
             this->next = right->next;
+            this->high_key = right->high_key;
             if (this->next) {
-                Leaf* rr = this->into_leaf(this->storage->get(this->next));
-                rr->prev = this->idx;
+                Ref rr = this->storage->get(this->next);
+                rr->touch();
+                this->into_leaf(rr.get())->prev = this->idx;
             }
             this->storage->deregister(right);
         };
 
-        static constexpr unsigned Storage_Size() {
-            return Set<K, Order()>::Storage_Size() + Vector<V, Order()>::Storage_Size() + sizeof(BlockIdx) * 2;
-        }
+        static constexpr unsigned Storage_Size() { return sizeof(Frame<V, Order()>); }
 
-        unsigned storage_size() const override { return Storage_Size(); }
+        unsigned storage_size() const { return Storage_Size(); }
 
         /*
          * Storage Mapping
-         * | 8 BlockIdx prev | 8 BlockIdx next |
-         * | 8 size | Order() K keys |
-         * | 8 size | Order() V data |
+         * | 4 BlockIdx prev | 4 BlockIdx next | 4 keys size | 4 data size | K high_key |
+         * | Order() K keys | Order() V data |
          */
 
-        void serialize(std::ostream &out) const override {
-            out.write(reinterpret_cast<const char *>(&prev), sizeof(prev));
-            out.write(reinterpret_cast<const char *>(&next), sizeof(next));
-            this->keys.serialize(out);
-            this->data.serialize(out);
+        void serialize(std::ostream &out) const {
+            out.write(reinterpret_cast<const char *>(&frame), sizeof(frame));
         };
 
-        void deserialize(std::istream &in) override {
-            in.read(reinterpret_cast<char *>(&prev), sizeof(prev));
-            in.read(reinterpret_cast<char *>(&next), sizeof(next));
-            this->keys.deserialize(in);
-            this->data.deserialize(in);
+        void deserialize(std::istream &in) {
+            in.read(reinterpret_cast<char *>(&frame), sizeof(frame));
         };
     };
 
     using iterator = Iterator<BTree, Block, Leaf, K, V>;
     using const_iterator = Iterator<const BTree, const Block, const Leaf, const K, const V>;
+    using range_cursor = RangeCursor<BTree, Block, Leaf, K, V>;
 
     BTree(const BTree &) = delete;
 
     BTree &operator=(const BTree &) = delete;
 
-    Leaf *get_leaf_begin() const {
-        Block *blk = root();
-        while (!blk->is_leaf()) blk = storage->get(Block::into_index(blk)->children[0]);
-        return Block::into_leaf(blk);
+    ConstRef get_leaf_begin() const {
+        ConstRef blk = root();
+        while (!blk->is_leaf()) blk = storage->read(Block::into_index(blk.get())->children[0]);
+        return blk;
     }
 
-    Leaf *get_leaf_end() const {
-        Block *blk = root();
+    ConstRef get_leaf_end() const {
+        ConstRef blk = root();
         while (!blk->is_leaf()) {
-            Index *idx = Block::into_index(blk);
-            blk = storage->get(idx->children[idx->children.size - 1]);
+            const Index *idx = Block::into_index(blk.get());
+            blk = storage->read(idx->children[idx->children.size - 1]);
         }
-        return Block::into_leaf(blk);
+        return blk;
     }
 
     iterator begin() {
@@ -459,12 +563,61 @@ public:
         return storage->persistence_index->root_idx;
     }
 
-    Block *root() const {
-        return storage->get(root_idx());
+    ConstRef root() const {
+        return storage->read(root_idx());
+    }
+
+    Log log;
+    // operations are logged unless the log itself is being replayed
+    bool logging;
+
+    enum LogOperation : char {
+        LogInsert = 'i', LogRemove = 'r', LogModify = 'm'
+    };
+
+    BTree(const char *path) : path(path), logging(false) {
+        storage = new BPersistence(path, Log::enabled());
+        if (path && Log::enabled()) recover();
+        logging = true;
+    }
+
+    /*
+     * Storage Mapping of a log record
+     * | K key | V value | (value omitted for LogRemove)
+     */
+    void log_operation(LogOperation op, const K &k, const V *v = nullptr) {
+        if (!Log::enabled() || !logging || !path) return;
+        char record[sizeof(K) + sizeof(V)];
+        memcpy(record, &k, sizeof(K));
+        if (v) memcpy(record + sizeof(K), v, sizeof(V));
+        log.append(op, record, v ? sizeof(K) + sizeof(V) : sizeof(K));
+    }
+
+    // redo operations logged after the last checkpoint of the data file
+    void recover() {
+        log.open(path);
+        log.replay(storage->persistence_index->lsn, [this](char op, const char *record, unsigned) {
+            K k;
+            V v;
+            memcpy(&k, record, sizeof(K));
+            if (op != LogRemove) memcpy(&v, record + sizeof(K), sizeof(V));
+            if (op == LogInsert) insert(k, v);
+            else if (op == LogRemove) remove(k);
+            else if (op == LogModify) {
+                iterator iter = find(k);
+                if (iter != end()) iter.modify(v);
+            } else
+                assert(false);
+        });
     }
 
-    BTree(const char *path) : path(path) {
-        storage = new BPersistence(path);
+    // write dirty pages and the index, after which the log up to now is no longer needed
+    void checkpoint() {
+        if (!path) return;
+        storage->persistence_index->lsn = log.lsn;
+        // throws before the log is dropped if the data file is not synced
+        storage->checkpoint();
+        log.checkpoint(log.lsn);
     }
 
 #ifdef ONLINE_JUDGE
@@ -476,81 +629,862 @@ public:
 #endif
 
     ~BTree() {
+        storage->persistence_index->lsn = log.lsn;
+        // otherwise the log is kept to replay what the data file is missing
+        if (storage->close()) log.checkpoint(log.lsn);
         delete storage;
     }
 
-    V at(const K &k) {
+    V at(const K &k) const {
         return *query(k);
     }
 
-    const V* query(const K& k) {
+    // leaf k belongs to, by descending from the root a level at a time
+    ConstRef leaf_of(const K &k) const {
+        ConstRef blk = root();
+        while (!blk->is_leaf()) {
+            const Index *index = Block::into_index(blk.get());
+            blk = storage->read(index->children[index->keys.upper_bound(k)]);
+        }
+        return blk;
+    }
+
+    const V* query(const K& k) const {
         if (!root_idx()) return nullptr;
-        auto v = storage->read(root_idx())->query(k);
+        auto v = Block::into_leaf(leaf_of(k).get())->query(k);
         storage->swap_out_pages();
         return v;
     }
 
     iterator find(const K &k) {
         if (!root_idx()) return end();
-        auto v = storage->read(root_idx())->find(k);
+        auto v = Block::into_leaf(leaf_of(k).get())->find(k);
         storage->swap_out_pages();
         if (v.first == 0) return end();
         return iterator(this, v.first, v.second);
     }
 
     Leaf *create_leaf() {
-        Leaf *block = new Leaf;
+        Leaf *block = storage->new_leaf();
         storage->record(block);
         return block;
     }
 
     Index *create_index() {
-        Index *block = new Index;
+        Index *block = storage->new_index();
         storage->record(block);
         return block;
     }
 
+    /*
+     * number of nodes a level of n entries is packed into, so that every node holds
+     * about fill_factor * hi entries, never more than hi, and no less than lo if possible
+     */
+    static unsigned bulk_load_nodes(unsigned n, double fill_factor, unsigned lo, unsigned hi) {
+        unsigned target = std::max(lo, std::min(hi, (unsigned) (fill_factor * hi)));
+        unsigned nodes = std::max(1u, (n + target - 1) / target);
+        unsigned min_nodes = (n + hi - 1) / hi;
+        while (nodes > min_nodes && n / nodes < lo) --nodes;
+        return nodes;
+    }
+
+    // entries of the i-th node when n entries are evenly spread over `nodes` nodes
+    static unsigned bulk_load_share(unsigned n, unsigned nodes, unsigned i) {
+        return n / nodes + (i < n % nodes ? 1 : 0);
+    }
+
+    /* bulk_load :: [(k, v)] -> BTree
+     * Build the tree bottom-up from strictly ascending (k, v) pairs. Leaves are packed
+     * to fill_factor and linked as they are created, then each Index level is built
+     * over the level below. Pages are never revisited once the next one is created,
+     * so each of them is written to disk exactly once.
+     * Pairs from the first one out of order on, and all of them if the tree is not
+     * empty, are inserted one by one instead.
+     * Returns number of pairs loaded, skipping keys already in the tree.
+     */
+    template<typename It>
+    unsigned bulk_load(It first, It last, double fill_factor = 1.0) {
+        unsigned n = 0;
+        if (root_idx()) {
+            for (; first != last; ++first)
+                if (insert(first->first, first->second) == OperationResult::Success) ++n;
+            return n;
+        }
+        for (It it = first, prev = first; it != last; prev = it++, ++n)
+            if (n && !(prev->first < it->first)) break;
+        if (n == 0) return 0;
+
+        unsigned count = bulk_load_nodes(n, fill_factor, (Order() + 1) / 2, Order() - 1);
+        K *low_keys = new K[count];
+        BlockIdx *blocks = new BlockIdx[count];
+        for (unsigned i = 0; i < count; i++) {
+            Leaf *leaf = create_leaf();
+            for (unsigned j = bulk_load_share(n, count, i); j > 0; j--, ++first) {
+                leaf->keys.append(first->first);
+                leaf->data.append(first->second);
+            }
+            low_keys[i] = leaf->keys[0];
+            blocks[i] = leaf->idx;
+            if (i != 0) {
+                Ref prev = storage->get(blocks[i - 1]);
+                prev->touch();
+                prev->next = leaf->idx;
+                prev->high_key = low_keys[i];
+                leaf->prev = prev->idx;
+            }
+            storage->unpin(leaf->idx);
+            storage->swap_out_pages();
+        }
+
+        while (count > 1) {
+            unsigned parents = bulk_load_nodes(count, fill_factor, (Order() + 1) / 2 + 1, Order());
+            for (unsigned i = 0, c = 0; i < parents; i++) {
+                Index *idx = create_index();
+                K low_key = low_keys[c];
+                idx->children.append(blocks[c++]);
+                for (unsigned j = bulk_load_share(count, parents, i); j > 1; j--, c++) {
+                    idx->keys.append(low_keys[c]);
+                    idx->children.append(blocks[c]);
+                }
+                if (i != 0) {
+                    Ref prev = storage->get(blocks[i - 1]);
+                    prev->touch();
+                    prev->next = idx->idx;
+                    prev->high_key = low_key;
+                }
+                // i <= c, so entries of this level are compacted in place
+                low_keys[i] = low_key;
+                blocks[i] = idx->idx;
+                storage->unpin(idx->idx);
+                storage->swap_out_pages();
+            }
+            count = parents;
+        }
+
+        root_idx() = blocks[0];
+        storage->persistence_index->size = n;
+        delete[] low_keys;
+        delete[] blocks;
+        // pairs are not logged one by one, make them durable at once
+        if (Log::enabled()) checkpoint();
+        for (; first != last; ++first)
+            if (insert(first->first, first->second) == OperationResult::Success) ++n;
+        return n;
+    }
+
     OperationResult insert(const K &k, const V &v) {
-        if (!root_idx()) root_idx() = create_leaf()->idx;
-        auto root = storage->get(root_idx());
-        bool result = storage->get(root_idx())->insert(k, v);
-        if (!result) return OperationResult::Duplicated;
-        if (root->should_split()) {
-            K k;
-            Block *next = root->split(k);
-            Block *prev = root;
-            Index *idx = create_index();
-            idx->children.append(prev->idx);
-            idx->children.append(next->idx);
-            idx->keys.append(k);
-            root_idx() = idx->idx;
+        if (Sync::enabled()) return insert_latched(k, v);
+        if (!root_idx()) {
+            root_idx() = create_leaf()->idx;
+            storage->unpin(root_idx());
         }
+        Path path;
+        descend(path, k);
+        bool result = insert_along(path, k, v, true);
+        unpin(path);
+        if (!result) return OperationResult::Duplicated;
         ++storage->persistence_index->size;
         storage->swap_out_pages();
+        log_operation(LogInsert, k, &v);
         return OperationResult::Success;
     }
 
+    /*
+     * Blocks an operation goes through, from the highest one it may change down to a leaf,
+     * and the child taken at each Index. Splits and merges walk the path back up instead of
+     * recursing, so that no block on it is looked up twice.
+     */
+    struct Path {
+        static constexpr unsigned Capacity = 64;
+
+        Block *blocks[Capacity];
+        // child of blocks[i] that blocks[i + 1] is
+        unsigned pos[Capacity];
+        unsigned size;
+
+        Path() : size(0) {}
+
+        Block *last() const { return blocks[size - 1]; }
+
+        void push(Block *block) {
+            assert(size < Capacity);
+            blocks[size++] = block;
+        }
+
+        void push(unsigned child, Block *block) {
+            pos[size - 1] = child;
+            push(block);
+        }
+
+        // the block pushed last is the highest one the operation may change
+        void cut() {
+            blocks[0] = last();
+            size = 1;
+        }
+    };
+
+    // pin blocks from the root down to the leaf k belongs to
+    void descend(Path &path, const K &k) {
+        path.push(storage->pin(root_idx()));
+        while (!path.last()->is_leaf()) {
+            Index *index = Block::into_index(path.last());
+            unsigned pos = index->keys.upper_bound(k);
+            path.push(pos, storage->pin(index->children[pos]));
+        }
+    }
+
+    // blocks merged away have no pin left
+    void unpin(const Path &path) {
+        for (unsigned i = 0; i < path.size; i++)
+            if (path.blocks[i]->idx) storage->unpin(path.blocks[i]->idx);
+    }
+
+    // insert into the leaf the path ends at, then split full blocks from there up
+    bool insert_along(Path &path, const K &k, const V &v, bool root) {
+        if (!Block::into_leaf(path.last())->insert(k, v)) return false;
+        for (unsigned i = path.size - 1; i > 0; i--)
+            if (path.blocks[i]->should_split()) Block::into_index(path.blocks[i - 1])->split_child(path.blocks[i]);
+        if (root && path.blocks[0]->should_split()) split_root(path.blocks[0]);
+        return true;
+    }
+
+    // a full root is split under a new Index root
+    void split_root(Block *root) {
+        K k;
+        Block *next = root->split(k);
+        Index *idx = create_index();
+        idx->children.append(root->idx);
+        idx->children.append(next->idx);
+        idx->keys.append(k);
+        root_idx() = idx->idx;
+        storage->unpin(next->idx);
+        storage->unpin(idx->idx);
+    }
+
     bool remove(const K &k) {
+        if (Sync::enabled()) return remove_latched(k);
         if (!root_idx()) return false;
-        auto root = storage->get(root_idx());
-        bool result = storage->get(root_idx())->remove(k);
+        Path path;
+        descend(path, k);
+        bool result = remove_along(path, k, true);
+        unpin(path);
         if (!result) return false;
-        if (root->keys.size == 0) {
-            if (!root->is_leaf()) {
-                Index *prev_root = Block::into_index(root);
-                root_idx() = prev_root->children[0];
-                storage->deregister(prev_root);
-                delete prev_root;
+        --storage->persistence_index->size;
+        storage->swap_out_pages();
+        log_operation(LogRemove, k);
+        return true;
+    }
+
+    // remove from the leaf the path ends at, then rebalance underfull blocks from there up
+    bool remove_along(Path &path, const K &k, bool root) {
+        if (!Block::into_leaf(path.last())->remove(k)) return false;
+        for (unsigned i = path.size - 1; i > 0; i--)
+            if (path.blocks[i]->should_merge()) Block::into_index(path.blocks[i - 1])->rebalance(path.pos[i - 1], path.blocks[i]);
+        Block *top = path.blocks[0];
+        if (root && top->keys.size == 0 && !top->is_leaf()) shrink_root(top);
+        return true;
+    }
+
+    // an Index root without keys is replaced by its only child
+    void shrink_root(Block *root) {
+        Index *prev_root = Block::into_index(root);
+        root_idx() = prev_root->children[0];
+        storage->deregister(prev_root);
+        dispose(prev_root);
+    }
+
+    /*
+     * Concurrent operations latch blocks from the root down (crabbing). A writer keeps the
+     * latches of ancestors only while the child it moves to may split or merge, and then
+     * the operation starts from the highest block it holds. Blocks a split or merge touches
+     * beside the path are latched on the way down: those to the right are waited for, those
+     * to the left are only tried and the operation restarts if one is taken, so that
+     * latches are always waited for top-down and left to right.
+     */
+    typename Sync::Latch root_latch;
+    // bumped with root_latch held exclusively, as root_idx may change
+    typename Sync::Version root_version;
+
+    struct Latches {
+        static constexpr unsigned Capacity = 64;
+
+        BTree *tree;
+        bool exclusive;
+        // root_latch is held
+        bool root;
+        Block *blocks[Capacity];
+        unsigned size;
+
+        Latches(BTree *tree, bool exclusive) : tree(tree), exclusive(exclusive), root(false), size(0) {}
+
+        Latches(const Latches &) = delete;
+
+        ~Latches() { release(); }
+
+        void lock_root() {
+            if (exclusive) {
+                tree->root_latch.lock();
+                tree->root_version.bump();
+            } else
+                tree->root_latch.lock_shared();
+            root = true;
+        }
+
+        void unlock_root() {
+            if (!root) return;
+            if (exclusive) {
+                tree->root_version.bump();
+                tree->root_latch.unlock();
+            } else
+                tree->root_latch.unlock_shared();
+            root = false;
+        }
+
+        Block *acquire(BlockIdx idx) {
+            assert(size < Capacity);
+            Block *block = tree->storage->pin(idx);
+            if (exclusive) {
+                block->latch.lock();
+                block->version.bump();
+            } else
+                block->latch.lock_shared();
+            return blocks[size++] = block;
+        }
+
+        // nullptr if the latch is taken
+        Block *try_acquire(BlockIdx idx) {
+            assert(exclusive && size < Capacity);
+            Block *block = tree->storage->pin(idx);
+            if (!block->latch.try_lock()) {
+                tree->storage->unpin(idx);
+                return nullptr;
             }
+            block->version.bump();
+            return blocks[size++] = block;
         }
-        --storage->persistence_index->size;
+
+        void release(unsigned from, unsigned to) {
+            for (unsigned i = from; i < to; i++) {
+                Block *block = blocks[i];
+                // unpinned before unlocked, as a block is evicted only if its latch is free
+                BlockIdx idx = block->idx;
+                if (idx) tree->storage->unpin(idx);
+                // a block merged away keeps an odd version, readers holding it start over
+                if (exclusive && idx) block->version.bump();
+                if (exclusive) block->latch.unlock(); else block->latch.unlock_shared();
+                if (!idx) tree->storage->retire(block);
+            }
+        }
+
+        void release() {
+            unlock_root();
+            release(0, size);
+            size = 0;
+        }
+
+        // release the block acquired last
+        void release_last() {
+            release(size - 1, size);
+            --size;
+        }
+
+        // release all but the block acquired last
+        void release_above() {
+            unlock_root();
+            release(0, size - 1);
+            blocks[0] = blocks[size - 1];
+            size = 1;
+        }
+    };
+
+    static bool insert_safe(const Block *block) { return block->keys.size + 1 < Order(); }
+
+    static bool remove_safe(const Block *block) { return block->keys.size * 2 >= Order() + 2; }
+
+    // blocks merged away are deleted after the operation, or with concurrent operations once their latch is released
+    static void dispose(Block *block) {
+        if (!Sync::enabled()) block->storage->retire(block);
+    }
+
+    OperationResult insert_latched(const K &k, const V &v) {
+        Latches latches(this, true);
+        latches.lock_root();
+        if (!root_idx()) {
+            root_idx() = create_leaf()->idx;
+            storage->unpin(root_idx());
+        }
+        Path path;
+        Block *blk = latches.acquire(root_idx());
+        path.push(blk);
+        if (insert_safe(blk)) latches.unlock_root();
+        while (!blk->is_leaf()) {
+            Index *idx = Block::into_index(blk);
+            unsigned pos = idx->keys.upper_bound(k);
+            blk = latches.acquire(idx->children[pos]);
+            path.push(pos, blk);
+            if (insert_safe(blk)) {
+                latches.release_above();
+                path.cut();
+            }
+        }
+        // a split leaf relinks its right neighbour
+        Leaf *leaf = Block::into_leaf(blk);
+        if (!insert_safe(leaf) && leaf->next) latches.acquire(leaf->next);
+        bool result = insert_along(path, k, v, latches.root);
+        if (!result) return OperationResult::Duplicated;
+        storage->add_size(1);
+        log_operation(LogInsert, k, &v);
+        latches.release();
         storage->swap_out_pages();
+        return OperationResult::Success;
+    }
+
+    // latch what merging child at pos of parent with a sibling may touch, false if one to the left is taken
+    bool acquire_siblings(Latches &latches, Index *parent, unsigned pos, Block *child) {
+        Block *left = nullptr, *right = nullptr;
+        if (pos + 1 < parent->children.size) right = latches.acquire(parent->children[pos + 1]);
+        if (pos > 0 && !(left = latches.try_acquire(parent->children[pos - 1]))) return false;
+        if (!child->is_leaf()) return true;
+        // the left leaf is kept, and the leaf after the one merged away is relinked
+        Block *merged = left ? child : right;
+        if (merged && merged->next && !(right && merged->next == right->idx)) latches.acquire(merged->next);
         return true;
     }
 
+    bool remove_latched(const K &k) {
+        for (;;) {
+            Latches latches(this, true);
+            latches.lock_root();
+            if (!root_idx()) return false;
+            Path path;
+            Block *blk = latches.acquire(root_idx());
+            path.push(blk);
+            // root is replaced when an Index with one key loses it
+            if (blk->is_leaf() || blk->keys.size > 1) latches.unlock_root();
+            bool restart = false;
+            while (!blk->is_leaf()) {
+                Index *idx = Block::into_index(blk);
+                unsigned pos = idx->keys.upper_bound(k);
+                Block *child = latches.acquire(idx->children[pos]);
+                path.push(pos, child);
+                if (remove_safe(child)) {
+                    latches.release_above();
+                    path.cut();
+                } else if (!acquire_siblings(latches, idx, pos, child)) {
+                    restart = true;
+                    break;
+                }
+                blk = child;
+            }
+            if (restart) {
+                latches.release();
+                Sync::pause();
+                continue;
+            }
+            bool result = remove_along(path, k, latches.root);
+            if (result) {
+                storage->add_size(-1);
+                log_operation(LogRemove, k);
+            }
+            latches.release();
+            storage->swap_out_pages();
+            return result;
+        }
+    }
+
+    static constexpr unsigned Optimistic_Attempts() { return 8; }
+
+    // copy value of k into v, safe with concurrent operations unlike query(k)
+    bool query(const K &k, V &v) {
+        if (Sync::enabled()) {
+            bool found;
+            for (unsigned i = 0; i < Optimistic_Attempts(); i++) {
+                if (query_optimistic(k, v, found)) return found;
+                Sync::pause();
+            }
+        }
+        return query_latched(k, v);
+    }
+
+    /*
+     * Optimistic lock coupling: take no latch and write nothing shared on the way down.
+     * The version of each block is read before using it and validated after. A block split
+     * after its parent was read is left through its right link. Keys moving to the left
+     * and freed pages, whose slots may be reused, are caught by the shift version of the
+     * pool instead. Returns false if a writer got in the way, or a page is not in memory,
+     * which is left to the latched lookup.
+     */
+    bool query_optimistic(const K &k, V &v, bool &found) {
+        typename BPersistence::Reclaimer::Guard epoch(storage->reclaimer);
+        unsigned long long shift = storage->shift_version.load();
+        unsigned long long root = root_version.load();
+        if (root & 1) return false;
+        BlockIdx idx = root_idx();
+        if (!root_version.validate(root)) return false;
+        if (!idx) {
+            found = false;
+            return true;
+        }
+        const Block *blk;
+        unsigned long long version;
+        if (!peek_unlatched(idx, blk, version)) return false;
+        // keys and children may be inconsistent until validated, but stay within capacity
+        for (;;) {
+            if (blk->next && !(k < blk->high_key))
+                idx = blk->next;
+            else if (!blk->is_leaf())
+                idx = Block::into_index(blk)->children.x[Block::into_index(blk)->keys.upper_bound(k)];
+            else
+                break;
+            if (!blk->version.validate(version)) return false;
+            if (!peek_unlatched(idx, blk, version)) return false;
+            if (!storage->shift_version.validate(shift)) return false;
+        }
+        const Leaf *leaf = Block::into_leaf(blk);
+        unsigned pos = leaf->keys.lower_bound(k);
+        found = pos < leaf->keys.size && leaf->keys.x[pos] == k;
+        if (found) {
+            V value = leaf->data.x[pos];
+            if (!blk->version.validate(version) || !storage->shift_version.validate(shift)) return false;
+            v = value;
+        } else if (!blk->version.validate(version) || !storage->shift_version.validate(shift))
+            return false;
+        return true;
+    }
+
+    // block idx if it is in memory and no writer holds it
+    bool peek_unlatched(BlockIdx idx, const Block *&blk, unsigned long long &version) {
+        blk = storage->peek(idx);
+        if (!blk) return false;
+        version = blk->version.load();
+        return !(version & 1);
+    }
+
+    bool query_latched(const K &k, V &v) {
+        Latches latches(this, false);
+        latches.lock_root();
+        if (!root_idx()) return false;
+        Block *blk = latches.acquire(root_idx());
+        latches.unlock_root();
+        while (!blk->is_leaf()) {
+            Index *idx = Block::into_index(blk);
+            blk = latches.acquire(idx->children[idx->keys.upper_bound(k)]);
+            latches.release_above();
+        }
+        const V *result = Block::into_leaf(blk)->query(k);
+        if (result) v = *result;
+        latches.release();
+        storage->swap_out_pages();
+        return result != nullptr;
+    }
+
+    /*
+     * Look up n keys at once, copying the value of keys[i] into values[i] where found[i].
+     * Keys are visited in sorted order from a single descent, so blocks shared by several
+     * keys are latched and searched once, and children are prefetched before their keys
+     * are looked up. Pages a batch touches stay in memory until it returns.
+     * Returns number of keys found.
+     */
+    unsigned multi_get(const K *keys, unsigned n, V *values, bool *found) {
+        if (n == 0) return 0;
+        unsigned *order = new unsigned[n];
+        sort_order(keys, order, n);
+        for (unsigned i = 0; i < n; i++) found[i] = false;
+        unsigned result = 0;
+        {
+            Latches latches(this, false);
+            latches.lock_root();
+            if (root_idx()) {
+                Block *root = latches.acquire(root_idx());
+                latches.unlock_root();
+                result = multi_get(latches, root, keys, order, 0, n, values, found);
+            }
+        }
+        delete[] order;
+        storage->swap_out_pages();
+        return result;
+    }
+
+    // look up keys[order[from .. to)], sorted, below blk which is latched last
+    unsigned multi_get(Latches &latches, Block *blk, const K *keys, const unsigned *order,
+                       unsigned from, unsigned to, V *values, bool *found) {
+        if (blk->is_leaf()) {
+            const Leaf *leaf = Block::into_leaf(blk);
+            unsigned n = 0;
+            for (unsigned i = from; i < to; i++) {
+                unsigned j = order[i];
+                unsigned pos = leaf->keys.lower_bound(keys[j]);
+                if (pos < leaf->keys.size && leaf->keys[pos] == keys[j]) {
+                    values[j] = leaf->data[pos];
+                    found[j] = true;
+                    ++n;
+                }
+            }
+            return n;
+        }
+        const Index *index = Block::into_index(blk);
+        // each child is fetched ahead of the lookups before it
+        for (unsigned i = from, pos; i < to; i = run_end(index, keys, order, i, to, pos)) {
+            pos = index->keys.upper_bound(keys[order[i]]);
+            BlockIdx child = index->children[pos];
+            if (const Block *page = storage->peek(child)) __builtin_prefetch(page->keys.x);
+            else
+                storage->prefetch(child);
+        }
+        // reads of children not in memory go out as one batch
+        storage->submit();
+        unsigned n = 0;
+        for (unsigned i = from, pos, end; i < to; i = end) {
+            pos = index->keys.upper_bound(keys[order[i]]);
+            end = run_end(index, keys, order, i, to, pos);
+            Block *child = latches.acquire(index->children[pos]);
+            n += multi_get(latches, child, keys, order, i, end, values, found);
+            latches.release_last();
+        }
+        return n;
+    }
+
+    // end of the run of keys from i on that go to child pos
+    static unsigned run_end(const Index *index, const K *keys, const unsigned *order,
+                            unsigned i, unsigned to, unsigned pos) {
+        if (pos == index->keys.size) return to;
+        while (i < to && keys[order[i]] < index->keys[pos]) i++;
+        return i;
+    }
+
+    // indices of keys in ascending order of keys, by merge sort
+    static void sort_order(const K *keys, unsigned *order, unsigned n) {
+        bool sorted = true;
+        for (unsigned i = 0; i < n; i++) {
+            order[i] = i;
+            if (i && keys[i] < keys[i - 1]) sorted = false;
+        }
+        if (sorted) return;
+        unsigned *from = order, *to = new unsigned[n];
+        for (unsigned width = 1; width < n; width *= 2) {
+            for (unsigned lo = 0; lo < n; lo += 2 * width) {
+                unsigned mid = std::min(lo + width, n), hi = std::min(lo + 2 * width, n);
+                unsigned i = lo, j = mid, k = lo;
+                while (i < mid && j < hi) to[k++] = keys[from[j]] < keys[from[i]] ? from[j++] : from[i++];
+                while (i < mid) to[k++] = from[i++];
+                while (j < hi) to[k++] = from[j++];
+            }
+            std::swap(from, to);
+        }
+        if (from != order) {
+            memcpy(order, from, n * sizeof(unsigned));
+            to = from;
+        }
+        delete[] to;
+    }
+
+    // keys of a batch, and their values if it inserts, applied in ascending order of keys
+    struct Batch {
+        K *keys;
+        V *values;
+        unsigned *order;
+        unsigned n;
+
+        Batch(unsigned n, bool with_values) :
+                keys(new K[n]), values(with_values ? new V[n] : nullptr), order(new unsigned[n]), n(n) {}
+
+        Batch(const Batch &) = delete;
+
+        ~Batch() {
+            delete[] keys;
+            delete[] values;
+            delete[] order;
+        }
+
+        void sort() { sort_order(keys, order, n); }
+
+        const K &key(unsigned i) const { return keys[order[i]]; }
+
+        const V &value(unsigned i) const { return values[order[i]]; }
+
+        // a key repeated in the batch is applied once
+        bool repeated(unsigned i) const { return i > 0 && !(key(i - 1) < key(i)); }
+    };
+
+    /*
+     * Insert pairs in [first, last) with a few descents instead of one per pair. Pairs are
+     * sorted and split into runs going to the same leaf, and each run is merged into its
+     * leaf in one pass. A block that fills up is split once the run going to it is applied,
+     * and a descent stops at a full Index, which is split before the next one.
+     * With concurrent operations pairs are inserted one by one.
+     * Returns number of pairs inserted, skipping keys in the tree or earlier in the batch.
+     */
+    template<typename It>
+    unsigned insert_batch(It first, It last) {
+        unsigned n = 0, inserted = 0;
+        if (Sync::enabled()) {
+            for (; first != last; ++first)
+                if (insert(first->first, first->second) == OperationResult::Success) ++n;
+            return n;
+        }
+        for (It it = first; it != last; ++it) ++n;
+        if (n == 0) return 0;
+        Batch batch(n, true);
+        for (unsigned i = 0; i < n; i++, ++first) {
+            batch.keys[i] = first->first;
+            batch.values[i] = first->second;
+        }
+        batch.sort();
+        if (!root_idx()) {
+            root_idx() = create_leaf()->idx;
+            storage->unpin(root_idx());
+        }
+        for (unsigned i = 0; i < n;) {
+            Ref root = storage->get(root_idx());
+            i = insert_run(root.get(), batch, i, n, inserted);
+            if (root->should_split()) split_root(root.get());
+            root.release();
+            storage->swap_out_pages();
+        }
+        storage->persistence_index->size += inserted;
+        return inserted;
+    }
+
+    // insert keys of batch from i on below blk, returns where it stopped
+    unsigned insert_run(Block *blk, const Batch &batch, unsigned i, unsigned to, unsigned &inserted) {
+        if (blk->is_leaf()) return insert_into_leaf(Block::into_leaf(blk), batch, i, to, inserted);
+        Index *index = Block::into_index(blk);
+        do {
+            unsigned pos = index->keys.upper_bound(batch.key(i));
+            unsigned end = run_end(index, batch.keys, batch.order, i, to, pos);
+            Ref child = storage->get(index->children[pos]);
+            i = insert_run(child.get(), batch, i, end, inserted);
+            if (child->should_split()) index->split_child(child.get());
+        } while (i < to && !index->should_split());
+        return i;
+    }
+
+    // merge keys of batch from i on into leaf from the back, as many as it has room for
+    unsigned insert_into_leaf(Leaf *leaf, const Batch &batch, unsigned i, unsigned to, unsigned &inserted) {
+        unsigned size = leaf->keys.size, room = Order() - size, fresh = 0, end = i;
+        for (unsigned pos = leaf->keys.lower_bound(batch.key(i)); end < to && fresh < room; end++) {
+            if (batch.repeated(end)) continue;
+            while (pos < size && leaf->keys[pos] < batch.key(end)) pos++;
+            if (pos < size && leaf->keys[pos] == batch.key(end)) continue;
+            ++fresh;
+        }
+        if (fresh) leaf->touch();
+        K *keys = leaf->keys.x;
+        V *data = leaf->data.x;
+        for (unsigned j = end, at = size + fresh, from = size; j-- > i;) {
+            const K &k = batch.key(j);
+            if (batch.repeated(j)) continue;
+            for (; from > 0 && k < keys[from - 1]; from--, at--) {
+                keys[at - 1] = keys[from - 1];
+                data[at - 1] = data[from - 1];
+            }
+            if (from > 0 && keys[from - 1] == k) continue;
+            --at;
+            keys[at] = k;
+            data[at] = batch.value(j);
+            log_operation(LogInsert, k, &data[at]);
+        }
+        leaf->keys.size = leaf->data.size = size + fresh;
+        inserted += fresh;
+        return end;
+    }
+
+    /*
+     * Remove keys in [first, last) with a few descents. Keys are sorted, the keys going to
+     * a leaf are removed from it in one pass, and an underfull block is rebalanced once the
+     * run going to it is applied. A descent stops at an underfull Index, which is rebalanced
+     * before the next one.
+     * With concurrent operations keys are removed one by one.
+     * Returns number of keys removed.
+     */
+    template<typename It>
+    unsigned remove_batch(It first, It last) {
+        unsigned n = 0, removed = 0;
+        if (Sync::enabled()) {
+            for (; first != last; ++first)
+                if (remove(*first)) ++n;
+            return n;
+        }
+        if (!root_idx()) return 0;
+        for (It it = first; it != last; ++it) ++n;
+        if (n == 0) return 0;
+        Batch batch(n, false);
+        for (unsigned i = 0; i < n; i++, ++first) batch.keys[i] = *first;
+        batch.sort();
+        for (unsigned i = 0; i < n;) {
+            Ref root = storage->get(root_idx());
+            i = remove_run(root.get(), batch, i, n, removed, true);
+            while (root->keys.size == 0 && !root->is_leaf()) {
+                shrink_root(root.get());
+                root = storage->get(root_idx());
+            }
+            root.release();
+            storage->swap_out_pages();
+        }
+        storage->persistence_index->size -= removed;
+        return removed;
+    }
+
+    // remove keys of batch from i on below blk, returns where it stopped
+    unsigned remove_run(Block *blk, const Batch &batch, unsigned i, unsigned to, unsigned &removed, bool root) {
+        if (blk->is_leaf()) return remove_from_leaf(Block::into_leaf(blk), batch, i, to, removed);
+        Index *index = Block::into_index(blk);
+        do {
+            unsigned pos = index->keys.upper_bound(batch.key(i));
+            unsigned end = run_end(index, batch.keys, batch.order, i, to, pos);
+            Ref child = storage->get(index->children[pos]);
+            i = remove_run(child.get(), batch, i, end, removed, false);
+            while (child->should_merge() && index->rebalance(pos, child.get()));
+        } while (i < to && index->keys.size > 0 && (root || !index->should_merge()));
+        return i;
+    }
+
+    // drop keys of batch from i to to from leaf, compacting it in one pass
+    unsigned remove_from_leaf(Leaf *leaf, const Batch &batch, unsigned i, unsigned to, unsigned &removed) {
+        K *keys = leaf->keys.x;
+        V *data = leaf->data.x;
+        unsigned size = leaf->keys.size, at = leaf->keys.lower_bound(batch.key(i));
+        for (unsigned from = at, j = i; from < size; from++) {
+            while (j < to && batch.key(j) < keys[from]) j++;
+            if (j < to && batch.key(j) == keys[from]) {
+                log_operation(LogRemove, keys[from]);
+                continue;
+            }
+            keys[at] = keys[from];
+            data[at] = data[from];
+            at++;
+        }
+        if (at == size) return to;
+        leaf->touch();
+        removed += size - at;
+        leaf->keys.size = leaf->data.size = at;
+        return to;
+    }
+
+    // keys in [lo, hi) a leaf at a time
+    range_cursor range(const K &lo, const K &hi) { return range_cursor(this, lo, hi); }
+
+    /*
+     * Call f(keys, values, count) on runs of keys in [lo, hi) and their values, in order.
+     * Returns number of keys scanned.
+     */
+    template<typename F>
+    unsigned scan(const K &lo, const K &hi, F f) {
+        unsigned n = 0;
+        {
+            range_cursor cursor(this, lo, hi);
+            while (cursor.next()) {
+                f(cursor.keys, cursor.values, cursor.count);
+                n += cursor.count;
+            }
+        }
+        storage->swap_out_pages();
+        return n;
+    }
+
     unsigned size() const { return storage->persistence_index->size; }
 
-    unsigned count(const K &k) { return query(k) ? 1 : 0; }
+    unsigned count(const K &k) const { return query(k) ? 1 : 0; }
 
     void debug(Block *block) {
         std::cerr << "Block ID: " << block->idx << " ";
@@ -573,7 +1507,7 @@ public:
             }
             std::cerr << std::endl;
             for (int i = 0; i < index->children.size; i++) {
-                debug(storage->get(index->children[i]));
+                debug(storage->get(index->children[i]).get());
             }
         }
     }
@@ -0,0 +1,210 @@
+//
+// Created by Alex Chi on 2019-06-16.
+//
+
+#include <catch.hpp>
+#include <atomic>
+#include <cstdio>
+#include <thread>
+#include "BTree.hpp"
+#include "MultiThread.hpp"
+#include "Flusher.hpp"
+
+using ConcurrentMap = BTree<int, long long, 16, 64, Default_Max_Pages(), FileStore, NoLog, MultiThread>;
+
+const unsigned test_threads = 8;
+
+// run f(t) on threads t = 0 .. test_threads - 1
+template<typename F>
+void run_threads(F f) {
+    std::thread threads[test_threads];
+    for (unsigned t = 0; t < test_threads; t++) threads[t] = std::thread(f, t);
+    for (unsigned t = 0; t < test_threads; t++) threads[t].join();
+}
+
+TEST_CASE("Concurrent", "[Concurrent]") {
+    const int test_size = 40000;
+
+    SECTION("should insert from many threads") {
+        remove("concurrent.db");
+        {
+            ConcurrentMap m("concurrent.db");
+            std::atomic<int> failed(0);
+            run_threads([&](unsigned t) {
+                for (int i = t; i < test_size; i += test_threads)
+                    if (m.insert(i, i) != OperationResult::Success) ++failed;
+            });
+            REQUIRE (failed == 0);
+            REQUIRE (m.size() == test_size);
+            REQUIRE (m.storage->stat.swap_out > 0);
+            long long v;
+            for (int i = 0; i < test_size; i++) {
+                REQUIRE (m.query(i, v));
+                REQUIRE (v == i);
+            }
+        }
+        {
+            ConcurrentMap m("concurrent.db");
+            REQUIRE (m.size() == test_size);
+            for (int i = 0; i < test_size; i++) REQUIRE (*m.query(i) == i);
+        }
+        remove("concurrent.db");
+    }
+
+    SECTION("should write back in background while others write") {
+        remove("concurrent.db");
+        {
+            ConcurrentMap m("concurrent.db");
+            // operations on a concurrent tree hold no lock, the flusher has one of its own
+            std::mutex lock;
+            Flusher<ConcurrentMap> flusher(m, lock, 32, 8, 1);
+            run_threads([&](unsigned t) {
+                for (int i = t; i < test_size; i += test_threads) m.insert(i, i);
+            });
+            long long done = flusher.count;
+            while (flusher.count <= done + 1) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            REQUIRE (m.storage->dirty_count() < 32);
+            long long v;
+            for (int i = 0; i < test_size; i++) {
+                REQUIRE (m.query(i, v));
+                REQUIRE (v == i);
+            }
+        }
+        {
+            ConcurrentMap m("concurrent.db");
+            REQUIRE (m.size() == test_size);
+            for (int i = 0; i < test_size; i++) REQUIRE (*m.query(i) == i);
+        }
+        remove("concurrent.db");
+    }
+
+    SECTION("should remove and query from many threads") {
+        remove("concurrent.db");
+        {
+            ConcurrentMap m("concurrent.db");
+            for (int i = 0; i < test_size; i++) m.insert(i, i);
+            std::atomic<int> failed(0);
+            run_threads([&](unsigned t) {
+                long long v;
+                if (t % 2) {
+                    // odd keys are never removed
+                    for (int round = 0; round < 2; round++)
+                        for (int i = t; i < test_size; i += test_threads)
+                            if (!m.query(i, v) || v != i) ++failed;
+                } else {
+                    for (int i = t; i < test_size; i += test_threads)
+                        if (!m.remove(i)) ++failed;
+                    for (int i = t; i < test_size; i += test_threads * 2)
+                        if (m.insert(i, -i) != OperationResult::Success) ++failed;
+                }
+            });
+            REQUIRE (failed == 0);
+            long long v;
+            unsigned size = 0;
+            for (int i = 0; i < test_size; i++) {
+                bool even_thread = (i % test_threads) % 2 == 0;
+                if (!even_thread) {
+                    REQUIRE (m.query(i, v));
+                    REQUIRE (v == i);
+                    ++size;
+                } else if (i % (test_threads * 2) == i % test_threads) {
+                    REQUIRE (m.query(i, v));
+                    REQUIRE (v == -i);
+                    ++size;
+                } else
+                    REQUIRE (!m.query(i, v));
+            }
+            REQUIRE (m.size() == size);
+        }
+        remove("concurrent.db");
+    }
+
+    SECTION("should look up without latches") {
+        ConcurrentMap m(nullptr);
+        for (int i = 0; i < 300; i++) m.insert(i, i);
+        REQUIRE (m.root_version.load() % 2 == 0);
+        REQUIRE (m.storage->peek(m.root_idx())->version.load() % 2 == 0);
+        auto accessed = m.storage->stat.access_cache_hit + m.storage->stat.access_cache_miss;
+        long long v;
+        for (int i = 0; i < 300; i++) {
+            REQUIRE (m.query(i, v));
+            REQUIRE (v == i);
+        }
+        REQUIRE (!m.query(300, v));
+        // never went through the buffer pool
+        REQUIRE (m.storage->stat.access_cache_hit + m.storage->stat.access_cache_miss == accessed);
+    }
+
+    SECTION("should get many keys while others write") {
+        remove("concurrent.db");
+        {
+            ConcurrentMap m("concurrent.db");
+            for (int i = 0; i < test_size; i++) m.insert(i, i);
+            std::atomic<int> failed(0);
+            run_threads([&](unsigned t) {
+                if (t % 2) {
+                    const unsigned batch = 256;
+                    int keys[batch];
+                    long long values[batch];
+                    bool found[batch];
+                    for (int round = 0; round < 40; round++) {
+                        // odd keys are never removed
+                        for (unsigned i = 0; i < batch; i++) keys[i] = (rand() % (test_size / 2)) * 2 + 1;
+                        if (m.multi_get(keys, batch, values, found) != batch) ++failed;
+                        for (unsigned i = 0; i < batch; i++) if (values[i] != keys[i]) ++failed;
+                    }
+                } else {
+                    for (int i = t; i < test_size; i += test_threads) m.remove(i);
+                    for (int i = t; i < test_size; i += test_threads) m.insert(i, i);
+                }
+            });
+            REQUIRE (failed == 0);
+            REQUIRE (m.size() == test_size);
+        }
+        remove("concurrent.db");
+    }
+
+    SECTION("should scan while others write") {
+        remove("concurrent.db");
+        {
+            ConcurrentMap m("concurrent.db");
+            for (int i = 0; i < test_size; i++) m.insert(i, i);
+            std::atomic<int> failed(0);
+            run_threads([&](unsigned t) {
+                if (t % 2) {
+                    // keys of odd threads, which are odd, are never removed
+                    int expected = 1, seen = 0, last = -1;
+                    m.scan(0, test_size, [&](const int *keys, const long long *values, unsigned count) {
+                        for (unsigned i = 0; i < count; i++) {
+                            if (keys[i] <= last) ++failed;
+                            last = keys[i];
+                            if (keys[i] % 2 == 0) continue;
+                            if (keys[i] != expected || values[i] != keys[i]) ++failed;
+                            ++seen;
+                            expected += 2;
+                        }
+                    });
+                    if (seen != test_size / 2) ++failed;
+                } else {
+                    for (int i = t; i < test_size; i += test_threads) m.remove(i);
+                    for (int i = t; i < test_size; i += test_threads) m.insert(i, i);
+                }
+            });
+            REQUIRE (failed == 0);
+            REQUIRE (m.size() == test_size);
+        }
+        remove("concurrent.db");
+    }
+
+    SECTION("should empty the tree from many threads") {
+        ConcurrentMap m(nullptr);
+        for (int i = 0; i < test_size / 4; i++) m.insert(i, i);
+        run_threads([&](unsigned t) {
+            for (int i = t; i < test_size / 4; i += test_threads) m.remove(i);
+        });
+        REQUIRE (m.size() == 0);
+        long long v;
+        for (int i = 0; i < test_size / 4; i++) REQUIRE (!m.query(i, v));
+        REQUIRE (m.insert(1, 1) == OperationResult::Success);
+    }
+}
@@ -31,6 +31,10 @@ TEST_CASE("Index", "[BTree]") {
         REQUIRE (that->children[0] == 2);
         REQUIRE (that->children[1] == 3);
         REQUIRE (that->children[2] == 4);
+
+        REQUIRE (idx.next == that->idx);
+        REQUIRE (idx.high_key == 2);
+        REQUIRE (that->next == 0);
     }
 
     SECTION("should borrow from left") {
@@ -49,6 +53,7 @@ TEST_CASE("Index", "[BTree]") {
         idx2.insert_block(7, 7);
 
         REQUIRE (idx2.borrow_from_left(&idx1, 4) == 3);
+        REQUIRE (idx1.high_key == 3);
         REQUIRE (idx1.keys.size == 2);
         REQUIRE (idx1.children.size == 3);
         REQUIRE (idx2.keys.size == 4);
@@ -79,6 +84,7 @@ TEST_CASE("Index", "[BTree]") {
         idx2.insert_block(7, 7);
 
         REQUIRE (idx1.borrow_from_right(&idx2, 4) == 5);
+        REQUIRE (idx1.high_key == 5);
         REQUIRE (idx1.keys.size == 4);
         REQUIRE (idx1.children.size == 5);
         REQUIRE (idx2.keys.size == 2);
@@ -127,8 +133,14 @@ TEST_CASE("Index", "[BTree]") {
         storage->record(&idx2);
         idx2.children.append(3);
         idx2.insert_block(4, 4);
+        idx1.next = idx2.idx;
+        idx1.high_key = 3;
+        idx2.next = 233;
+        idx2.high_key = 5;
 
         idx1.merge_with_right(&idx2, 3);
+        REQUIRE (idx1.next == 233);
+        REQUIRE (idx1.high_key == 5);
         REQUIRE (idx1.keys.size == 4);
         REQUIRE (idx1.children.size == 5);
         REQUIRE (idx2.keys.size == 0);
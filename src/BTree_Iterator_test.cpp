@@ -213,3 +213,67 @@ TEST_CASE("Iterator", "[Iterator]") {
     }
 }
 
+
+TEST_CASE("Range", "[Iterator]") {
+    SECTION("should scan runs of keys in range") {
+        BTree<int, int, 16> m;
+        for (int i = 0; i < 1000; i++) m.insert(i * 2, i);
+        int bounds[][2] = {{0, 2000}, {-5, 3}, {1, 1}, {7, 8}, {101, 777}, {1998, 5000}, {500, 100}};
+        for (auto &bound : bounds) {
+            int lo = bound[0], hi = bound[1], expected = lo < 0 ? 0 : (lo + 1) / 2 * 2;
+            unsigned in_range = 0;
+            for (int i = 0; i < 1000; i++) if (lo <= i * 2 && i * 2 < hi) ++in_range;
+            unsigned n = m.scan(lo, hi, [&](const int *keys, const int *values, unsigned count) {
+                REQUIRE (count > 0);
+                REQUIRE (count <= 16);
+                for (unsigned i = 0; i < count; i++) {
+                    REQUIRE (keys[i] == expected);
+                    REQUIRE (values[i] == expected / 2);
+                    expected += 2;
+                }
+            });
+            REQUIRE (n == in_range);
+        }
+        REQUIRE (m.scan(0, 2000, [](const int *, const int *, unsigned) {}) == 1000);
+    }
+
+    SECTION("should stop a cursor early") {
+        BTree<int, int, 16> m;
+        for (int i = 0; i < 1000; i++) m.insert(i, i);
+        {
+            auto cursor = m.range(100, 900);
+            REQUIRE (cursor.next());
+            REQUIRE (cursor.keys[0] == 100);
+            REQUIRE (cursor.next());
+        }
+        for (int i = 1000; i < 2000; i++) m.insert(i, i);
+        auto cursor = m.range(1990, 3000);
+        int n = 0;
+        while (cursor.next()) n += cursor.count;
+        REQUIRE (n == 10);
+        REQUIRE (!cursor.next());
+    }
+
+    SECTION("should scan with offload and prefetch") {
+        const int test_size = 10000;
+        remove("range.test");
+        {
+            Map m("range.test");
+            for (int i = 0; i < test_size; i++) m.insert(i, i);
+        }
+        {
+            Map m("range.test");
+            long long sum = 0;
+            REQUIRE (m.scan(0, test_size, [&](const int *keys, const int *values, unsigned count) {
+                for (unsigned i = 0; i < count; i++) {
+                    REQUIRE (keys[i] == values[i]);
+                    sum += values[i];
+                }
+            }) == test_size);
+            REQUIRE (sum == (long long) test_size * (test_size - 1) / 2);
+            REQUIRE (m.storage->stat.prefetch > 0);
+            REQUIRE (m.storage->lru.size <= 8);
+        }
+        remove("range.test");
+    }
+}
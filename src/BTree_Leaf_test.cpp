@@ -44,6 +44,8 @@ TEST_CASE("Leaf", "[Leaf]") {
         REQUIRE(that->query(2) == nullptr);
         REQUIRE(leaf.next == that->idx);
         REQUIRE(that->prev == leaf.idx);
+        REQUIRE(leaf.high_key == 3);
+        REQUIRE(that->next == 0);
     }
 
     SECTION("should borrow from left") {
@@ -57,6 +59,7 @@ TEST_CASE("Leaf", "[Leaf]") {
         leaf1.next = leaf2.idx;
         leaf2.prev = leaf1.idx;
         REQUIRE(leaf2.borrow_from_left(&leaf1, 0) == 2);
+        REQUIRE(leaf1.high_key == 2);
         REQUIRE(leaf1.keys.size == 1);
         REQUIRE(leaf1.data.size == 1);
         REQUIRE(leaf2.keys.size == 3);
@@ -81,6 +84,7 @@ TEST_CASE("Leaf", "[Leaf]") {
         leaf1.next = leaf2.idx;
         leaf2.prev = leaf1.idx;
         REQUIRE(leaf1.borrow_from_right(&leaf2, 0) == 4);
+        REQUIRE(leaf1.high_key == 4);
         REQUIRE(leaf1.keys.size == 3);
         REQUIRE(leaf2.keys.size == 1);
         REQUIRE(leaf1.data.size == 3);
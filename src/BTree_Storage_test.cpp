@@ -4,8 +4,10 @@
 
 #include <catch.hpp>
 #include "BTree.hpp"
+#include "Flusher.hpp"
 #include <cstdio>
 #include <algorithm>
+#include <type_traits>
 
 using Map = BTree<int, int, 4, 65536>;
 using BigMap = BTree<int, long long, 512, 65536>;
@@ -146,6 +148,210 @@ TEST_CASE("Storage", "[Storage]") {
         remove("persist_long_long.db");
     }
 
+    SECTION("should recycle frames of evicted pages") {
+        const int test_size = 100000;
+        remove("persist_long_long.db");
+        {
+            BigLimitedMap m("persist_long_long.db");
+            for (int i = 0; i < test_size; i++) m.insert(i, i);
+            for (int i = 0; i < test_size; i++) REQUIRE (*m.query(i) == i);
+            for (int i = 0; i < test_size; i += 2) m.remove(i);
+            REQUIRE (m.storage->stat.swap_out > 0);
+            // pages in memory, and those evicted during an operation until it returns
+            REQUIRE (m.storage->frames.capacity() <= 2 * BigLimitedMap::MaxPageInMemory());
+        }
+        remove("persist_long_long.db");
+    }
+
+    SECTION("should persist data with each replacement policy") {
+        const int test_size = 20000;
+        auto run = [&](auto *tag) {
+            using PolicyMap = typename std::remove_pointer<decltype(tag)>::type;
+            remove("persist_policy.db");
+            {
+                PolicyMap m("persist_policy.db");
+                for (int i = 0; i < test_size; i++) m.insert(i * 7 % test_size, i);
+                REQUIRE (m.storage->lru.size <= 8);
+            }
+            {
+                PolicyMap m("persist_policy.db");
+                for (int i = 0; i < test_size; i++) REQUIRE (*m.query(i * 7 % test_size) == i);
+                REQUIRE (m.storage->stat.swap_out > 0);
+            }
+            remove("persist_policy.db");
+        };
+        run((BTree<int, long long, 16, 8, Default_Max_Pages(), FileStore, NoLog, SingleThread, LRU> *) nullptr);
+        run((BTree<int, long long, 16, 8, Default_Max_Pages(), FileStore, NoLog, SingleThread, Clock> *) nullptr);
+        run((BTree<int, long long, 16, 8, Default_Max_Pages(), FileStore, NoLog, SingleThread, TwoQueue> *) nullptr);
+    }
+
+    SECTION("should work with fewer pages in memory than a path") {
+        const int test_size = 5000;
+        using TinyMap = BTree<int, long long, 4, 2>;
+        remove("persist_tiny.db");
+        {
+            TinyMap m("persist_tiny.db");
+            for (int i = 0; i < test_size; i++) {
+                m.insert(i * 7 % test_size, i);
+                REQUIRE (m.storage->lru.size <= 2);
+            }
+            for (int i = 0; i < test_size; i += 2) REQUIRE (m.remove(i * 7 % test_size));
+            REQUIRE (m.storage->lru.size <= 2);
+            int cnt = 0;
+            for (auto it = m.begin(); it != m.end(); ++it) {
+                it.modify(*it + 1);
+                ++cnt;
+            }
+            REQUIRE (cnt == test_size / 2);
+        }
+        {
+            TinyMap m("persist_tiny.db");
+            for (int i = 0; i < test_size; i++) {
+                if (i % 2) REQUIRE (*m.query(i * 7 % test_size) == i + 1);
+                else
+                    REQUIRE (m.query(i * 7 % test_size) == nullptr);
+            }
+        }
+        remove("persist_tiny.db");
+    }
+
+    SECTION("should write back only modified pages") {
+        const int test_size = 100000;
+        remove("persist_read.db");
+        {
+            BigLimitedMap m("persist_read.db");
+            for (int i = 0; i < test_size; i++) m.insert(i, i);
+        }
+        {
+            BigLimitedMap m("persist_read.db");
+            for (int i = 0; i < test_size; i++) REQUIRE (m.count(i) == 1);
+            for (int i = 0; i < test_size; i += 97) REQUIRE (*m.find(i) == i);
+            long long sum = 0;
+            for (auto it = m.begin(); it != m.end(); ++it) sum += *it;
+            for (auto it = m.cbegin(); it != m.cend(); ++it) sum -= *it;
+            REQUIRE (sum == 0);
+            REQUIRE (m.scan(0, test_size, [](const int *, const long long *, unsigned) {}) == test_size);
+            REQUIRE (m.storage->stat.swap_out > 0);
+            REQUIRE (m.storage->stat.dirty_write == 0);
+            m.storage->checkpoint();
+            REQUIRE (m.storage->stat.checkpoint_write == 0);
+            m.find(test_size / 2).modify(233);
+            m.storage->checkpoint();
+            REQUIRE (m.storage->stat.checkpoint_write == 1);
+        }
+        {
+            BigLimitedMap m("persist_read.db");
+            REQUIRE (*m.query(test_size / 2) == 233);
+        }
+        remove("persist_read.db");
+    }
+
+    SECTION("should write back dirty pages in background") {
+        const int test_size = 100000;
+        remove("persist_flush.db");
+        {
+            BigMap m("persist_flush.db");
+            std::mutex lock;
+            Flusher<BigMap> flusher(m, lock, 64, 16, 1);
+            for (int i = 0; i < test_size; i++) {
+                std::lock_guard<std::mutex> guard(lock);
+                m.insert(i, i);
+            }
+            // a whole pass after the last insert
+            long long done = flusher.count;
+            while (flusher.count <= done + 1) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            std::lock_guard<std::mutex> guard(lock);
+            // pages are flushed only past the high watermark
+            REQUIRE (m.storage->dirty_count() < 64);
+            REQUIRE (m.storage->stat.write_back > 0);
+            REQUIRE (m.storage->stat.swap_out == 0);
+            m.storage->checkpoint();
+            REQUIRE (m.storage->stat.checkpoint_write < 64);
+        }
+        {
+            BigMap m("persist_flush.db");
+            REQUIRE (m.size() == test_size);
+            for (int i = 0; i < test_size; i++) REQUIRE (*m.query(i) == i);
+        }
+        remove("persist_flush.db");
+    }
+
+    SECTION("should persist bulk loaded data when memory is small") {
+        const int test_size = 100000;
+        remove("persist_long_long.db");
+        std::pair<int, long long> *test_data = new std::pair<int, long long>[test_size];
+        for (int i = 0; i < test_size; i++) test_data[i] = std::make_pair(i, (long long) i);
+        {
+            BigLimitedMap m("persist_long_long.db");
+            m.bulk_load(test_data, test_data + test_size);
+            REQUIRE (m.storage->stat.swap_out == m.storage->stat.dirty_write);
+        }
+        {
+            BigLimitedMap m("persist_long_long.db");
+            REQUIRE (m.size() == test_size);
+            for (int i = 0; i < test_size; i++) {
+                REQUIRE (*m.query(i) == i);
+                if (i % 2) m.remove(i);
+            }
+        }
+        {
+            BigLimitedMap m("persist_long_long.db");
+            for (int i = 0; i < test_size; i++) {
+                if (i % 2) REQUIRE (m.query(i) == nullptr);
+                else
+                    REQUIRE (*m.query(i) == i);
+            }
+        }
+        delete[] test_data;
+        remove("persist_long_long.db");
+    }
+    SECTION("should checkpoint incrementally") {
+        const int test_size = 100000;
+        remove("persist_long_long.db");
+        {
+            BigMap m("persist_long_long.db");
+            for (int i = 0; i < test_size; i++) m.insert(i, i);
+            m.checkpoint();
+            REQUIRE (m.storage->stat.checkpoint_write == m.storage->lru.size);
+            long long page_write = m.storage->stat.checkpoint_write;
+            long long table_write = m.storage->stat.table_write;
+            m.checkpoint();
+            REQUIRE (m.storage->stat.checkpoint_write == page_write);
+            REQUIRE (m.storage->stat.table_write == table_write);
+            m.find(0).modify(-1);
+            m.checkpoint();
+            REQUIRE (m.storage->stat.checkpoint_write - page_write <= 6);
+            REQUIRE (m.storage->stat.table_write == table_write);
+        }
+        {
+            BigMap m("persist_long_long.db");
+            REQUIRE (*m.query(0) == -1);
+            for (int i = 1; i < test_size; i++) REQUIRE (*m.query(i) == i);
+        }
+        remove("persist_long_long.db");
+    }
+
+    SECTION("should size page table by pages in use") {
+        remove("persist_long_long.db");
+        {
+            BigMap m("persist_long_long.db");
+            for (int i = 0; i < 1000; i++) m.insert(i, i);
+            m.checkpoint();
+            REQUIRE (m.storage->table.allocated == 1);
+            REQUIRE (m.storage->directory.allocated == 1);
+        }
+        {
+            std::ifstream f("persist_long_long.db", std::ios::binary | std::ios::ate);
+            REQUIRE (f.tellg() < 256 * 1024);
+        }
+        {
+            BigMap m("persist_long_long.db");
+            REQUIRE (m.storage->table.allocated == 1);
+            REQUIRE (m.size() == 1000);
+            for (int i = 0; i < 1000; i++) REQUIRE (*m.query(i) == i);
+        }
+        remove("persist_long_long.db");
+    }
 
     SECTION("should use empty slot") {
         const int test_size = 100000;
@@ -157,8 +363,8 @@ TEST_CASE("Storage", "[Storage]") {
             }
             unsigned long lst_page_use = 0;
             for (int i = 0; i < m.MaxPage(); i++) {
-                if (m.storage->pages[i] != nullptr)
-                    lst_page_use = std::max(lst_page_use, m.storage->persistence_index->page_offset[i]);
+                if (m.storage->pages.get(i) != nullptr)
+                    lst_page_use = std::max(lst_page_use, m.storage->table.get(i).offset);
             }
             for (int i = 0; i < test_size; i++) m.remove(i);
             for (int i = 0; i < test_size; i++) m.insert(i, i);
@@ -166,8 +372,8 @@ TEST_CASE("Storage", "[Storage]") {
             for (int i = 0; i < test_size; i++) m.insert(i, i);
             unsigned long _lst_page_use = 0;
             for (int i = 0; i < m.MaxPage(); i++) {
-                if (m.storage->pages[i] != nullptr)
-                    _lst_page_use = std::max(_lst_page_use, m.storage->persistence_index->page_offset[i]);
+                if (m.storage->pages.get(i) != nullptr)
+                    _lst_page_use = std::max(_lst_page_use, m.storage->table.get(i).offset);
             }
             REQUIRE(_lst_page_use - lst_page_use <= 1000);
         }
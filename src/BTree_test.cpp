@@ -2,12 +2,37 @@
 // Created by Alex Chi on 2019-05-23.
 //
 
+#include <algorithm>
+#include <cstring>
+#include <random>
 #include <sstream>
+#include <vector>
 #include <catch.hpp>
 #include "BTree.hpp"
 
 using Map = BTree<int, int, 4, 65536>;
 
+// right links of each level should follow children of the level above, bounded by high keys
+template<typename Tree>
+void check_links(Tree &m) {
+    std::vector<unsigned> level{m.root_idx()};
+    while (!level.empty()) {
+        std::vector<unsigned> below;
+        for (unsigned i = 0; i < level.size(); i++) {
+            auto block = m.storage->get(level[i]);
+            REQUIRE (block->next == (i + 1 < level.size() ? level[i + 1] : 0));
+            if (block->next) {
+                REQUIRE (block->keys[block->keys.size - 1] < block->high_key);
+                REQUIRE (m.storage->get(block->next)->keys[0] >= block->high_key);
+            }
+            if (block->is_leaf()) continue;
+            auto *index = Tree::Block::into_index(block.get());
+            for (unsigned j = 0; j < index->children.size; j++) below.push_back(index->children[j]);
+        }
+        level = below;
+    }
+}
+
 TEST_CASE("BTree", "[BTree]") {
     SECTION("should use unit test settings") {
         BTree<int, int> t;
@@ -207,6 +232,226 @@ TEST_CASE("BTree", "[BTree]") {
         delete[] test_data;
     }
 
+    SECTION("should link blocks of each level") {
+        Map m;
+        const int test_size = 2000;
+        for (int i = 0; i < test_size; i++) m.insert(i * 7 % test_size, i);
+        check_links(m);
+        for (int i = 0; i < test_size; i += 3) m.remove(i);
+        check_links(m);
+        for (int i = test_size - 1; i >= 0; i--) m.remove(i);
+        for (int i = 0; i < test_size; i += 5) m.insert(i, i);
+        check_links(m);
+
+        Map n;
+        std::pair<int, int> *test_data = new std::pair<int, int>[test_size];
+        for (int i = 0; i < test_size; i++) test_data[i] = std::make_pair(i, i);
+        n.bulk_load(test_data, test_data + test_size);
+        check_links(n);
+        delete[] test_data;
+    }
+
+    SECTION("should keep merged blocks within order") {
+        const int test_size = 500;
+        bool *present = new bool[test_size];
+        auto run = [&](auto &m) {
+            memset(present, 0, test_size);
+            for (int step = 0; step < 20000; step++) {
+                int k = rand() % test_size;
+                if (rand() % 2) {
+                    m.insert(k, k);
+                    present[k] = true;
+                } else {
+                    m.remove(k);
+                    present[k] = false;
+                }
+            }
+            check_links(m);
+            for (int i = 0; i < test_size; i++) REQUIRE ((m.query(i) != nullptr) == present[i]);
+        };
+        for (int seed = 0; seed < 20; seed++) {
+            srand(seed);
+            BTree<int, int, 4, 65536> even;
+            run(even);
+            BTree<int, int, 5, 65536> odd;
+            run(odd);
+        }
+        delete[] present;
+    }
+
+    SECTION("should get many keys at once") {
+        Map m;
+        const int test_size = 2000, batch = 500;
+        for (int i = 0; i < test_size; i += 2) m.insert(i, i * 3);
+        int keys[batch], values[batch];
+        bool found[batch];
+        REQUIRE (m.multi_get(keys, 0, values, found) == 0);
+        for (int round = 0; round < 10; round++) {
+            unsigned expected = 0;
+            for (int i = 0; i < batch; i++) {
+                // sorted in the first round, with duplicates and missing keys later
+                keys[i] = round ? rand() % (test_size + 10) : i;
+                if (keys[i] % 2 == 0 && keys[i] < test_size) ++expected;
+            }
+            REQUIRE (m.multi_get(keys, batch, values, found) == expected);
+            for (int i = 0; i < batch; i++) {
+                REQUIRE (found[i] == (m.query(keys[i]) != nullptr));
+                if (found[i]) REQUIRE (values[i] == keys[i] * 3);
+            }
+        }
+        Map n;
+        REQUIRE (n.multi_get(keys, batch, values, found) == 0);
+    }
+
+    SECTION("should insert and remove in batches") {
+        const int test_size = 3000, batch = 400;
+        bool *present = new bool[test_size];
+        std::pair<int, int> *pairs = new std::pair<int, int>[batch];
+        int *keys = new int[batch];
+        auto run = [&](auto &m) {
+            memset(present, 0, test_size);
+            for (int round = 0; round < 30; round++) {
+                // clustered around a random start, with repeated keys
+                int start = rand() % test_size;
+                unsigned expected = 0;
+                bool *seen = new bool[test_size]();
+                for (int i = 0; i < batch; i++) {
+                    int k = (start + rand() % (batch * 2)) % test_size;
+                    if (round % 3 == 2) {
+                        keys[i] = k;
+                        if (present[k] && !seen[k]) ++expected;
+                        present[k] = false;
+                    } else {
+                        pairs[i] = std::make_pair(k, k * 2);
+                        if (!present[k] && !seen[k]) ++expected;
+                        present[k] = true;
+                    }
+                    seen[k] = true;
+                }
+                delete[] seen;
+                if (round % 3 == 2) REQUIRE (m.remove_batch(keys, keys + batch) == expected);
+                else
+                    REQUIRE (m.insert_batch(pairs, pairs + batch) == expected);
+                check_links(m);
+            }
+            unsigned size = 0;
+            for (int i = 0; i < test_size; i++) {
+                if (present[i]) {
+                    ++size;
+                    REQUIRE (m.query(i));
+                    REQUIRE (*m.query(i) == i * 2);
+                } else
+                    REQUIRE (m.query(i) == nullptr);
+            }
+            REQUIRE (m.size() == size);
+            for (int i = 0; i < test_size; i += batch) {
+                int n = std::min(batch, test_size - i);
+                for (int j = 0; j < n; j++) keys[j] = i + j;
+                m.remove_batch(keys, keys + n);
+            }
+            REQUIRE (m.size() == 0);
+            REQUIRE (m.begin() == m.end());
+        };
+        for (int seed = 0; seed < 5; seed++) {
+            srand(seed);
+            BTree<int, int, 4, 65536> even;
+            run(even);
+            BTree<int, int, 5, 65536> odd;
+            run(odd);
+        }
+        delete[] present;
+        delete[] pairs;
+        delete[] keys;
+    }
+
+    SECTION("should bulk load sorted data") {
+        for (int test_size = 0; test_size <= 64; test_size++) {
+            Map m;
+            std::pair<int, int> *test_data = new std::pair<int, int>[test_size];
+            for (int i = 0; i < test_size; i++) test_data[i] = std::make_pair(i * 2, i * 2);
+            unsigned expected = test_size;
+            REQUIRE (m.bulk_load(test_data, test_data + test_size) == expected);
+            REQUIRE (m.size() == expected);
+            for (int i = 0; i < test_size; i++) {
+                REQUIRE (m.query(i * 2));
+                REQUIRE (*m.query(i * 2) == i * 2);
+                REQUIRE (m.query(i * 2 + 1) == nullptr);
+            }
+            if (test_size > 0) {
+                int i = 0;
+                for (auto iter = m.begin(); iter != m.end(); ++iter, ++i) REQUIRE (*iter == i * 2);
+            }
+            for (int i = 0; i < test_size; i++) m.insert(i * 2 + 1, i * 2 + 1);
+            for (int i = 0; i < test_size; i++) REQUIRE (m.remove(i * 2));
+            for (int i = 0; i < test_size * 2; i++) {
+                if (i % 2) REQUIRE (*m.query(i) == i);
+                else
+                    REQUIRE (m.query(i) == nullptr);
+            }
+            delete[] test_data;
+        }
+    }
+
+    SECTION("should bulk load into packed pages") {
+        BTree<int, int, 512> m;
+        const int test_size = 100000;
+        std::pair<int, int> *test_data = new std::pair<int, int>[test_size];
+        for (int i = 0; i < test_size; i++) test_data[i] = std::make_pair(i, i);
+        m.bulk_load(test_data, test_data + test_size);
+        int leaves = (test_size + m.Order() - 2) / (m.Order() - 1);
+        REQUIRE (m.storage->stat.create == leaves + 1);
+        for (int i = 0; i < test_size; i++) {
+            REQUIRE (m.query(i));
+            REQUIRE (*m.query(i) == i);
+        }
+        delete[] test_data;
+    }
+
+    SECTION("should bulk load with fill factor") {
+        BTree<int, int, 512> m;
+        const int test_size = 100000;
+        std::pair<int, int> *test_data = new std::pair<int, int>[test_size];
+        for (int i = 0; i < test_size; i++) test_data[i] = std::make_pair(i, i);
+        m.bulk_load(test_data, test_data + test_size, 0.7);
+        REQUIRE (m.storage->stat.create > (test_size + m.Order() - 2) / (m.Order() - 1) + 1);
+        for (int i = test_size - 1; i >= 0; i--) {
+            REQUIRE (m.query(i));
+            REQUIRE (*m.query(i) == i);
+            REQUIRE (m.remove(i));
+        }
+        REQUIRE (m.size() == 0);
+        delete[] test_data;
+    }
+
+    SECTION("should insert pairs out of order when bulk loading") {
+        Map m;
+        std::pair<int, int> test_data[] = {{0, 0}, {2, 2}, {4, 4}, {3, 3}, {1, 1}, {4, 5}, {6, 6}};
+        REQUIRE (m.bulk_load(test_data, test_data + 7) == 6);
+        REQUIRE (m.size() == 6);
+        for (int i = 0; i <= 4; i++) REQUIRE (*m.query(i) == i);
+        REQUIRE (*m.query(6) == 6);
+
+        BTree<int, int, 512> n;
+        const int test_size = 100000;
+        std::vector<std::pair<int, int>> shuffled;
+        for (int i = 0; i < test_size; i++) shuffled.emplace_back(i, i);
+        std::shuffle(shuffled.begin() + test_size / 2, shuffled.end(), std::mt19937(1));
+        REQUIRE (n.bulk_load(shuffled.begin(), shuffled.end()) == (unsigned) test_size);
+        REQUIRE (n.size() == (unsigned) test_size);
+        int i = 0;
+        for (auto iter = n.begin(); iter != n.end(); ++iter, ++i) REQUIRE (*iter == i);
+        REQUIRE (i == test_size);
+    }
+
+    SECTION("should insert when bulk loading into non-empty tree") {
+        Map m;
+        m.insert(5, 5);
+        std::pair<int, int> test_data[] = {{1, 1}, {3, 3}, {5, 5}, {7, 7}};
+        REQUIRE (m.bulk_load(test_data, test_data + 4) == 3);
+        REQUIRE (m.size() == 4);
+        for (int i = 1; i <= 7; i += 2) REQUIRE (*m.query(i) == i);
+    }
+
     SECTION("should align key to 4K") {
         using BTreeInt = BTree<int, int>;
         using BTreeLong = BTree<long long, int>;
@@ -266,4 +511,49 @@ TEST_CASE("Serialize", "[BTree]") {
             REQUIRE (idx.children[4] == 4);
         }
     }
+
+    SECTION("block should be stored as one frame") {
+        std::stringstream s;
+        {
+            Map::Leaf leaf;
+            leaf.insert(1, 1);
+            leaf.next = 3;
+            REQUIRE (reinterpret_cast<char *>(leaf.keys.x) == reinterpret_cast<char *>(&leaf.frame.keys));
+            REQUIRE (leaf.frame.keys_size == 1);
+            REQUIRE (leaf.frame.next == 3);
+            leaf.serialize(s);
+            REQUIRE (s.str().size() == Map::Leaf::Storage_Size());
+            REQUIRE (Map::Leaf::Storage_Size() == sizeof(leaf.frame));
+        }
+        {
+            Map::Leaf leaf;
+            leaf.deserialize(s);
+            REQUIRE (leaf.next == 3);
+            REQUIRE (leaf.data.size == 1);
+            REQUIRE (*leaf.query(1) == 1);
+        }
+    }
+
+    SECTION("block should be dispatched by its tag") {
+        REQUIRE (!std::is_polymorphic<Map::Block>::value);
+        std::stringstream s;
+        {
+            Map::Leaf leaf;
+            Map::Block *block = &leaf;
+            REQUIRE (block->is_leaf());
+            leaf.insert(1, 1);
+            REQUIRE (block->storage_size() == Map::Leaf::Storage_Size());
+            block->serialize(s);
+        }
+        {
+            Map::Index idx;
+            Map::Block *block = &idx;
+            REQUIRE (!block->is_leaf());
+            REQUIRE (block->storage_size() == Map::Index::Storage_Size());
+            Map::Leaf leaf;
+            block = &leaf;
+            block->deserialize(s);
+            REQUIRE (*leaf.query(1) == 1);
+        }
+    }
 }
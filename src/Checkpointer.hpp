@@ -0,0 +1,82 @@
+//
+// Created by Alex Chi on 2019-06-14.
+//
+
+#ifndef BPLUSTREE_CHECKPOINTER_HPP
+#define BPLUSTREE_CHECKPOINTER_HPP
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <system_error>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+/*
+ * Checkpoint a tree every `interval` milliseconds from a background thread.
+ * A checkpoint holds `lock`, which callers must also hold around their own
+ * operations on the tree, and may stop the checkpointer while holding it.
+ * A checkpoint that fails keeps the log, and is counted in failed.
+ */
+template<typename Tree, typename Lock = std::mutex>
+class Checkpointer {
+    Tree &tree;
+    Lock &lock;
+
+    std::mutex m;
+    std::condition_variable cv;
+    bool stopped;
+    std::thread worker;
+
+    // m is only held while waiting, so that stop is not held up by the tree lock or a checkpoint
+    void run() {
+        std::unique_lock<std::mutex> guard(m);
+        while (!cv.wait_for(guard, std::chrono::milliseconds(interval), [this] { return stopped; })) {
+            guard.unlock();
+            checkpoint();
+            guard.lock();
+        }
+    }
+
+    void checkpoint() {
+        std::unique_lock<Lock> tree_guard(lock, std::defer_lock);
+        // rather than blocking on it, so that a caller holding the tree lock may stop the checkpointer
+        while (!tree_guard.try_lock()) {
+            std::unique_lock<std::mutex> guard(m);
+            if (cv.wait_for(guard, std::chrono::microseconds(100), [this] { return stopped; })) return;
+        }
+        try {
+            tree.checkpoint();
+            ++count;
+        } catch (const std::system_error &e) {
+            std::clog << "[Warning] checkpoint failed: " << e.what() << std::endl;
+            ++failed;
+        }
+    }
+
+public:
+    unsigned interval;
+    std::atomic<long long> count, failed;
+
+    Checkpointer(Tree &tree, Lock &lock, unsigned interval) :
+            tree(tree), lock(lock), stopped(false), interval(interval), count(0), failed(0) {
+        worker = std::thread(&Checkpointer::run, this);
+    }
+
+    Checkpointer(const Checkpointer &) = delete;
+
+    ~Checkpointer() { stop(); }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> guard(m);
+            if (stopped) return;
+            stopped = true;
+        }
+        cv.notify_all();
+        worker.join();
+    }
+};
+
+#endif //BPLUSTREE_CHECKPOINTER_HPP
@@ -12,6 +12,7 @@
 #ifndef ONLINE_JUDGE
 
 #include "Persistence.hpp"
+#include "Search.hpp"
 
 #endif
 
@@ -37,21 +38,26 @@ struct Allocator {
 };
 
 template<typename T, unsigned Cap>
-class Vector : Serializable {
+class Vector {
     Allocator<T> a;
+    // elements and size of a vector allocated on its own, null for a view
+    T *own;
+    unsigned own_size;
 public:
     T *x;
-    unsigned size;
+    unsigned &size;
 
     static constexpr unsigned capacity() { return Cap; }
 
-    Vector() : size(0) {
-        x = a.allocate(capacity());
-    }
+    Vector() : own(a.allocate(capacity())), own_size(0), x(own), size(own_size) {}
+
+    // view over elements and size kept elsewhere, such as in a page frame, which owns them
+    Vector(unsigned &size, T *x) : own(nullptr), x(x), size(size) {}
 
-    virtual ~Vector() {
+    ~Vector() {
+        if (!own) return;
         for (int i = 0; i < size; i++) a.destruct(&x[i]);
-        a.deallocate(x);
+        a.deallocate(own);
     }
 
     Vector(const Vector &) = delete;
@@ -142,9 +148,60 @@ public:
     }
 };
 
+/*
+ * Sorted keys. A set may also keep a sample of the first key in every cache line of keys,
+ * so that a search reads the sample and one line of keys instead of a line per step of a
+ * binary search over all of them. The sample is refreshed by every change made through
+ * the set, and only through it. Its Samples keys are owned by whoever enables it, so that
+ * sets searched without one, such as keys of leaves, do not carry them.
+ */
 template<typename T, unsigned Cap>
 class Set : public Vector<T, Cap> {
+    using Base = Vector<T, Cap>;
 public:
+    static constexpr unsigned Stride = sizeof(T) >= 64 ? 1 : 64 / sizeof(T);
+
+    static constexpr unsigned Samples = Cap / Stride + 1;
+
+    // sample[j] is x[j * Stride], null if keys are not sampled
+    T *sample;
+
+    Set() : Base(), sample(nullptr) {}
+
+    Set(unsigned &size, T *x) : Base(size, x), sample(nullptr) {}
+
+    // sample keys into s, of Samples keys
+    void enable_sample(T *s) {
+        sample = s;
+        refresh();
+    }
+
+    // refresh samples of keys from pos on
+    void refresh(unsigned pos = 0) {
+        if (!sample) return;
+        for (unsigned j = (pos + Stride - 1) / Stride; j * Stride < this->size; j++) sample[j] = this->x[j * Stride];
+    }
+
+    // keys of x[0, n) less than d, or no greater than d if upper
+    static unsigned count(const T *x, unsigned n, const T &d, bool upper) {
+#ifndef ONLINE_JUDGE
+        if constexpr (KeySearch<T>::Vectorized) return KeySearch<T>::count_window(x, n, d, upper);
+#endif
+        unsigned c = 0;
+        for (unsigned i = 0; i < n; i++) c += upper ? !(d < x[i]) : x[i] < d;
+        return c;
+    }
+
+    unsigned sampled_bound(const T &d, bool upper) const {
+        unsigned size = this->size;
+        unsigned c = count(sample, (size + Stride - 1) / Stride, d, upper);
+        if (c == 0) return 0;
+        // x[base] is before the bound, x[base + Stride] is not
+        unsigned base = (c - 1) * Stride;
+        unsigned rest = size > base ? size - base : 0;
+        return base + count(this->x + base, rest < Stride ? rest : Stride, d, upper);
+    }
+
     unsigned bin_lower_bound(const T &d) const {
         // https://academy.realm.io/posts/how-we-beat-cpp-stl-binary-search/
         unsigned low = 0, size = this->size;
@@ -188,17 +245,63 @@ public:
     }
 
     unsigned upper_bound(const T &d) const {
+        if (sample) return sampled_bound(d, true);
+#ifndef ONLINE_JUDGE
+        if constexpr (KeySearch<T>::Vectorized) return KeySearch<T>::upper_bound(this->x, this->size, d);
+#endif
         if (Cap >= 16) return bin_upper_bound(d); else return linear_upper_bound(d);
     }
     unsigned lower_bound(const T &d) const {
+        if (sample) return sampled_bound(d, false);
+#ifndef ONLINE_JUDGE
+        if constexpr (KeySearch<T>::Vectorized) return KeySearch<T>::lower_bound(this->x, this->size, d);
+#endif
         if (Cap >= 16) return bin_lower_bound(d); else return linear_lower_bound(d);
     }
 
     unsigned insert(const T &d) {
         unsigned pos = upper_bound(d);
-        Vector<T, Cap>::insert(pos, d);
+        insert(pos, d);
         return pos;
     }
+
+    void insert(unsigned pos, const T &d) {
+        Base::insert(pos, d);
+        refresh(pos);
+    }
+
+    void assign(unsigned pos, const T &d) {
+        (*this)[pos] = d;
+        if (sample && pos % Stride == 0) sample[pos / Stride] = d;
+    }
+
+    void append(const T &d) {
+        Base::append(d);
+        refresh(this->size - 1);
+    }
+
+    T remove(unsigned pos) {
+        T d = Base::remove(pos);
+        refresh(pos);
+        return d;
+    }
+
+    void remove_range(unsigned pos, unsigned length = 1) {
+        Base::remove_range(pos, length);
+        refresh(pos);
+    }
+
+    void move_from(Set &that, unsigned offset, unsigned length) {
+        Base::move_from(that, offset, length);
+        refresh();
+        that.refresh(offset);
+    }
+
+    void move_insert_from(Set &that, unsigned offset, unsigned length, unsigned at) {
+        Base::move_insert_from(that, offset, length, at);
+        refresh(at);
+        that.refresh(offset);
+    }
 };
 
 #endif //BPLUSTREE_CONTAINER_HPP
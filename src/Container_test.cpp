@@ -72,6 +72,20 @@ TEST_CASE("Vector", "[Vector]") {
         REQUIRE (TestClass::destruct_cnt == 16);
     }
 
+    SECTION("should view data kept elsewhere", "[Vector]") {
+        unsigned size = 0;
+        int data[8];
+        {
+            Vector<int, 8> v(size, data);
+            v.append(1);
+            v.insert(0, 2);
+            REQUIRE (v[0] == 2);
+        }
+        REQUIRE (size == 2);
+        REQUIRE (data[0] == 2);
+        REQUIRE (data[1] == 1);
+    }
+
     SECTION("should insert", "[Vector]") {
         Vector<int, 8> v;
         v.append(2);
@@ -272,6 +286,44 @@ TEST_CASE("Set", "[Set]") {
         REQUIRE (s.upper_bound(7) == 6);
         REQUIRE (s.upper_bound(8) == 6);
     }
+
+    SECTION("should search through sample of keys") {
+        Set<long long, 256> s, t, plain;
+        long long s_sample[Set<long long, 256>::Samples], t_sample[Set<long long, 256>::Samples];
+        s.enable_sample(s_sample);
+        t.enable_sample(t_sample);
+        for (int i = 0; i < 100000; i++) {
+            int op = rand() % 6;
+            if (op <= 1 && s.size < 256) {
+                long long k = rand() % 1000;
+                s.insert(k);
+                plain.insert(k);
+            } else if (op == 2 && s.size > 0) {
+                unsigned pos = rand() % s.size;
+                s.remove(pos);
+                plain.remove(pos);
+            } else if (op == 3 && s.size > 0) {
+                // keep keys sorted
+                unsigned pos = rand() % s.size;
+                long long k = pos == 0 ? -1 : s[pos - 1];
+                s.assign(pos, k);
+                plain[pos] = k;
+            } else if (op == 4 && s.size > 1) {
+                // move the upper half out and back
+                unsigned half = s.size / 2;
+                t.move_from(s, s.size - half, half);
+                s.move_insert_from(t, 0, half, s.size);
+            } else if (op == 5 && s.size > 0 && s[s.size - 1] < 1000) {
+                s.pop();
+                s.append(1000);
+                plain.pop();
+                plain.append(1000);
+            }
+            long long d = rand() % 1002 - 1;
+            REQUIRE (s.lower_bound(d) == plain.lower_bound(d));
+            REQUIRE (s.upper_bound(d) == plain.upper_bound(d));
+        }
+    }
 }
 
 TEST_CASE("Allocator", "[Allocator][!mayfail]") {
@@ -0,0 +1,80 @@
+//
+// Created by Alex Chi on 2019-06-18.
+//
+
+#ifndef BPLUSTREE_FLUSHER_HPP
+#define BPLUSTREE_FLUSHER_HPP
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+/*
+ * Write back cold dirty pages from a background thread, so that eviction on the request
+ * path mostly drops clean pages. Every `interval` milliseconds, once `high` pages are dirty,
+ * pages are written back in batches until at most `low` are left dirty.
+ * A batch holds `lock`, which callers of a single-thread tree must also hold around their
+ * own operations on it. Concurrent trees may pass a lock of the flusher's own.
+ */
+template<typename Tree, typename Lock = std::mutex>
+class Flusher {
+    Tree &tree;
+    Lock &lock;
+
+    std::mutex m;
+    std::condition_variable cv;
+    bool stopped;
+    std::thread worker;
+
+    // pages written back while the tree lock is held
+    static constexpr unsigned Batch = 16;
+
+    void run() {
+        std::unique_lock<std::mutex> guard(m);
+        while (!cv.wait_for(guard, std::chrono::milliseconds(interval), [this] { return stopped; })) {
+            guard.unlock();
+            flush();
+            guard.lock();
+            ++count;
+        }
+    }
+
+    void flush() {
+        bool flushing = false;
+        for (;;) {
+            std::lock_guard<Lock> tree_guard(lock);
+            unsigned dirty = tree.storage->dirty_count();
+            if (dirty >= high) flushing = true;
+            if (!flushing || dirty <= low) return;
+            // whatever is left dirty is pinned or latched for now
+            if (tree.storage->write_back(low, Batch) == 0) return;
+        }
+    }
+
+public:
+    unsigned interval, high, low;
+    std::atomic<long long> count;
+
+    Flusher(Tree &tree, Lock &lock, unsigned high, unsigned low, unsigned interval) :
+            tree(tree), lock(lock), stopped(false), interval(interval), high(high), low(low), count(0) {
+        worker = std::thread(&Flusher::run, this);
+    }
+
+    Flusher(const Flusher &) = delete;
+
+    ~Flusher() { stop(); }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> guard(m);
+            if (stopped) return;
+            stopped = true;
+        }
+        cv.notify_all();
+        worker.join();
+    }
+};
+
+#endif //BPLUSTREE_FLUSHER_HPP
@@ -18,9 +18,12 @@ public:
 
     Iterator &operator++() {
         ++pos;
-        if (pos == leaf()->keys.size && leaf()->next) {
-            pos = 0;
-            leaf_idx = leaf()->next;
+        {
+            auto l = leaf();
+            if (pos == (int) l->keys.size && l->next) {
+                pos = 0;
+                leaf_idx = l->next;
+            }
         }
         expire();
         return *this;
@@ -30,15 +33,20 @@ public:
         tree->storage->swap_out_pages();
     }
 
-    const Leaf *leaf() const { return reinterpret_cast<const Leaf *>(tree->storage->read(leaf_idx)); }
+    // the leaf, pinned while the reference lives
+    typename BTree::ConstRef leaf() const { return tree->storage->read(leaf_idx); }
 
-    Leaf *leaf_mut() { return Block::into_leaf(tree->storage->get(leaf_idx)); }
+    typename BTree::Ref leaf_mut() { return tree->storage->get(leaf_idx); }
 
     Iterator &operator--() {
         --pos;
-        if (pos < 0 && leaf()->prev) {
-            leaf_idx = leaf()->prev;
-            pos = leaf()->keys.size - 1;
+        if (pos < 0) {
+            auto l = leaf();
+            if (Block::into_leaf(l.get())->prev) {
+                leaf_idx = Block::into_leaf(l.get())->prev;
+                l = leaf();
+                pos = l->keys.size - 1;
+            }
         }
         expire();
         return *this;
@@ -56,7 +64,7 @@ public:
         return _;
     }
 
-    V operator*() {
+    V operator*() const {
         return getValue();
     }
 
@@ -68,14 +76,95 @@ public:
         return !(a == b);
     }
 
-    V getValue() {
+    V getValue() const {
         expire();
-        return leaf_mut()->data[pos];
+        return Block::into_leaf(leaf().get())->data[pos];
     }
 
     void modify(const V &v) {
         expire();
-        leaf_mut()->data[pos] = v;
+        auto l = leaf_mut();
+        l->touch();
+        Block::into_leaf(l.get())->data[pos] = v;
+        tree->log_operation(BTree::LogModify, l->keys[pos], &v);
+    }
+};
+
+/*
+ * Cursor over keys in [lo, hi) yielding runs of keys and values, a leaf at a time.
+ * The leaf of the current run stays pinned, and latched shared against concurrent writers,
+ * until the cursor moves on, while the leaf after it is prefetched.
+ * keys and values point into the leaf and are valid until the next call to next.
+ */
+template<typename BTree, typename Block, typename Leaf, typename K, typename V>
+class RangeCursor {
+    BTree *tree;
+    K hi;
+    typename BTree::Latches latches;
+    Leaf *leaf;
+    unsigned pos;
+    bool started, last;
+
+public:
+    const K *keys;
+    const V *values;
+    unsigned count;
+
+    RangeCursor(BTree *tree, const K &lo, const K &hi) :
+            tree(tree), hi(hi), latches(tree, false), leaf(nullptr), pos(0), started(false), last(false),
+            keys(nullptr), values(nullptr), count(0) {
+        latches.lock_root();
+        if (!tree->root_idx()) {
+            latches.release();
+            return;
+        }
+        Block *blk = latches.acquire(tree->root_idx());
+        latches.unlock_root();
+        while (!blk->is_leaf()) {
+            auto *index = Block::into_index(blk);
+            blk = latches.acquire(index->children[index->keys.upper_bound(lo)]);
+            latches.release_above();
+        }
+        leaf = Block::into_leaf(blk);
+        pos = leaf->keys.lower_bound(lo);
+    }
+
+    RangeCursor(const RangeCursor &) = delete;
+
+    // move to the next run, false once the range is exhausted
+    bool next() {
+        while (leaf) {
+            if (started) {
+                if (last || !leaf->next) {
+                    close();
+                    return false;
+                }
+                leaf = Block::into_leaf(latches.acquire(leaf->next));
+                latches.release_above();
+                pos = 0;
+                tree->storage->swap_out_pages();
+            }
+            started = true;
+            unsigned end = leaf->keys.lower_bound(hi);
+            last = end < leaf->keys.size;
+            if (!last && leaf->next) {
+                tree->storage->prefetch(leaf->next);
+                tree->storage->submit();
+            }
+            if (pos < end) {
+                keys = leaf->keys.x + pos;
+                values = leaf->data.x + pos;
+                count = end - pos;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void close() {
+        latches.release();
+        leaf = nullptr;
+        count = 0;
     }
 };
 
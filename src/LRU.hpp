@@ -6,89 +6,335 @@
 #define BPLUSTREE_LRU_HPP
 
 #include <cstring>
+#ifndef ONLINE_JUDGE
+#include "SparseArray.hpp"
+#endif
 
+/*
+ * Replacement policies of the page cache. Each of them tracks pages in memory by id and
+ * offers put, get on a hit, remove, drop for a freed page whose id may be reused, expire
+ * to pick a victim, and expire_while, for_each and contains. Lists are linked through
+ * arrays indexed by page id, so that no node is allocated per page.
+ */
+
+// doubly linked lists of page ids, a page is in at most one of them
 template<unsigned Cap, typename Idx = unsigned>
-class LRU {
-    struct Node {
-        Idx idx;
-        Node *prev, *next;
+class PageLists {
+    struct Link {
+        // id + 1 of neighbours, 0 if none
+        Idx prev, next;
+        // list the page is in, 0 if none
+        unsigned char list;
+        // referenced since the clock hand passed it
+        bool ref;
+    };
 
-        Node(Idx idx) : idx(idx), prev(nullptr), next(nullptr) {}
-    } *head, *tail;
+    SparseArray<Link, Cap> links;
 
-    void push(Node* ptr) {
-        if (size == 0) { head = tail = ptr; }
-        else {
-            ptr->next = head;
-            head->prev = ptr;
-            head = ptr;
+public:
+    struct List {
+        Idx head, tail;
+        unsigned size;
+        unsigned char id;
+
+        explicit List(unsigned char id) : head(0), tail(0), size(0), id(id) {}
+    };
+
+    Link &operator[](Idx idx) { return links.ref(idx); }
+
+    unsigned char list(Idx idx) const { return links.get(idx).list; }
+
+    bool ref(Idx idx) const { return links.get(idx).ref; }
+
+    // first page of l after idx, wrapping around
+    Idx next(const List &l, Idx idx) const {
+        Idx next = links.get(idx).next;
+        return next ? next - 1 : l.head - 1;
+    }
+
+    // insert idx before at, or at the tail if at is none
+    void insert(List &l, Idx idx, Idx at) {
+        assert(idx < Cap);
+        Link &link = links.ref(idx);
+        assert(!link.list);
+        link.list = l.id;
+        link.ref = false;
+        link.next = at;
+        link.prev = at ? links.ref(at - 1).prev : l.tail;
+        if (link.prev) links.ref(link.prev - 1).next = idx + 1; else l.head = idx + 1;
+        if (link.next) links.ref(link.next - 1).prev = idx + 1; else l.tail = idx + 1;
+        ++l.size;
+    }
+
+    void push_front(List &l, Idx idx) { insert(l, idx, l.head); }
+
+    void remove(List &l, Idx idx) {
+        Link &link = links.ref(idx);
+        assert(link.list == l.id);
+        if (link.prev) links.ref(link.prev - 1).next = link.next; else l.head = link.next;
+        if (link.next) links.ref(link.next - 1).prev = link.prev; else l.tail = link.prev;
+        link.prev = link.next = 0;
+        link.list = 0;
+        --l.size;
+    }
+
+    // visit from head to tail, f may remove what it visits
+    template<typename F>
+    void for_each(const List &l, F f) const {
+        for (Idx i = l.head; i;) {
+            Idx next = links.get(i - 1).next;
+            f(i - 1);
+            i = next;
         }
+    }
+
+    // visit from tail to head while f returns true, false if stopped
+    template<typename F>
+    bool for_each_reverse(const List &l, F f) const {
+        for (Idx i = l.tail; i; i = links.get(i - 1).prev)
+            if (!f(i - 1)) return false;
+        return true;
+    }
+
+    // visit once around from at, id + 1 or 0 for the head, while f returns true
+    template<typename F>
+    bool for_each_from(const List &l, Idx at, F f) const {
+        Idx start = at ? at : l.head;
+        if (!start) return true;
+        Idx i = start;
+        do {
+            if (!f(i - 1)) return false;
+            i = next(l, i - 1) + 1;
+        } while (i != start);
+        return true;
+    }
+};
+
+// least recently used, every hit moves the page to the front
+template<unsigned Cap, typename Idx = unsigned>
+class LRU {
+    using Lists = PageLists<Cap, Idx>;
+    Lists lists;
+    typename Lists::List l;
+
+public:
+    unsigned size;
+
+    LRU() : l(1), size(0) {}
+
+    LRU(const LRU &) = delete;
+
+    void put(Idx idx) {
+        lists.push_front(l, idx);
         ++size;
     }
 
-    void remove(Node* ptr) {
-        if (ptr->prev) ptr->prev->next = ptr->next; else {
-            head = ptr->next;
-        }
-        if (ptr->next) ptr->next->prev = ptr->prev; else {
-            tail = ptr->prev;
-        }
-        ptr->next = ptr->prev = nullptr;
+    void get(Idx idx) {
+        assert(lists.list(idx) == l.id);
+        lists.remove(l, idx);
+        lists.push_front(l, idx);
+    }
+
+    Idx expire() { return l.tail - 1; }
+
+    void remove(Idx idx) {
+        lists.remove(l, idx);
         --size;
     }
 
+    void drop(Idx idx) { remove(idx); }
+
+    bool contains(Idx idx) const { return lists.list(idx) != 0; }
+
+    // visit from the most to the least recently used
+    template<typename F>
+    void for_each(F f) const { lists.for_each(l, f); }
+
+    // visit from the next victim on while f returns true, leaving pages as they are
+    template<typename F>
+    void for_each_cold(F f) const { lists.for_each_reverse(l, f); }
+
+    // visit from the least to the most recently used while f returns true, f may remove what it visits
+    template<typename F>
+    void expire_while(F f) {
+        for (unsigned n = size; n > 0 && size > 0; n--) {
+            Idx idx = expire();
+            if (!f(idx)) return;
+            // a page that stays counts as used
+            if (contains(idx)) get(idx);
+        }
+    }
+};
+
+/*
+ * CLOCK: a hit only sets the reference bit of a page, and the hand sweeping pages for a
+ * victim clears it, so that a page survives a sweep if it was used since the last one.
+ * New pages are placed right before the hand, unreferenced.
+ */
+template<unsigned Cap, typename Idx = unsigned>
+class Clock {
+    using Lists = PageLists<Cap, Idx>;
+    Lists lists;
+    typename Lists::List ring;
+    // id + 1 of the page the hand points to, 0 for the head, new pages go right before it
+    Idx hand;
+
 public:
     unsigned size;
 
-    Node** nodes;
+    Clock() : ring(1), hand(0), size(0) {}
 
-    LRU() : head(nullptr), tail(nullptr), size(0) {
-        nodes = new Node*[Cap];
-        memset(nodes, 0, sizeof(Node*) * Cap);
+    Clock(const Clock &) = delete;
+
+    void put(Idx idx) {
+        lists.insert(ring, idx, hand);
+        ++size;
     }
 
-    ~LRU() {
-        delete[] nodes;
+    void get(Idx idx) { lists[idx].ref = true; }
+
+    Idx expire() {
+        for (;;) {
+            Idx idx = hand ? hand - 1 : ring.head - 1;
+            if (!lists.ref(idx)) {
+                hand = idx + 1;
+                return idx;
+            }
+            lists[idx].ref = false;
+            hand = lists.next(ring, idx) + 1;
+        }
     }
 
+    void remove(Idx idx) {
+        if (hand == idx + 1) hand = size > 1 ? lists.next(ring, idx) + 1 : 0;
+        lists.remove(ring, idx);
+        --size;
+    }
+
+    void drop(Idx idx) { remove(idx); }
+
+    bool contains(Idx idx) const { return lists.list(idx) != 0; }
+
+    template<typename F>
+    void for_each(F f) const { lists.for_each(ring, f); }
+
+    // visit in the order of the hand while f returns true, leaving reference bits as they are
+    template<typename F>
+    void for_each_cold(F f) const { lists.for_each_from(ring, hand, f); }
+
+    // visit victims in the order of the hand while f returns true, f may remove what it visits
+    template<typename F>
+    void expire_while(F f) {
+        for (unsigned n = size * 2; n > 0 && size > 0; n--) {
+            Idx idx = expire();
+            if (!f(idx)) return;
+            if (contains(idx)) hand = lists.next(ring, idx) + 1;
+        }
+    }
+};
+
+/*
+ * 2Q: pages enter a FIFO queue, and hits there are ignored, as they are likely correlated.
+ * Pages expired from it are remembered in a ghost queue of ids, and a page loaded again
+ * while remembered goes to the main queue, managed as a CLOCK. A scan then only cycles
+ * through the FIFO queue, and the pages used again and again stay.
+ */
+template<unsigned Cap, typename Idx = unsigned>
+class TwoQueue {
+    using Lists = PageLists<Cap, Idx>;
+    Lists lists;
+    typename Lists::List in, main, ghost;
+    Idx hand;
+
+    enum { In = 1, Main = 2, Ghost = 3 };
+
+    // share of pages in the FIFO queue, and of ghosts, as in the paper
+    bool in_full() const { return in.size * 4 > size || !main.size; }
+
+    unsigned max_ghosts() const { return size / 2 + 1; }
+
+public:
+    unsigned size;
+
+    TwoQueue() : in(In), main(Main), ghost(Ghost), hand(0), size(0) {}
+
+    TwoQueue(const TwoQueue &) = delete;
+
     void put(Idx idx) {
-        assert(idx < Cap);
-        assert(nodes[idx] == nullptr);
-        Node *ptr = new Node(idx);
-        push(ptr);
-        nodes[idx] = ptr;
+        if (lists.list(idx) == Ghost) {
+            lists.remove(ghost, idx);
+            lists.insert(main, idx, hand);
+        } else
+            lists.push_front(in, idx);
+        ++size;
     }
 
     void get(Idx idx) {
-        assert(idx < Cap);
-        assert(nodes[idx]);
-        remove(nodes[idx]);
-        push(nodes[idx]);
+        if (lists.list(idx) == Main) lists[idx].ref = true;
     }
 
     Idx expire() {
-        return tail->idx;
+        if (in_full()) return in.tail - 1;
+        for (;;) {
+            Idx idx = hand ? hand - 1 : main.head - 1;
+            if (!lists.ref(idx)) {
+                hand = idx + 1;
+                return idx;
+            }
+            lists[idx].ref = false;
+            hand = lists.next(main, idx) + 1;
+        }
     }
 
     void remove(Idx idx) {
-        assert(idx < Cap);
-        assert(nodes[idx]);
-        remove(nodes[idx]);
-        delete nodes[idx];
-        nodes[idx] = nullptr;
-    }
-
-    void debug() {
-        unsigned last_idx;
-        for (auto ptr = head; ptr != nullptr; ptr = ptr->next) {
-            if (ptr->idx == last_idx) {
-                std::clog << "Cycle detected!" << std::endl;
-                return;
-            }
-            std::clog << ptr->idx << " ";
-            last_idx = ptr->idx;
+        bool seen_once = lists.list(idx) == In;
+        drop(idx);
+        if (seen_once) lists.push_front(ghost, idx);
+        while (ghost.size > max_ghosts()) lists.remove(ghost, ghost.tail - 1);
+    }
+
+    // not remembered, a page taking the id next is new and goes through the FIFO queue
+    void drop(Idx idx) {
+        if (lists.list(idx) == In) lists.remove(in, idx);
+        else {
+            if (hand == idx + 1) hand = main.size > 1 ? lists.next(main, idx) + 1 : 0;
+            lists.remove(main, idx);
+        }
+        --size;
+        while (ghost.size > max_ghosts()) lists.remove(ghost, ghost.tail - 1);
+    }
+
+    bool contains(Idx idx) const {
+        unsigned char list = lists.list(idx);
+        return list == In || list == Main;
+    }
+
+    template<typename F>
+    void for_each(F f) const {
+        lists.for_each(in, f);
+        lists.for_each(main, f);
+    }
+
+    // visit the FIFO queue from its tail, then the main queue from the hand, while f returns true
+    template<typename F>
+    void for_each_cold(F f) const {
+        if (lists.for_each_reverse(in, f)) lists.for_each_from(main, hand, f);
+    }
+
+    // visit victims in order while f returns true, f may remove what it visits
+    template<typename F>
+    void expire_while(F f) {
+        for (unsigned n = size * 2; n > 0 && size > 0; n--) {
+            Idx idx = expire();
+            if (!f(idx)) return;
+            if (!contains(idx)) continue;
+            // a page that stays counts as used
+            if (lists.list(idx) == In) {
+                lists.remove(in, idx);
+                lists.push_front(in, idx);
+            } else
+                hand = lists.next(main, idx) + 1;
         }
-        std::clog << std::endl;
     }
 };
 
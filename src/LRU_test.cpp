@@ -28,4 +28,130 @@ TEST_CASE("LRU", "[Persistence]") {
         lru.put(0);
         REQUIRE(lru.expire() == 0);
     }
-}
\ No newline at end of file
+}
+// load pages 0 .. n - 1 with policy R as the page cache would, keeping at most cap in memory
+template<typename R>
+void load_pages(R &r, unsigned from, unsigned to, unsigned cap) {
+    for (unsigned i = from; i < to; i++) {
+        if (r.contains(i)) r.get(i);
+        else
+            r.put(i);
+        while (r.size > cap) r.remove(r.expire());
+    }
+}
+
+TEST_CASE("Replacement", "[Persistence]") {
+    SECTION("clock should spare pages used since the last sweep") {
+        Clock<64> clock;
+        for (unsigned i = 0; i < 4; i++) clock.put(i);
+        clock.get(0);
+        clock.get(2);
+        REQUIRE (clock.expire() == 1);
+        clock.remove(1);
+        REQUIRE (clock.expire() == 3);
+        clock.remove(3);
+        // bits of 0 and 2 were cleared by the sweep
+        REQUIRE (clock.expire() == 0);
+        clock.put(5);
+        clock.remove(0);
+        REQUIRE (clock.expire() == 2);
+        clock.remove(2);
+        REQUIRE (clock.expire() == 5);
+        clock.remove(5);
+        REQUIRE (clock.size == 0);
+    }
+
+    SECTION("2Q should expire pages seen once first") {
+        TwoQueue<64> q;
+        for (unsigned i = 0; i < 4; i++) q.put(i);
+        REQUIRE (q.expire() == 0);
+        q.remove(0);
+        // remembered, so it goes to the main queue
+        q.put(0);
+        for (unsigned i = 4; i < 8; i++) q.put(i);
+        for (unsigned i = 0; i < 6; i++) {
+            REQUIRE (q.expire() != 0);
+            q.remove(q.expire());
+        }
+        REQUIRE (q.contains(0));
+        REQUIRE (q.size == 2);
+    }
+
+    SECTION("2Q should not remember pages freed when their ids are reused") {
+        TwoQueue<64> q;
+        for (unsigned i = 0; i < 4; i++) q.put(i);
+        q.drop(0);
+        // a new page with the id of page 0 freed
+        q.put(0);
+        for (unsigned i = 4; i < 8; i++) q.put(i);
+        for (unsigned i = 1; i < 4; i++) {
+            REQUIRE (q.expire() == i);
+            q.remove(i);
+        }
+        // from the FIFO queue, like any page seen once
+        REQUIRE (q.expire() == 0);
+        q.remove(0);
+        q.put(0);
+        REQUIRE (q.expire() != 0);
+    }
+
+    SECTION("2Q should keep hot pages through a scan") {
+        TwoQueue<4096> q;
+        LRU<4096> lru;
+        // hot pages 0 .. 7 are used many times, then pages 100 .. 2099 once each
+        for (int round = 0; round < 4; round++) {
+            load_pages(q, 0, 8, 16);
+            load_pages(q, 100 + round * 8, 108 + round * 8, 16);
+            load_pages(lru, 0, 8, 16);
+        }
+        load_pages(q, 100, 2100, 16);
+        load_pages(lru, 100, 2100, 16);
+        unsigned kept = 0;
+        for (unsigned i = 0; i < 8; i++) {
+            if (q.contains(i)) ++kept;
+            REQUIRE (!lru.contains(i));
+        }
+        REQUIRE (kept == 8);
+    }
+
+    SECTION("should stop after two sweeps when no page is expired") {
+        Clock<64> clock;
+        TwoQueue<64> q;
+        for (unsigned i = 0; i < 8; i++) {
+            clock.put(i);
+            q.put(i);
+        }
+        unsigned n = 0;
+        clock.expire_while([&](unsigned) { return ++n < 100; });
+        REQUIRE (n == 16);
+        REQUIRE (clock.size == 8);
+        n = 0;
+        q.expire_while([&](unsigned) { return ++n < 100; });
+        REQUIRE (n == 16);
+        REQUIRE (q.size == 8);
+    }
+
+    SECTION("should visit pages coldest first without touching them") {
+        LRU<64> lru;
+        Clock<64> clock;
+        for (unsigned i = 0; i < 4; i++) {
+            lru.put(i);
+            clock.put(i);
+        }
+        lru.get(0);
+        unsigned order[4], n = 0;
+        lru.for_each_cold([&](unsigned idx) { return (order[n++] = idx) != 3; });
+        REQUIRE (n == 3);
+        REQUIRE (order[0] == 1);
+        REQUIRE (order[1] == 2);
+        REQUIRE (lru.expire() == 1);
+        clock.get(0);
+        REQUIRE (clock.expire() == 1);
+        n = 0;
+        clock.for_each_cold([&](unsigned idx) { return (order[n++] = idx), true; });
+        REQUIRE (n == 4);
+        REQUIRE (order[0] == 1);
+        REQUIRE (order[3] == 0);
+        REQUIRE (clock.expire() == 1);
+    }
+}
@@ -0,0 +1,137 @@
+//
+// Created by Alex Chi on 2019-06-12.
+//
+
+#ifndef BPLUSTREE_MMAPSTORE_HPP
+#define BPLUSTREE_MMAPSTORE_HPP
+
+#include <cassert>
+#include <cerrno>
+#include <iostream>
+#include <istream>
+#include <ostream>
+#include <streambuf>
+#include <system_error>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * Page store backed by a shared memory mapping of the data file.
+ * Streams handed out read and write the mapping directly, so loading a page
+ * costs a page fault instead of a seek and a read syscall.
+ * The mapping grows by doubling, and the file is truncated to its used length on close.
+ * Failing to open, grow, map or sync the data file throws std::system_error.
+ */
+class MmapStore {
+    struct Buffer : public std::streambuf {
+        void view_get(char *begin, char *end) { setg(begin, begin, end); }
+
+        void view_put(char *begin, char *end) { setp(begin, end); }
+    } buf;
+
+    std::istream in;
+    std::ostream out;
+
+    int fd;
+    char *base;
+    size_t capacity;
+
+    static void raise(int error, const char *what) {
+        throw std::system_error(error, std::generic_category(), what);
+    }
+
+    // the old mapping stays in place until the new one is there
+    void map(size_t cap) {
+        if (ftruncate(fd, cap) != 0) raise(errno, "failed to grow data file");
+        void *p = mmap(nullptr, cap, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED) raise(errno, "failed to map data file");
+        if (base) munmap(base, capacity);
+        base = reinterpret_cast<char *>(p);
+        capacity = cap;
+    }
+
+public:
+    static constexpr size_t Initial_Size() { return 1024 * 1024; }
+
+    size_t length;
+
+    MmapStore() : in(&buf), out(&buf), fd(-1), base(nullptr), capacity(0), length(0) {}
+
+    MmapStore(const MmapStore &) = delete;
+
+    ~MmapStore() {
+        try {
+            close();
+        } catch (const std::system_error &e) {
+            std::clog << "[Warning] " << e.what() << std::endl;
+        }
+    }
+
+    // returns true if an existing data file is opened
+    bool open(const char *path) {
+        fd = ::open(path, O_RDWR | O_CREAT, 0644);
+        if (fd < 0) raise(errno, "failed to open data file");
+        struct stat st;
+        if (fstat(fd, &st) != 0) raise(errno, "failed to open data file");
+        length = st.st_size;
+        map(length > Initial_Size() ? length : Initial_Size());
+        return length > 0;
+    }
+
+    // throws if the data file could not be synced or truncated, it is closed anyway
+    void close() {
+        if (fd < 0) return;
+        int error = msync(base, capacity, MS_SYNC) == 0 ? 0 : errno;
+        munmap(base, capacity);
+        if (ftruncate(fd, length) != 0 && !error) error = errno;
+        ::close(fd);
+        fd = -1;
+        base = nullptr;
+        capacity = 0;
+        if (error) raise(error, "failed to close data file");
+    }
+
+    // make everything written so far durable, throws if some of it is not
+    void sync() {
+        if (msync(base, capacity, MS_SYNC) != 0) raise(errno, "failed to sync data file");
+        int result;
+        while ((result = fsync(fd)) != 0 && errno == EINTR);
+        if (result != 0) raise(errno, "failed to sync data file");
+    }
+
+    void reserve(size_t end) {
+        if (end > length) length = end;
+        if (end <= capacity) return;
+        size_t cap = capacity;
+        while (cap < end) cap *= 2;
+        map(cap);
+    }
+
+    // fault a range in ahead of reading it
+    void prefetch(size_t offset, size_t size) {
+        size_t begin = offset & ~(size_t) 0xfff;
+        if (offset + size > capacity) return;
+        madvise(base + begin, offset + size - begin, MADV_WILLNEED);
+    }
+
+    // faults are taken on prefetch already
+    void submit() {}
+
+    std::istream &reader(size_t offset, size_t) {
+        assert(offset <= capacity);
+        buf.view_get(base + offset, base + capacity);
+        in.clear();
+        return in;
+    }
+
+    std::ostream &writer(size_t offset, size_t size) {
+        reserve(offset + size);
+        buf.view_put(base + offset, base + offset + size);
+        out.clear();
+        return out;
+    }
+};
+
+#endif //BPLUSTREE_MMAPSTORE_HPP
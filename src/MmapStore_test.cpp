@@ -0,0 +1,113 @@
+//
+// Created by Alex Chi on 2019-06-12.
+//
+
+#include <catch.hpp>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "BTree.hpp"
+#include "MmapStore.hpp"
+
+using MmapMap = BTree<int, long long, 512, 32, Default_Max_Pages(), MmapStore>;
+using FileMap = BTree<int, long long, 512, 32, Default_Max_Pages(), FileStore>;
+
+TEST_CASE("MmapStore", "[Persistence]") {
+    SECTION("should read what is written") {
+        remove("mmap.test");
+        {
+            MmapStore store;
+            REQUIRE (!store.open("mmap.test"));
+            for (int i = 0; i < 1024; i++) {
+                long long offset = (long long) i * 4096;
+                store.writer(offset, sizeof(offset)).write(reinterpret_cast<char *>(&offset), sizeof(offset));
+            }
+            REQUIRE (store.length == 1023 * 4096 + sizeof(long long));
+        }
+        {
+            MmapStore store;
+            REQUIRE (store.open("mmap.test"));
+            for (int i = 0; i < 1024; i++) {
+                long long offset;
+                REQUIRE (store.reader(i * 4096, sizeof(offset)).read(reinterpret_cast<char *>(&offset), sizeof(offset)));
+                REQUIRE (offset == (long long) i * 4096);
+            }
+        }
+        remove("mmap.test");
+    }
+
+    SECTION("should throw if the data file cannot grow") {
+        remove("mmap.test");
+        pid_t pid = fork();
+        if (pid == 0) {
+            // growing past the limit fails with EFBIG
+            signal(SIGXFSZ, SIG_IGN);
+            rlimit limit{4096, 4096};
+            setrlimit(RLIMIT_FSIZE, &limit);
+            MmapStore store;
+            try {
+                store.open("mmap.test");
+            } catch (const std::system_error &e) {
+                _exit(e.code().value() == EFBIG ? 0 : 2);
+            }
+            _exit(1);
+        }
+        int status;
+        waitpid(pid, &status, 0);
+        REQUIRE (WIFEXITED(status));
+        REQUIRE (WEXITSTATUS(status) == 0);
+        remove("mmap.test");
+    }
+
+    SECTION("should persist data") {
+        const int test_size = 100000;
+        remove("persist_mmap.db");
+        {
+            MmapMap m("persist_mmap.db");
+            for (int i = 0; i < test_size; i++) m.insert(i, i);
+            REQUIRE (m.storage->stat.swap_out > 0);
+        }
+        {
+            MmapMap m("persist_mmap.db");
+            REQUIRE (m.size() == test_size);
+            for (int i = 0; i < test_size; i++) {
+                REQUIRE (*m.query(i) == i);
+                if (i % 2) m.remove(i);
+            }
+        }
+        {
+            MmapMap m("persist_mmap.db");
+            for (int i = 0; i < test_size; i++) {
+                if (i % 2) REQUIRE (m.query(i) == nullptr);
+                else
+                    REQUIRE (*m.query(i) == i);
+            }
+        }
+        remove("persist_mmap.db");
+    }
+
+    SECTION("should share file format with fstream store") {
+        const int test_size = 100000;
+        remove("persist_mmap.db");
+        {
+            FileMap m("persist_mmap.db");
+            for (int i = 0; i < test_size; i++) m.insert(i, i);
+        }
+        {
+            MmapMap m("persist_mmap.db");
+            for (int i = 0; i < test_size; i++) {
+                REQUIRE (*m.query(i) == i);
+                m.insert(i + test_size, i + test_size);
+            }
+        }
+        {
+            FileMap m("persist_mmap.db");
+            REQUIRE (m.size() == test_size * 2);
+            for (int i = 0; i < test_size * 2; i++) REQUIRE (*m.query(i) == i);
+        }
+        remove("persist_mmap.db");
+    }
+}
@@ -0,0 +1,128 @@
+//
+// Created by Alex Chi on 2019-06-16.
+//
+
+#ifndef BPLUSTREE_MULTITHREAD_HPP
+#define BPLUSTREE_MULTITHREAD_HPP
+
+#include <atomic>
+#include <cassert>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * Synchronization policy for trees shared by threads.
+ * Every Block carries a reader/writer latch, and the buffer pool is guarded by a mutex.
+ * See SingleThread for the default.
+ */
+struct MultiThread {
+    using Latch = std::shared_mutex;
+    using Mutex = std::mutex;
+
+    static constexpr bool enabled() { return true; }
+
+    static void pause() { std::this_thread::yield(); }
+
+    // odd while a writer holds the block, see BTree::query_optimistic
+    class Version {
+        std::atomic<unsigned long long> value;
+
+    public:
+        Version() : value(0) {}
+
+        unsigned long long load() const { return value.load(std::memory_order_acquire); }
+
+        // true if nothing was written since load returned v
+        bool validate(unsigned long long v) const {
+            std::atomic_thread_fence(std::memory_order_acquire);
+            return value.load(std::memory_order_relaxed) == v;
+        }
+
+        void bump() { value.fetch_add(1, std::memory_order_acq_rel); }
+    };
+
+    /*
+     * Epoch based reclamation. Readers holding a Guard may use objects without a latch,
+     * so retired objects are deleted only after every reader that could have seen them
+     * has left. Readers count themselves in a per-thread slot under the parity of the
+     * global epoch, and the epoch advances only once readers of the previous one are gone.
+     * Calls to retire and collect are serialized by the caller.
+     */
+    template<typename T>
+    class Reclaimer {
+        static constexpr unsigned Slots = 64;
+
+        struct alignas(64) Slot {
+            std::atomic<unsigned> readers[2];
+
+            Slot() : readers{{0}, {0}} {}
+        };
+
+        Slot slots[Slots];
+        std::atomic<unsigned long long> epoch;
+        // retired under an epoch of each parity
+        std::vector<T *> retired[2];
+
+        static unsigned thread_slot() {
+            static std::atomic<unsigned> threads(0);
+            thread_local unsigned slot = threads++ % Slots;
+            return slot;
+        }
+
+    public:
+        class Guard {
+            std::atomic<unsigned> *readers;
+
+        public:
+            explicit Guard(Reclaimer &r) {
+                Slot &slot = r.slots[thread_slot()];
+                for (;;) {
+                    unsigned long long e = r.epoch.load();
+                    readers = &slot.readers[e & 1];
+                    readers->fetch_add(1);
+                    if (r.epoch.load() == e) break;
+                    readers->fetch_sub(1);
+                }
+            }
+
+            Guard(const Guard &) = delete;
+
+            ~Guard() { readers->fetch_sub(1, std::memory_order_release); }
+        };
+
+        Reclaimer() : epoch(0) {}
+
+        Reclaimer(const Reclaimer &) = delete;
+
+        ~Reclaimer() { assert(retired[0].empty() && retired[1].empty()); }
+
+        // object is no longer reachable by readers entering from now on
+        void retire(T *object) { retired[epoch.load() & 1].push_back(object); }
+
+        // free(object) for every object retired, once no reader is left
+        template<typename F>
+        void clear(F free) {
+            for (auto &objects : retired) {
+                for (T *object : objects) free(object);
+                objects.clear();
+            }
+        }
+
+        // free(object) for objects no reader may hold any more
+        template<typename F>
+        void collect(F free) {
+            if (retired[0].empty() && retired[1].empty()) return;
+            unsigned long long e = epoch.load();
+            unsigned previous = (e + 1) & 1;
+            for (Slot &slot : slots)
+                if (slot.readers[previous].load()) return;
+            for (T *object : retired[previous]) free(object);
+            retired[previous].clear();
+            epoch.store(e + 1);
+        }
+    };
+};
+
+#endif //BPLUSTREE_MULTITHREAD_HPP
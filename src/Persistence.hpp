@@ -5,10 +5,17 @@
 #ifndef BPLUSTREE_PERSISTENCE_HPP
 #define BPLUSTREE_PERSISTENCE_HPP
 
+#include <algorithm>
 #include <fstream>
 #include <iostream>
+#include <cerrno>
 #include <cstring>
+#include <cstddef>
+#include <system_error>
 #ifndef ONLINE_JUDGE
+#include <fcntl.h>
+#include <unistd.h>
+#include "SparseArray.hpp"
 #include "LRU.hpp"
 #endif
 
@@ -23,12 +30,283 @@ public:
     static constexpr bool is_serializable() { return true; }
 };
 
-template<typename Block, typename Index, typename Leaf, unsigned MAX_PAGES = 1048576, unsigned MAX_IN_MEMORY = 65536>
+/*
+ * Page store backed by std::fstream, every page access seeks on the data file.
+ * A store opens the data file and hands out streams positioned at a given offset.
+ * A stream failing a write stays failed, and sync throws std::system_error for it.
+ */
+struct FileStore {
+    std::fstream f;
+
+    // returns true if an existing data file is opened
+    bool open(const char *path) {
+        f.open(path, std::ios::in | std::ios::out | std::ios::ate | std::ios::binary);
+        bool exists = bool(f);
+        if (!exists) f.open(path, std::ios::in | std::ios::out | std::ios::trunc | std::ios::binary);
+#ifndef ONLINE_JUDGE
+        // for hints and syncs fstream has no way to pass on, fsync on any descriptor of the file flushes it
+        fd = ::open(path, O_RDONLY);
+#endif
+        return exists;
+    }
+
+    void close() {
+        f.close();
+#ifndef ONLINE_JUDGE
+        if (fd >= 0) ::close(fd);
+        fd = -1;
+#endif
+    }
+
+    // start reading a range in the background, a hint only
+    void prefetch(size_t offset, size_t size) {
+#ifndef ONLINE_JUDGE
+        if (fd >= 0) posix_fadvise(fd, offset, size, POSIX_FADV_WILLNEED);
+#endif
+    }
+
+    // reads start right away on prefetch
+    void submit() {}
+
+    std::istream &reader(size_t offset, size_t) {
+        f.seekg(offset, f.beg);
+        return f;
+    }
+
+    std::ostream &writer(size_t offset, size_t) {
+        f.seekp(offset, f.beg);
+        return f;
+    }
+
+    // make everything written so far durable, throws if some of it is not
+    void sync() {
+        if (!f.flush()) {
+            f.clear();
+            throw std::system_error(EIO, std::generic_category(), "failed to write data file");
+        }
+#ifndef ONLINE_JUDGE
+        int result;
+        while ((result = fsync(fd)) != 0 && errno == EINTR);
+        if (result != 0) throw std::system_error(errno, std::generic_category(), "failed to sync data file");
+#endif
+    }
+
+    int fd;
+
+    FileStore() : fd(-1) {}
+};
+
+// growable array for bookkeeping that should not scale with MAX_PAGES
+template<typename T>
+class Stack {
+    T *x;
+    unsigned capacity;
+public:
+    unsigned size;
+
+    Stack() : x(nullptr), capacity(0), size(0) {}
+
+    Stack(const Stack &) = delete;
+
+    ~Stack() { delete[] x; }
+
+    void push(const T &d) {
+        if (size == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            T *_x = new T[capacity];
+            for (unsigned i = 0; i < size; i++) _x[i] = x[i];
+            delete[] x;
+            x = _x;
+        }
+        x[size++] = d;
+    }
+
+    T &operator[](unsigned i) {
+        assert(i < size);
+        return x[i];
+    }
+
+    // remove without keeping order
+    T remove(unsigned i) {
+        assert(i < size);
+        T d = x[i];
+        x[i] = x[--size];
+        return d;
+    }
+
+    void clear() { size = 0; }
+};
+
+/*
+ * Chunks of Size bytes carved out of slabs of Per_Slab chunks. A freed chunk goes on a free
+ * list and is handed out again, and slabs go back to the allocator only with the slab
+ * itself, so that objects coming and going all the time don't fragment the heap.
+ */
+template<unsigned Size, unsigned Align, unsigned Per_Slab = 16>
+class Slab {
+    union Chunk {
+        Chunk *next;
+        alignas(Align) char data[Size];
+    };
+
+    Chunk *free_list;
+    Stack<Chunk *> slabs;
+public:
+    Slab() : free_list(nullptr) {}
+
+    Slab(const Slab &) = delete;
+
+    ~Slab() {
+        for (unsigned i = 0; i < slabs.size; i++) delete[] slabs[i];
+    }
+
+    void *allocate() {
+        if (!free_list) {
+            Chunk *slab = new Chunk[Per_Slab];
+            for (unsigned i = 0; i < Per_Slab; i++) slab[i].next = i + 1 < Per_Slab ? &slab[i + 1] : nullptr;
+            free_list = slab;
+            slabs.push(slab);
+        }
+        Chunk *chunk = free_list;
+        free_list = chunk->next;
+        return chunk;
+    }
+
+    void deallocate(void *x) {
+        Chunk *chunk = static_cast<Chunk *>(x);
+        chunk->next = free_list;
+        free_list = chunk;
+    }
+
+    // chunks taken from the allocator
+    unsigned capacity() const { return slabs.size * Per_Slab; }
+};
+
+/*
+ * Synchronization policy for trees used by one thread at a time: latches and locks do nothing.
+ * See MultiThread for concurrent use.
+ */
+struct SingleThread {
+    struct Latch {
+        void lock() {}
+
+        bool try_lock() { return true; }
+
+        void unlock() {}
+
+        void lock_shared() {}
+
+        void unlock_shared() {}
+    };
+
+    using Mutex = Latch;
+
+    static constexpr bool enabled() { return false; }
+
+    // back off before restarting an operation that lost a race
+    static void pause() {}
+
+    struct Version {
+        unsigned long long load() const { return 0; }
+
+        bool validate(unsigned long long) const { return true; }
+
+        void bump() {}
+    };
+
+    // no reader outlives an operation, but the operation itself may still hold what it retires
+    template<typename T>
+    struct Reclaimer {
+        Stack<T *> retired;
+
+        struct Guard {
+            explicit Guard(Reclaimer &) {}
+        };
+
+        void retire(T *object) { retired.push(object); }
+
+        // free(object) for objects retired so far
+        template<typename F>
+        void collect(F free) {
+            for (unsigned i = 0; i < retired.size; i++) free(retired[i]);
+            retired.clear();
+        }
+
+        template<typename F>
+        void clear(F free) { collect(free); }
+    };
+};
+
+/*
+ * A page pinned for as long as the reference lives, so that it is not evicted under its
+ * holder. Moving a reference hands the pin over. A page merged away, whose idx is reset,
+ * has no pin left to release.
+ */
+template<typename Pool, typename Block>
+class PageRef {
+    Pool *pool;
+    Block *block;
+
+public:
+    PageRef() : pool(nullptr), block(nullptr) {}
+
+    PageRef(Pool *pool, Block *block) : pool(pool), block(block) {}
+
+    PageRef(const PageRef &) = delete;
+
+    PageRef(PageRef &&that) : pool(that.pool), block(that.block) { that.block = nullptr; }
+
+    PageRef &operator=(PageRef &&that) {
+        if (this != &that) {
+            release();
+            pool = that.pool;
+            block = that.block;
+            that.block = nullptr;
+        }
+        return *this;
+    }
+
+    ~PageRef() { release(); }
+
+    void release() {
+        if (block && block->idx) pool->unpin(block->idx);
+        block = nullptr;
+    }
+
+    Block *get() const { return block; }
+
+    Block *operator->() const { return block; }
+
+    explicit operator bool() const { return block != nullptr; }
+};
+
+template<typename Block, typename Index, typename Leaf,
+        unsigned MAX_PAGES = 1048576, unsigned MAX_IN_MEMORY = 65536,
+        typename Store = FileStore, typename Sync = SingleThread,
+        template<unsigned, typename> class Replacer = TwoQueue>
 struct Persistence {
     const char *path;
-    std::fstream f;
+    Store store;
+
+    static const unsigned VERSION = 10;
+
+    struct Page {
+        size_t offset;
+        size_t size;
+        unsigned char is_leaf;
+    };
 
-    static const unsigned VERSION = 6;
+    /*
+     * The page table is a two-level radix tree. Entries of pages are kept in table chunks
+     * of TABLE_CHUNK pages, offsets of table chunks in directory pages of TABLE_CHUNK
+     * chunks, and offsets of directory pages in the header. Chunks and directory pages
+     * are allocated on first write and saved as pages of the data file.
+     */
+    static constexpr unsigned TABLE_CHUNK = 512;
+    using Table = SparseArray<Page, MAX_PAGES, TABLE_CHUNK>;
+    using Directory = SparseArray<size_t, Table::Chunks, TABLE_CHUNK>;
+    static constexpr size_t Chunk_Size() { return sizeof(Page) * TABLE_CHUNK; }
+    static constexpr size_t Directory_Page_Size() { return sizeof(size_t) * TABLE_CHUNK; }
 
     struct PersistenceIndex {
         unsigned root_idx;
@@ -36,9 +314,9 @@ struct Persistence {
         unsigned version;
         unsigned size;
         size_t tail_pos;
-        size_t page_offset[MAX_PAGES];
-        size_t page_size[MAX_PAGES];
-        unsigned char is_leaf[MAX_PAGES];
+        // last log record covered by this index
+        unsigned long long lsn;
+        size_t directory_offset[Directory::Chunks];
 
         static unsigned constexpr MAGIC_KEY() {
             return sizeof(Index) * 233
@@ -49,15 +327,109 @@ struct Persistence {
         PersistenceIndex() : root_idx(0), magic_key(MAGIC_KEY()),
                              version(VERSION),
                              tail_pos(sizeof(PersistenceIndex)),
-                             size(0) {
-            memset(page_offset, 0, sizeof(page_offset));
-            memset(is_leaf, 0, sizeof(is_leaf));
+                             size(0), lsn(0) {
+            memset(directory_offset, 0, sizeof(directory_offset));
         }
     } *persistence_index;
 
-    Block **pages;
-    bool *dirty;
+    Table table;
+    Directory directory;
+
+    SparseArray<Block *, MAX_PAGES> pages;
+    SparseArray<bool, MAX_PAGES> dirty;
+    // pages in memory marked dirty
+    unsigned dirty_pages;
     unsigned lst_empty_slot;
+    // slots from here on are empty, see park_extents
+    unsigned slot_end;
+
+    /*
+     * With concurrent operations, pages, the page table and the LRU are guarded by pool_lock,
+     * and a page is kept in memory while it is pinned by an operation holding it.
+     * Calls on the store are serialized by io_lock, which is never held together with
+     * pool_lock, so that threads finding their pages in memory do not wait for the disk.
+     * A page being read in or written out meanwhile is marked moving, and pinning it waits.
+     */
+    struct Guard {
+        typename Sync::Mutex &mutex;
+
+        explicit Guard(typename Sync::Mutex &mutex) : mutex(mutex) { mutex.lock(); }
+
+        ~Guard() { mutex.unlock(); }
+    };
+
+    typename Sync::Mutex pool_lock, io_lock;
+    SparseArray<unsigned, MAX_PAGES> pins;
+    SparseArray<bool, MAX_PAGES> moving;
+    // pages evicted dirty, written by write_out once pool_lock is released
+    Stack<Block *> outgoing;
+
+    // frames blocks live in, recycled as pages are loaded and evicted
+    Slab<std::max(sizeof(Leaf), sizeof(Index)), std::max(alignof(Leaf), alignof(Index))> frames;
+
+    // pages evicted or merged away are freed once no optimistic reader may hold them
+    using Reclaimer = typename Sync::template Reclaimer<Block>;
+    Reclaimer reclaimer;
+    // bumped before keys move to a page on the left or a page is freed, see BTree::query_optimistic
+    typename Sync::Version shift_version;
+
+    // errno of the first write that failed, checkpoints throw from then on
+    int write_error;
+    bool closed, saved;
+
+    // table chunks and directory pages modified since the last save
+    Stack<unsigned> dirty_chunks;
+    SparseArray<bool, Table::Chunks> chunk_dirty;
+    bool directory_dirty[Directory::Chunks];
+
+    void set_page(unsigned page_id, size_t offset, size_t size, unsigned char is_leaf) {
+        table.ref(page_id) = Page{offset, size, is_leaf};
+        if (offset && page_id >= slot_end) slot_end = page_id + 1;
+        unsigned chunk = page_id / TABLE_CHUNK;
+        if (!chunk_dirty.get(chunk)) {
+            chunk_dirty.ref(chunk) = true;
+            dirty_chunks.push(chunk);
+        }
+    }
+
+    void set_chunk_offset(unsigned chunk, size_t offset) {
+        directory.ref(chunk) = offset;
+        directory_dirty[chunk / TABLE_CHUNK] = true;
+    }
+
+    /*
+     * Shadow paging: pages referenced by the index on disk are never overwritten.
+     * The first write of such a page after a save goes to a new extent, and extents
+     * freed since the last save are only reused after the next one. Hence the data
+     * file always holds a consistent tree as of the last save, which a log replays onto.
+     * Table chunks and directory pages are shadowed the same way.
+     */
+    bool shadow;
+    // page image on disk is referenced by the index on disk
+    SparseArray<bool, MAX_PAGES> stable;
+    SparseArray<bool, Table::Chunks> chunk_stable;
+    bool directory_stable[Directory::Chunks];
+
+    struct Extent {
+        size_t offset, size;
+    };
+    // extents referenced on disk but no longer in memory, and extents free to use
+    Stack<Extent> retired, released;
+    // pages written to new extents since the last save
+    Stack<unsigned> unstable;
+    // slots holding free extents in the index on disk
+    Stack<unsigned> parked;
+
+    // take a free extent of at least size, looking only at the most recent ones
+    bool take_extent(size_t size, size_t &offset) {
+        for (unsigned i = released.size; i > 0 && i + 8 > released.size; i--) {
+            if (released[i - 1].size >= size) {
+                offset = released.remove(i - 1).offset;
+                return true;
+            }
+        }
+        return false;
+    }
 
     struct Stat {
         long long create;
@@ -66,6 +438,11 @@ struct Persistence {
         long long access_cache_miss;
         long long dirty_write;
         long long swap_out;
+        long long checkpoint;
+        long long checkpoint_write;
+        long long table_write;
+        long long prefetch;
+        long long write_back;
 
         void stat() {
             printf("    access hit/total %lld/%lld %.5f%%\n",
@@ -76,165 +453,618 @@ struct Persistence {
             printf("    swap_in/out/dirty %lld %lld %lld %.5f%%\n",
                    access_cache_miss, swap_out, dirty_write,
                    double(dirty_write) / (swap_out) * 100);
+            printf("    checkpoint pages/chunks %lld %lld %lld\n", checkpoint, checkpoint_write, table_write);
+            printf("    prefetch %lld\n", prefetch);
+            printf("    written back ahead of eviction %lld\n", write_back);
         }
 
         Stat() : create(0), destroy(0),
-                 access_cache_hit(1), access_cache_miss(0), dirty_write(0), swap_out(0) {}
+                 access_cache_hit(1), access_cache_miss(0), dirty_write(0), swap_out(0),
+                 checkpoint(0), checkpoint_write(0), table_write(0), prefetch(0), write_back(0) {}
     } stat;
 
-    using BLRU = LRU<MAX_PAGES>;
+    // pages in memory, in the order they are expired by the replacement policy
+    using BLRU = Replacer<MAX_PAGES, unsigned>;
     BLRU lru;
 
-    Persistence(const char *path = nullptr) : path(path), lst_empty_slot(16) {
+    Persistence(const char *path = nullptr, bool shadow = false) :
+            path(path), dirty_pages(0), lst_empty_slot(16), slot_end(16), write_error(0), closed(false), saved(true),
+            shadow(shadow) {
         assert(Index::is_serializable());
         assert(Leaf::is_serializable());
         persistence_index = new PersistenceIndex;
-        pages = new Block *[MAX_PAGES];
-        dirty = new bool[MAX_PAGES];
-        memset(pages, 0, sizeof(Block *) * MAX_PAGES);
-        memset(dirty, 0, sizeof(bool) * MAX_PAGES);
-        if (path) {
-            f.open(path, std::ios::in | std::ios::out | std::ios::ate | std::ios::binary);
-            if (f)
-                restore();
-            else
-                f.open(path, std::ios::in | std::ios::out | std::ios::trunc | std::ios::binary);
+        memset(directory_dirty, 0, sizeof(directory_dirty));
+        memset(directory_stable, 0, sizeof(directory_stable));
+        try {
+            if (path && store.open(path)) restore();
+        } catch (...) {
+            delete persistence_index;
+            throw;
         }
     }
 
     ~Persistence() {
-        save();
-        f.close();
-        delete[] dirty;
-        delete[] pages;
+        close();
+        reclaimer.clear([this](Block *page) { free_page(page); });
         delete persistence_index;
     }
 
+    /*
+     * Save and close the data file, returns false if that failed, in which case a log up to
+     * the lsn of the header is still needed. Pages are left in memory then.
+     */
+    bool close() {
+        if (closed) return saved;
+        closed = true;
+        try {
+            save();
+            store.close();
+        } catch (const std::system_error &e) {
+            std::clog << "[Warning] failed to save " << path << ": " << e.what() << std::endl;
+            saved = false;
+        }
+        return saved;
+    }
+
+    static constexpr size_t Header_Size() { return sizeof(PersistenceIndex); }
+
+    // read the header and the parts of the page table in use
     void restore() {
         if (!path) return;
-        f.seekg(0, f.beg);
-        if (!f.read(reinterpret_cast<char *>(persistence_index), sizeof(PersistenceIndex))) {
-            std::clog << "[Warning] failed to restore from " << path << " " << f.gcount() << std::endl;
-            f.clear();
+        std::istream &in = store.reader(0, Header_Size());
+        if (!in.read(reinterpret_cast<char *>(persistence_index), Header_Size())) {
+            std::clog << "[Warning] failed to restore from " << path << " " << in.gcount() << std::endl;
+            in.clear();
+        }
+        if (persistence_index->version == 0 && persistence_index->magic_key == 0) {
+            // index was never saved, e.g. crashed before the first save
+            new(persistence_index) PersistenceIndex;
         }
         assert(persistence_index->version == VERSION);
         assert(persistence_index->magic_key == PersistenceIndex::MAGIC_KEY());
+        for (unsigned d = 0; d < Directory::Chunks; d++) {
+            if (!persistence_index->directory_offset[d]) continue;
+            store.reader(persistence_index->directory_offset[d], Directory_Page_Size())
+                    .read(reinterpret_cast<char *>(directory.chunk(d)), Directory_Page_Size());
+            directory_stable[d] = shadow;
+        }
+        unsigned chunks = directory.chunk_end() * TABLE_CHUNK;
+        if (chunks > Table::Chunks) chunks = Table::Chunks;
+        for (unsigned chunk = 0; chunk < chunks; chunk++) {
+            size_t offset = directory.get(chunk);
+            if (!offset) continue;
+            Page *entries = table.chunk(chunk);
+            store.reader(offset, Chunk_Size()).read(reinterpret_cast<char *>(entries), Chunk_Size());
+            if (!shadow) continue;
+            chunk_stable.ref(chunk) = true;
+            for (unsigned i = 0; i < TABLE_CHUNK; i++) {
+                unsigned page_id = chunk * TABLE_CHUNK + i;
+                if (entries[i].offset != 0) slot_end = std::max(slot_end, page_id + 1);
+                if (entries[i].is_leaf == 2 && entries[i].offset != 0) parked.push(page_id);
+                else if (entries[i].offset != 0) stable.ref(page_id) = true;
+            }
+        }
+        if (shadow) unpark_extents();
+    }
+
+    // move a page referenced by the index on disk to a new extent before overwriting it
+    void relocate(unsigned page_id) {
+        Page page = table.get(page_id);
+        size_t offset;
+        retired.push(Extent{page.offset, page.size});
+        allocate_extent(offset, page.size);
+        set_page(page_id, offset, page.size, page.is_leaf);
+        stable.ref(page_id) = false;
+        unstable.push(page_id);
+    }
+
+    // mark a dirty page clean, returning where it is to be written by put_page
+    Page clean_page(unsigned page_id) {
+        if (shadow && stable.get(page_id)) relocate(page_id);
+        dirty.ref(page_id) = false;
+        --dirty_pages;
+        return table.get(page_id);
+    }
+
+    void put_page(const Block *page, const Page &entry) {
+        // a store queueing writes may fail to hand earlier ones over
+        try {
+            std::ostream &out = store.writer(entry.offset, entry.size);
+            page->serialize(out);
+            check_write(out);
+        } catch (const std::system_error &e) {
+            fail(e.code().value());
+        }
+    }
+
+    void write_page(unsigned page_id) {
+        Page entry = clean_page(page_id);
+        put_page(pages.get(page_id), entry);
     }
 
     void offload_page(unsigned page_id) {
         if (!path) return;
-        Block *page = pages[page_id];
 
-        if (dirty[page_id]) {
-            auto offset = persistence_index->page_offset[page_id];
-            f.seekp(offset, f.beg);
-            page->serialize(f);
+        if (dirty.get(page_id)) {
+            write_page(page_id);
             ++stat.dirty_write;
         }
 
-        delete pages[page_id];
-        pages[page_id] = nullptr;
+        Block *page = pages.get(page_id);
+        pages.store(page_id, nullptr);
+        reclaimer.retire(page);
 
         lru.remove(page_id);
     }
 
-    bool is_loaded(unsigned page_id) { return pages[page_id] != nullptr; }
+    bool is_loaded(unsigned page_id) { return pages.get(page_id) != nullptr; }
 
-    Block *load_page(unsigned page_id) {
-        if (pages[page_id]) {
-            ++stat.access_cache_hit;
-            lru.get(page_id);
-            return pages[page_id];
+    // read a page marked moving into a frame, and put it in memory pinned
+    void load_page(unsigned page_id, Block *page, const Page &entry) {
+        try {
+            Guard guard(io_lock);
+            page->deserialize(store.reader(entry.offset, entry.size));
+        } catch (...) {
+            Guard guard(pool_lock);
+            moving.ref(page_id) = false;
+            free_page(page);
+            throw;
         }
-        if (!path) return nullptr;
-        ++stat.access_cache_miss;
-        Block *page;
-        if (!persistence_index->page_offset[page_id]) return nullptr;
-        if (persistence_index->is_leaf[page_id] == 1)
-            page = new Leaf;
-        else if (persistence_index->is_leaf[page_id] == 0)
-            page = new Index;
-        else
-            assert(false);
-        f.seekg(persistence_index->page_offset[page_id], f.beg);
-        page->deserialize(f);
-        pages[page_id] = page;
+        Guard guard(pool_lock);
+        moving.ref(page_id) = false;
+        pages.store(page_id, page);
         page->storage = this;
         page->idx = page_id;
         lru.put(page_id);
-        return page;
+        ++pins.ref(page_id);
+    }
+
+    // write pages evicted dirty, by whoever evicted them or waits for one of them
+    void write_out() {
+        for (;;) {
+            Block *page;
+            Page entry;
+            {
+                Guard guard(pool_lock);
+                if (!outgoing.size) return;
+                page = outgoing.remove(outgoing.size - 1);
+                entry = clean_page(page->idx);
+                ++stat.dirty_write;
+            }
+            {
+                Guard guard(io_lock);
+                put_page(page, entry);
+            }
+            Guard guard(pool_lock);
+            moving.ref(page->idx) = false;
+            reclaimer.retire(page);
+        }
     }
 
+    /*
+     * Write dirty pages in memory and modified parts of the page table, keeping pages loaded.
+     * Cost is proportional to what changed since the last checkpoint, not to MAX_PAGES.
+     * Everything is on disk once it returns, and a log up to the lsn of the header may be
+     * dropped. Throws std::system_error instead if a write failed, since the last one too.
+     */
+    void checkpoint() {
+        if (!path) return;
+        write_out();
+        lru.for_each([this](unsigned page_id) {
+            if (dirty.get(page_id)) {
+                write_page(page_id);
+                ++stat.checkpoint_write;
+            }
+        });
+        // pages must be on disk before the index referencing them
+        if (shadow) sync();
+        write_table();
+        // and so must the table chunks and directory pages the header points at
+        sync();
+        check_write(store.writer(0, Header_Size())
+                            .write(reinterpret_cast<char *>(persistence_index), Header_Size()));
+        sync();
+        if (shadow) {
+            for (unsigned i = 0; i < unstable.size; i++) {
+                unsigned page_id = unstable[i];
+                Page page = table.get(page_id);
+                stable.ref(page_id) = page.offset != 0 && page.is_leaf != 2;
+            }
+            unstable.clear();
+            unpark_extents();
+        }
+        ++stat.checkpoint;
+    }
+
+    // wait for what is written to be durable, throws if some of it is not, then and from then on
+    void sync() {
+        if (!write_error) {
+            try {
+                store.sync();
+            } catch (const std::system_error &e) {
+                fail(e.code().value());
+                throw;
+            }
+        }
+        if (write_error) throw std::system_error(write_error, std::generic_category(), "failed to write page");
+    }
+
+    // a failed write leaves the stream failed, and the data file short of a page until reopened
+    void check_write(std::ostream &out) {
+        if (out) return;
+        out.clear();
+        fail(EIO);
+    }
+
+    void fail(int error) {
+        if (!write_error) write_error = error;
+    }
+
+    // returns true if a table chunk or directory page at offset has to move before being written
+    bool place(size_t &offset, bool &stable, size_t size) {
+        if (offset && !(shadow && stable)) return false;
+        if (offset) retired.push(Extent{offset, size});
+        allocate_extent(offset, size);
+        stable = false;
+        return true;
+    }
+
+    void write_table() {
+        // In shadow mode, moving a chunk retires its extent, and parking that modifies
+        // the table again. Find extents for everything to be written before writing.
+        for (bool moved = true; moved;) {
+            moved = false;
+            if (shadow) park_extents();
+            for (unsigned i = 0; i < dirty_chunks.size; i++) {
+                unsigned chunk = dirty_chunks[i];
+                size_t offset = directory.get(chunk);
+                if (place(offset, chunk_stable.ref(chunk), Chunk_Size())) {
+                    set_chunk_offset(chunk, offset);
+                    moved = true;
+                }
+            }
+            for (unsigned d = 0; d < Directory::Chunks; d++) {
+                if (directory_dirty[d] &&
+                    place(persistence_index->directory_offset[d], directory_stable[d], Directory_Page_Size()))
+                    moved = true;
+            }
+        }
+        for (unsigned i = 0; i < dirty_chunks.size; i++) {
+            unsigned chunk = dirty_chunks[i];
+            check_write(store.writer(directory.get(chunk), Chunk_Size())
+                                .write(reinterpret_cast<char *>(table.chunk(chunk)), Chunk_Size()));
+            chunk_dirty.ref(chunk) = false;
+            chunk_stable.ref(chunk) = shadow;
+            ++stat.table_write;
+        }
+        dirty_chunks.clear();
+        for (unsigned d = 0; d < Directory::Chunks; d++) {
+            if (!directory_dirty[d]) continue;
+            check_write(store.writer(persistence_index->directory_offset[d], Directory_Page_Size())
+                                .write(reinterpret_cast<char *>(directory.chunk(d)), Directory_Page_Size()));
+            directory_dirty[d] = false;
+            directory_stable[d] = shadow;
+            ++stat.table_write;
+        }
+    }
+
+    // checkpoint and release every page in memory
     void save() {
         if (!path) return;
-        f.seekp(0, f.beg);
-        f.write(reinterpret_cast<char *>(persistence_index), sizeof(PersistenceIndex));
-        for (unsigned i = 0; i < MAX_PAGES; i++) {
-            if (pages[i]) offload_page(i);
+        checkpoint();
+        while (lru.size) offload_page(lru.expire());
+    }
+
+    /*
+     * Once the index is saved, retired extents are no longer referenced. Record them
+     * together with free ones as deleted pages in empty slots so that they survive a restart.
+     */
+    void park_extents() {
+        // slots past the last one in use are taken, so that parking costs as much as the extents
+        for (Stack<Extent> *extents : {&retired, &released}) {
+            // extents left over once slots run out are parked by a later checkpoint
+            while (extents->size && slot_end < MAX_PAGES) {
+                Extent extent = extents->remove(extents->size - 1);
+                parked.push(slot_end);
+                set_page(slot_end, extent.offset, extent.size, 2);
+            }
+        }
+    }
+
+    // move extents parked in the index on disk back to the free list in memory
+    void unpark_extents() {
+        for (unsigned i = 0; i < parked.size; i++) {
+            unsigned slot = parked[i];
+            Page page = table.get(slot);
+            released.push(Extent{page.offset, page.size});
+            set_page(slot, 0, 0, 0);
+            lst_empty_slot = std::min(lst_empty_slot, slot);
         }
+        parked.clear();
+        while (slot_end > 16 && table.get(slot_end - 1).offset == 0) --slot_end;
     }
 
-    const Block *read(unsigned page_id) {
-        return load_page(page_id);
+    using Ref = PageRef<Persistence, Block>;
+    using ConstRef = PageRef<Persistence, const Block>;
+
+    // page pinned for reading
+    ConstRef read(unsigned page_id) { return ConstRef(this, pin(page_id)); }
+
+    // page pinned for writing, a page is only written back once touched
+    Ref get(unsigned page_id) { return Ref(this, pin(page_id)); }
+
+    // mark a pinned page modified
+    void touch(unsigned page_id) {
+        Guard guard(pool_lock);
+        assert(pins.get(page_id) > 0);
+        if (dirty.get(page_id)) return;
+        dirty.ref(page_id) = true;
+        ++dirty_pages;
     }
 
-    Block *get(unsigned page_id) {
-        dirty[page_id] = true;
-        return load_page(page_id);
+    // hint the store to read a page that is about to be loaded
+    void prefetch(unsigned page_id) {
+        Page page;
+        {
+            Guard guard(pool_lock);
+            if (!path || pages.get(page_id) || moving.get(page_id)) return;
+            page = table.get(page_id);
+            if (!page.offset) return;
+            ++stat.prefetch;
+        }
+        Guard guard(io_lock);
+        store.prefetch(page.offset, page.size);
+    }
+
+    // start reads prefetched so far at once, for stores queueing them
+    void submit() {
+        if (!path) return;
+        Guard guard(io_lock);
+        store.submit();
+    }
+
+    // page if in memory, without locking or touching the LRU, for readers validating versions
+    const Block *peek(unsigned page_id) const { return pages.load(page_id); }
+
+    // a block in a frame of the pool, which frees it once it is retired
+    Leaf *new_leaf() {
+        Guard guard(pool_lock);
+        return new(frames.allocate()) Leaf;
+    }
+
+    Index *new_index() {
+        Guard guard(pool_lock);
+        return new(frames.allocate()) Index;
+    }
+
+    // put the frame of a retired block back, with pool_lock held
+    void free_page(Block *page) {
+        if (page->is_leaf()) {
+            Leaf *leaf = static_cast<Leaf *>(page);
+            leaf->~Leaf();
+            frames.deallocate(leaf);
+        } else {
+            Index *index = static_cast<Index *>(page);
+            index->~Index();
+            frames.deallocate(index);
+        }
+    }
+
+    // free a block merged away once readers are done with it
+    void retire(Block *block) {
+        Guard guard(pool_lock);
+        reclaimer.retire(block);
+    }
+
+    // load a page and keep it in memory until unpin
+    Block *pin(unsigned page_id) {
+        Block *page;
+        Page entry;
+        for (;;) {
+            {
+                Guard guard(pool_lock);
+                page = pages.get(page_id);
+                if (page) {
+                    ++stat.access_cache_hit;
+                    lru.get(page_id);
+                    ++pins.ref(page_id);
+                    return page;
+                }
+                if (!path) return nullptr;
+                if (!moving.get(page_id)) {
+                    entry = table.get(page_id);
+                    if (!entry.offset) return nullptr;
+                    ++stat.access_cache_miss;
+                    moving.ref(page_id) = true;
+                    // pages are evicted as soon as the pool is full, not only between operations
+                    evict(MAX_IN_MEMORY - 1);
+                    if (entry.is_leaf == 1)
+                        page = new(frames.allocate()) Leaf;
+                    else if (entry.is_leaf == 0)
+                        page = new(frames.allocate()) Index;
+                    else
+                        assert(false);
+                    break;
+                }
+            }
+            // read in by another thread, or still to be written out
+            write_out();
+            Sync::pause();
+        }
+        load_page(page_id, page, entry);
+        write_out();
+        return page;
+    }
+
+    void unpin(unsigned page_id) {
+        Guard guard(pool_lock);
+        assert(pins.get(page_id) > 0);
+        --pins.ref(page_id);
+    }
+
+    void add_size(int delta) {
+        Guard guard(pool_lock);
+        persistence_index->size += delta;
     }
 
     size_t align_to_4k(size_t offset) {
         return (offset + 0xfff) & (~0xfff);
     }
 
-    unsigned append_page(size_t &offset, size_t size) {
+    void allocate_extent(size_t &offset, size_t size) {
+        if (shadow && take_extent(size, offset)) return;
         offset = align_to_4k(persistence_index->tail_pos);
         persistence_index->tail_pos = offset + size;
+    }
+
+    unsigned append_page(size_t &offset, size_t size) {
+        allocate_extent(offset, size);
         return lst_empty_slot++;
     }
 
     unsigned request_page(size_t &offset, size_t size) {
         for(;;lst_empty_slot++) {
-            if (persistence_index->page_offset[lst_empty_slot] == 0) return append_page(offset, size);
-            if (persistence_index->is_leaf[lst_empty_slot] == 2 && persistence_index->page_size[lst_empty_slot] >= size) {
-                offset = persistence_index->page_offset[lst_empty_slot];
+            Page page = table.get(lst_empty_slot);
+            if (page.offset == 0) return append_page(offset, size);
+            if (page.is_leaf == 2 && page.size >= size) {
+                offset = page.offset;
                 return lst_empty_slot++;
             }
         }
     }
 
     void create_page(Block *block) {
+        evict(MAX_IN_MEMORY - 1);
         size_t offset;
         unsigned page_id = request_page(offset, block->storage_size());
         block->idx = page_id;
-        pages[page_id] = block;
-        persistence_index->is_leaf[page_id] = block->is_leaf() ? 1 : 0;
-        persistence_index->page_offset[page_id] = offset;
-        persistence_index->page_size[page_id] = block->storage_size();
+        pages.store(page_id, block);
+        set_page(page_id, offset, block->storage_size(), block->is_leaf() ? 1 : 0);
         lru.put(page_id);
-        dirty[page_id] = true;
+        dirty.ref(page_id) = true;
+        ++dirty_pages;
+        // the creator holds a new page until it is linked into the tree
+        pins.ref(page_id) = 1;
+        if (shadow) {
+            stable.ref(page_id) = false;
+            unstable.push(page_id);
+        }
+    }
+
+    /*
+     * Offload pages until at most size are in memory, pages pinned or latched stay.
+     * Dirty pages are left to write_out, and marked moving until they are written.
+     */
+    void evict(unsigned size) {
+        if (!path || lru.size <= size) return;
+        lru.expire_while([this, size](unsigned idx) {
+            if (lru.size <= size) return false;
+            Block *page = pages.get(idx);
+            if (!pins.get(idx) && page->latch.try_lock()) {
+                // obsolete, readers still holding the page start over
+                page->version.bump();
+                page->latch.unlock();
+                if (dirty.get(idx)) {
+                    moving.ref(idx) = true;
+                    outgoing.push(page);
+                    pages.store(idx, nullptr);
+                    lru.remove(idx);
+                } else
+                    offload_page(idx);
+                ++stat.swap_out;
+            }
+            return true;
+        });
     }
 
+    /*
+     * Write back dirty pages coldest first, keeping them in memory, until at most low are
+     * dirty or batch are written, so that eviction finds clean pages. Pages pinned or
+     * latched are left to eviction. Returns number of pages written.
+     */
+    unsigned write_back(unsigned low, unsigned batch) {
+        if (!path) return 0;
+        struct Write {
+            Block *page;
+            Page entry;
+        };
+        Stack<Write> writes;
+        {
+            Guard guard(pool_lock);
+            lru.for_each_cold([this, low, batch, &writes](unsigned idx) {
+                if (dirty_pages <= low || writes.size == batch) return false;
+                Block *page = pages.get(idx);
+                // kept latched until written, and pinned so that it stays in memory
+                if (dirty.get(idx) && !pins.get(idx) && page->latch.try_lock()) {
+                    ++pins.ref(idx);
+                    writes.push(Write{page, clean_page(idx)});
+                    ++stat.write_back;
+                }
+                return true;
+            });
+        }
+        {
+            Guard guard(io_lock);
+            for (unsigned i = 0; i < writes.size; i++) put_page(writes[i].page, writes[i].entry);
+            // left to the next checkpoint to raise, as this runs in the background
+            try {
+                store.submit();
+            } catch (const std::system_error &e) {
+                fail(e.code().value());
+            }
+        }
+        Guard guard(pool_lock);
+        for (unsigned i = 0; i < writes.size; i++) {
+            --pins.ref(writes[i].page->idx);
+            writes[i].page->latch.unlock();
+        }
+        return writes.size;
+    }
+
+    unsigned dirty_count() {
+        Guard guard(pool_lock);
+        return dirty_pages;
+    }
+
+    // called between operations, when nothing is pinned by the caller any more
     void swap_out_pages() {
-        while (lru.size > MAX_IN_MEMORY) {
-            unsigned idx = lru.expire();
-            offload_page(idx);
-            ++stat.swap_out;
+        {
+            Guard guard(pool_lock);
+            evict(MAX_IN_MEMORY);
+            reclaimer.collect([this](Block *page) { free_page(page); });
         }
+        write_out();
     }
 
     void record(Block *block) {
-        create_page(block);
-        block->storage = this;
-        ++stat.create;
+        {
+            Guard guard(pool_lock);
+            create_page(block);
+            block->storage = this;
+            ++stat.create;
+        }
+        write_out();
     }
 
     void deregister(Block *block) {
-        lru.remove(block->idx);
-        pages[block->idx] = nullptr;
-        dirty[block->idx] = false;
-        lst_empty_slot = std::min(lst_empty_slot, block->idx);
-        persistence_index->is_leaf[block->idx] = 2;
+        Guard guard(pool_lock);
+        shift_version.bump();
+        unsigned page_id = block->idx;
+        // the id is reused by a new page, which is not to be taken for this one
+        lru.drop(page_id);
+        pages.store(page_id, nullptr);
+        if (dirty.get(page_id)) --dirty_pages;
+        dirty.ref(page_id) = false;
+        pins.ref(page_id) = 0;
+        lst_empty_slot = std::min(lst_empty_slot, page_id);
+        Page page = table.get(page_id);
+        if (shadow && stable.get(page_id)) {
+            // extent is still referenced on disk, leave the slot without one
+            retired.push(Extent{page.offset, page.size});
+            set_page(page_id, 0, 0, 2);
+            stable.ref(page_id) = false;
+        } else
+            set_page(page_id, page.offset, page.size, 2);
         block->idx = 0;
         ++stat.destroy;
     }
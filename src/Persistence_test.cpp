@@ -3,7 +3,11 @@
 //
 
 #include <catch.hpp>
+#include <csignal>
 #include <cstdio>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
 #include "Persistence.hpp"
 #include "Container.hpp"
 
@@ -18,6 +22,8 @@ using MPersistence = Persistence<MockBlock, MockIndex, MockLeaf, 32, 4>;
 struct MockBlock : public Serializable {
     unsigned idx;
     MPersistence *storage;
+    SingleThread::Latch latch;
+    SingleThread::Version version;
 
     MockBlock() : storage(nullptr) {}
 
@@ -52,8 +58,8 @@ struct MockIndex : public MockLeaf {
 
 };
 
-MockLeaf *make_leaf() {
-    MockLeaf *leaf = new MockLeaf;
+MockLeaf *make_leaf(MPersistence &persistence) {
+    MockLeaf *leaf = persistence.new_leaf();
     for (int i = 0; i < leaf->data.capacity(); i++) leaf->data.append(i);
     return leaf;
 }
@@ -61,12 +67,12 @@ MockLeaf *make_leaf() {
 TEST_CASE("Persistence", "[Persistence]") {
     SECTION("should occupy storage") {
         MPersistence persistence;
-        MockLeaf *leaf1 = make_leaf();
+        MockLeaf *leaf1 = make_leaf(persistence);
         persistence.record(leaf1);
         REQUIRE (leaf1->storage == &persistence);
         unsigned idx = leaf1->idx;
         persistence.offload_page(idx);
-        leaf1 = dynamic_cast<MockLeaf *>(persistence.get(idx));
+        leaf1 = dynamic_cast<MockLeaf *>(persistence.get(idx).get());
         REQUIRE (leaf1->storage == &persistence);
     }
 
@@ -83,36 +89,36 @@ TEST_CASE("Persistence", "[Persistence]") {
 
     SECTION("should offload pages") {
         MPersistence persistence;
-        MockLeaf *leaf1 = new MockLeaf;
-        MockLeaf *leaf2 = new MockLeaf;
+        MockLeaf *leaf1 = persistence.new_leaf();
+        MockLeaf *leaf2 = persistence.new_leaf();
         persistence.record(leaf1);
         persistence.record(leaf2);
     }
 
     SECTION("should get correct pages") {
         MPersistence persistence;
-        MockLeaf *leaf1 = new MockLeaf;
-        MockLeaf *leaf2 = new MockLeaf;
+        MockLeaf *leaf1 = persistence.new_leaf();
+        MockLeaf *leaf2 = persistence.new_leaf();
         persistence.record(leaf1);
         persistence.record(leaf2);
-        REQUIRE(persistence.get(leaf1->idx) == leaf1);
-        REQUIRE(persistence.get(leaf2->idx) == leaf2);
+        REQUIRE(persistence.get(leaf1->idx).get() == leaf1);
+        REQUIRE(persistence.get(leaf2->idx).get() == leaf2);
     }
 
     SECTION("should return null on not found pages") {
         MPersistence persistence;
-        REQUIRE(persistence.get(5) == nullptr);
+        REQUIRE(!persistence.get(5));
     }
 
     SECTION("should persist value") {
         remove("p1.test");
         unsigned leaf_idx, index_idx;
         {
-            MockLeaf *leaf = new MockLeaf;
-            MockIndex *index = new MockIndex;
+            MPersistence persistence("p1.test");
+            MockLeaf *leaf = persistence.new_leaf();
+            MockIndex *index = persistence.new_index();
             for (int i = 0; i < leaf->data.capacity(); i++) leaf->data.append(i);
             for (int i = 0; i < index->data.capacity(); i++) index->data.append(i);
-            MPersistence persistence("p1.test");
             persistence.record(leaf);
             persistence.record(index);
             leaf_idx = leaf->idx;
@@ -120,9 +126,9 @@ TEST_CASE("Persistence", "[Persistence]") {
         }
         {
             MPersistence persistence("p1.test");
-            MockLeaf *leaf = dynamic_cast<MockLeaf *>(persistence.get(leaf_idx));
+            MockLeaf *leaf = dynamic_cast<MockLeaf *>(persistence.get(leaf_idx).get());
             REQUIRE(leaf);
-            MockIndex *index = dynamic_cast<MockIndex *>(persistence.get(index_idx));
+            MockIndex *index = dynamic_cast<MockIndex *>(persistence.get(index_idx).get());
             REQUIRE(index);
             REQUIRE(leaf->idx == leaf_idx);
             REQUIRE(index->idx == index_idx);
@@ -133,19 +139,19 @@ TEST_CASE("Persistence", "[Persistence]") {
 
     SECTION("should correctly offload pages") {
         {
-            MockLeaf *leaf = new MockLeaf;
-            MockIndex *index = new MockIndex;
+            MPersistence persistence("p1.test");
+            MockLeaf *leaf = persistence.new_leaf();
+            MockIndex *index = persistence.new_index();
             for (int i = 0; i < leaf->data.capacity(); i++) leaf->data.append(i);
             for (int i = 0; i < index->data.capacity(); i++) index->data.append(i);
-            MPersistence persistence("p1.test");
             persistence.record(leaf);
             persistence.record(index);
             unsigned leaf_idx = leaf->idx;
             unsigned index_idx = index->idx;
             persistence.offload_page(leaf_idx);
             persistence.offload_page(index_idx);
-            leaf = dynamic_cast<MockLeaf *>(persistence.get(leaf_idx));
-            index = dynamic_cast<MockIndex *>(persistence.get(index_idx));
+            leaf = dynamic_cast<MockLeaf *>(persistence.get(leaf_idx).get());
+            index = dynamic_cast<MockIndex *>(persistence.get(index_idx).get());
             for (int i = 0; i < leaf->data.capacity(); i++) REQUIRE(leaf->data[i] == i);
             for (int i = 0; i < index->data.capacity(); i++) REQUIRE(index->data[i] == i);
         }
@@ -154,19 +160,119 @@ TEST_CASE("Persistence", "[Persistence]") {
     SECTION("should swap out pages") {
         remove("p_swap.test");
         MPersistence persistence("p_swap.test");
-        persistence.record(make_leaf());
-        persistence.record(make_leaf());
-        persistence.record(make_leaf());
-        persistence.record(make_leaf());
-        persistence.record(make_leaf());
-        persistence.record(make_leaf());
-        persistence.record(make_leaf());
-        persistence.record(make_leaf());
+        for (int i = 0; i < 8; i++) {
+            MockLeaf *leaf = make_leaf(persistence);
+            persistence.record(leaf);
+            persistence.unpin(leaf->idx);
+        }
         persistence.swap_out_pages();
         REQUIRE(persistence.stat.swap_out == 4);
         remove("p_swap.test");
     }
 
+    SECTION("should keep pinned pages and evict others as pages are loaded") {
+        remove("p_swap.test");
+        MPersistence persistence("p_swap.test");
+        unsigned idx[8];
+        for (int i = 0; i < 8; i++) {
+            MockLeaf *leaf = make_leaf(persistence);
+            persistence.record(leaf);
+            idx[i] = leaf->idx;
+            persistence.unpin(idx[i]);
+        }
+        REQUIRE(persistence.lru.size == 4);
+        {
+            MPersistence::ConstRef first = persistence.read(idx[0]);
+            MPersistence::Ref second = persistence.get(idx[1]);
+            for (int i = 2; i < 8; i++) {
+                REQUIRE(persistence.read(idx[i]));
+                REQUIRE(persistence.lru.size <= 4);
+            }
+            REQUIRE(persistence.is_loaded(idx[0]));
+            REQUIRE(persistence.is_loaded(idx[1]));
+            REQUIRE(first.get() == persistence.read(idx[0]).get());
+            // every page is pinned, so the pool grows beyond its size
+            MPersistence::ConstRef refs[4];
+            for (int i = 2; i < 6; i++) refs[i - 2] = persistence.read(idx[i]);
+            REQUIRE(persistence.lru.size == 6);
+        }
+        persistence.swap_out_pages();
+        REQUIRE(persistence.lru.size == 4);
+        remove("p_swap.test");
+    }
+
+    SECTION("should park free extents past the pages in use") {
+        remove("p1.test");
+        {
+            MPersistence persistence("p1.test", true);
+            unsigned idx[8];
+            for (int i = 0; i < 8; i++) {
+                MockLeaf *leaf = make_leaf(persistence);
+                persistence.record(leaf);
+                idx[i] = leaf->idx;
+                persistence.unpin(idx[i]);
+            }
+            persistence.checkpoint();
+            for (int i = 0; i < 8; i += 2) persistence.deregister(persistence.get(idx[i]).get());
+            persistence.checkpoint();
+            REQUIRE (persistence.slot_end == idx[7] + 1);
+            REQUIRE (persistence.parked.size == 0);
+            REQUIRE (persistence.retired.size + persistence.released.size >= 4);
+        }
+        {
+            MPersistence persistence("p1.test", true);
+            REQUIRE (persistence.released.size >= 4);
+        }
+        remove("p1.test");
+    }
+
+    SECTION("should throw on checkpoint once a write fails") {
+        remove("p1.test");
+        pid_t pid = fork();
+        if (pid == 0) {
+            // writes past the limit fail with EFBIG
+            signal(SIGXFSZ, SIG_IGN);
+            rlimit limit{8192, 8192};
+            setrlimit(RLIMIT_FSIZE, &limit);
+            MPersistence persistence("p1.test");
+            for (int i = 0; i < 8; i++) {
+                MockLeaf *leaf = make_leaf(persistence);
+                persistence.record(leaf);
+                persistence.unpin(leaf->idx);
+            }
+            // and the data file is not trusted again, though nothing is left to write
+            for (int round = 0; round < 2; round++) {
+                try {
+                    persistence.checkpoint();
+                    _exit(1);
+                } catch (const std::system_error &) {}
+            }
+            _exit(0);
+        }
+        int status;
+        waitpid(pid, &status, 0);
+        REQUIRE (WIFEXITED(status));
+        REQUIRE (WEXITSTATUS(status) == 0);
+        remove("p1.test");
+    }
+
+    SECTION("should recycle chunks of a slab") {
+        Slab<64, 8, 4> slab;
+        void *chunks[6];
+        for (int i = 0; i < 6; i++) chunks[i] = slab.allocate();
+        REQUIRE (slab.capacity() == 8);
+        REQUIRE (reinterpret_cast<size_t>(chunks[5]) % 8 == 0);
+        slab.deallocate(chunks[2]);
+        slab.deallocate(chunks[4]);
+        REQUIRE (slab.allocate() == chunks[4]);
+        REQUIRE (slab.allocate() == chunks[2]);
+        slab.allocate();
+        slab.allocate();
+        REQUIRE (slab.capacity() == 8);
+        slab.allocate();
+        REQUIRE (slab.capacity() == 12);
+    }
+
     SECTION("should align to 4k") {
         MPersistence persistence("p_swap.test");
         for (int i = 0; i < 20000; i++) {
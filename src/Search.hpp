@@ -0,0 +1,101 @@
+//
+// Created by Alex Chi on 2019-06-20.
+//
+
+#ifndef BPLUSTREE_SEARCH_HPP
+#define BPLUSTREE_SEARCH_HPP
+
+#include <cstring>
+#include <type_traits>
+
+/*
+ * Search of sorted arithmetic keys: a branchless binary search narrows down to a window of
+ * Window keys, whose keys less than (or no greater than) the one searched for are counted
+ * by comparing a vector of keys at a time. Vectors are 16, 32 or 64 bytes wide, for SSE2,
+ * AVX2 and AVX-512. The widest one the CPU supports is chosen at runtime, unless the build
+ * targets one already. Other key types are searched by Set itself.
+ */
+template<typename T>
+struct KeySearch {
+    static constexpr bool Vectorized = std::is_arithmetic<T>::value && !std::is_same<T, bool>::value
+                                       && sizeof(T) <= 8;
+
+    static constexpr unsigned Window = 64;
+
+    template<unsigned Bytes>
+    struct Vec {
+        typedef T type __attribute__((vector_size(Bytes)));
+    };
+
+    // keys of x[0, n) less than d, or no greater than d if upper
+    template<unsigned Bytes>
+    __attribute__((always_inline)) static inline unsigned count(const T *x, unsigned n, T d, bool upper) {
+        using V = typename Vec<Bytes>::type;
+        constexpr unsigned Lanes = Bytes / sizeof(T);
+        V dv = V{} + d;
+        // a lane of a comparison is -1 where it holds
+        decltype(V{} < V{}) hits = {};
+        unsigned i = 0;
+        for (; i + Lanes <= n; i += Lanes) {
+            V v;
+            memcpy(&v, x + i, sizeof(V));
+            hits += upper ? (v <= dv) : (v < dv);
+        }
+        unsigned c = 0;
+        for (unsigned j = 0; j < Lanes; j++) c -= hits[j];
+        for (; i < n; i++) c += upper ? !(d < x[i]) : x[i] < d;
+        return c;
+    }
+
+    static unsigned count_sse2(const T *x, unsigned n, T d, bool upper) { return count<16>(x, n, d, upper); }
+
+#if defined(__x86_64__) || defined(__i386__)
+
+    __attribute__((target("avx2")))
+    static unsigned count_avx2(const T *x, unsigned n, T d, bool upper) { return count<32>(x, n, d, upper); }
+
+    __attribute__((target("avx512f,avx512bw")))
+    static unsigned count_avx512(const T *x, unsigned n, T d, bool upper) { return count<64>(x, n, d, upper); }
+
+    using Count = unsigned (*)(const T *, unsigned, T, bool);
+
+    static Count select() {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) return count_avx512;
+        if (__builtin_cpu_supports("avx2")) return count_avx2;
+        return count_sse2;
+    }
+
+#endif
+
+    static unsigned count_window(const T *x, unsigned n, T d, bool upper) {
+#if defined(__AVX512F__) && defined(__AVX512BW__)
+        return count<64>(x, n, d, upper);
+#elif defined(__AVX2__)
+        return count<32>(x, n, d, upper);
+#elif defined(__x86_64__) || defined(__i386__)
+        static const Count dispatch = select();
+        return dispatch(x, n, d, upper);
+#else
+        return count<16>(x, n, d, upper);
+#endif
+    }
+
+    static unsigned bound(const T *x, unsigned size, const T &d, bool upper) {
+        unsigned low = 0;
+        while (size > Window) {
+            unsigned half = size / 2;
+            unsigned other_half = size - half;
+            unsigned probe = low + half;
+            size = half;
+            low = (upper ? !(d < x[probe]) : x[probe] < d) ? low + other_half : low;
+        }
+        return low + count_window(x + low, size, d, upper);
+    }
+
+    static unsigned lower_bound(const T *x, unsigned size, const T &d) { return bound(x, size, d, false); }
+
+    static unsigned upper_bound(const T *x, unsigned size, const T &d) { return bound(x, size, d, true); }
+};
+
+#endif //BPLUSTREE_SEARCH_HPP
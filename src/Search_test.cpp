@@ -0,0 +1,69 @@
+//
+// Created by Alex Chi on 2019-06-20.
+//
+
+#include <catch.hpp>
+#include <algorithm>
+#include <random>
+#include "Container.hpp"
+#include "Search.hpp"
+
+template<typename T>
+static void check_bounds(unsigned max_size) {
+    std::mt19937 gen(233);
+    T *x = new T[max_size];
+    for (unsigned size = 0; size <= max_size; size += size < 130 ? 1 : 37) {
+        // keys from a small range, so that some repeat
+        for (unsigned i = 0; i < size; i++) x[i] = (T) (gen() % (size * 2 + 1)) - (T) (std::is_signed<T>::value ? size : 0);
+        std::sort(x, x + size);
+        for (int probe = -2; probe <= (int) size * 2 + 2; probe++) {
+            T d = (T) probe - (T) (std::is_signed<T>::value ? size : 0);
+            unsigned lower = std::lower_bound(x, x + size, d) - x;
+            unsigned upper = std::upper_bound(x, x + size, d) - x;
+            REQUIRE (KeySearch<T>::lower_bound(x, size, d) == lower);
+            REQUIRE (KeySearch<T>::upper_bound(x, size, d) == upper);
+            if (size <= KeySearch<T>::Window) {
+                REQUIRE (KeySearch<T>::count_sse2(x, size, d, false) == lower);
+                REQUIRE (KeySearch<T>::count_sse2(x, size, d, true) == upper);
+#if defined(__x86_64__) || defined(__i386__)
+                if (__builtin_cpu_supports("avx2")) {
+                    REQUIRE (KeySearch<T>::count_avx2(x, size, d, false) == lower);
+                    REQUIRE (KeySearch<T>::count_avx2(x, size, d, true) == upper);
+                }
+                if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) {
+                    REQUIRE (KeySearch<T>::count_avx512(x, size, d, false) == lower);
+                    REQUIRE (KeySearch<T>::count_avx512(x, size, d, true) == upper);
+                }
+#endif
+            }
+        }
+    }
+    delete[] x;
+}
+
+TEST_CASE("KeySearch", "[Search]") {
+    SECTION("should find bounds of integral keys") {
+        check_bounds<int>(600);
+        check_bounds<unsigned>(600);
+        check_bounds<long long>(600);
+        check_bounds<unsigned long long>(300);
+        check_bounds<short>(300);
+        check_bounds<char>(60);
+    }
+
+    SECTION("should find bounds of floating keys") {
+        check_bounds<float>(600);
+        check_bounds<double>(600);
+    }
+
+    SECTION("should be used by Set") {
+        REQUIRE (KeySearch<long long>::Vectorized);
+        REQUIRE (!KeySearch<bool>::Vectorized);
+        Set<double, 512> s;
+        for (int i = 0; i < 500; i++) s.append(i * 0.5);
+        REQUIRE (s.lower_bound(100.25) == 201);
+        REQUIRE (s.upper_bound(100.5) == 202);
+        REQUIRE (s.lower_bound(-1) == 0);
+        REQUIRE (s.upper_bound(1000) == 500);
+    }
+}
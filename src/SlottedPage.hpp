@@ -0,0 +1,258 @@
+//
+// Created by Alex Chi on 2019-06-19.
+//
+
+#ifndef BPLUSTREE_SLOTTEDPAGE_HPP
+#define BPLUSTREE_SLOTTEDPAGE_HPP
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <string>
+
+/*
+ * Orders keys as unsigned bytes, a key before those it is a prefix of. A comparator also
+ * tells which prefix keys between two bounds share, and how short a separator between two
+ * keys may be. One that doesn't order keys by bytes should return 0 and b_size instead,
+ * which turns prefix compression and suffix truncation off.
+ */
+struct Bytewise {
+    int operator()(const char *a, unsigned a_size, const char *b, unsigned b_size) const {
+        int c = memcmp(a, b, std::min(a_size, b_size));
+        if (c != 0) return c;
+        return a_size < b_size ? -1 : (a_size > b_size ? 1 : 0);
+    }
+
+    // length of the prefix of every key k with a <= k < b
+    static unsigned common_prefix(const char *a, unsigned a_size, const char *b, unsigned b_size) {
+        unsigned n = 0;
+        while (n < a_size && n < b_size && a[n] == b[n]) ++n;
+        return n;
+    }
+
+    // length of the shortest prefix of b ordered after a, given a < b
+    static unsigned separator(const char *a, unsigned a_size, const char *b, unsigned b_size) {
+        return std::min(common_prefix(a, a_size, b, b_size) + 1, b_size);
+    }
+};
+
+/*
+ * A page of variable-length entries. A directory of slots grows from the front of the body
+ * and the keys and values they point to from the back, so entries are never padded.
+ * Slots are kept in key order. Space of removed entries is garbage until the page is
+ * compacted, which happens when an entry doesn't fit otherwise.
+ * A prefix all keys of the page start with is stored once at the end of the body, and
+ * only the rest of each key in its entry. Keys are passed in and out in full.
+ *
+ * Storage Mapping
+ * | 4 next | 4 first | 2 count | 2 heap | 2 garbage | 2 prefix size |
+ * | count Slot | free space | heap of keys and values | prefix |
+ */
+template<unsigned Size, typename Compare = Bytewise>
+struct SlottedPage {
+    struct Slot {
+        unsigned short offset, key_size, value_size;
+    };
+
+    static constexpr unsigned Header_Size() { return sizeof(unsigned) * 2 + sizeof(unsigned short) * 4; }
+
+    static constexpr unsigned Body_Size() { return Size - Header_Size(); }
+
+    static_assert(Body_Size() < 65536, "offsets in a page are 16 bits");
+
+    // right neighbour on the same level
+    unsigned next;
+    // leftmost child of an index page, other children are values of its entries
+    unsigned first;
+    unsigned short count;
+    // where keys and values begin in the body
+    unsigned short heap;
+    // bytes of the heap left by removed entries
+    unsigned short garbage;
+    unsigned short prefix;
+    char body[Body_Size()];
+
+    SlottedPage() { clear(); }
+
+    void clear() {
+        next = first = 0;
+        count = garbage = prefix = 0;
+        heap = Body_Size();
+    }
+
+    static constexpr unsigned entry_size(unsigned key_size, unsigned value_size) {
+        return sizeof(Slot) + key_size + value_size;
+    }
+
+    Slot *slots() { return reinterpret_cast<Slot *>(body); }
+
+    const Slot *slots() const { return reinterpret_cast<const Slot *>(body); }
+
+    const char *prefix_data() const { return body + Body_Size() - prefix; }
+
+    // key i without the prefix of the page
+    const char *suffix(unsigned i) const { return body + slots()[i].offset; }
+
+    unsigned suffix_size(unsigned i) const { return slots()[i].key_size; }
+
+    unsigned key_size(unsigned i) const { return prefix + suffix_size(i); }
+
+    void key(unsigned i, std::string &k) const {
+        k.assign(prefix_data(), prefix).append(suffix(i), suffix_size(i));
+    }
+
+    char *value(unsigned i) { return body + slots()[i].offset + slots()[i].key_size; }
+
+    const char *value(unsigned i) const { return body + slots()[i].offset + slots()[i].key_size; }
+
+    unsigned value_size(unsigned i) const { return slots()[i].value_size; }
+
+    // bytes between the directory and the heap
+    unsigned free_space() const { return heap - count * sizeof(Slot); }
+
+    // bytes taken by entries, their slots and the prefix
+    unsigned used() const { return Body_Size() - free_space() - garbage; }
+
+    bool fits(unsigned key_size, unsigned value_size) const {
+        return entry_size(key_size - prefix, value_size) <= free_space() + garbage;
+    }
+
+    // order of k against the prefix, the prefix being ordered before keys it starts
+    int compare_prefix(const char *k, unsigned k_size) const {
+        int c = memcmp(prefix_data(), k, std::min<unsigned>(prefix, k_size));
+        if (c == 0 && k_size < prefix) return 1;
+        return c;
+    }
+
+    int compare(unsigned i, const char *k, unsigned k_size) const {
+        if (prefix) {
+            int c = compare_prefix(k, k_size);
+            if (c != 0) return c;
+        }
+        return Compare()(suffix(i), suffix_size(i), k + prefix, k_size - prefix);
+    }
+
+    bool match(unsigned i, const char *k, unsigned k_size) const {
+        return i < count && compare(i, k, k_size) == 0;
+    }
+
+    // first key no less than k, or greater than k if upper
+    unsigned bound(const char *k, unsigned k_size, bool upper) const {
+        if (prefix) {
+            // a key without the prefix is ordered before or after all keys of the page
+            int c = compare_prefix(k, k_size);
+            if (c != 0) return c > 0 ? 0 : count;
+            k += prefix;
+            k_size -= prefix;
+        }
+        unsigned low = 0, size = count;
+        while (size > 0) {
+            unsigned half = size / 2;
+            int c = Compare()(suffix(low + half), suffix_size(low + half), k, k_size);
+            if (c < 0 || (upper && c == 0)) {
+                low += half + 1;
+                size -= half + 1;
+            } else
+                size = half;
+        }
+        return low;
+    }
+
+    unsigned lower_bound(const char *k, unsigned k_size) const { return bound(k, k_size, false); }
+
+    unsigned upper_bound(const char *k, unsigned k_size) const { return bound(k, k_size, true); }
+
+    // k must start with the prefix of the page
+    bool insert(unsigned pos, const char *k, unsigned k_size, const char *v, unsigned v_size) {
+        assert(pos <= count);
+        assert(k_size >= prefix && compare_prefix(k, k_size) == 0);
+        if (!fits(k_size, v_size)) return false;
+        k += prefix;
+        k_size -= prefix;
+        if (free_space() < entry_size(k_size, v_size)) compact();
+        heap -= k_size + v_size;
+        memcpy(body + heap, k, k_size);
+        memcpy(body + heap + k_size, v, v_size);
+        memmove(slots() + pos + 1, slots() + pos, (count - pos) * sizeof(Slot));
+        slots()[pos] = Slot{heap, (unsigned short) k_size, (unsigned short) v_size};
+        ++count;
+        return true;
+    }
+
+    bool append(const char *k, unsigned k_size, const char *v, unsigned v_size) {
+        return insert(count, k, k_size, v, v_size);
+    }
+
+    void remove(unsigned pos) {
+        assert(pos < count);
+        garbage += suffix_size(pos) + value_size(pos);
+        memmove(slots() + pos, slots() + pos + 1, (count - pos - 1) * sizeof(Slot));
+        --count;
+    }
+
+    // drop entries from pos on
+    void truncate(unsigned pos) {
+        assert(pos <= count);
+        while (count > pos) remove(count - 1);
+    }
+
+    // append entries from pos on to that, false if they don't fit
+    bool copy_to(SlottedPage &that, unsigned pos) const {
+        char k[Body_Size()];
+        memcpy(k, prefix_data(), prefix);
+        for (unsigned i = pos; i < count; i++) {
+            memcpy(k + prefix, suffix(i), suffix_size(i));
+            if (!that.append(k, key_size(i), value(i), value_size(i))) return false;
+        }
+        return true;
+    }
+
+    // move entries from pos on to the end of that, which must have room for them
+    void move_to(SlottedPage &that, unsigned pos) {
+        bool moved = copy_to(that, pos);
+        assert(moved);
+        truncate(pos);
+    }
+
+    // rewrite entries under a new prefix, which all keys start with, false if they don't fit
+    bool set_prefix(const char *p, unsigned n) {
+        SlottedPage page;
+        page.next = next;
+        page.first = first;
+        page.prefix = n;
+        page.heap -= n;
+        memcpy(page.body + page.heap, p, n);
+        if (!copy_to(page, 0)) return false;
+        *this = page;
+        return true;
+    }
+
+    // first entry of the upper half by bytes, leaving at least one entry on either side
+    unsigned split_point() const {
+        assert(count >= 2);
+        unsigned half = used() / 2, n = 0, pos = 0;
+        while (pos + 1 < count && n < half) {
+            n += entry_size(suffix_size(pos), value_size(pos));
+            ++pos;
+        }
+        return std::max(pos, 1u);
+    }
+
+    // rewrite the heap in slot order without garbage
+    void compact() {
+        char heap_copy[Body_Size()];
+        unsigned short end = Body_Size() - prefix, top = end;
+        for (unsigned i = 0; i < count; i++) {
+            Slot &slot = slots()[i];
+            unsigned n = slot.key_size + slot.value_size;
+            top -= n;
+            memcpy(heap_copy + top, body + slot.offset, n);
+            slot.offset = top;
+        }
+        memcpy(body + top, heap_copy + top, end - top);
+        heap = top;
+        garbage = 0;
+    }
+};
+
+#endif //BPLUSTREE_SLOTTEDPAGE_HPP
@@ -0,0 +1,106 @@
+//
+// Created by Alex Chi on 2019-06-15.
+//
+
+#ifndef BPLUSTREE_SPARSEARRAY_HPP
+#define BPLUSTREE_SPARSEARRAY_HPP
+
+#include <cassert>
+#include <cstring>
+
+/*
+ * Array of Cap elements stored as a directory of chunks of Chunk_Size elements.
+ * Chunks are allocated on first write and the directory grows to the highest chunk
+ * written, so memory scales with indices in use instead of Cap.
+ * Elements never written read as T().
+ * load may run in other threads alongside store, as directories and chunks stay allocated
+ * until clear.
+ */
+template<typename T, unsigned Cap, unsigned Chunk_Size = 512>
+class SparseArray {
+    T **dir;
+    unsigned dir_size;
+    // directories replaced by grow, a concurrent load may still read them
+    T **old_dirs[32];
+    unsigned old_dirs_size;
+
+    void grow(unsigned c) {
+        unsigned size = dir_size ? dir_size : 8;
+        while (size <= c) size *= 2;
+        if (size > Chunks) size = Chunks;
+        T **_dir = new T *[size];
+        if (dir_size) memcpy(_dir, dir, sizeof(T *) * dir_size);
+        memset(_dir + dir_size, 0, sizeof(T *) * (size - dir_size));
+        if (dir) {
+            assert(old_dirs_size < 32);
+            old_dirs[old_dirs_size++] = dir;
+        }
+        // published before its size, so a load seeing the new size sees the new directory
+        __atomic_store_n(&dir, _dir, __ATOMIC_RELEASE);
+        __atomic_store_n(&dir_size, size, __ATOMIC_RELEASE);
+    }
+
+public:
+    static constexpr unsigned Chunk = Chunk_Size;
+    static constexpr unsigned Chunks = (Cap + Chunk_Size - 1) / Chunk_Size;
+
+    // number of chunks allocated
+    unsigned allocated;
+
+    SparseArray() : dir(nullptr), dir_size(0), old_dirs_size(0), allocated(0) {}
+
+    SparseArray(const SparseArray &) = delete;
+
+    ~SparseArray() { clear(); }
+
+    T get(unsigned i) const {
+        assert(i < Cap);
+        unsigned c = i / Chunk;
+        return c < dir_size && dir[c] ? dir[c][i % Chunk] : T();
+    }
+
+    // element i, may run in another thread than store
+    T load(unsigned i) const {
+        assert(i < Cap);
+        unsigned c = i / Chunk;
+        if (c >= __atomic_load_n(&dir_size, __ATOMIC_ACQUIRE)) return T();
+        T *elements = __atomic_load_n(&__atomic_load_n(&dir, __ATOMIC_ACQUIRE)[c], __ATOMIC_ACQUIRE);
+        return elements ? __atomic_load_n(&elements[i % Chunk], __ATOMIC_ACQUIRE) : T();
+    }
+
+    void store(unsigned i, T value) { __atomic_store_n(&ref(i), value, __ATOMIC_RELEASE); }
+
+    // reference to element i, allocating its chunk
+    T &ref(unsigned i) {
+        assert(i < Cap);
+        return chunk(i / Chunk)[i % Chunk];
+    }
+
+    bool has_chunk(unsigned c) const { return c < dir_size && dir[c]; }
+
+    // elements of chunk c, allocating it
+    T *chunk(unsigned c) {
+        assert(c < Chunks);
+        if (c >= dir_size) grow(c);
+        if (!dir[c]) {
+            __atomic_store_n(&dir[c], new T[Chunk](), __ATOMIC_RELEASE);
+            ++allocated;
+        }
+        return dir[c];
+    }
+
+    // chunks are allocated below this one only
+    unsigned chunk_end() const { return dir_size; }
+
+    void clear() {
+        for (unsigned c = 0; c < dir_size; c++) delete[] dir[c];
+        delete[] dir;
+        for (unsigned i = 0; i < old_dirs_size; i++) delete[] old_dirs[i];
+        dir = nullptr;
+        dir_size = 0;
+        old_dirs_size = 0;
+        allocated = 0;
+    }
+};
+
+#endif //BPLUSTREE_SPARSEARRAY_HPP
@@ -0,0 +1,33 @@
+//
+// Created by Alex Chi on 2019-06-15.
+//
+
+#include <catch.hpp>
+#include "SparseArray.hpp"
+
+TEST_CASE("SparseArray", "[Persistence]") {
+    SECTION("should read default value when not written") {
+        SparseArray<int, 1048576> a;
+        REQUIRE(a.get(0) == 0);
+        REQUIRE(a.get(1048575) == 0);
+        REQUIRE(a.allocated == 0);
+    }
+
+    SECTION("should allocate chunks on write") {
+        SparseArray<long long, 1048576, 512> a;
+        a.ref(1) = 1;
+        a.ref(511) = 511;
+        REQUIRE(a.allocated == 1);
+        a.ref(1048575) = 1048575;
+        REQUIRE(a.allocated == 2);
+        REQUIRE(a.has_chunk(2047));
+        REQUIRE(!a.has_chunk(1));
+        REQUIRE(a.get(1) == 1);
+        REQUIRE(a.get(511) == 511);
+        REQUIRE(a.get(512) == 0);
+        REQUIRE(a.get(1048575) == 1048575);
+        a.clear();
+        REQUIRE(a.allocated == 0);
+        REQUIRE(a.get(1) == 0);
+    }
+}
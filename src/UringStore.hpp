@@ -0,0 +1,463 @@
+//
+// Created by Alex Chi on 2019-06-14.
+//
+
+#ifndef BPLUSTREE_URINGSTORE_HPP
+#define BPLUSTREE_URINGSTORE_HPP
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <istream>
+#include <new>
+#include <ostream>
+#include <streambuf>
+#include <system_error>
+#include <utility>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/*
+ * Page store doing I/O through io_uring. Reads hinted by prefetch and writes are queued
+ * and handed to the kernel in batches, so that the device sees many requests at once:
+ * children visited by multi_get, the leaf after a scan, pages written back by eviction
+ * and checkpoints. Without io_uring, e.g. behind a seccomp filter, the same queue is
+ * served by pread and pwrite.
+ * With Direct the data file is opened with O_DIRECT, so that pages move between the
+ * buffers of the queue and the disk without being cached by the kernel as well. Offsets
+ * of pages are already 4K aligned, and lengths are rounded up to 4K, the padding
+ * belonging to the extent of the page.
+ * A stream handed out uses a buffer of the queue, and is valid until the next call.
+ * A failed read throws std::system_error from reader. A write that fails or comes up
+ * short is only known once it completes, so it is kept and thrown from sync, which every
+ * checkpoint calls. So do open, and calls handing requests to a ring that refuses them.
+ */
+template<bool Direct = false>
+class BasicUringStore {
+    struct Buffer : public std::streambuf {
+        void view_get(char *begin, char *end) { setg(begin, begin, end); }
+
+        void view_put(char *begin, char *end) { setp(begin, end); }
+    } buf;
+
+    std::istream in;
+    std::ostream out;
+
+    // just enough of io_uring without liburing, one submitter at a time
+    class Ring {
+        int fd;
+        unsigned *sq_tail, *sq_mask, *sq_array;
+        unsigned *cq_head, *cq_tail, *cq_mask;
+        io_uring_sqe *sqes;
+        io_uring_cqe *cqes;
+        void *sq_ring, *cq_ring;
+        size_t sq_size, cq_size, sqes_size;
+        // pushed but not submitted
+        unsigned pending;
+
+    public:
+        Ring() : fd(-1), sqes(nullptr), sq_ring(MAP_FAILED), cq_ring(MAP_FAILED), pending(0) {}
+
+        Ring(const Ring &) = delete;
+
+        bool ready() const { return fd >= 0; }
+
+        bool setup(unsigned entries) {
+            io_uring_params p;
+            memset(&p, 0, sizeof(p));
+            fd = (int) syscall(__NR_io_uring_setup, entries, &p);
+            if (fd < 0) return false;
+            sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+            cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+            bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+            if (single) sq_size = cq_size = std::max(sq_size, cq_size);
+            sq_ring = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+            cq_ring = single ? sq_ring :
+                      mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+            sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+            void *s = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+            if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || s == MAP_FAILED) {
+                if (s != MAP_FAILED) munmap(s, sqes_size);
+                close();
+                return false;
+            }
+            char *sq = reinterpret_cast<char *>(sq_ring), *cq = reinterpret_cast<char *>(cq_ring);
+            sq_tail = reinterpret_cast<unsigned *>(sq + p.sq_off.tail);
+            sq_mask = reinterpret_cast<unsigned *>(sq + p.sq_off.ring_mask);
+            sq_array = reinterpret_cast<unsigned *>(sq + p.sq_off.array);
+            cq_head = reinterpret_cast<unsigned *>(cq + p.cq_off.head);
+            cq_tail = reinterpret_cast<unsigned *>(cq + p.cq_off.tail);
+            cq_mask = reinterpret_cast<unsigned *>(cq + p.cq_off.ring_mask);
+            cqes = reinterpret_cast<io_uring_cqe *>(cq + p.cq_off.cqes);
+            sqes = reinterpret_cast<io_uring_sqe *>(s);
+            return true;
+        }
+
+        void close() {
+            if (sqes) munmap(sqes, sqes_size);
+            if (cq_ring != MAP_FAILED && cq_ring != sq_ring) munmap(cq_ring, cq_size);
+            if (sq_ring != MAP_FAILED) munmap(sq_ring, sq_size);
+            if (fd >= 0) ::close(fd);
+            fd = -1;
+            sq_ring = cq_ring = MAP_FAILED;
+            sqes = nullptr;
+            pending = 0;
+        }
+
+        // there is always room, as requests in flight never outnumber entries
+        void push(unsigned char op, int file, char *data, unsigned size, size_t offset, unsigned long long tag) {
+            unsigned tail = *sq_tail, idx = tail & *sq_mask;
+            io_uring_sqe *sqe = &sqes[idx];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = op;
+            sqe->fd = file;
+            sqe->addr = reinterpret_cast<unsigned long long>(data);
+            sqe->len = size;
+            sqe->off = offset;
+            sqe->user_data = tag;
+            sq_array[idx] = idx;
+            __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+            ++pending;
+        }
+
+        // submit what is pushed, and wait until at least wait requests complete
+        void enter(unsigned wait) {
+            while (pending || wait) {
+                int r = (int) syscall(__NR_io_uring_enter, fd, pending, wait, wait ? IORING_ENTER_GETEVENTS : 0,
+                                      nullptr, 0);
+                if (r < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+                if (r < 0) raise(errno, "failed to submit to io_uring");
+                if (r == 0 && !wait) return;
+                pending -= r;
+                wait = 0;
+            }
+        }
+
+        // next completion, false if there is none
+        bool pop(unsigned long long &tag, int &result) {
+            unsigned head = *cq_head;
+            if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) return false;
+            const io_uring_cqe &cqe = cqes[head & *cq_mask];
+            tag = cqe.user_data;
+            result = cqe.res;
+            __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+            return true;
+        }
+    } ring;
+
+    enum Op : unsigned char {
+        Read, Write
+    };
+
+    // a slot is taken from being queued until it completes, or until the page read is used
+    enum State : unsigned char {
+        Free, Queued, InFlight, Done
+    };
+
+    struct Slot {
+        State state;
+        Op op;
+        size_t offset;
+        unsigned size;
+        // bytes transferred, or -errno
+        int result;
+        char *data;
+        unsigned capacity;
+        // when it was taken, prefetched pages nobody asked for are dropped oldest first
+        unsigned long long stamp;
+    };
+
+public:
+    // requests queued or in flight at most
+    static constexpr unsigned Depth = 64;
+
+    // alignment of buffers, and of offsets and lengths with O_DIRECT
+    static constexpr size_t Block_Size = 4096;
+
+private:
+    Slot slots[Depth];
+    // slots queued and not submitted yet
+    unsigned queue[Depth];
+    unsigned queued;
+    unsigned long long clock;
+
+    int fd;
+    bool direct_io;
+    // errno of the first write that failed, 0 if none did
+    int write_error;
+    // page handed out by reader
+    char *page;
+    unsigned page_capacity;
+
+    static void reserve(char *&data, unsigned &capacity, unsigned size) {
+        if (size <= capacity) return;
+        release(data);
+        data = (char *) ::operator new(size, (std::align_val_t) Block_Size);
+        capacity = size;
+    }
+
+    static void release(char *data) {
+        if (data) ::operator delete(data, (std::align_val_t) Block_Size);
+    }
+
+    // length of I/O for size bytes
+    size_t span(size_t size) const {
+        return direct_io ? (size + Block_Size - 1) & ~(Block_Size - 1) : size;
+    }
+
+    bool overlaps(const Slot &s, size_t offset, size_t size) const {
+        return s.state != Free && s.offset < offset + size && offset < s.offset + s.size;
+    }
+
+    static void raise(int error, const char *what) {
+        throw std::system_error(error, std::generic_category(), what);
+    }
+
+    void complete(unsigned i, int result) {
+        Slot &s = slots[i];
+        if (s.op == Write) {
+            if (result != (int) s.size && !write_error) write_error = result < 0 ? -result : EIO;
+            s.state = Free;
+        } else {
+            s.result = result;
+            s.state = Done;
+        }
+    }
+
+    // collect completions, waiting for at least wait of them
+    void reap(unsigned wait) {
+        if (!ring.ready()) return;
+        if (wait) ring.enter(wait);
+        unsigned long long tag;
+        int result;
+        while (ring.pop(tag, result)) complete((unsigned) tag, result);
+    }
+
+    void wait(unsigned i) {
+        while (slots[i].state == Queued || slots[i].state == InFlight) {
+            if (slots[i].state == Queued) submit();
+            else
+                reap(1);
+        }
+    }
+
+    // a slot with room for size bytes
+    unsigned take(unsigned size) {
+        for (;;) {
+            reap(0);
+            unsigned victim = Depth;
+            for (unsigned i = 0; i < Depth; i++) {
+                if (slots[i].state == Free) {
+                    victim = i;
+                    break;
+                }
+                if (slots[i].state == Done && (victim == Depth || slots[i].stamp < slots[victim].stamp))
+                    victim = i;
+            }
+            if (victim == Depth) {
+                // everything is in flight once submitted
+                submit();
+                reap(1);
+                continue;
+            }
+            Slot &s = slots[victim];
+            s.state = Free;
+            reserve(s.data, s.capacity, size);
+            s.stamp = ++clock;
+            return victim;
+        }
+    }
+
+    void enqueue(unsigned i, Op op, size_t offset, unsigned size) {
+        Slot &s = slots[i];
+        s.op = op;
+        s.offset = offset;
+        s.size = size;
+        s.state = Queued;
+        queue[queued++] = i;
+    }
+
+    // wait for writes to a range to land, and drop reads of it if it is to be written
+    void settle(size_t offset, size_t size, bool writing) {
+        for (unsigned i = 0; i < Depth; i++) {
+            if (!overlaps(slots[i], offset, size)) continue;
+            if (slots[i].op == Write) wait(i);
+            else if (writing) {
+                wait(i);
+                slots[i].state = Free;
+            }
+        }
+    }
+
+public:
+    // number of batches handed to the kernel, and reads served by a prefetch
+    unsigned long long submits, prefetch_hits;
+
+    BasicUringStore() : in(&buf), out(&buf), queued(0), clock(0), fd(-1), direct_io(false), write_error(0),
+                        page(nullptr), page_capacity(0), submits(0), prefetch_hits(0) {
+        for (unsigned i = 0; i < Depth; i++) {
+            slots[i].state = Free;
+            slots[i].op = Read;
+            slots[i].data = nullptr;
+            slots[i].capacity = 0;
+        }
+    }
+
+    BasicUringStore(const BasicUringStore &) = delete;
+
+    ~BasicUringStore() {
+        try {
+            close();
+        } catch (const std::system_error &e) {
+            std::clog << "[Warning] " << e.what() << std::endl;
+        }
+        for (unsigned i = 0; i < Depth; i++) release(slots[i].data);
+        release(page);
+    }
+
+    // returns true if an existing data file is opened, io_uring is used if it is there and uring is set
+    bool open(const char *path, bool uring = true) {
+        fd = Direct ? ::open(path, O_RDWR | O_CREAT | O_DIRECT, 0644) : -1;
+        direct_io = fd >= 0;
+        // file systems such as tmpfs refuse O_DIRECT, pages are then cached by the kernel too
+        if (fd < 0) fd = ::open(path, O_RDWR | O_CREAT, 0644);
+        if (fd < 0) raise(errno, "failed to open data file");
+        struct stat st;
+        fstat(fd, &st);
+        if (uring) ring.setup(Depth);
+        return st.st_size > 0;
+    }
+
+    bool uring() const { return ring.ready(); }
+
+    bool direct() const { return direct_io; }
+
+    // throws if requests could not be completed, the data file is closed anyway
+    void close() {
+        if (fd < 0) return;
+        int error = 0;
+        try {
+            submit();
+            for (unsigned i = 0; i < Depth; i++) wait(i);
+        } catch (const std::system_error &e) {
+            error = e.code().value();
+        }
+        // requests still in flight are cancelled as the ring is torn down
+        ring.close();
+        for (unsigned i = 0; i < Depth; i++) slots[i].state = Free;
+        queued = 0;
+        ::close(fd);
+        fd = -1;
+        if (error) raise(error, "failed to close data file");
+    }
+
+    // pread or pwrite all of size bytes, returns bytes transferred or -errno
+    int transfer(Op op, char *data, unsigned size, size_t offset) {
+        unsigned done = 0;
+        while (done < size) {
+            ssize_t r = op == Read ? pread(fd, data + done, size - done, offset + done)
+                                   : pwrite(fd, data + done, size - done, offset + done);
+            if (r < 0 && errno == EINTR) continue;
+            if (r < 0) return -errno;
+            // end of file
+            if (r == 0) break;
+            done += (unsigned) r;
+        }
+        return (int) done;
+    }
+
+    // hand queued requests over, to the kernel, or served right away without io_uring
+    void submit() {
+        if (!queued) return;
+        for (unsigned j = 0; j < queued; j++) {
+            unsigned i = queue[j];
+            Slot &s = slots[i];
+            if (ring.ready()) {
+                ring.push(s.op == Read ? IORING_OP_READ : IORING_OP_WRITE, fd, s.data, s.size, s.offset, i);
+                s.state = InFlight;
+            } else
+                complete(i, transfer(s.op, s.data, s.size, s.offset));
+        }
+        queued = 0;
+        if (ring.ready()) ring.enter(0);
+        ++submits;
+    }
+
+    // queue a read of a range about to be asked for, started on submit
+    void prefetch(size_t offset, size_t size) {
+        if (fd < 0) return;
+        assert(!direct_io || offset % Block_Size == 0);
+        size = span(size);
+        for (unsigned i = 0; i < Depth; i++) {
+            // read anyway, or only after a write in the way
+            if (overlaps(slots[i], offset, size) && (slots[i].op == Write || slots[i].offset == offset)) return;
+        }
+        enqueue(take(size), Read, offset, size);
+    }
+
+    std::istream &reader(size_t offset, size_t size) {
+        assert(!direct_io || offset % Block_Size == 0);
+        size = span(size);
+        settle(offset, size, false);
+        unsigned i = 0;
+        while (i < Depth && !(slots[i].state != Free && slots[i].op == Read &&
+                                slots[i].offset == offset && slots[i].size >= size))
+            i++;
+        int n;
+        if (i < Depth) {
+            wait(i);
+            std::swap(page, slots[i].data);
+            std::swap(page_capacity, slots[i].capacity);
+            n = slots[i].result;
+            slots[i].state = Free;
+            ++prefetch_hits;
+        } else {
+            // what is queued goes on meanwhile
+            submit();
+            reserve(page, page_capacity, size);
+            n = transfer(Read, page, size, offset);
+        }
+        // a page read short ends early, and the stream reading it fails
+        if (n < 0) raise(-n, "failed to read page");
+        buf.view_get(page, page + n);
+        in.clear();
+        return in;
+    }
+
+    // the write goes with the next batch, by when the stream is filled
+    std::ostream &writer(size_t offset, size_t size) {
+        assert(!direct_io || offset % Block_Size == 0);
+        size_t length = span(size);
+        settle(offset, length, true);
+        unsigned i = take(length);
+        enqueue(i, Write, offset, length);
+        memset(slots[i].data + size, 0, length - size);
+        buf.view_put(slots[i].data, slots[i].data + size);
+        out.clear();
+        return out;
+    }
+
+    // make everything written so far durable, throws if some of it is not
+    void sync() {
+        submit();
+        for (unsigned i = 0; i < Depth; i++)
+            if (slots[i].op == Write) wait(i);
+        if (write_error) raise(write_error, "failed to write page");
+        int r;
+        while ((r = fsync(fd)) != 0 && errno == EINTR);
+        if (r != 0) raise(errno, "failed to sync data file");
+    }
+};
+
+using UringStore = BasicUringStore<>;
+
+// pages bypass the page cache of the kernel
+using DirectStore = BasicUringStore<true>;
+
+#endif //BPLUSTREE_URINGSTORE_HPP
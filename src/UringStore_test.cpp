@@ -0,0 +1,221 @@
+//
+// Created by Alex Chi on 2019-06-14.
+//
+
+#include <catch.hpp>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "BTree.hpp"
+#include "UringStore.hpp"
+
+using UringMap = BTree<int, long long, 512, 32, Default_Max_Pages(), UringStore>;
+using DirectMap = BTree<int, long long, 512, 32, Default_Max_Pages(), DirectStore>;
+using FileMap = BTree<int, long long, 512, 32, Default_Max_Pages(), FileStore>;
+
+TEST_CASE("UringStore", "[Persistence]") {
+    SECTION("should read what is written with and without io_uring") {
+        for (bool uring : {true, false}) {
+            remove("uring.test");
+            {
+                UringStore store;
+                REQUIRE (!store.open("uring.test", uring));
+                if (!uring) REQUIRE (!store.uring());
+                for (int i = 0; i < 1024; i++) {
+                    long long offset = (long long) i * 4096;
+                    store.writer(offset, sizeof(offset)).write(reinterpret_cast<char *>(&offset), sizeof(offset));
+                }
+                // writes queued or in flight are waited for before the range is read or written again
+                long long x = 233;
+                store.writer(4096, sizeof(x)).write(reinterpret_cast<char *>(&x), sizeof(x));
+                REQUIRE (store.reader(4096, sizeof(x)).read(reinterpret_cast<char *>(&x), sizeof(x)));
+                REQUIRE (x == 233);
+                REQUIRE (store.submits < 1024);
+            }
+            {
+                UringStore store;
+                REQUIRE (store.open("uring.test", uring));
+                for (int i = 0; i < 1024; i++) store.prefetch(i * 4096, sizeof(long long));
+                store.submit();
+                for (int i = 0; i < 1024; i++) {
+                    long long offset;
+                    REQUIRE (store.reader(i * 4096, sizeof(offset)).read(reinterpret_cast<char *>(&offset), sizeof(offset)));
+                    REQUIRE (offset == (i == 1 ? 233 : (long long) i * 4096));
+                }
+                REQUIRE (store.prefetch_hits > 0);
+            }
+            remove("uring.test");
+        }
+    }
+
+    SECTION("should raise failed writes on sync") {
+        for (bool uring : {true, false}) {
+            remove("uring.test");
+            pid_t pid = fork();
+            if (pid == 0) {
+                // writes past the limit fail with EFBIG
+                signal(SIGXFSZ, SIG_IGN);
+                rlimit limit{4096, 4096};
+                setrlimit(RLIMIT_FSIZE, &limit);
+                UringStore store;
+                store.open("uring.test", uring);
+                for (int i = 0; i < 16; i++) {
+                    long long offset = (long long) i * 4096;
+                    store.writer(offset, sizeof(offset)).write(reinterpret_cast<char *>(&offset), sizeof(offset));
+                }
+                try {
+                    store.sync();
+                } catch (const std::system_error &e) {
+                    _exit(e.code().value() == EFBIG ? 0 : 2);
+                }
+                _exit(1);
+            }
+            int status;
+            waitpid(pid, &status, 0);
+            REQUIRE (WIFEXITED(status));
+            REQUIRE (WEXITSTATUS(status) == 0);
+            remove("uring.test");
+        }
+    }
+
+    SECTION("should raise failed page writes on checkpoint") {
+        remove("persist_uring.db");
+        pid_t pid = fork();
+        if (pid == 0) {
+            signal(SIGXFSZ, SIG_IGN);
+            rlimit limit{65536, 65536};
+            setrlimit(RLIMIT_FSIZE, &limit);
+            UringMap m("persist_uring.db");
+            for (int i = 0; i < 100000; i++) m.insert(i, i);
+            // the write crossing the limit comes up short, and those after it fail
+            try {
+                m.checkpoint();
+            } catch (const std::system_error &) {
+                _exit(0);
+            }
+            _exit(1);
+        }
+        int status;
+        waitpid(pid, &status, 0);
+        REQUIRE (WIFEXITED(status));
+        REQUIRE (WEXITSTATUS(status) == 0);
+        remove("persist_uring.db");
+    }
+
+    SECTION("should persist data") {
+        const int test_size = 100000;
+        remove("persist_uring.db");
+        {
+            UringMap m("persist_uring.db");
+            for (int i = 0; i < test_size; i++) m.insert(i, i);
+            REQUIRE (m.storage->stat.swap_out > 0);
+        }
+        {
+            UringMap m("persist_uring.db");
+            REQUIRE (m.size() == test_size);
+            int *keys = new int[test_size];
+            long long *values = new long long[test_size];
+            bool *found = new bool[test_size];
+            for (int i = 0; i < test_size; i++) keys[i] = test_size - 1 - i;
+            REQUIRE (m.multi_get(keys, test_size, values, found) == test_size);
+            for (int i = 0; i < test_size; i++) REQUIRE (values[i] == keys[i]);
+            REQUIRE (m.storage->store.prefetch_hits > 0);
+            delete[] keys;
+            delete[] values;
+            delete[] found;
+            for (int i = 0; i < test_size; i++) {
+                REQUIRE (*m.query(i) == i);
+                if (i % 2) m.remove(i);
+            }
+        }
+        {
+            UringMap m("persist_uring.db");
+            long long sum = 0;
+            REQUIRE (m.scan(0, test_size, [&](const int *, const long long *values, unsigned n) {
+                for (unsigned i = 0; i < n; i++) sum += values[i];
+            }) == test_size / 2);
+            REQUIRE (sum == (long long) (test_size / 2) * (test_size / 2 - 1));
+        }
+        remove("persist_uring.db");
+    }
+
+    SECTION("should read what is written with O_DIRECT") {
+        remove("uring.test");
+        {
+            DirectStore store;
+            REQUIRE (!store.open("uring.test"));
+            for (int i = 0; i < 1024; i++) {
+                long long offset = (long long) i * 4096;
+                store.writer(offset, sizeof(offset)).write(reinterpret_cast<char *>(&offset), sizeof(offset));
+            }
+        }
+        {
+            DirectStore store;
+            REQUIRE (store.open("uring.test"));
+            for (int i = 0; i < 1024; i += 2) store.prefetch(i * 4096, sizeof(long long));
+            store.submit();
+            for (int i = 0; i < 1024; i++) {
+                long long offset;
+                REQUIRE (store.reader(i * 4096, sizeof(offset)).read(reinterpret_cast<char *>(&offset), sizeof(offset)));
+                REQUIRE (offset == (long long) i * 4096);
+            }
+        }
+        remove("uring.test");
+    }
+
+    SECTION("should persist data with O_DIRECT") {
+        const int test_size = 100000;
+        remove("persist_uring.db");
+        {
+            FileMap m("persist_uring.db");
+            for (int i = 0; i < test_size; i++) m.insert(i, i);
+        }
+        {
+            DirectMap m("persist_uring.db");
+            for (int i = 0; i < test_size; i++) {
+                REQUIRE (*m.query(i) == i);
+                if (i % 2) m.remove(i);
+            }
+            for (int i = test_size; i < test_size * 2; i++) m.insert(i, i);
+            REQUIRE (m.storage->stat.swap_out > 0);
+        }
+        {
+            DirectMap m("persist_uring.db");
+            REQUIRE (m.size() == test_size / 2 * 3);
+        }
+        {
+            FileMap m("persist_uring.db");
+            for (int i = 0; i < test_size * 2; i++) {
+                if (i < test_size && i % 2) REQUIRE (m.query(i) == nullptr);
+                else
+                    REQUIRE (*m.query(i) == i);
+            }
+        }
+        remove("persist_uring.db");
+    }
+
+    SECTION("should share file format with fstream store") {
+        const int test_size = 100000;
+        remove("persist_uring.db");
+        {
+            FileMap m("persist_uring.db");
+            for (int i = 0; i < test_size; i++) m.insert(i, i);
+        }
+        {
+            UringMap m("persist_uring.db");
+            for (int i = 0; i < test_size; i++) {
+                REQUIRE (*m.query(i) == i);
+                m.insert(i + test_size, i + test_size);
+            }
+        }
+        {
+            FileMap m("persist_uring.db");
+            REQUIRE (m.size() == test_size * 2);
+            for (int i = 0; i < test_size * 2; i++) REQUIRE (*m.query(i) == i);
+        }
+        remove("persist_uring.db");
+    }
+}
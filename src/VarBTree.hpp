@@ -0,0 +1,395 @@
+//
+// Created by Alex Chi on 2019-06-19.
+//
+
+#ifndef BPLUSTREE_VARBTREE_HPP
+#define BPLUSTREE_VARBTREE_HPP
+
+#include <string>
+#include "BTree.hpp"
+#include "SlottedPage.hpp"
+
+/*
+ * B+ tree of variable-length keys and values, such as strings and blobs, kept in slotted
+ * pages of Page_Size bytes and ordered by Compare. A key and its value take at most
+ * Max_Entry() bytes, so that a page split in two always has room for one more entry.
+ *
+ * Blocks are merged with a neighbour once less than a quarter full if both fit in one page,
+ * and are never borrowed from, as entries of different sizes don't balance by count.
+ */
+template<unsigned Page_Size = 4096,
+        typename Compare = Bytewise,
+        unsigned Max_Page_In_Memory = 65536,
+        unsigned Max_Page = Default_Max_Pages(),
+        typename Store = FileStore,
+        template<unsigned, typename> class Replacer = TwoQueue>
+class VarBTree {
+public:
+    using BlockIdx = unsigned;
+    using Page = SlottedPage<Page_Size, Compare>;
+
+    static constexpr unsigned Max_Entry() { return Page::Body_Size() / 4 - sizeof(typename Page::Slot); }
+
+    class Leaf;
+
+    class Index;
+
+    class Block;
+
+    using BPersistence = Persistence<Block, Index, Leaf, Max_Page, Max_Page_In_Memory, Store, SingleThread, Replacer>;
+    using Ref = typename BPersistence::Ref;
+    using ConstRef = typename BPersistence::ConstRef;
+
+    struct Block : public Serializable {
+        BlockIdx idx;
+        Page page;
+        BPersistence *storage;
+        mutable SingleThread::Latch latch;
+        SingleThread::Version version;
+
+        Block() : storage(nullptr) {}
+
+        virtual ~Block() {}
+
+        virtual bool is_leaf() const = 0;
+
+        void touch() {
+            if (storage) storage->touch(idx);
+        }
+
+        bool should_merge() const { return page.used() * 4 < Page::Body_Size(); }
+
+        unsigned storage_size() const override { return sizeof(Page); }
+
+        void serialize(std::ostream &out) const override {
+            out.write(reinterpret_cast<const char *>(&page), sizeof(page));
+        }
+
+        void deserialize(std::istream &in) override {
+            in.read(reinterpret_cast<char *>(&page), sizeof(page));
+        }
+    };
+
+    // entry i of an index is the separator before child i + 1, whose idx is its value
+    struct Index : public Block {
+        bool is_leaf() const override { return false; }
+
+        BlockIdx child(unsigned i) const {
+            if (i == 0) return this->page.first;
+            BlockIdx c;
+            memcpy(&c, this->page.value(i - 1), sizeof(c));
+            return c;
+        }
+
+        bool insert_child(unsigned pos, const std::string &k, BlockIdx c) {
+            return this->page.insert(pos, k.data(), k.size(), reinterpret_cast<const char *>(&c), sizeof(c));
+        }
+    };
+
+    struct Leaf : public Block {
+        bool is_leaf() const override { return true; }
+    };
+
+    mutable BPersistence *storage;
+
+    VarBTree(const char *path = nullptr) {
+        storage = new BPersistence(path);
+    }
+
+    VarBTree(const VarBTree &) = delete;
+
+    VarBTree &operator=(const VarBTree &) = delete;
+
+    ~VarBTree() { delete storage; }
+
+    unsigned &root_idx() const { return storage->persistence_index->root_idx; }
+
+    unsigned size() const { return storage->persistence_index->size; }
+
+    Leaf *create_leaf() {
+        Leaf *block = storage->new_leaf();
+        storage->record(block);
+        return block;
+    }
+
+    Index *create_index() {
+        Index *block = storage->new_index();
+        storage->record(block);
+        return block;
+    }
+
+    // free a block merged away, after its last reference is released
+    void dispose(Block *block) {
+        storage->deregister(block);
+        storage->retire(block);
+    }
+
+    static const Index *into_index(const Block *b) {
+        assert(!b->is_leaf());
+        return static_cast<const Index *>(b);
+    }
+
+    static Index *into_index(Block *b) {
+        assert(!b->is_leaf());
+        return static_cast<Index *>(b);
+    }
+
+    unsigned height() const {
+        if (!root_idx()) return 0;
+        unsigned h = 1;
+        for (ConstRef blk = storage->read(root_idx()); !blk->is_leaf(); ++h)
+            blk = storage->read(blk->page.first);
+        return h;
+    }
+
+    // bounds of keys a block may hold, low <= k < high, null if unbounded
+    struct Fences {
+        const std::string *low, *high;
+    };
+
+    // fences of child pos are the separators around it, or fences of the index at either end
+    static Fences child_fences(const Page &page, unsigned pos, Fences fences, std::string &low, std::string &high) {
+        if (pos > 0) {
+            page.key(pos - 1, low);
+            fences.low = &low;
+        }
+        if (pos < page.count) {
+            page.key(pos, high);
+            fences.high = &high;
+        }
+        return fences;
+    }
+
+    // rewrite a page under the prefix all keys between fences start with
+    static bool set_prefix(Page &page, Fences fences) {
+        if (!fences.low || !fences.high) return page.set_prefix("", 0);
+        const std::string &low = *fences.low, &high = *fences.high;
+        return page.set_prefix(low.data(), Compare::common_prefix(low.data(), low.size(), high.data(), high.size()));
+    }
+
+    ConstRef find_leaf(const std::string &k) const {
+        ConstRef blk = storage->read(root_idx());
+        while (!blk->is_leaf()) {
+            const Index *index = into_index(blk.get());
+            blk = storage->read(index->child(index->page.upper_bound(k.data(), k.size())));
+        }
+        return blk;
+    }
+
+    bool query(const std::string &k, std::string &v) const {
+        if (!root_idx()) return false;
+        bool found;
+        {
+            ConstRef leaf = find_leaf(k);
+            unsigned pos = leaf->page.lower_bound(k.data(), k.size());
+            found = leaf->page.match(pos, k.data(), k.size());
+            if (found) v.assign(leaf->page.value(pos), leaf->page.value_size(pos));
+        }
+        storage->swap_out_pages();
+        return found;
+    }
+
+    /*
+     * Call f(key, key_size, value, value_size) for entries with lo <= key < hi in order.
+     * Returns number of entries visited.
+     */
+    template<typename F>
+    unsigned scan(const std::string &lo, const std::string &hi, F f) const {
+        if (!root_idx()) return 0;
+        unsigned n = 0;
+        std::string key;
+        {
+            ConstRef leaf = find_leaf(lo);
+            unsigned pos = leaf->page.lower_bound(lo.data(), lo.size());
+            for (;;) {
+                const Page &page = leaf->page;
+                for (; pos < page.count; pos++) {
+                    if (page.compare(pos, hi.data(), hi.size()) >= 0) goto done;
+                    page.key(pos, key);
+                    f(key.data(), key.size(), page.value(pos), page.value_size(pos));
+                    ++n;
+                }
+                if (!page.next) break;
+                leaf = storage->read(page.next);
+                pos = 0;
+            }
+        }
+        done:
+        storage->swap_out_pages();
+        return n;
+    }
+
+    // entries larger than Max_Entry() fail
+    OperationResult insert(const std::string &k, const std::string &v) {
+        if (k.size() + std::max(v.size(), sizeof(BlockIdx)) > Max_Entry()) return OperationResult::Fail;
+        if (!root_idx()) {
+            root_idx() = create_leaf()->idx;
+            storage->unpin(root_idx());
+        }
+        std::string split_key;
+        BlockIdx right = 0;
+        OperationResult result = insert(storage->get(root_idx()).get(), k, v, Fences{nullptr, nullptr},
+                                        split_key, right);
+        if (right) {
+            // a split root goes under a new Index root
+            Index *index = create_index();
+            index->page.first = root_idx();
+            index->insert_child(0, split_key, right);
+            root_idx() = index->idx;
+            storage->unpin(index->idx);
+        }
+        if (result == OperationResult::Success) ++storage->persistence_index->size;
+        storage->swap_out_pages();
+        return result;
+    }
+
+    /*
+     * insert into the subtree of blk. If blk splits, right is the block holding keys
+     * from split_key on.
+     */
+    OperationResult insert(Block *blk, const std::string &k, const std::string &v, Fences fences,
+                           std::string &split_key, BlockIdx &right) {
+        Page &page = blk->page;
+        if (blk->is_leaf()) {
+            unsigned pos = page.lower_bound(k.data(), k.size());
+            if (page.match(pos, k.data(), k.size())) return OperationResult::Duplicated;
+            blk->touch();
+            if (page.insert(pos, k.data(), k.size(), v.data(), v.size())) return OperationResult::Success;
+            Ref that = split(blk, fences, split_key);
+            right = that->idx;
+            Page &target = Compare()(k.data(), k.size(), split_key.data(), split_key.size()) < 0 ? page : that->page;
+            bool inserted = target.insert(target.lower_bound(k.data(), k.size()), k.data(), k.size(), v.data(), v.size());
+            assert(inserted);
+            return OperationResult::Success;
+        }
+        Index *index = into_index(blk);
+        unsigned pos = page.upper_bound(k.data(), k.size());
+        std::string low, high, child_key;
+        BlockIdx child_right = 0;
+        OperationResult result = insert(storage->get(index->child(pos)).get(), k, v,
+                                        child_fences(page, pos, fences, low, high), child_key, child_right);
+        if (child_right) {
+            blk->touch();
+            if (index->insert_child(pos, child_key, child_right)) return result;
+            Ref that = split(blk, fences, split_key);
+            right = that->idx;
+            Index *target = Compare()(child_key.data(), child_key.size(), split_key.data(), split_key.size()) < 0
+                            ? index : into_index(that.get());
+            bool inserted = target->insert_child(target->page.upper_bound(child_key.data(), child_key.size()),
+                                                 child_key, child_right);
+            assert(inserted);
+        }
+        return result;
+    }
+
+    /*
+     * Move the upper half of blk by bytes to a new block on its right. Keys of the new block
+     * are no less than split_key. A leaf is separated by the shortest key between both halves
+     * (suffix truncation). The separator in the middle of an index moves up, and its child
+     * becomes the leftmost child of the new block. Both blocks take the prefix shared
+     * between their narrower fences.
+     */
+    Ref split(Block *blk, Fences fences, std::string &split_key) {
+        Page &page = blk->page;
+        unsigned pos = page.split_point();
+        Block *that;
+        if (blk->is_leaf()) {
+            that = create_leaf();
+            std::string last;
+            page.key(pos - 1, last);
+            page.key(pos, split_key);
+            split_key.resize(Compare::separator(last.data(), last.size(), split_key.data(), split_key.size()));
+        } else {
+            that = create_index();
+            page.key(pos, split_key);
+            that->page.first = into_index(blk)->child(pos + 1);
+            page.remove(pos);
+        }
+        set_prefix(that->page, Fences{&split_key, fences.high});
+        page.move_to(that->page, pos);
+        that->page.next = page.next;
+        page.next = that->idx;
+        // the prefix only grows, so entries left take no more space
+        bool shrunk = set_prefix(page, Fences{fences.low, &split_key});
+        assert(shrunk);
+        return Ref(storage, that);
+    }
+
+    bool remove(const std::string &k) {
+        if (!root_idx()) return false;
+        bool removed;
+        {
+            Ref root = storage->get(root_idx());
+            removed = remove(root.get(), k, Fences{nullptr, nullptr});
+            if (removed && !root->is_leaf() && root->page.count == 0) {
+                // an Index root without keys is replaced by its only child
+                root_idx() = root->page.first;
+                dispose(root.get());
+            }
+        }
+        if (removed) --storage->persistence_index->size;
+        storage->swap_out_pages();
+        return removed;
+    }
+
+    bool remove(Block *blk, const std::string &k, Fences fences) {
+        Page &page = blk->page;
+        if (blk->is_leaf()) {
+            unsigned pos = page.lower_bound(k.data(), k.size());
+            if (!page.match(pos, k.data(), k.size())) return false;
+            blk->touch();
+            page.remove(pos);
+            return true;
+        }
+        Index *index = into_index(blk);
+        unsigned pos = page.upper_bound(k.data(), k.size());
+        bool merge;
+        {
+            std::string low, high;
+            Ref child = storage->get(index->child(pos));
+            if (!remove(child.get(), k, child_fences(page, pos, fences, low, high))) return false;
+            merge = child->should_merge();
+        }
+        if (merge && page.count > 0) merge_children(index, pos == 0 ? 0 : pos - 1, fences);
+        return true;
+    }
+
+    /*
+     * merge child pos + 1 of index into child pos, if they fit in one page under the prefix
+     * shared between fences of both
+     */
+    void merge_children(Index *index, unsigned pos, Fences fences) {
+        Page &page = index->page;
+        Ref left = storage->get(index->child(pos));
+        Ref right = storage->get(index->child(pos + 1));
+        Page &l = left->page, &r = right->page;
+        std::string low, high, separator;
+        if (pos > 0) {
+            page.key(pos - 1, low);
+            fences.low = &low;
+        }
+        if (pos + 1 < page.count) {
+            page.key(pos + 1, high);
+            fences.high = &high;
+        }
+        Page merged;
+        merged.first = l.first;
+        merged.next = r.next;
+        if (!set_prefix(merged, fences) || !l.copy_to(merged, 0)) return;
+        if (!left->is_leaf()) {
+            BlockIdx first = r.first;
+            page.key(pos, separator);
+            if (!merged.append(separator.data(), separator.size(), reinterpret_cast<const char *>(&first),
+                               sizeof(first)))
+                return;
+        }
+        if (!r.copy_to(merged, 0)) return;
+        index->touch();
+        left->touch();
+        l = merged;
+        page.remove(pos);
+        dispose(right.get());
+    }
+};
+
+#endif //BPLUSTREE_VARBTREE_HPP
@@ -0,0 +1,226 @@
+//
+// Created by Alex Chi on 2019-06-19.
+//
+
+#include <catch.hpp>
+#include <cstdio>
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+#include "VarBTree.hpp"
+
+using Page = SlottedPage<256>;
+using VarMap = VarBTree<>;
+using SmallVarMap = VarBTree<1024, Bytewise, 16>;
+
+static std::string var_key(int i) {
+    return "user/" + std::to_string(i * 7919 % 100003) + std::string(i % 37, 'k');
+}
+
+static std::string var_value(int i) {
+    return std::string(i % 97, (char) ('a' + i % 26));
+}
+
+static std::string url_key(int i) {
+    char k[64];
+    sprintf(k, "https://example.com/users/profile/%08d", i);
+    return k;
+}
+
+template<typename P>
+static std::string key_of(const P &page, unsigned i) {
+    std::string k;
+    page.key(i, k);
+    return k;
+}
+
+// orders keys as Bytewise does, but without prefix compression and suffix truncation
+struct Plain : Bytewise {
+    static unsigned common_prefix(const char *, unsigned, const char *, unsigned) { return 0; }
+
+    static unsigned separator(const char *, unsigned, const char *, unsigned b_size) { return b_size; }
+};
+
+TEST_CASE("SlottedPage", "[SlottedPage]") {
+    SECTION("should keep entries in key order without padding") {
+        Page page;
+        const char *keys[] = {"pear", "apple", "banana", "a", "fig"};
+        for (const char *k : keys) {
+            unsigned n = strlen(k);
+            REQUIRE (page.insert(page.lower_bound(k, n), k, n, k, n));
+        }
+        REQUIRE (page.count == 5);
+        const char *sorted[] = {"a", "apple", "banana", "fig", "pear"};
+        unsigned used = 0;
+        for (unsigned i = 0; i < 5; i++) {
+            REQUIRE (key_of(page, i) == sorted[i]);
+            REQUIRE (std::string(page.value(i), page.value_size(i)) == sorted[i]);
+            used += Page::entry_size(strlen(sorted[i]), strlen(sorted[i]));
+        }
+        REQUIRE (page.used() == used);
+        REQUIRE (page.lower_bound("b", 1) == 2);
+        REQUIRE (page.upper_bound("banana", 6) == 3);
+        REQUIRE (page.match(3, "fig", 3));
+        REQUIRE (!page.match(2, "fig", 3));
+    }
+
+    SECTION("should reuse space of removed entries") {
+        Page page;
+        std::string v(40, 'v');
+        int n = 0;
+        while (page.append(std::to_string(n).data(), std::to_string(n).size(), v.data(), v.size())) ++n;
+        REQUIRE (n > 2);
+        REQUIRE (!page.fits(1, 40));
+        page.remove(0);
+        REQUIRE (page.garbage > 0);
+        REQUIRE (page.fits(1, 40));
+        REQUIRE (page.insert(0, "0", 1, v.data(), v.size()));
+        REQUIRE (page.garbage == 0);
+        for (int i = 0; i < n; i++) {
+            REQUIRE (key_of(page, i) == std::to_string(i));
+            REQUIRE (std::string(page.value(i), page.value_size(i)) == v);
+        }
+    }
+
+    SECTION("should move upper half to another page") {
+        Page page, that;
+        for (int i = 0; i < 10; i++) REQUIRE (page.append(std::to_string(i).data(), 1, "x", 1));
+        unsigned pos = page.split_point();
+        REQUIRE (pos == 5);
+        page.move_to(that, pos);
+        REQUIRE (page.count == 5);
+        REQUIRE (that.count == 5);
+        REQUIRE (key_of(that, 0) == "5");
+    }
+
+    SECTION("should store the prefix of keys once") {
+        Page page, plain;
+        REQUIRE (page.set_prefix("user/", 5));
+        for (int i = 0; i < 10; i++) {
+            std::string k = "user/" + std::to_string(i);
+            REQUIRE (page.append(k.data(), k.size(), "v", 1));
+            REQUIRE (plain.append(k.data(), k.size(), "v", 1));
+        }
+        REQUIRE (page.used() == plain.used() - 9 * 5);
+        REQUIRE (key_of(page, 3) == "user/3");
+        REQUIRE (page.lower_bound("user/3", 6) == 3);
+        REQUIRE (page.upper_bound("user/3", 6) == 4);
+        REQUIRE (page.lower_bound("a", 1) == 0);
+        REQUIRE (page.lower_bound("user", 4) == 0);
+        REQUIRE (page.lower_bound("z", 1) == 10);
+        REQUIRE (page.compare(0, "user", 4) > 0);
+        REQUIRE (page.set_prefix("user/", 4));
+        REQUIRE (page.used() == plain.used() - 9 * 4);
+        for (int i = 0; i < 10; i++) REQUIRE (key_of(page, i) == "user/" + std::to_string(i));
+    }
+
+    SECTION("should choose shortest separator") {
+        REQUIRE (Bytewise::separator("abc", 3, "abzz", 4) == 3);
+        REQUIRE (Bytewise::separator("ab", 2, "abc", 3) == 3);
+        REQUIRE (Bytewise::common_prefix("user/1", 6, "user/2", 6) == 5);
+    }
+}
+
+TEST_CASE("VarBTree", "[VarBTree]") {
+    SECTION("should insert, query and remove variable-length entries") {
+        const int test_size = 20000;
+        VarMap m;
+        std::vector<int> order(test_size);
+        for (int i = 0; i < test_size; i++) order[i] = i;
+        std::shuffle(order.begin(), order.end(), std::mt19937(233));
+        for (int i : order) REQUIRE (m.insert(var_key(i), var_value(i)) == OperationResult::Success);
+        REQUIRE (m.insert(var_key(0), "") == OperationResult::Duplicated);
+        REQUIRE (m.size() == test_size);
+        std::string v;
+        for (int i = 0; i < test_size; i++) {
+            REQUIRE (m.query(var_key(i), v));
+            REQUIRE (v == var_value(i));
+        }
+        REQUIRE (!m.query("user/", v));
+        for (int i : order) if (i % 3) REQUIRE (m.remove(var_key(i)));
+        REQUIRE (!m.remove(var_key(1)));
+        for (int i = 0; i < test_size; i++) REQUIRE (m.query(var_key(i), v) == (i % 3 == 0));
+        for (int i = 0; i < test_size; i += 3) REQUIRE (m.remove(var_key(i)));
+        REQUIRE (m.size() == 0);
+        REQUIRE (m.storage->read(m.root_idx())->is_leaf());
+    }
+
+    SECTION("should scan in key order") {
+        const int test_size = 5000;
+        VarMap m;
+        std::vector<std::string> keys;
+        for (int i = 0; i < test_size; i++) {
+            keys.push_back(var_key(i));
+            m.insert(var_key(i), var_value(i));
+        }
+        std::sort(keys.begin(), keys.end());
+        std::vector<std::string> scanned;
+        REQUIRE (m.scan(keys[100], keys[4000], [&](const char *k, unsigned k_size, const char *, unsigned) {
+            scanned.emplace_back(k, k_size);
+        }) == 3900);
+        REQUIRE (std::equal(scanned.begin(), scanned.end(), keys.begin() + 100));
+    }
+
+    SECTION("should compress prefixes and truncate separators") {
+        const int test_size = 50000;
+        VarBTree<1024> m;
+        VarBTree<1024, Plain> plain;
+        std::vector<int> order(test_size);
+        for (int i = 0; i < test_size; i++) order[i] = i;
+        std::shuffle(order.begin(), order.end(), std::mt19937(233));
+        for (int i : order) {
+            REQUIRE (m.insert(url_key(i), "v") == OperationResult::Success);
+            REQUIRE (plain.insert(url_key(i), "v") == OperationResult::Success);
+        }
+        long long pages = m.storage->stat.create - m.storage->stat.destroy;
+        long long plain_pages = plain.storage->stat.create - plain.storage->stat.destroy;
+        REQUIRE (pages * 2 < plain_pages);
+        REQUIRE (m.height() < plain.height());
+        {
+            auto root = m.storage->read(m.root_idx());
+            REQUIRE (!root->is_leaf());
+            unsigned separators = 0;
+            for (unsigned i = 0; i < root->page.count; i++) separators += root->page.key_size(i);
+            REQUIRE (separators < root->page.count * url_key(0).size());
+        }
+        std::string v;
+        for (int i = 0; i < test_size; i++) REQUIRE (m.query(url_key(i), v));
+        for (int i = 0; i < test_size; i++) if (i % 5) REQUIRE (m.remove(url_key(i)));
+        for (int i = 0; i < test_size; i++) REQUIRE (m.query(url_key(i), v) == (i % 5 == 0));
+        REQUIRE (m.scan("", "~", [](const char *, unsigned, const char *, unsigned) {}) == test_size / 5);
+    }
+
+    SECTION("should reject entries larger than a quarter page") {
+        VarMap m;
+        REQUIRE (m.insert("k", std::string(VarMap::Max_Entry(), 'v')) == OperationResult::Fail);
+        REQUIRE (m.insert("k", std::string(VarMap::Max_Entry() - 1, 'v')) == OperationResult::Success);
+    }
+
+    SECTION("should persist data") {
+        const int test_size = 20000;
+        remove("persist_var.db");
+        {
+            SmallVarMap m("persist_var.db");
+            for (int i = 0; i < test_size; i++) m.insert(var_key(i), var_value(i));
+            REQUIRE (m.storage->stat.swap_out > 0);
+        }
+        {
+            SmallVarMap m("persist_var.db");
+            REQUIRE (m.size() == test_size);
+            std::string v;
+            for (int i = 0; i < test_size; i++) {
+                REQUIRE (m.query(var_key(i), v));
+                REQUIRE (v == var_value(i));
+                if (i % 2) REQUIRE (m.remove(var_key(i)));
+            }
+        }
+        {
+            SmallVarMap m("persist_var.db");
+            REQUIRE (m.size() == test_size / 2);
+            std::string v;
+            for (int i = 0; i < test_size; i++) REQUIRE (m.query(var_key(i), v) == (i % 2 == 0));
+        }
+        remove("persist_var.db");
+    }
+}
@@ -0,0 +1,264 @@
+//
+// Created by Alex Chi on 2019-06-13.
+//
+
+#ifndef BPLUSTREE_WAL_HPP
+#define BPLUSTREE_WAL_HPP
+
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <system_error>
+#include <iostream>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <fcntl.h>
+#include <unistd.h>
+
+/*
+ * Write-ahead log with group commit.
+ * Records are buffered in memory and written with a single fsync once group_size
+ * records are pending, or group_interval microseconds after the first pending one.
+ * An operation is durable once a sync covering its lsn has completed.
+ * A failed write or sync fails the log: records from then on are not durable, and the
+ * next append or sync throws std::system_error. So do open and replay on failure.
+ *
+ * Storage Mapping of a record
+ * | 8 lsn | 1 op | 4 length | length payload | 4 checksum |
+ */
+class WAL {
+    static constexpr unsigned Header_Size() { return sizeof(unsigned long long) + sizeof(char) + sizeof(unsigned); }
+
+    static unsigned checksum(const char *data, unsigned length, unsigned hash = 2166136261u) {
+        // FNV-1a
+        for (unsigned i = 0; i < length; i++) hash = (hash ^ (unsigned char) data[i]) * 16777619u;
+        return hash;
+    }
+
+    int fd;
+    char *buffer;
+    unsigned buffer_size, buffer_capacity;
+    unsigned pending;
+    std::chrono::steady_clock::time_point first_pending;
+
+    std::mutex lock;
+    std::condition_variable cv;
+    std::thread flusher;
+    bool stopped;
+    // errno of the write or sync that failed the log, 0 if none did
+    int error;
+
+    static void raise(int error, const char *what) {
+        throw std::system_error(error, std::generic_category(), what);
+    }
+
+    // keep the first error, the log is failed from then on
+    bool fail(int e) {
+        if (!error) error = e;
+        return false;
+    }
+
+    void check() {
+        if (error) raise(error, "write-ahead log failed");
+    }
+
+    static int sync_fd(int fd) {
+        int result;
+        while ((result = fdatasync(fd)) != 0 && errno == EINTR);
+        return result;
+    }
+
+    void reserve(unsigned size) {
+        if (size <= buffer_capacity) return;
+        while (buffer_capacity < size) buffer_capacity *= 2;
+        char *_buffer = new char[buffer_capacity];
+        memcpy(_buffer, buffer, buffer_size);
+        delete[] buffer;
+        buffer = _buffer;
+    }
+
+    // false if the log is failed, synced_lsn only advances once records are on disk
+    bool flush_locked() {
+        if (error) return false;
+        if (pending == 0) return true;
+        for (unsigned written = 0; written < buffer_size;) {
+            ssize_t result = ::write(fd, buffer + written, buffer_size - written);
+            if (result < 0 && errno == EINTR) continue;
+            if (result < 0) return fail(errno);
+            if (result == 0) return fail(EIO);
+            written += (unsigned) result;
+        }
+        if (sync_fd(fd) != 0) return fail(errno);
+        buffer_size = 0;
+        pending = 0;
+        synced_lsn = lsn;
+        ++stat.sync;
+        return true;
+    }
+
+    void run_flusher() {
+        std::unique_lock<std::mutex> guard(lock);
+        while (!stopped) {
+            // a failed log is left to the next append or sync
+            if (pending == 0 || group_interval == 0 || error) {
+                cv.wait(guard);
+                continue;
+            }
+            auto deadline = first_pending + std::chrono::microseconds(group_interval);
+            if (std::chrono::steady_clock::now() < deadline) {
+                cv.wait_until(guard, deadline);
+                continue;
+            }
+            flush_locked();
+        }
+    }
+
+public:
+    // fsync once this many records are pending
+    unsigned group_size;
+    // or once the oldest pending record has waited this many microseconds, 0 to disable
+    unsigned group_interval;
+
+    unsigned long long lsn;
+    unsigned long long synced_lsn;
+
+    struct Stat {
+        long long append;
+        long long sync;
+
+        Stat() : append(0), sync(0) {}
+    } stat;
+
+    static constexpr bool enabled() { return true; }
+
+    WAL(unsigned group_size = 128, unsigned group_interval = 1000) :
+            fd(-1), buffer_size(0), buffer_capacity(4096), pending(0), stopped(false), error(0),
+            group_size(group_size), group_interval(group_interval), lsn(0), synced_lsn(0) {
+        buffer = new char[buffer_capacity];
+    }
+
+    WAL(const WAL &) = delete;
+
+    ~WAL() {
+        close();
+        delete[] buffer;
+    }
+
+    // log of data file `path` is stored in `path`.log
+    void open(const char *path) {
+        do fd = ::open((std::string(path) + ".log").c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+        while (fd < 0 && errno == EINTR);
+        if (fd < 0) raise(errno, "failed to open write-ahead log");
+        flusher = std::thread(&WAL::run_flusher, this);
+    }
+
+    // records not on disk by now are lost if the log is failed, see sync
+    void close() {
+        if (fd < 0) return;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            flush_locked();
+            stopped = true;
+        }
+        cv.notify_all();
+        flusher.join();
+        ::close(fd);
+        fd = -1;
+    }
+
+    unsigned long long append(char op, const char *data, unsigned length) {
+        std::lock_guard<std::mutex> guard(lock);
+        assert(fd >= 0);
+        check();
+        reserve(buffer_size + Header_Size() + length + sizeof(unsigned));
+        char *record = buffer + buffer_size;
+        ++lsn;
+        memcpy(record, &lsn, sizeof(lsn));
+        memcpy(record + sizeof(lsn), &op, sizeof(op));
+        memcpy(record + sizeof(lsn) + sizeof(op), &length, sizeof(length));
+        memcpy(record + Header_Size(), data, length);
+        unsigned hash = checksum(record, Header_Size() + length);
+        memcpy(record + Header_Size() + length, &hash, sizeof(hash));
+        buffer_size += Header_Size() + length + sizeof(unsigned);
+        ++stat.append;
+        if (pending++ == 0) {
+            first_pending = std::chrono::steady_clock::now();
+            cv.notify_all();
+        }
+        if (pending >= group_size && !flush_locked()) check();
+        return lsn;
+    }
+
+    // force pending records to disk, throws if they may not be
+    void sync() {
+        std::lock_guard<std::mutex> guard(lock);
+        if (!flush_locked()) check();
+    }
+
+    /*
+     * Feed every record after lsn `from` to f(op, data, length), in order.
+     * Reading stops at the first torn or corrupted record, which is cut off the log.
+     */
+    template<typename F>
+    void replay(unsigned long long from, F f) {
+        std::lock_guard<std::mutex> guard(lock);
+        off_t end = lseek(fd, 0, SEEK_END);
+        if (end < 0) raise(errno, "failed to read write-ahead log");
+        size_t size = (size_t) end;
+        char *data = new char[size];
+        for (size_t read = 0; read < size;) {
+            ssize_t result = pread(fd, data + read, size - read, (off_t) read);
+            if (result < 0 && errno == EINTR) continue;
+            if (result <= 0) {
+                delete[] data;
+                raise(result < 0 ? errno : EIO, "failed to read write-ahead log");
+            }
+            read += (size_t) result;
+        }
+        size_t pos = 0;
+        lsn = from;
+        while (pos + Header_Size() + sizeof(unsigned) <= size) {
+            unsigned long long record_lsn;
+            char op;
+            unsigned length, hash;
+            memcpy(&record_lsn, data + pos, sizeof(record_lsn));
+            memcpy(&op, data + pos + sizeof(record_lsn), sizeof(op));
+            memcpy(&length, data + pos + sizeof(record_lsn) + sizeof(op), sizeof(length));
+            if (pos + Header_Size() + length + sizeof(unsigned) > size) break;
+            memcpy(&hash, data + pos + Header_Size() + length, sizeof(hash));
+            if (hash != checksum(data + pos, Header_Size() + length)) break;
+            if (record_lsn > from) {
+                f(op, data + pos + Header_Size(), length);
+                lsn = record_lsn;
+            }
+            pos += Header_Size() + length + sizeof(unsigned);
+        }
+        if (pos != size) {
+            std::clog << "[Warning] log truncated at " << pos << "/" << size << std::endl;
+            // records appended after a torn one would never be replayed
+            if (ftruncate(fd, (off_t) pos) != 0 || sync_fd(fd) != 0) {
+                delete[] data;
+                raise(errno, "failed to truncate write-ahead log");
+            }
+        }
+        synced_lsn = lsn;
+        delete[] data;
+    }
+
+    // records up to lsn are covered by a checkpoint of the data file and can be dropped
+    void checkpoint(unsigned long long lsn) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (fd < 0) return;
+        assert(lsn == this->lsn);
+        buffer_size = 0;
+        pending = 0;
+        // records left behind are skipped by replay, being covered by the checkpoint
+        if (ftruncate(fd, 0) != 0 || sync_fd(fd) != 0) fail(errno);
+        synced_lsn = lsn;
+    }
+};
+
+#endif //BPLUSTREE_WAL_HPP
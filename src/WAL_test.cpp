@@ -0,0 +1,294 @@
+//
+// Created by Alex Chi on 2019-06-13.
+//
+
+#include <catch.hpp>
+#include <cstdio>
+#include <fstream>
+#include <csignal>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "BTree.hpp"
+#include "WAL.hpp"
+#include "Checkpointer.hpp"
+
+using WalMap = BTree<int, long long, 512, 32, Default_Max_Pages(), FileStore, WAL>;
+
+// run f in a child process which then dies without running destructors of what f leaks
+template<typename F>
+void crash_after(F f) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        f();
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    REQUIRE (WIFEXITED(status));
+    REQUIRE (WEXITSTATUS(status) == 0);
+}
+
+long file_size(const char *path) {
+    std::ifstream f(path, std::ios::binary | std::ios::ate);
+    return f ? (long) f.tellg() : -1;
+}
+
+TEST_CASE("WAL", "[WAL]") {
+    SECTION("should commit in groups") {
+        remove("wal.test.log");
+        WAL wal(4, 0);
+        wal.open("wal.test");
+        int x = 233;
+        for (int i = 0; i < 3; i++) wal.append('i', reinterpret_cast<char *>(&x), sizeof(x));
+        REQUIRE (wal.stat.sync == 0);
+        REQUIRE (wal.synced_lsn == 0);
+        wal.append('i', reinterpret_cast<char *>(&x), sizeof(x));
+        REQUIRE (wal.stat.sync == 1);
+        REQUIRE (wal.synced_lsn == 4);
+        wal.close();
+        remove("wal.test.log");
+    }
+
+    SECTION("should commit after interval") {
+        remove("wal.test.log");
+        WAL wal(1000, 1000);
+        wal.open("wal.test");
+        int x = 233;
+        wal.append('i', reinterpret_cast<char *>(&x), sizeof(x));
+        for (int i = 0; i < 1000 && wal.stat.sync == 0; i++) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        wal.sync();
+        REQUIRE (wal.stat.sync == 1);
+        wal.close();
+        remove("wal.test.log");
+    }
+
+    SECTION("should fail instead of acknowledging records not written") {
+        remove("wal.test.log");
+        crash_after([]() {
+            // writes past the limit fail with EFBIG
+            signal(SIGXFSZ, SIG_IGN);
+            rlimit limit{64, 64};
+            setrlimit(RLIMIT_FSIZE, &limit);
+            WAL wal(1000, 0);
+            wal.open("wal.test");
+            char x[16] = {};
+            for (int i = 0; i < 8; i++) wal.append('i', x, sizeof(x));
+            bool thrown = false;
+            try {
+                wal.sync();
+            } catch (const std::system_error &e) {
+                thrown = e.code().value() == EFBIG;
+            }
+            if (!thrown || wal.synced_lsn != 0) _exit(1);
+            try {
+                wal.append('i', x, sizeof(x));
+                _exit(2);
+            } catch (const std::system_error &) {}
+        });
+        remove("wal.test.log");
+    }
+
+    SECTION("should replay records and cut torn tail") {
+        remove("wal.test.log");
+        {
+            WAL wal(1, 0);
+            wal.open("wal.test");
+            for (int i = 0; i < 10; i++) wal.append('i', reinterpret_cast<char *>(&i), sizeof(i));
+        }
+        long size = file_size("wal.test.log");
+        {
+            std::ofstream f("wal.test.log", std::ios::binary | std::ios::app);
+            f.write("torn", 4);
+        }
+        {
+            WAL wal;
+            wal.open("wal.test");
+            int cnt = 0;
+            wal.replay(0, [&](char op, const char *data, unsigned length) {
+                REQUIRE (op == 'i');
+                REQUIRE (length == sizeof(int));
+                REQUIRE (*reinterpret_cast<const int *>(data) == cnt++);
+            });
+            REQUIRE (cnt == 10);
+            REQUIRE (wal.lsn == 10);
+        }
+        REQUIRE (file_size("wal.test.log") == size);
+        {
+            WAL wal;
+            wal.open("wal.test");
+            int cnt = 0;
+            wal.replay(6, [&](char, const char *data, unsigned) {
+                REQUIRE (*reinterpret_cast<const int *>(data) == 6 + cnt++);
+            });
+            REQUIRE (cnt == 4);
+            wal.checkpoint(wal.lsn);
+        }
+        REQUIRE (file_size("wal.test.log") == 0);
+        remove("wal.test.log");
+    }
+}
+
+TEST_CASE("Recovery", "[WAL]") {
+    const int test_size = 20000;
+
+    SECTION("should recover after crash before first save") {
+        remove("wal.db");
+        remove("wal.db.log");
+        crash_after([&]() {
+            WalMap *m = new WalMap("wal.db");
+            m->log.group_size = 1;
+            for (int i = 0; i < test_size; i++) m->insert(i, i);
+            for (int i = 0; i < test_size; i += 2) m->remove(i);
+        });
+        {
+            WalMap m("wal.db");
+            REQUIRE (m.size() == test_size / 2);
+            for (int i = 0; i < test_size; i++) {
+                if (i % 2) REQUIRE (*m.query(i) == i);
+                else
+                    REQUIRE (m.query(i) == nullptr);
+            }
+        }
+        REQUIRE (file_size("wal.db.log") == 0);
+        {
+            WalMap m("wal.db");
+            REQUIRE (m.size() == test_size / 2);
+        }
+        remove("wal.db");
+        remove("wal.db.log");
+    }
+
+    SECTION("should recover after crash following a save") {
+        remove("wal.db");
+        remove("wal.db.log");
+        {
+            WalMap m("wal.db");
+            for (int i = 0; i < test_size; i++) m.insert(i, i);
+        }
+        crash_after([&]() {
+            WalMap *m = new WalMap("wal.db");
+            m->log.group_size = 1;
+            for (int i = 0; i < test_size; i += 3) m->remove(i);
+            for (int i = test_size; i < test_size * 2; i++) m->insert(i, i);
+            m->find(1).modify(233);
+        });
+        {
+            WalMap m("wal.db");
+            for (int i = 0; i < test_size * 2; i++) {
+                if (i == 1) REQUIRE (*m.query(i) == 233);
+                else if (i < test_size && i % 3 == 0) REQUIRE (m.query(i) == nullptr);
+                else
+                    REQUIRE (*m.query(i) == i);
+            }
+        }
+        remove("wal.db");
+        remove("wal.db.log");
+    }
+
+    SECTION("should keep operations synced before crash") {
+        remove("wal.db");
+        remove("wal.db.log");
+        crash_after([&]() {
+            WalMap *m = new WalMap("wal.db");
+            m->log.group_size = test_size * 2;
+            m->log.group_interval = 0;
+            for (int i = 0; i < test_size; i++) m->insert(i, i);
+            m->log.sync();
+            for (int i = test_size; i < test_size * 2; i++) m->insert(i, i);
+        });
+        {
+            WalMap m("wal.db");
+            REQUIRE (m.size() == test_size);
+            for (int i = 0; i < test_size; i++) REQUIRE (*m.query(i) == i);
+            for (int i = test_size; i < test_size * 2; i++) REQUIRE (m.query(i) == nullptr);
+        }
+        remove("wal.db");
+        remove("wal.db.log");
+    }
+
+    SECTION("should recover batches after crash") {
+        remove("wal.db");
+        remove("wal.db.log");
+        crash_after([&]() {
+            WalMap *m = new WalMap("wal.db");
+            m->log.group_size = 1;
+            std::pair<int, long long> *pairs = new std::pair<int, long long>[test_size];
+            for (int i = 0; i < test_size; i++) pairs[i] = std::make_pair(test_size - 1 - i, test_size - 1 - i);
+            m->insert_batch(pairs, pairs + test_size);
+            int *keys = new int[test_size / 2];
+            for (int i = 0; i < test_size / 2; i++) keys[i] = i * 2;
+            m->remove_batch(keys, keys + test_size / 2);
+        });
+        {
+            WalMap m("wal.db");
+            REQUIRE (m.size() == test_size / 2);
+            for (int i = 0; i < test_size; i++) {
+                if (i % 2) REQUIRE (*m.query(i) == i);
+                else
+                    REQUIRE (m.query(i) == nullptr);
+            }
+        }
+        remove("wal.db");
+        remove("wal.db.log");
+    }
+
+    SECTION("should reuse extents across saves") {
+        remove("wal.db");
+        remove("wal.db.log");
+        size_t tail_pos = 0;
+        for (int round = 0; round < 4; round++) {
+            WalMap m("wal.db");
+            for (int i = 0; i < test_size; i++) {
+                if (round % 2) m.remove(i);
+                else
+                    m.insert(i, i);
+            }
+            if (round == 1) tail_pos = m.storage->persistence_index->tail_pos;
+            if (round == 3) REQUIRE (m.storage->persistence_index->tail_pos <= tail_pos + tail_pos / 16);
+        }
+        remove("wal.db");
+        remove("wal.db.log");
+    }
+
+    SECTION("should stop a checkpointer while holding the tree lock") {
+        remove("wal.db");
+        remove("wal.db.log");
+        {
+            WalMap m("wal.db");
+            std::mutex lock;
+            Checkpointer<WalMap> checkpointer(m, lock, 1);
+            std::lock_guard<std::mutex> guard(lock);
+            // the checkpointer is waiting for the lock by now
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            checkpointer.stop();
+        }
+        remove("wal.db");
+        remove("wal.db.log");
+    }
+
+    SECTION("should recover from checkpoint taken in background") {
+        remove("wal.db");
+        remove("wal.db.log");
+        crash_after([&]() {
+            WalMap *m = new WalMap("wal.db");
+            std::mutex *lock = new std::mutex;
+            Checkpointer<WalMap> *checkpointer = new Checkpointer<WalMap>(*m, *lock, 1);
+            for (int i = 0; i < test_size; i++) {
+                std::lock_guard<std::mutex> guard(*lock);
+                m->insert(i, i);
+            }
+            long long done = checkpointer->count;
+            while (checkpointer->count <= done) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            // everything is covered by the data file now
+            std::lock_guard<std::mutex> guard(*lock);
+            if (file_size("wal.db.log") != 0) _exit(1);
+        });
+        {
+            WalMap m("wal.db");
+            REQUIRE (m.size() == test_size);
+            for (int i = 0; i < test_size; i++) REQUIRE (*m.query(i) == i);
+        }
+        remove("wal.db");
+        remove("wal.db.log");
+    }
+}